@@ -325,6 +325,7 @@ AltServerApp* AltServerApp::instance()
 
 AltServerApp::AltServerApp() : _appGroupSemaphore(1)
 {
+	_sessionCache = std::make_shared<AppleAPISessionCache>(this->sessionsDirectoryPath());
 }
 
 AltServerApp::~AltServerApp()
@@ -475,6 +476,14 @@ pplx::task<std::shared_ptr<Application>> AltServerApp::InstallApplication(std::o
 
 				return this->_InstallApplication(filepath, installDevice, appleID, password);
 			}
+			else if ((APIErrorCode)error.code() == APIErrorCode::InvalidSession)
+			{
+				// The developer portal stopped accepting the session partway through the install,
+				// so forget it and try one more time, which signs in again.
+				_sessionCache->RemoveSession(appleID);
+
+				return this->_InstallApplication(filepath, installDevice, appleID, password);
+			}
 			else
 			{
 				throw;
@@ -541,18 +550,63 @@ pplx::task<std::shared_ptr<Application>> AltServerApp::_InstallApplication(std::
     destinationDirectoryPath.append(make_uuid());
     
 	auto account = std::make_shared<Account>();
-	auto app = std::make_shared<Application>();
 	auto team = std::make_shared<Team>();
-	auto device = std::make_shared<Device>();
-	auto appID = std::make_shared<AppID>();
-	auto certificate = std::make_shared<Certificate>();
-	auto profile = std::make_shared<ProvisioningProfile>();
 
 	auto session = std::make_shared<AppleAPISession>();
 
-	return pplx::create_task([=]() {
+	// Preparing the app doesn't depend on the developer portal, so download or import it while signing in.
+	auto appTask = pplx::create_task([=]() {
+		if (filepath.has_value())
+		{
+			odslog("Importing app...");
+
+			return pplx::create_task([filepath] {
+				return fs::path(*filepath);
+			});
+		}
+		else
+		{
+			odslog("Downloading app...");
+
+			// Show alert before downloading AltStore.
+			this->ShowInstallationNotification("AltStore", installDevice->name());
+			return this->DownloadApp();
+		}
+	})
+	.then([=](fs::path downloadedAppPath)
+		{
+			odslog("Downloaded app!");
+
+			fs::create_directory(destinationDirectoryPath);
+
+			auto appBundlePath = UnzipAppBundle(downloadedAppPath.string(), destinationDirectoryPath.string());
+			auto app = std::make_shared<Application>(appBundlePath);
+
+			if (filepath.has_value())
+			{
+				// Show alert after "downloading" local .ipa.
+				this->ShowInstallationNotification(app->name(), installDevice->name());
+			}
+			else
+			{
+				// Remove downloaded app.
+
+				try
+				{
+					fs::remove(downloadedAppPath);
+				}
+				catch (std::exception& e)
+				{
+					odslog("Failed to remove downloaded .ipa." << e.what());
+				}
+			}
+
+			return app;
+		});
+
+	auto teamTask = pplx::create_task([=]() {
 		auto anisetteData = AnisetteDataManager::instance()->FetchAnisetteData();
-		return this->Authenticate(appleID, password, anisetteData);
+		return this->AuthenticateWithCachedSession(appleID, password, anisetteData);
 	})
     .then([=](std::pair<std::shared_ptr<Account>, std::shared_ptr<AppleAPISession>> pair)
           {
@@ -563,82 +617,63 @@ pplx::task<std::shared_ptr<Application>> AltServerApp::_InstallApplication(std::
 
               return this->FetchTeam(account, session);
           })
-    .then([=](std::shared_ptr<Team> tempTeam)
-          {
+	.then([=](std::shared_ptr<Team> tempTeam)
+		{
+			*team = *tempTeam;
+			return team;
+		});
+
+	// Registering the device and fetching the certificate only need the team, so run them side by side.
+	auto deviceTask = teamTask.then([=](std::shared_ptr<Team> team)
+		{
 			odslog("Registering device...");
 
-              *team = *tempTeam;
-              return this->RegisterDevice(installDevice, team, session);
-          })
-    .then([=](std::shared_ptr<Device> tempDevice)
-          {
+			return this->RegisterDevice(installDevice, team, session);
+		});
+
+	auto certificateTask = teamTask.then([=](std::shared_ptr<Team> team)
+		{
 			odslog("Fetching certificate...");
 
-              *device = *tempDevice;
-              return this->FetchCertificate(team, session);
-          })
-    .then([=](std::shared_ptr<Certificate> tempCertificate)
-          {
-              *certificate = *tempCertificate;
+			return this->FetchCertificate(team, session);
+		});
 
-			  if (filepath.has_value())
-			  {
-				  odslog("Importing app...");
+	// Provisioning profiles can be requested as soon as both the device and the app are ready.
+	auto profilesTask = deviceTask.then([=](std::shared_ptr<Device> device)
+		{
+			return appTask.then([=](std::shared_ptr<Application> app)
+				{
+					return this->PrepareAllProvisioningProfiles(app, device, team, session);
+				});
+		});
 
-				  return pplx::create_task([filepath] {
-					  return fs::path(*filepath);
-					});
-			  }
-			  else
-			  {
-				  odslog("Downloading app...");
-
-				  // Show alert before downloading AltStore.
-				  this->ShowInstallationNotification("AltStore", device->name());
-				  return this->DownloadApp();
-			  }
-          })
-    .then([=](fs::path downloadedAppPath)
-          {
-			odslog("Downloaded app!");
+	return profilesTask.then([=](std::map<std::string, std::shared_ptr<ProvisioningProfile>> profiles)
+		{
+			return certificateTask.then([=](std::shared_ptr<Certificate> certificate)
+				{
+					auto app = appTask.get();
+					auto device = deviceTask.get();
 
-              fs::create_directory(destinationDirectoryPath);
-              
-              auto appBundlePath = UnzipAppBundle(downloadedAppPath.string(), destinationDirectoryPath.string());
-			  auto app = std::make_shared<Application>(appBundlePath);
-
-			  if (filepath.has_value())
-			  {
-				  // Show alert after "downloading" local .ipa.
-				  this->ShowInstallationNotification(app->name(), device->name());
-			  }
-			  else
-			  {
-				  // Remove downloaded app.
-
-				  try
-				  {
-					  fs::remove(downloadedAppPath);
-				  }
-				  catch (std::exception& e)
-				  {
-					  odslog("Failed to remove downloaded .ipa." << e.what());
-				  }
-			  }              
-              
-              return app;
-          })
-    .then([=](std::shared_ptr<Application> tempApp)
-          {
-              *app = *tempApp;
-			  return this->PrepareAllProvisioningProfiles(app, device, team, session);
-          })
-    .then([=](std::map<std::string, std::shared_ptr<ProvisioningProfile>> profiles)
-          {
-              return this->InstallApp(app, device, team, certificate, profiles);
-          })
+					return this->InstallApp(app, device, team, certificate, profiles);
+				});
+		})
     .then([=](pplx::task<std::shared_ptr<Application>> task)
           {
+			// Wait for every branch before cleaning up so an early failure elsewhere can't
+			// leave the app being unzipped into a directory we've already removed.
+			// This also observes any errors the branches threw that didn't end up in task.
+			for (auto& branch : { appTask.then([](std::shared_ptr<Application>) {}), deviceTask.then([](std::shared_ptr<Device>) {}), certificateTask.then([](std::shared_ptr<Certificate>) {}) })
+			{
+				try
+				{
+					branch.wait();
+				}
+				catch (std::exception& e)
+				{
+					odslog("Installation step failed. " << e.what());
+				}
+			}
+
 			if (fs::exists(destinationDirectoryPath))
 			{
 				fs::remove_all(destinationDirectoryPath);
@@ -732,6 +767,89 @@ pplx::task<std::pair<std::shared_ptr<Account>, std::shared_ptr<AppleAPISession>>
 	});
 }
 
+pplx::task<std::pair<std::shared_ptr<Account>, std::shared_ptr<AppleAPISession>>> AltServerApp::AuthenticateWithCachedSession(std::string appleID, std::string password, std::shared_ptr<AnisetteData> anisetteData)
+{
+	if (anisetteData == NULL)
+	{
+		throw ServerError(ServerErrorCode::InvalidAnisetteData);
+	}
+
+	auto cachedSession = _sessionCache->SessionForAppleID(appleID, password, anisetteData);
+	if (cachedSession == nullptr)
+	{
+		return this->AuthenticateAndCacheSession(appleID, password, anisetteData);
+	}
+
+	odslog("Using cached session...");
+
+	// Fetching the account is the same request a full sign-in ends with, so a still-valid session costs nothing extra.
+	return AppleAPI::getInstance()->FetchAccount(cachedSession)
+	.then([=](pplx::task<std::shared_ptr<Account>> task) -> pplx::task<std::pair<std::shared_ptr<Account>, std::shared_ptr<AppleAPISession>>> {
+		try
+		{
+			auto account = task.get();
+			return pplx::create_task([account, cachedSession]() {
+				return std::make_pair(account, cachedSession);
+			});
+		}
+		catch (APIError& error)
+		{
+			if ((APIErrorCode)error.code() != APIErrorCode::InvalidSession)
+			{
+				throw;
+			}
+
+			odslog("Cached session was rejected, signing in again...");
+
+			_sessionCache->RemoveSession(appleID);
+			return this->AuthenticateAndCacheSession(appleID, password, anisetteData);
+		}
+	});
+}
+
+pplx::task<std::pair<std::shared_ptr<Account>, std::shared_ptr<AppleAPISession>>> AltServerApp::AuthenticateAndCacheSession(std::string appleID, std::string password, std::shared_ptr<AnisetteData> anisetteData)
+{
+	std::lock_guard<std::mutex> lock(_authenticationMutex);
+
+	auto pendingAuthentication = _authenticationTasks.find(appleID);
+	if (pendingAuthentication != _authenticationTasks.end() && pendingAuthentication->second.first == password)
+	{
+		odslog("Waiting for sign-in in progress...");
+
+		return pendingAuthentication->second.second.then([=](std::pair<std::shared_ptr<Account>, std::shared_ptr<AppleAPISession>> pair) {
+			// Use our own anisette data, since the other install's may have gone stale while signing in.
+			auto session = std::make_shared<AppleAPISession>(pair.second->dsid(), pair.second->authToken(), anisetteData, pair.second->expirationDate());
+			return std::make_pair(pair.first, session);
+		});
+	}
+
+	auto task = this->Authenticate(appleID, password, anisetteData)
+	.then([=](pplx::task<std::pair<std::shared_ptr<Account>, std::shared_ptr<AppleAPISession>>> task) {
+		{
+			std::lock_guard<std::mutex> lock(_authenticationMutex);
+			_authenticationTasks.erase(appleID);
+		}
+
+		auto pair = task.get();
+
+		try
+		{
+			_sessionCache->CacheSession(pair.second, appleID, password);
+		}
+		catch (std::exception& e)
+		{
+			// Not being able to cache the session shouldn't fail the installation.
+			odslog("Failed to cache session. " << e.what());
+		}
+
+		return pair;
+	});
+
+	_authenticationTasks[appleID] = std::make_pair(password, task);
+
+	return task;
+}
+
 pplx::task<std::shared_ptr<Team>> AltServerApp::FetchTeam(std::shared_ptr<Account> account, std::shared_ptr<AppleAPISession> session)
 {
     auto task = AppleAPI::getInstance()->FetchTeams(account, session)
@@ -1237,12 +1355,12 @@ pplx::task<std::shared_ptr<Application>> AltServerApp::InstallApp(std::shared_pt
 			plist_dict_set_item(plist, "ALTAppGroups", appGroups);
 		}
 
-		char* plistXML = nullptr;
-		uint32_t length = 0;
-		plist_to_xml(plist, &plistXML, &length);
-
 		std::ofstream fout(infoPlistPath.string(), std::ios::out | std::ios::binary);
-		fout.write(plistXML, length);
+		plist_to_xml_with_writer(plist, [](const char* buffer, size_t length, void* context) -> int {
+			std::ofstream* fout = (std::ofstream*)context;
+			fout->write(buffer, length);
+			return fout->good() ? 0 : -1;
+		}, &fout);
 		fout.close();
 	};
 
@@ -1712,4 +1830,30 @@ fs::path AltServerApp::certificatesDirectoryPath() const
 	}
 
 	return certificatesDirectoryPath;
+}
+
+fs::path AltServerApp::sessionsDirectoryPath() const
+{
+	auto appDataPath = this->appDataDirectoryPath();
+	auto sessionsDirectoryPath = appDataPath.append("Sessions");
+
+	if (!fs::exists(sessionsDirectoryPath))
+	{
+		fs::create_directory(sessionsDirectoryPath);
+	}
+
+	return sessionsDirectoryPath;
+}
+
+fs::path AltServerApp::uploadManifestsDirectoryPath() const
+{
+	auto appDataPath = this->appDataDirectoryPath();
+	auto uploadManifestsDirectoryPath = appDataPath.append("UploadManifests");
+
+	if (!fs::exists(uploadManifestsDirectoryPath))
+	{
+		fs::create_directory(uploadManifestsDirectoryPath);
+	}
+
+	return uploadManifestsDirectoryPath;
 }
\ No newline at end of file
@@ -19,12 +19,16 @@
 #include "Team.hpp"
 
 #include "AppleAPISession.h"
+#include "AppleAPISessionCache.hpp"
 #include "AnisetteDataManager.h"
 
 #include "Semaphore.h"
 
 #include <pplx/pplxtasks.h>
 
+#include <map>
+#include <mutex>
+
 #ifdef _WIN32
 #include <filesystem>
 #undef _WINSOCKAPI_
@@ -65,6 +69,8 @@ public:
 	std::string appleFolderPath() const;
 	std::string internetServicesFolderPath() const;
 	std::string applicationSupportFolderPath() const;
+
+	fs::path uploadManifestsDirectoryPath() const;
 private:
 	AltServerApp();
 	~AltServerApp();
@@ -85,6 +91,12 @@ private:
 
 	Semaphore _appGroupSemaphore;
 
+	std::shared_ptr<AppleAPISessionCache> _sessionCache;
+
+	// Concurrent installs with the same Apple ID wait on a single sign-in, keyed by Apple ID.
+	std::mutex _authenticationMutex;
+	std::map<std::string, std::pair<std::string, pplx::task<std::pair<std::shared_ptr<Account>, std::shared_ptr<AppleAPISession>>>>> _authenticationTasks;
+
 	bool presentedRunningNotification() const;
 	void setPresentedRunningNotification(bool presentedRunningNotification);
 
@@ -93,6 +105,7 @@ private:
 
 	fs::path appDataDirectoryPath() const;
 	fs::path certificatesDirectoryPath() const;
+	fs::path sessionsDirectoryPath() const;
 
 	void HandleAnisetteError(AnisetteError& error);
     
@@ -101,6 +114,8 @@ private:
 	void ShowInstallationNotification(std::string appName, std::string deviceName);
     
 	pplx::task<std::pair<std::shared_ptr<Account>, std::shared_ptr<AppleAPISession>>>  Authenticate(std::string appleID, std::string password, std::shared_ptr<AnisetteData> anisetteData);
+	pplx::task<std::pair<std::shared_ptr<Account>, std::shared_ptr<AppleAPISession>>> AuthenticateWithCachedSession(std::string appleID, std::string password, std::shared_ptr<AnisetteData> anisetteData);
+	pplx::task<std::pair<std::shared_ptr<Account>, std::shared_ptr<AppleAPISession>>> AuthenticateAndCacheSession(std::string appleID, std::string password, std::shared_ptr<AnisetteData> anisetteData);
     pplx::task<std::shared_ptr<Team>> FetchTeam(std::shared_ptr<Account> account, std::shared_ptr<AppleAPISession> session);
     pplx::task<std::shared_ptr<Certificate>> FetchCertificate(std::shared_ptr<Team> team, std::shared_ptr<AppleAPISession> session);
 	pplx::task<std::map<std::string, std::shared_ptr<ProvisioningProfile>>> PrepareAllProvisioningProfiles(
@@ -9,6 +9,8 @@
 
 #include <set>
 
+#include <plist/plist.h>
+
 #include "AnisetteData.h"
 #include "AltServerApp.h"
 
@@ -415,8 +417,8 @@ std::shared_ptr<AnisetteData> AnisetteDataManager::FetchAnisetteData()
 #else
 		std::string description = deviceID->description();
 
-		std::vector<unsigned char> deviceIDData(description.begin(), description.end());
-		auto encodedDeviceID = StringFromWideString(utility::conversions::to_base64(deviceIDData));
+		std::string encodedDeviceID(PLIST_BASE64_ENCODED_SIZE(description.size()) + 1, '\0');
+		encodedDeviceID.resize(plist_base64_encode(&encodedDeviceID[0], (const uint8_t*)description.data(), description.size()));
 
 		ObjcObject* localUserID = (ObjcObject*)((id(*)(id, SEL, const char*))objc_msgSend)(NSString, stringInit, encodedDeviceID.c_str());
 #endif
@@ -0,0 +1,219 @@
+//
+//  AppleAPISessionCache.cpp
+//  AltServer-Windows
+//
+//  Copyright © 2020 Riley Testut. All rights reserved.
+//
+
+#include "AppleAPISessionCache.hpp"
+
+#include <windows.h>
+#include <dpapi.h>
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+
+#include <plist/plist.h>
+
+#include <corecrypto/ccdigest.h>
+#include <corecrypto/ccsha2.h>
+
+#pragma comment( lib, "crypt32.lib" )
+
+#define odslog(msg) { std::stringstream ss; ss << msg << std::endl; OutputDebugStringA(ss.str().c_str()); }
+
+namespace fs = std::filesystem;
+
+extern std::vector<unsigned char> readFile(const char* filename);
+
+// Apple IDs are case-insensitive.
+static std::string AppleAPISessionCacheKey(std::string appleID)
+{
+	std::transform(appleID.begin(), appleID.end(), appleID.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+	return appleID;
+}
+
+static std::vector<unsigned char> AppleAPISessionCacheEntropy(std::string appleID, std::string password)
+{
+	auto key = AppleAPISessionCacheKey(appleID);
+
+	std::vector<unsigned char> entropy(key.begin(), key.end());
+	entropy.push_back('\0');
+	entropy.insert(entropy.end(), password.begin(), password.end());
+	return entropy;
+}
+
+AppleAPISessionCache::AppleAPISessionCache(fs::path directoryPath) : _directoryPath(directoryPath)
+{
+}
+
+fs::path AppleAPISessionCache::SessionPath(std::string appleID) const
+{
+	// Name files after a hash of the Apple ID so the folder doesn't list which accounts signed in.
+	auto key = AppleAPISessionCacheKey(appleID);
+
+	const struct ccdigest_info* di = ccsha256_di();
+
+	std::vector<unsigned char> hash(di->output_size);
+	ccdigest(di, key.size(), key.data(), hash.data());
+
+	std::stringstream filename;
+	for (auto byte : hash)
+	{
+		filename << std::hex << std::setw(2) << std::setfill('0') << (int)byte;
+	}
+	filename << ".session";
+
+	auto path = _directoryPath;
+	path.append(filename.str());
+	return path;
+}
+
+std::shared_ptr<AppleAPISession> AppleAPISessionCache::SessionForAppleID(std::string appleID, std::string password, std::shared_ptr<AnisetteData> anisetteData)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	auto path = this->SessionPath(appleID);
+	if (!fs::exists(path))
+	{
+		return nullptr;
+	}
+
+	auto encryptedData = readFile(path.string().c_str());
+	auto entropy = AppleAPISessionCacheEntropy(appleID, password);
+
+	DATA_BLOB encryptedBlob = { (DWORD)encryptedData.size(), encryptedData.data() };
+	DATA_BLOB entropyBlob = { (DWORD)entropy.size(), entropy.data() };
+	DATA_BLOB decryptedBlob = { 0, NULL };
+
+	if (!CryptUnprotectData(&encryptedBlob, NULL, &entropyBlob, NULL, NULL, CRYPTPROTECT_UI_FORBIDDEN, &decryptedBlob))
+	{
+		// Different password (or Windows user) than the one that cached the session.
+		odslog("Could not decrypt cached session. Error: " << GetLastError());
+		return nullptr;
+	}
+
+	plist_t plist = NULL;
+	plist_from_memory((const char*)decryptedBlob.pbData, (uint32_t)decryptedBlob.cbData, &plist);
+
+	SecureZeroMemory(decryptedBlob.pbData, decryptedBlob.cbData);
+	LocalFree(decryptedBlob.pbData);
+
+	if (plist == NULL)
+	{
+		return nullptr;
+	}
+
+	plist_t dsidNode = plist_dict_get_item(plist, "DSID");
+	plist_t authTokenNode = plist_dict_get_item(plist, "AuthToken");
+	plist_t expirationDateNode = plist_dict_get_item(plist, "ExpirationDate");
+
+	if (dsidNode == NULL || plist_get_node_type(dsidNode) != PLIST_STRING ||
+		authTokenNode == NULL || plist_get_node_type(authTokenNode) != PLIST_STRING)
+	{
+		plist_free(plist);
+		return nullptr;
+	}
+
+	char* dsid = NULL;
+	plist_get_string_val(dsidNode, &dsid);
+
+	char* authToken = NULL;
+	plist_get_string_val(authTokenNode, &authToken);
+
+	std::optional<time_t> expirationDate = std::nullopt;
+	if (expirationDateNode != NULL && plist_get_node_type(expirationDateNode) == PLIST_UINT)
+	{
+		uint64_t value = 0;
+		plist_get_uint_val(expirationDateNode, &value);
+		expirationDate = (time_t)value;
+	}
+
+	auto session = std::make_shared<AppleAPISession>(dsid, authToken, anisetteData, expirationDate);
+
+	free(dsid);
+	free(authToken);
+	plist_free(plist);
+
+	if (expirationDate.has_value() && *expirationDate <= time(NULL))
+	{
+		odslog("Cached session expired.");
+
+		fs::remove(path);
+		return nullptr;
+	}
+
+	return session;
+}
+
+void AppleAPISessionCache::CacheSession(std::shared_ptr<AppleAPISession> session, std::string appleID, std::string password)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	plist_t plist = plist_new_dict();
+	plist_dict_set_item(plist, "DSID", plist_new_string(session->dsid().c_str()));
+	plist_dict_set_item(plist, "AuthToken", plist_new_string(session->authToken().c_str()));
+
+	if (session->expirationDate().has_value())
+	{
+		plist_dict_set_item(plist, "ExpirationDate", plist_new_uint((uint64_t)*session->expirationDate()));
+	}
+
+	char* data = NULL;
+	uint32_t length = 0;
+	plist_to_bin(plist, &data, &length);
+	plist_free(plist);
+
+	auto path = this->SessionPath(appleID);
+
+	if (data == NULL)
+	{
+		throw fs::filesystem_error("Failed to serialize session.", path, std::make_error_code(std::errc::invalid_argument));
+	}
+
+	auto entropy = AppleAPISessionCacheEntropy(appleID, password);
+
+	DATA_BLOB decryptedBlob = { length, (BYTE*)data };
+	DATA_BLOB entropyBlob = { (DWORD)entropy.size(), entropy.data() };
+	DATA_BLOB encryptedBlob = { 0, NULL };
+
+	BOOL success = CryptProtectData(&decryptedBlob, L"AltServer Session", &entropyBlob, NULL, NULL, CRYPTPROTECT_UI_FORBIDDEN, &encryptedBlob);
+
+	SecureZeroMemory(data, length);
+	free(data);
+
+	if (!success)
+	{
+		throw fs::filesystem_error("Failed to encrypt session.", path, std::error_code((int)GetLastError(), std::system_category()));
+	}
+
+	// Write to a temporary file first so a failed write never leaves a truncated session behind.
+	auto temporaryPath = path;
+	temporaryPath += ".tmp";
+
+	std::ofstream file(temporaryPath, std::ios::out | std::ios::binary | std::ios::trunc);
+	file.write((const char*)encryptedBlob.pbData, encryptedBlob.cbData);
+	file.close();
+
+	LocalFree(encryptedBlob.pbData);
+
+	if (file.fail())
+	{
+		fs::remove(temporaryPath);
+		throw fs::filesystem_error("Failed to write session.", path, std::make_error_code(std::errc::io_error));
+	}
+
+	fs::rename(temporaryPath, path);
+}
+
+void AppleAPISessionCache::RemoveSession(std::string appleID)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	std::error_code error;
+	fs::remove(this->SessionPath(appleID), error);
+}
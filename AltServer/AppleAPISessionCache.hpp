@@ -0,0 +1,42 @@
+//
+//  AppleAPISessionCache.hpp
+//  AltServer-Windows
+//
+//  Copyright © 2020 Riley Testut. All rights reserved.
+//
+
+#ifndef AppleAPISessionCache_hpp
+#define AppleAPISessionCache_hpp
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <filesystem>
+
+#include "AppleAPISession.h"
+#include "AnisetteData.h"
+
+// Remembers the auth token from a successful sign-in so later installs with the same Apple ID
+// can skip the full GSA handshake. Each session is stored in its own file encrypted with DPAPI,
+// using the Apple ID and password as entropy: only the same Windows user can read it back,
+// and only when signing in with the same password.
+class AppleAPISessionCache
+{
+public:
+	AppleAPISessionCache(std::filesystem::path directoryPath);
+
+	// Returns nullptr if there is no cached session or it has expired.
+	// The returned session uses anisetteData, since anisette data is only valid for a short time.
+	std::shared_ptr<AppleAPISession> SessionForAppleID(std::string appleID, std::string password, std::shared_ptr<AnisetteData> anisetteData);
+
+	void CacheSession(std::shared_ptr<AppleAPISession> session, std::string appleID, std::string password);
+	void RemoveSession(std::string appleID);
+
+private:
+	std::filesystem::path _directoryPath;
+	std::mutex _mutex;
+
+	std::filesystem::path SessionPath(std::string appleID) const;
+};
+
+#endif /* AppleAPISessionCache_hpp */
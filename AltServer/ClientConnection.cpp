@@ -6,6 +6,8 @@
 #include <WinSock2.h>
 #include <filesystem>
 
+#include <plist/plist.h>
+
 #include "DeviceManager.hpp"
 #include "AnisetteDataManager.h"
 #include "AnisetteData.h"
@@ -37,6 +39,34 @@ std::wstring WideStringFromString(std::string string)
 	return wideString;
 }
 
+std::vector<unsigned char> DataFromBase64String(const utility::string_t& encodedString)
+{
+	// Base64 is plain ASCII, so narrow the wide string in small chunks and feed them
+	// straight to the decoder instead of converting and decoding the whole string separately.
+	std::vector<unsigned char> data(PLIST_BASE64_DECODED_SIZE(encodedString.size()));
+
+	plist_base64_state_t state;
+	plist_base64_state_init(&state);
+
+	char chunk[4096];
+	size_t length = 0;
+
+	for (size_t offset = 0; offset < encodedString.size(); offset += sizeof(chunk))
+	{
+		size_t count = (encodedString.size() - offset < sizeof(chunk)) ? encodedString.size() - offset : sizeof(chunk);
+		for (size_t i = 0; i < count; i++)
+		{
+			auto character = encodedString[offset + i];
+			chunk[i] = (character < 0x80) ? (char)character : ' ';
+		}
+
+		length += plist_base64_decode_update(&state, data.data() + length, chunk, count);
+	}
+
+	data.resize(length);
+	return data;
+}
+
 ClientConnection::ClientConnection()
 {
 }
@@ -238,7 +268,7 @@ pplx::task<void> ClientConnection::ProcessInstallProfilesRequest(web::json::valu
 	for (auto& value : array)
 	{
 		auto encodedData = value.as_string();
-		auto data = utility::conversions::from_base64(encodedData);
+		auto data = DataFromBase64String(encodedData);
 
 		auto profile = std::make_shared<ProvisioningProfile>(data);
 		if (profile != nullptr)
@@ -21,30 +21,49 @@
 #include <fstream>
 #include <sstream>
 #include <condition_variable>
+#include <deque>
 
 #include "Archiver.hpp"
 #include "ServerError.hpp"
 #include "ProvisioningProfile.hpp"
 #include "Application.hpp"
+#include "DevicePool.hpp"
+#include "AltServerApp.h"
 
 #include <WinSock2.h>
 
 #define DEVICE_LISTENING_SOCKET 28151
 
+// Written next to a staged app bundle once it has been uploaded completely, and contains the identifier of its upload manifest.
+#define UPLOAD_MANIFEST_MARKER_EXTENSION ".altserver-manifest"
+
+// Uploading a bundle as a single uncompressed .ipa saves the per-file AFC requests of uploading it file by file,
+// but always sends the whole bundle. Both are compared in bytes sent, counting each AFC round trip as this many
+// bytes (about what USB or Wi-Fi transfers in the time of a round trip).
+#define UPLOAD_ROUND_TRIP_COST (32 * 1024)
+
+// afc_upload pipelines the requests for this many files at a time, which costs about two round trips.
+#define BATCHED_UPLOAD_WINDOW 64
+
+// AFC packet header plus file handle, for each of a file's open, write and close requests.
+#define BATCHED_UPLOAD_FILE_OVERHEAD (3 * 48)
+
+#define SINGLE_ARCHIVE_UPLOAD_CHUNK_SIZE (4 * 1024 * 1024)
+
 #define odslog(msg) { std::wstringstream ss; ss << msg << std::endl; OutputDebugStringW(ss.str().c_str()); }
 
 extern std::string StringFromWideString(std::wstring wideString);
 extern std::wstring WideStringFromString(std::string string);
 
-void DeviceManagerUpdateStatus(plist_t command, plist_t status, void *udid);
-void DeviceManagerUpdateAppDeletionStatus(plist_t command, plist_t status, void* udid);
+void DeviceManagerUpdateStatus(plist_t command, plist_t status, void *progressHandler);
+void DeviceManagerUpdateAppDeletionStatus(plist_t command, plist_t status, void* completionHandler);
+void DeviceManagerDidWriteFile(const char* path, afc_error_t error, void* handler);
 void DeviceDidChangeConnectionStatus(const idevice_event_t* event, void* user_data);
 
 namespace fs = std::filesystem;
 
 extern std::string make_uuid();
 extern std::string temporary_directory();
-extern std::vector<unsigned char> readFile(const char* filename);
 
 /// Returns a version of 'str' where every occurrence of
 /// 'find' is substituted by 'replace'.
@@ -86,6 +105,9 @@ DeviceManager::DeviceManager()
 
 void DeviceManager::Start()
 {
+	// Create pool up front, since devices are probed concurrently.
+	DevicePool::instance();
+
 	idevice_event_subscribe(DeviceDidChangeConnectionStatus, NULL);
 }
 
@@ -95,19 +117,6 @@ pplx::task<void> DeviceManager::InstallApp(std::string appFilepath, std::string
 		// Enforce only one installation at a time.
 		this->_mutex.lock();
 
-		auto UUID = make_uuid();
-
-		char* uuidString = (char*)malloc(UUID.size() + 1);
-		strncpy(uuidString, (const char*)UUID.c_str(), UUID.size());
-		uuidString[UUID.size()] = '\0';
-
-		idevice_t device = nullptr;
-		lockdownd_client_t client = NULL;
-		instproxy_client_t ipc = NULL;
-		afc_client_t afc = NULL;
-		misagent_client_t mis = NULL;
-		lockdownd_service_descriptor_t service = NULL;
-
 		fs::path temporaryDirectory(temporary_directory());
 		temporaryDirectory.append(make_uuid());
 
@@ -116,66 +125,44 @@ pplx::task<void> DeviceManager::InstallApp(std::string appFilepath, std::string
 		auto installedProfiles = std::make_shared<std::vector<std::shared_ptr<ProvisioningProfile>>>();
 		auto cachedProfiles = std::make_shared<std::map<std::string, std::shared_ptr<ProvisioningProfile>>>();
 
-		auto finish = [this, installedProfiles, cachedProfiles, activeProfiles, temporaryDirectory, &uuidString]
-		(idevice_t device, lockdownd_client_t client, instproxy_client_t ipc, afc_client_t afc, misagent_client_t mis, lockdownd_service_descriptor_t service)
-		{
-			auto cleanUp = [=]() {
-				instproxy_client_free(ipc);
-				afc_client_free(afc);
-				lockdownd_client_free(client);
-				misagent_client_free(mis);
-				idevice_free(device);
-				lockdownd_service_descriptor_free(service);
-
-				free(uuidString);
-
-				this->_mutex.unlock();
-				fs::remove_all(temporaryDirectory);
-			};
+		auto cleanUp = [this, temporaryDirectory]() {
+			this->_mutex.unlock();
+			fs::remove_all(temporaryDirectory);
+		};
 
-			try
+		auto finish = [this, installedProfiles, cachedProfiles, activeProfiles](misagent_client_t mis)
+		{
+			if (activeProfiles.has_value())
 			{
-				if (activeProfiles.has_value())
+				// Remove installed provisioning profiles if they're not active.
+				for (auto& installedProfile : *installedProfiles)
 				{
-					// Remove installed provisioning profiles if they're not active.
-					for (auto& installedProfile : *installedProfiles)
+					if (std::count(activeProfiles->begin(), activeProfiles->end(), installedProfile->bundleIdentifier()) == 0)
 					{
-						if (std::count(activeProfiles->begin(), activeProfiles->end(), installedProfile->bundleIdentifier()) == 0)
-						{
-							this->RemoveProvisioningProfile(installedProfile, mis);
-						}
+						this->RemoveProvisioningProfile(installedProfile, mis);
 					}
 				}
+			}
 
-				for (auto& pair : *cachedProfiles)
-				{
-					BOOL reinstall = true;
+			for (auto& pair : *cachedProfiles)
+			{
+				BOOL reinstall = true;
 
-					for (auto& installedProfile : *installedProfiles)
+				for (auto& installedProfile : *installedProfiles)
+				{
+					if (installedProfile->bundleIdentifier() == pair.second->bundleIdentifier())
 					{
-						if (installedProfile->bundleIdentifier() == pair.second->bundleIdentifier())
-						{
-							// Don't reinstall cached profile because it was installed with app.
-							reinstall = false;
-							break;
-						}
+						// Don't reinstall cached profile because it was installed with app.
+						reinstall = false;
+						break;
 					}
+				}
 
-					if (reinstall)
-					{
-						this->InstallProvisioningProfile(pair.second, mis);
-					}					
-				}				
-			}
-			catch (std::exception& exception)
-			{
-				cleanUp();
-				throw;
+				if (reinstall)
+				{
+					this->InstallProvisioningProfile(pair.second, mis);
+				}
 			}
-
-			// Clean up outside scope so if an exception is thrown, we don't
-			// catch it ourselves again.
-			cleanUp();
 		};
 
 		try
@@ -222,419 +209,661 @@ pplx::task<void> DeviceManager::InstallApp(std::string appFilepath, std::string
 				}
 			}
 
-			/* Find Device */
-			if (idevice_new(&device, deviceUDID.c_str()) != IDEVICE_E_SUCCESS)
-			{
-				throw ServerError(ServerErrorCode::DeviceNotFound);
-			}
+			// Misagent must be connected up front, since if we take too long writing files to device, connecting may fail later when managing profiles.
+			int services = DeviceSession::InstallationProxyService | DeviceSession::MisagentService | DeviceSession::AFCService;
 
-			/* Connect to Device */
-			if (lockdownd_client_new_with_handshake(device, &client, "altserver") != LOCKDOWN_E_SUCCESS)
-			{
-				throw ServerError(ServerErrorCode::ConnectionFailed);
-			}
+			DevicePool::instance()->PerformWithSession(deviceUDID, true, services, [&](std::shared_ptr<DeviceSession> session, const DeviceServiceClients& clients) {
+				instproxy_client_t ipc = clients.installationProxyClient;
+				misagent_client_t mis = clients.misagentClient;
+				afc_client_t afc = clients.afcClient;
+
+				try
+				{
+					fs::path stagingPath("PublicStaging");
+
+					/* Prepare for installation */
+					char** files = NULL;
+					if (afc_get_file_info(afc, (const char*)stagingPath.c_str(), &files) != AFC_E_SUCCESS)
+					{
+						if (afc_make_directory(afc, (const char*)stagingPath.c_str()) != AFC_E_SUCCESS)
+						{
+							throw ServerError(ServerErrorCode::DeviceWriteFailed);
+						}
+					}
+
+					if (files)
+					{
+						int i = 0;
 
-			/* Connect to Installation Proxy */
-			if ((lockdownd_start_service(client, "com.apple.mobile.installation_proxy", &service) != LOCKDOWN_E_SUCCESS) || service == NULL)
+						while (files[i])
+						{
+							free(files[i]);
+							i++;
+						}
+
+						free(files);
+					}
+
+					std::cout << "Writing to device..." << std::endl;
+
+					plist_t options = instproxy_client_options_new();
+
+					fs::path archivePath = fs::path(stagingPath).append(appBundlePath.stem().string() + ".ipa");
+					fs::path destinationPath = stagingPath.append(appBundlePath.filename().string());
+
+					bool isArchiveUpload = false;
+
+					// Remember what was uploaded to each device so refreshes only upload files that changed since the last install.
+					fs::path manifestPath = AltServerApp::instance()->uploadManifestsDirectoryPath().append(deviceUDID);
+					fs::create_directories(manifestPath);
+					manifestPath.append(appBundlePath.filename().string() + ".plist");
+
+					try
+					{
+						UploadManifest manifest(appBundlePath, make_uuid());
+						auto stagedManifest = this->StagedUploadManifest(afc, destinationPath.string(), manifestPath);
+
+						uint64_t archiveSize = this->ArchiveSize(manifest, appBundlePath.filename().string());
+						isArchiveUpload = this->ShouldUploadArchive(manifest, stagedManifest, archiveSize);
+
+						if (isArchiveUpload)
+						{
+							// Leaves the staged bundle (and its manifest) untouched, so later installs can still upload just the differences.
+							this->WriteArchive(afc, appBundlePath.string(), archivePath.string(), archiveSize, [progressCompletionHandler](double progress) {
+								double weightedProgress = progress * 0.75;
+								progressCompletionHandler(weightedProgress);
+							});
+						}
+						else
+						{
+							instproxy_client_options_add(options, "PackageType", "Developer", NULL);
+
+							size_t numberOfFiles = manifest.numberOfFiles();
+							size_t writtenFiles = 0;
+
+							this->WriteDirectory(afc, appBundlePath.string(), destinationPath.string(), manifest, stagedManifest, [&writtenFiles, numberOfFiles, progressCompletionHandler](std::string filepath) {
+								writtenFiles++;
+
+								double progress = (double)writtenFiles / (double)numberOfFiles;
+								double weightedProgress = progress * 0.75;
+								progressCompletionHandler(weightedProgress);
+							});
+
+							this->WriteStagedUploadManifest(afc, destinationPath.string(), manifest, manifestPath);
+						}
+					}
+					catch (ServerError& e)
+					{
+						instproxy_client_options_free(options);
+
+						if (application->bundleIdentifier().find("science.xnu.undecimus") != std::string::npos)
+						{
+							auto userInfo = e.userInfo();
+							userInfo["NSLocalizedRecoverySuggestion"] = "Make sure Windows real-time protection is disabled on your computer then try again.";
+
+							throw ServerError((ServerErrorCode)e.code(), userInfo);
+						}
+						else
+						{
+							throw;
+						}
+					}
+					catch (std::exception& exception)
+					{
+						instproxy_client_options_free(options);
+
+						if (application->bundleIdentifier().find("science.xnu.undecimus") != std::string::npos)
+						{
+							std::map<std::string, std::string> userInfo = {
+								{ "NSLocalizedDescription", exception.what() },
+								{ "NSLocalizedRecoverySuggestion", "Make sure Windows real-time protection is disabled on your computer then try again." }
+							};
+
+							if (std::string(exception.what()) == std::string("vector<T> too long"))
+							{
+								userInfo["NSLocalizedFailureReason"] = "Windows Defender Blocked Installation";
+							}
+							else
+							{
+								userInfo["NSLocalizedFailureReason"] = exception.what();
+							}
+
+							throw ServerError(ServerErrorCode::Unknown, userInfo);
+						}
+						else
+						{
+							throw;
+						}
+					}
+
+					std::cout << "Finished writing to device." << std::endl;
+
+					/* Provisioning Profiles */
+					bool shouldManageProfiles = (activeProfiles.has_value() || (application->provisioningProfile() != NULL && application->provisioningProfile()->isFreeProvisioningProfile()));
+					if (shouldManageProfiles)
+					{
+						// Free developer account was used to sign this app, so we need to remove all
+						// provisioning profiles in order to remain under sideloaded app limit.
+
+						auto removedProfiles = this->RemoveAllFreeProvisioningProfilesExcludingBundleIdentifiers({}, mis);
+						for (auto& pair : removedProfiles)
+						{
+							if (activeProfiles.has_value())
+							{
+								if (activeProfiles->count(pair.first) > 0)
+								{
+									// Only cache active profiles to reinstall afterwards.
+									(*cachedProfiles)[pair.first] = pair.second;
+								}
+							}
+							else
+							{
+								// Cache all profiles to reinstall afterwards if we didn't provide activeProfiles.
+								(*cachedProfiles)[pair.first] = pair.second;
+							}
+						}
+					}
+
+					std::optional<ServerError> serverError = std::nullopt;
+					std::optional<LocalizedError> localizedError = std::nullopt;
+
+					// Called on libimobiledevice's I/O thread, but only until the operation below has finished.
+					std::function<void(double, int, char*, char*)> progressHandler = [progressCompletionHandler, &serverError, &localizedError]
+					(double progress, int resultCode, char *name, char *description) {
+						if (resultCode != 0 || name != NULL)
+						{
+							if (resultCode == -402620383)
+							{
+								std::map<std::string, std::string> userInfo = {
+									{ "NSLocalizedRecoverySuggestion", "Make sure 'Offload Unused Apps' is disabled in Settings > iTunes & App Stores, then install or delete all offloaded apps." }
+								};
+								serverError = std::make_optional<ServerError>(ServerErrorCode::MaximumFreeAppLimitReached, userInfo);
+							}
+							else if (name != NULL && std::string(name) == "DeviceOSVersionTooLow")
+							{
+								serverError = std::make_optional<ServerError>(ServerErrorCode::UnsupportediOSVersion);
+							}
+							else
+							{
+								localizedError = std::make_optional<LocalizedError>(resultCode, description != NULL ? description : "");
+							}
+
+							return;
+						}
+
+						if (progress > 0)
+						{
+							double weightedProgress = progress * 0.25;
+							double adjustedProgress = weightedProgress + 0.75;
+							progressCompletionHandler(adjustedProgress);
+						}
+					};
+
+					auto narrowDestinationPath = StringFromWideString(isArchiveUpload ? archivePath.c_str() : destinationPath.c_str());
+					std::replace(narrowDestinationPath.begin(), narrowDestinationPath.end(), '\\', '/');
+
+					instproxy_operation_t operation = NULL;
+					instproxy_error_t result = instproxy_install_async(ipc, narrowDestinationPath.c_str(), options, DeviceManagerUpdateStatus, &progressHandler, &operation);
+					instproxy_client_options_free(options);
+
+					if (result != INSTPROXY_E_SUCCESS)
+					{
+						throw ServerError(ServerErrorCode::ConnectionFailed);
+					}
+
+					// Wait until we're finished installing.
+					result = instproxy_operation_wait(operation, 0);
+					instproxy_operation_free(operation);
+
+					if (isArchiveUpload)
+					{
+						// Unlike staged bundles, archives can't be partially reused, so don't leave them taking up space.
+						afc_remove_path(afc, narrowDestinationPath.c_str());
+					}
+
+					if (serverError.has_value())
+					{
+						throw serverError.value();
+					}
+
+					if (localizedError.has_value())
+					{
+						throw localizedError.value();
+					}
+
+					if (result != INSTPROXY_E_SUCCESS)
+					{
+						throw ServerError(ServerErrorCode::LostConnection);
+					}
+				}
+				catch (std::exception& exception)
+				{
+					try
+					{
+						// MUST finish so we restore provisioning profiles.
+						finish(mis);
+					}
+					catch (std::exception& e)
+					{
+						// Ignore since we already caught an exception during installation.
+					}
+
+					throw;
+				}
+
+				// Call finish outside try-block so if an exception is thrown, we don't
+				// catch it ourselves and "finish" again.
+				finish(mis);
+			});
+		}
+		catch (std::exception& exception)
+		{
+			cleanUp();
+			throw;
+		}
+
+		cleanUp();
+	});
+}
+
+void DeviceManager::WriteDirectory(afc_client_t client, std::string directoryPath, std::string destinationPath, const UploadManifest& manifest, const std::optional<UploadManifest>& stagedManifest, std::function<void(std::string)> wroteFileCallback)
+{
+	std::replace(destinationPath.begin(), destinationPath.end(), '\\', '/');
+
+	auto destinationFilepath = [destinationPath](const std::string& relativePath) {
+		return replace_all(destinationPath + "/" + relativePath, "__colon__", ":");
+	};
+
+	// Invalidate the staged bundle before modifying it, so an interrupted upload is never mistaken for a complete one.
+	auto markerPath = destinationPath + UPLOAD_MANIFEST_MARKER_EXTENSION;
+	afc_remove_path(client, markerPath.c_str());
+
+	if (stagedManifest.has_value())
+	{
+		// Remove anything that is no longer part of the bundle, since extra files would invalidate its code signature.
+		std::set<std::string> removedDirectories;
+
+		for (auto& pair : stagedManifest->entries())
+		{
+			auto entry = manifest.entries().find(pair.first);
+			if (entry != manifest.entries().end() && entry->second.isDirectory == pair.second.isDirectory)
 			{
-				throw ServerError(ServerErrorCode::ConnectionFailed);
+				continue;
 			}
 
-			if (instproxy_client_new(device, service, &ipc) != INSTPROXY_E_SUCCESS)
+			bool isParentRemoved = false;
+			for (auto parentPath = fs::path(pair.first).parent_path(); !parentPath.empty(); parentPath = parentPath.parent_path())
 			{
-				throw ServerError(ServerErrorCode::ConnectionFailed);
+				if (removedDirectories.count(parentPath.generic_string()) > 0)
+				{
+					isParentRemoved = true;
+					break;
+				}
 			}
 
-			if (service)
+			if (isParentRemoved)
 			{
-				lockdownd_service_descriptor_free(service);
-				service = NULL;
+				continue;
 			}
 
+			odslog("Removing stale file: " << pair.first.c_str());
 
-			/* Connect to Misagent */
-			// Must connect now, since if we take too long writing files to device, connecting may fail later when managing profiles.
-			if (lockdownd_start_service(client, "com.apple.misagent", &service) != LOCKDOWN_E_SUCCESS || service == NULL)
+			afc_error_t error = afc_remove_path_and_contents(client, destinationFilepath(pair.first).c_str());
+			if (error != AFC_E_SUCCESS && error != AFC_E_OBJECT_NOT_FOUND)
 			{
-				throw ServerError(ServerErrorCode::ConnectionFailed);
+				throw ServerError(ServerErrorCode::DeviceWriteFailed);
 			}
 
-			if (misagent_client_new(device, service, &mis) != MISAGENT_E_SUCCESS)
+			if (pair.second.isDirectory)
 			{
-				throw ServerError(ServerErrorCode::ConnectionFailed);
+				removedDirectories.insert(pair.first);
 			}
+		}
+	}
+	else
+	{
+		// We don't know what a previous upload left behind, so start over.
+		afc_error_t error = afc_remove_path_and_contents(client, destinationPath.c_str());
+		if (error != AFC_E_SUCCESS && error != AFC_E_OBJECT_NOT_FOUND)
+		{
+			throw ServerError(ServerErrorCode::DeviceWriteFailed);
+		}
+	}
 
+	// Files are reported in the order they were queued.
+	std::deque<std::string> queuedFilepaths;
+	std::optional<afc_error_t> uploadError = std::nullopt;
 
-			/* Connect to AFC service */
-			if ((lockdownd_start_service(client, "com.apple.afc", &service) != LOCKDOWN_E_SUCCESS) || service == NULL)
-			{
-				throw ServerError(ServerErrorCode::ConnectionFailed);
-			}
+	std::function<void(const char*, afc_error_t)> didWriteFileHandler = [&queuedFilepaths, &uploadError, wroteFileCallback](const char* path, afc_error_t error) {
+		auto filepath = queuedFilepaths.front();
+		queuedFilepaths.pop_front();
+
+		if (error != AFC_E_SUCCESS)
+		{
+			odslog("Failed to write file: " << filepath.c_str() << ". Error: " << error);
 
-			if (afc_client_new(device, service, &afc) != AFC_E_SUCCESS)
+			if (!uploadError.has_value())
 			{
-				throw ServerError(ServerErrorCode::ConnectionFailed);
+				uploadError = error;
 			}
 
-			fs::path stagingPath("PublicStaging");
+			return;
+		}
+
+		wroteFileCallback(filepath);
+	};
+
+	// Queue the whole tree so directories, opens, writes and closes are pipelined instead of
+	// costing a round trip each.
+	afc_upload_t upload = NULL;
+	if (afc_upload_new(client, DeviceManagerDidWriteFile, &didWriteFileHandler, &upload) != AFC_E_SUCCESS)
+	{
+		throw ServerError(ServerErrorCode::DeviceWriteFailed);
+	}
 
-			/* Prepare for installation */
-			char** files = NULL;
-			if (afc_get_file_info(afc, (const char*)stagingPath.c_str(), &files) != AFC_E_SUCCESS)
+	try
+	{
+		afc_upload_add_directory(upload, destinationPath.c_str());
+
+		// Manifest entries are sorted, so directories are always queued before their contents.
+		for (auto& pair : manifest.entries())
+		{
+			auto filepath = fs::path(directoryPath).append(pair.first);
+
+			bool isStaged = false;
+			if (stagedManifest.has_value())
 			{
-				if (afc_make_directory(afc, (const char*)stagingPath.c_str()) != AFC_E_SUCCESS)
-				{
-					throw ServerError(ServerErrorCode::DeviceWriteFailed);
-				}
+				auto stagedEntry = stagedManifest->entries().find(pair.first);
+				isStaged = (stagedEntry != stagedManifest->entries().end() && stagedEntry->second == pair.second);
 			}
 
-			if (files)
+			if (pair.second.isDirectory)
 			{
-				int i = 0;
-
-				while (files[i])
+				if (!isStaged)
 				{
-					free(files[i]);
-					i++;
+					afc_upload_add_directory(upload, destinationFilepath(pair.first).c_str());
 				}
 
-				free(files);
+				continue;
+			}
+
+			if (isStaged)
+			{
+				// Already on device from a previous install.
+				wroteFileCallback(filepath.string());
+				continue;
 			}
 
-			std::cout << "Writing to device..." << std::endl;
+			auto deviceFilepath = destinationFilepath(pair.first);
 
-			plist_t options = instproxy_client_options_new();
-			instproxy_client_options_add(options, "PackageType", "Developer", NULL);
+			odslog("Writing File: " << filepath.c_str() << " to: " << deviceFilepath.c_str());
 
-			fs::path destinationPath = stagingPath.append(appBundlePath.filename().string());
+			queuedFilepaths.push_back(filepath.string());
 
-			int numberOfFiles = 0;
-			for (auto& item : fs::recursive_directory_iterator(appBundlePath))
+			// Read from disk a chunk at a time while flushing, so large binaries aren't held in memory.
+			// Flushes automatically once enough has been queued.
+			if (afc_upload_add_local_file(upload, deviceFilepath.c_str(), filepath.string().c_str()) != AFC_E_SUCCESS)
 			{
-				if (item.is_regular_file())
-				{
-					numberOfFiles++;
-				}				
+				throw ServerError(ServerErrorCode::DeviceWriteFailed);
 			}
+		}
 
-			int writtenFiles = 0;
-
-			try
-			{
-				this->WriteDirectory(afc, appBundlePath.string(), destinationPath.string(), [&writtenFiles, numberOfFiles, progressCompletionHandler](std::string filepath) {
-					writtenFiles++;
+		if (afc_upload_flush(upload) != AFC_E_SUCCESS || uploadError.has_value())
+		{
+			throw ServerError(ServerErrorCode::DeviceWriteFailed);
+		}
+	}
+	catch (std::exception& exception)
+	{
+		afc_upload_free(upload);
+		throw;
+	}
 
-					double progress = (double)writtenFiles / (double)numberOfFiles;
-					double weightedProgress = progress * 0.75;
-					progressCompletionHandler(weightedProgress);
-				});
-			}
-			catch (ServerError& e)
-			{
-				if (application->bundleIdentifier().find("science.xnu.undecimus") != std::string::npos)
-				{
-					auto userInfo = e.userInfo();
-					userInfo["NSLocalizedRecoverySuggestion"] = "Make sure Windows real-time protection is disabled on your computer then try again.";
+	afc_upload_free(upload);
+}
 
-					throw ServerError((ServerErrorCode)e.code(), userInfo);
-				}	
-				else
-				{
-					throw;
-				}				
-			}
-			catch (std::exception& exception)
-			{
-				if (application->bundleIdentifier().find("science.xnu.undecimus") != std::string::npos)
-				{
-					std::map<std::string, std::string> userInfo = {
-						{ "NSLocalizedDescription", exception.what() },
-						{ "NSLocalizedRecoverySuggestion", "Make sure Windows real-time protection is disabled on your computer then try again." }
-					};
+void DeviceManager::WriteArchive(afc_client_t client, std::string appBundlePath, std::string destinationPath, uint64_t archiveSize, std::function<void(double)> progressHandler)
+{
+	std::replace(destinationPath.begin(), destinationPath.end(), '\\', '/');
 
-					if (std::string(exception.what()) == std::string("vector<T> too long"))
-					{
-						userInfo["NSLocalizedFailureReason"] = "Windows Defender Blocked Installation";
-					}
-					else
-					{
-						userInfo["NSLocalizedFailureReason"] = exception.what();
-					}
+	odslog("Writing archive of: " << appBundlePath.c_str() << " to: " << destinationPath.c_str());
 
-					throw ServerError(ServerErrorCode::Unknown, userInfo);
-				}
-				else
-				{
-					throw;
-				}
-			}
+	uint64_t handle = 0;
+	if (afc_file_open(client, destinationPath.c_str(), AFC_FOPEN_WRONLY, &handle) != AFC_E_SUCCESS)
+	{
+		throw ServerError(ServerErrorCode::DeviceWriteFailed);
+	}
 
-			std::cout << "Finished writing to device." << std::endl;
+	// Only differs from the offset of the next chunk after the archiver rewrote the header of a large entry.
+	uint64_t fileOffset = 0;
+	uint64_t totalBytesWritten = 0;
+	bool writeFailed = false;
 
+	try
+	{
+		// Stream the archive straight into the file rather than creating it on disk first.
+		ZipAppBundle(appBundlePath, SINGLE_ARCHIVE_UPLOAD_CHUNK_SIZE, [&](uint64_t offset, const char* data, size_t size) {
+			if (offset != fileOffset && afc_file_seek(client, handle, (int64_t)offset, SEEK_SET) != AFC_E_SUCCESS)
+			{
+				writeFailed = true;
+				return false;
+			}
 
-			if (service)
+			uint32_t bytesWritten = 0;
+			if (afc_file_write(client, handle, data, (uint32_t)size, &bytesWritten) != AFC_E_SUCCESS || bytesWritten != size)
 			{
-				lockdownd_service_descriptor_free(service);
-				service = NULL;
+				writeFailed = true;
+				return false;
 			}
 
-			/* Provisioning Profiles */			
-			bool shouldManageProfiles = (activeProfiles.has_value() || (application->provisioningProfile() != NULL && application->provisioningProfile()->isFreeProvisioningProfile()));
-			if (shouldManageProfiles)
-			{				
-				// Free developer account was used to sign this app, so we need to remove all
-				// provisioning profiles in order to remain under sideloaded app limit.
+			fileOffset = offset + size;
 
-				auto removedProfiles = this->RemoveAllFreeProvisioningProfilesExcludingBundleIdentifiers({}, mis);
-				for (auto& pair : removedProfiles)
-				{
-					if (activeProfiles.has_value())
-					{
-						if (activeProfiles->count(pair.first) > 0)
-						{
-							// Only cache active profiles to reinstall afterwards.
-							(*cachedProfiles)[pair.first] = pair.second;
-						}
-					}
-					else
-					{
-						// Cache all profiles to reinstall afterwards if we didn't provide activeProfiles.
-						(*cachedProfiles)[pair.first] = pair.second;
-					}
-				}				
+			if (fileOffset > totalBytesWritten)
+			{
+				totalBytesWritten = fileOffset;
+				progressHandler(std::min((double)totalBytesWritten / (double)archiveSize, 1.0));
 			}
 
-			lockdownd_client_free(client);
-			client = NULL;
-
-			std::mutex waitingMutex;
-			std::condition_variable cv;
+			return true;
+		});
+	}
+	catch (std::exception& exception)
+	{
+		afc_file_close(client, handle);
 
-			std::optional<ServerError> serverError = std::nullopt;
-			std::optional<LocalizedError> localizedError = std::nullopt;
+		odslog("Failed to write archive: " << exception.what());
 
-			bool didBeginInstalling = false;
-			bool didFinishInstalling = false;
+		if (writeFailed)
+		{
+			throw ServerError(ServerErrorCode::DeviceWriteFailed);
+		}
 
-			this->_installationProgressHandlers[UUID] = [device, client, ipc, afc, mis, service, finish, progressCompletionHandler, 
-				&waitingMutex, &cv, &didBeginInstalling, &didFinishInstalling, &serverError, &localizedError](double progress, int resultCode, char *name, char *description) {
-				double weightedProgress = progress * 0.25;
-				double adjustedProgress = weightedProgress + 0.75;
+		throw;
+	}
 
-				if (progress == 0 && didBeginInstalling)
-				{
-					if (resultCode != 0 || name != NULL)
-					{
-						if (resultCode == -402620383)
-						{
-							std::map<std::string, std::string> userInfo = {
-								{ "NSLocalizedRecoverySuggestion", "Make sure 'Offload Unused Apps' is disabled in Settings > iTunes & App Stores, then install or delete all offloaded apps." }
-							};
-							serverError = std::make_optional<ServerError>(ServerErrorCode::MaximumFreeAppLimitReached, userInfo);
-						}
-						else
-						{
-							std::string errorName(name);
+	afc_file_close(client, handle);
+}
 
-							if (errorName == "DeviceOSVersionTooLow")
-							{
-								serverError = std::make_optional<ServerError>(ServerErrorCode::UnsupportediOSVersion);
-							}
-							else
-							{
-								localizedError = std::make_optional<LocalizedError>(resultCode, description);
-							}
-						}
-					}
+uint64_t DeviceManager::ArchiveSize(const UploadManifest& manifest, std::string appBundleName) const
+{
+	// A stored entry is its data plus a local header (30 bytes) and a central directory record (46 bytes), both followed by the entry's name.
+	std::string payloadDirectory = "Payload/";
+	std::string appBundleDirectory = payloadDirectory + appBundleName + "/";
 
-					std::lock_guard<std::mutex> lock(waitingMutex);
-					didFinishInstalling = true;
-					cv.notify_all();
-				}
-				else
-				{
-					progressCompletionHandler(adjustedProgress);
-				}
+	uint64_t archiveSize = 2 * (30 + 46) + 2 * (payloadDirectory.size() + appBundleDirectory.size());
 
-				didBeginInstalling = true;
-			};
+	for (auto& pair : manifest.entries())
+	{
+		uint64_t nameLength = appBundleDirectory.size() + pair.first.size() + (pair.second.isDirectory ? 1 : 0);
+		archiveSize += 30 + 46 + 2 * nameLength;
 
-			auto narrowDestinationPath = StringFromWideString(destinationPath.c_str());
-			std::replace(narrowDestinationPath.begin(), narrowDestinationPath.end(), '\\', '/');
+		if (!pair.second.isDirectory)
+		{
+			archiveSize += pair.second.size;
+		}
+	}
 
-			instproxy_install(ipc, narrowDestinationPath.c_str(), options, DeviceManagerUpdateStatus, uuidString);
-			instproxy_client_options_free(options);
+	// End of central directory record.
+	archiveSize += 22;
 
-			// Wait until we're finished installing;
-			std::unique_lock<std::mutex> lock(waitingMutex);
-			cv.wait(lock, [&didFinishInstalling] { return didFinishInstalling; });
+	return archiveSize;
+}
 
-			lock.unlock();
+bool DeviceManager::ShouldUploadArchive(const UploadManifest& manifest, const std::optional<UploadManifest>& stagedManifest, uint64_t archiveSize) const
+{
+	if (archiveSize >= ALTZipArchiveMaximumSize)
+	{
+		return false;
+	}
 
-			if (serverError.has_value())
-			{
-				throw serverError.value();
-			}
+	// Uploading file by file only sends the files that aren't already staged, but removes stale ones one at a time.
+	size_t numberOfFiles = 0;
+	size_t numberOfRemovedFiles = 0;
+	uint64_t uploadSize = 0;
 
-			if (localizedError.has_value())
-			{
-				throw localizedError.value();
-			}			
+	for (auto& pair : manifest.entries())
+	{
+		if (pair.second.isDirectory)
+		{
+			continue;
 		}
-		catch (std::exception& exception)
+
+		if (stagedManifest.has_value())
 		{
-			try
+			auto stagedEntry = stagedManifest->entries().find(pair.first);
+			if (stagedEntry != stagedManifest->entries().end() && stagedEntry->second == pair.second)
 			{
-				// MUST finish so we restore provisioning profiles.
-				finish(device, client, ipc, afc, mis, service);
+				continue;
 			}
-			catch (std::exception& e)
+		}
+
+		numberOfFiles++;
+		uploadSize += pair.second.size + BATCHED_UPLOAD_FILE_OVERHEAD + pair.first.size();
+	}
+
+	if (stagedManifest.has_value())
+	{
+		for (auto& pair : stagedManifest->entries())
+		{
+			if (manifest.entries().count(pair.first) == 0)
 			{
-				// Ignore since we already caught an exception during installation.
+				numberOfRemovedFiles++;
 			}
-
-			throw;
 		}
+	}
+	else
+	{
+		// The whole staged bundle is removed at once.
+		numberOfRemovedFiles = 1;
+	}
 
-		// Call finish outside try-block so if an exception is thrown, we don't
-		// catch it ourselves and "finish" again.
-		finish(device, client, ipc, afc, mis, service);
-	});
-}
+	uint64_t numberOfWindows = (numberOfFiles + BATCHED_UPLOAD_WINDOW - 1) / BATCHED_UPLOAD_WINDOW;
+	uint64_t uploadCost = uploadSize + (2 * numberOfWindows + numberOfRemovedFiles) * UPLOAD_ROUND_TRIP_COST;
 
-void DeviceManager::WriteDirectory(afc_client_t client, std::string directoryPath, std::string destinationPath, std::function<void(std::string)> wroteFileCallback)
-{
-	std::replace(destinationPath.begin(), destinationPath.end(), '\\', '/');
+	// The archive is written a chunk per request, besides opening, closing and finally removing it.
+	uint64_t numberOfChunks = (archiveSize + SINGLE_ARCHIVE_UPLOAD_CHUNK_SIZE - 1) / SINGLE_ARCHIVE_UPLOAD_CHUNK_SIZE;
+	uint64_t archiveCost = archiveSize + (numberOfChunks + 3) * UPLOAD_ROUND_TRIP_COST;
 
-    afc_make_directory(client, destinationPath.c_str());
-    
-    for (auto& file : fs::directory_iterator(directoryPath))
-    {
-        auto filepath = file.path();
-        
-        if (fs::is_directory(filepath))
-        {
-            auto destinationDirectoryPath = fs::path(destinationPath).append(filepath.filename().string());
-            this->WriteDirectory(client, filepath.string(), destinationDirectoryPath.string(), wroteFileCallback);
-        }
-        else
-        {
-            auto destinationFilepath = fs::path(destinationPath).append(filepath.filename().string());
-            this->WriteFile(client, filepath.string(), destinationFilepath.string(), wroteFileCallback);
-        }
-    }
+	return archiveCost < uploadCost;
 }
 
-void DeviceManager::WriteFile(afc_client_t client, std::string filepath, std::string destinationPath, std::function<void(std::string)> wroteFileCallback)
+std::optional<UploadManifest> DeviceManager::StagedUploadManifest(afc_client_t client, std::string destinationPath, fs::path manifestPath)
 {
 	std::replace(destinationPath.begin(), destinationPath.end(), '\\', '/');
-	destinationPath = replace_all(destinationPath, "__colon__", ":");
 
-	odslog("Writing File: " << filepath.c_str() << " to: " << destinationPath.c_str());
-    
-    auto data = readFile(filepath.c_str());
-    
-    uint64_t af = 0;
-    if ((afc_file_open(client, destinationPath.c_str(), AFC_FOPEN_WRONLY, &af) != AFC_E_SUCCESS) || af == 0)
-    {
-        throw ServerError(ServerErrorCode::DeviceWriteFailed);
-    }
-    
-    uint32_t bytesWritten = 0;
-    
-    while (bytesWritten < data.size())
-    {
-        uint32_t count = 0;
-        
-        if (afc_file_write(client, af, (const char *)data.data() + bytesWritten, (uint32_t)data.size() - bytesWritten, &count) != AFC_E_SUCCESS)
-        {
-            throw ServerError(ServerErrorCode::DeviceWriteFailed);
-        }
-        
-        bytesWritten += count;
-    }
-    
-    if (bytesWritten != data.size())
-    {
-        throw ServerError(ServerErrorCode::DeviceWriteFailed);
-    }
-    
-    afc_file_close(client, af);
+	auto manifest = UploadManifest::ManifestAtPath(manifestPath);
+	if (!manifest.has_value())
+	{
+		return std::nullopt;
+	}
 
-	wroteFileCallback(filepath);
-}
-
-pplx::task<void> DeviceManager::RemoveApp(std::string bundleIdentifier, std::string deviceUDID)
-{
-	return pplx::task<void>([=] {
-		idevice_t device = NULL;
-		lockdownd_client_t client = NULL;
-		instproxy_client_t ipc = NULL;
-		lockdownd_service_descriptor_t service = NULL;
+	// The marker is only written once an upload finishes, so if it doesn't match our manifest
+	// the staged bundle was modified or replaced since and can't be reused.
+	auto markerPath = destinationPath + UPLOAD_MANIFEST_MARKER_EXTENSION;
 
-		auto cleanUp = [&]() {
-			if (service) {
-				lockdownd_service_descriptor_free(service);
-			}
-
-			if (ipc) {
-				instproxy_client_free(ipc);
-			}
-
-			if (client) {
-				lockdownd_client_free(client);
-			}
-
-			if (device) {
-				idevice_free(device);
-			}
-		};
-
-		try 
+	uint64_t handle = 0;
+	if (afc_file_open(client, markerPath.c_str(), AFC_FOPEN_RDONLY, &handle) != AFC_E_SUCCESS)
+	{
+		return std::nullopt;
+	}
+
+	char identifier[128];
+	uint32_t bytesRead = 0;
+	afc_error_t error = afc_file_read(client, handle, identifier, sizeof(identifier), &bytesRead);
+	afc_file_close(client, handle);
+
+	if (error != AFC_E_SUCCESS || std::string(identifier, bytesRead) != manifest->identifier())
+	{
+		return std::nullopt;
+	}
+
+	// Make sure the staged bundle itself still exists.
+	char** info = NULL;
+	if (afc_get_file_info(client, destinationPath.c_str(), &info) != AFC_E_SUCCESS || info == NULL)
+	{
+		return std::nullopt;
+	}
+
+	bool isDirectory = false;
+	for (int i = 0; info[i] != NULL && info[i + 1] != NULL; i += 2)
+	{
+		if (std::string(info[i]) == "st_ifmt")
 		{
-			/* Find Device */
-			if (idevice_new(&device, deviceUDID.c_str()) != IDEVICE_E_SUCCESS)
-			{
-				throw ServerError(ServerErrorCode::DeviceNotFound);
-			}
+			isDirectory = (std::string(info[i + 1]) == "S_IFDIR");
+		}
+	}
 
-			/* Connect to Device */
-			if (lockdownd_client_new_with_handshake(device, &client, "altserver") != LOCKDOWN_E_SUCCESS)
-			{
-				throw ServerError(ServerErrorCode::ConnectionFailed);
-			}
+	afc_dictionary_free(info);
 
-			/* Connect to Installation Proxy */
-			if ((lockdownd_start_service(client, "com.apple.mobile.installation_proxy", &service) != LOCKDOWN_E_SUCCESS) || service == NULL)
-			{
-				throw ServerError(ServerErrorCode::ConnectionFailed);
-			}
+	if (!isDirectory)
+	{
+		return std::nullopt;
+	}
 
-			if (instproxy_client_new(device, service, &ipc) != INSTPROXY_E_SUCCESS)
-			{
-				throw ServerError(ServerErrorCode::ConnectionFailed);
-			}
+	return manifest;
+}
 
-			if (service)
-			{
-				lockdownd_service_descriptor_free(service);
-				service = NULL;
-			}
+void DeviceManager::WriteStagedUploadManifest(afc_client_t client, std::string destinationPath, const UploadManifest& manifest, fs::path manifestPath)
+{
+	std::replace(destinationPath.begin(), destinationPath.end(), '\\', '/');
 
-			auto UUID = make_uuid();
+	try
+	{
+		manifest.WriteToPath(manifestPath);
+	}
+	catch (std::exception& e)
+	{
+		// Not fatal, the next install will just upload everything again.
+		odslog("Failed to save upload manifest. " << e.what());
+		return;
+	}
 
-			char* uuidString = (char*)malloc(UUID.size() + 1);
-			strncpy(uuidString, (const char*)UUID.c_str(), UUID.size());
-			uuidString[UUID.size()] = '\0';
+	auto markerPath = destinationPath + UPLOAD_MANIFEST_MARKER_EXTENSION;
+	auto identifier = manifest.identifier();
 
-			std::mutex waitingMutex;
-			std::condition_variable cv;
+	uint64_t handle = 0;
+	if (afc_file_open(client, markerPath.c_str(), AFC_FOPEN_WRONLY, &handle) != AFC_E_SUCCESS)
+	{
+		odslog("Failed to write upload manifest marker.");
+		return;
+	}
 
-			std::optional<ServerError> serverError = std::nullopt;
+	uint32_t bytesWritten = 0;
+	if (afc_file_write(client, handle, identifier.c_str(), (uint32_t)identifier.size(), &bytesWritten) != AFC_E_SUCCESS || bytesWritten != identifier.size())
+	{
+		odslog("Failed to write upload manifest marker.");
+	}
 
-			bool didFinishInstalling = false;
+	afc_file_close(client, handle);
+}
+
+pplx::task<void> DeviceManager::RemoveApp(std::string bundleIdentifier, std::string deviceUDID)
+{
+	return pplx::task<void>([=] {
+		DevicePool::instance()->PerformWithSession(deviceUDID, true, DeviceSession::InstallationProxyService, [&](std::shared_ptr<DeviceSession> session, const DeviceServiceClients& clients) {
+			std::optional<ServerError> serverError = std::nullopt;
 
-			this->_deletionCompletionHandlers[UUID] = [this, &waitingMutex, &cv, &didFinishInstalling, &serverError, &uuidString]
+			std::function<void(bool, int, char*, char*)> completionHandler = [&serverError]
 			(bool success, int errorCode, char* errorName, char* errorDescription) {
 				if (!success)
 				{
@@ -644,33 +873,30 @@ pplx::task<void> DeviceManager::RemoveApp(std::string bundleIdentifier, std::str
 					};
 					serverError = std::make_optional<ServerError>(ServerErrorCode::AppDeletionFailed, userInfo);
 				}
-
-				std::lock_guard<std::mutex> lock(waitingMutex);
-				didFinishInstalling = true;
-				cv.notify_all();
-
-				free(uuidString);
 			};
 
-			instproxy_uninstall(ipc, bundleIdentifier.c_str(), NULL, DeviceManagerUpdateAppDeletionStatus, uuidString);
+			instproxy_operation_t operation = NULL;
+			instproxy_error_t result = instproxy_uninstall_async(clients.installationProxyClient, bundleIdentifier.c_str(), NULL, DeviceManagerUpdateAppDeletionStatus, &completionHandler, &operation);
 
-			// Wait until we're finished installing;
-			std::unique_lock<std::mutex> lock(waitingMutex);
-			cv.wait(lock, [&didFinishInstalling] { return didFinishInstalling; });
+			if (result != INSTPROXY_E_SUCCESS)
+			{
+				throw ServerError(ServerErrorCode::ConnectionFailed);
+			}
 
-			lock.unlock();
+			// Wait until we're finished removing the app.
+			result = instproxy_operation_wait(operation, 0);
+			instproxy_operation_free(operation);
 
 			if (serverError.has_value())
 			{
 				throw serverError.value();
 			}
 
-			cleanUp();
-		}
-		catch (std::exception& exception) {
-			cleanUp();
-			throw;
-		}
+			if (result != INSTPROXY_E_SUCCESS)
+			{
+				throw ServerError(ServerErrorCode::LostConnection);
+			}
+		});
 	});
 }
 
@@ -704,62 +930,10 @@ pplx::task<void> DeviceManager::InstallProvisioningProfiles(std::vector<std::sha
 {
 	return pplx::task<void>([=] {
 		// Enforce only one installation at a time.
-		this->_mutex.lock();
-
-		idevice_t device = NULL;
-		lockdownd_client_t client = NULL;
-		afc_client_t afc = NULL;
-		misagent_client_t mis = NULL;
-		lockdownd_service_descriptor_t service = NULL;
-
-		auto cleanUp = [&]() {
-			if (service) {
-				lockdownd_service_descriptor_free(service);
-			}
-
-			if (mis) {
-				misagent_client_free(mis);
-			}
-
-			if (afc) {
-				afc_client_free(afc);
-			}
-
-			if (client) {
-				lockdownd_client_free(client);
-			}
-
-			if (device) {
-				idevice_free(device);
-			}
-
-			this->_mutex.unlock();
-		};
-
-		try
-		{
-			/* Find Device */
-			if (idevice_new(&device, deviceUDID.c_str()) != IDEVICE_E_SUCCESS)
-			{
-				throw ServerError(ServerErrorCode::DeviceNotFound);
-			}
-
-			/* Connect to Device */
-			if (lockdownd_client_new_with_handshake(device, &client, "altserver") != LOCKDOWN_E_SUCCESS)
-			{
-				throw ServerError(ServerErrorCode::ConnectionFailed);
-			}
-
-			/* Connect to Misagent */
-			if (lockdownd_start_service(client, "com.apple.misagent", &service) != LOCKDOWN_E_SUCCESS || service == NULL)
-			{
-				throw ServerError(ServerErrorCode::ConnectionFailed);
-			}
+		std::lock_guard<std::mutex> lock(this->_mutex);
 
-			if (misagent_client_new(device, service, &mis) != MISAGENT_E_SUCCESS)
-			{
-				throw ServerError(ServerErrorCode::ConnectionFailed);
-			}
+		DevicePool::instance()->PerformWithSession(deviceUDID, true, DeviceSession::MisagentService, [&](std::shared_ptr<DeviceSession> session, const DeviceServiceClients& clients) {
+			misagent_client_t mis = clients.misagentClient;
 
 			if (activeProfiles.has_value())
 			{
@@ -791,14 +965,7 @@ pplx::task<void> DeviceManager::InstallProvisioningProfiles(std::vector<std::sha
 			{
 				this->InstallProvisioningProfile(provisioningProfile, mis);
 			}
-
-			cleanUp();
-		}
-		catch (std::exception &exception)
-		{
-			cleanUp();
-			throw;
-		}
+		});
 	});
 }
 
@@ -806,72 +973,11 @@ pplx::task<void> DeviceManager::RemoveProvisioningProfiles(std::set<std::string>
 {
 	return pplx::task<void>([=] {
 		// Enforce only one removal at a time.
-		this->_mutex.lock();
-
-		idevice_t device = NULL;
-		lockdownd_client_t client = NULL;
-		afc_client_t afc = NULL;
-		misagent_client_t mis = NULL;
-		lockdownd_service_descriptor_t service = NULL;
-
-		auto cleanUp = [&]() {
-			if (service) {
-				lockdownd_service_descriptor_free(service);
-			}
-
-			if (mis) {
-				misagent_client_free(mis);
-			}
-
-			if (afc) {
-				afc_client_free(afc);
-			}
-
-			if (client) {
-				lockdownd_client_free(client);
-			}
-
-			if (device) {
-				idevice_free(device);
-			}
-
-			this->_mutex.unlock();
-		};
-
-		try
-		{
-			/* Find Device */
-			if (idevice_new(&device, deviceUDID.c_str()) != IDEVICE_E_SUCCESS)
-			{
-				throw ServerError(ServerErrorCode::DeviceNotFound);
-			}
-
-			/* Connect to Device */
-			if (lockdownd_client_new_with_handshake(device, &client, "altserver") != LOCKDOWN_E_SUCCESS)
-			{
-				throw ServerError(ServerErrorCode::ConnectionFailed);
-			}
-
-			/* Connect to Misagent */
-			if (lockdownd_start_service(client, "com.apple.misagent", &service) != LOCKDOWN_E_SUCCESS || service == NULL)
-			{
-				throw ServerError(ServerErrorCode::ConnectionFailed);
-			}
-
-			if (misagent_client_new(device, service, &mis) != MISAGENT_E_SUCCESS)
-			{
-				throw ServerError(ServerErrorCode::ConnectionFailed);
-			}
-
-			this->RemoveProvisioningProfiles(bundleIdentifiers, mis);
+		std::lock_guard<std::mutex> lock(this->_mutex);
 
-			cleanUp();
-		}
-		catch (std::exception& exception)
-		{
-			cleanUp();
-			throw;
-		}
+		DevicePool::instance()->PerformWithSession(deviceUDID, true, DeviceSession::MisagentService, [&](std::shared_ptr<DeviceSession> session, const DeviceServiceClients& clients) {
+			this->RemoveProvisioningProfiles(bundleIdentifiers, clients.misagentClient);
+		});
 	});
 }
 
@@ -1106,46 +1212,21 @@ std::vector<std::shared_ptr<ProvisioningProfile>> DeviceManager::CopyProvisionin
 pplx::task<std::shared_ptr<NotificationConnection>> DeviceManager::StartNotificationConnection(std::shared_ptr<Device> altDevice)
 {
 	return pplx::create_task([=]() -> std::shared_ptr<NotificationConnection> {
-		idevice_t device = NULL;
-		lockdownd_client_t lockdownClient = NULL;
-		lockdownd_service_descriptor_t service = NULL;
 		np_client_t client = NULL;
 
-		/* Find Device */
-		if (idevice_new_ignore_network(&device, altDevice->identifier().c_str()) != IDEVICE_E_SUCCESS)
-		{
-			throw ServerError(ServerErrorCode::DeviceNotFound);
-		}
-
-		/* Connect to Device */
-		if (lockdownd_client_new_with_handshake(device, &lockdownClient, "altserver") != LOCKDOWN_E_SUCCESS)
-		{
-			idevice_free(device);
-			throw ServerError(ServerErrorCode::ConnectionFailed);
-		}
-
-		/* Connect to Notification Proxy */
-		if ((lockdownd_start_service(lockdownClient, "com.apple.mobile.notification_proxy", &service) != LOCKDOWN_E_SUCCESS) || service == NULL)
-		{
-			lockdownd_client_free(lockdownClient);
-			idevice_free(device);
-
-			throw ServerError(ServerErrorCode::ConnectionFailed);
-		}
+		DevicePool::instance()->PerformWithSession(altDevice->identifier(), false, 0, [&](std::shared_ptr<DeviceSession> session, const DeviceServiceClients& clients) {
+			/* Connect to Notification Proxy */
+			lockdownd_service_descriptor_t service = session->StartService("com.apple.mobile.notification_proxy");
 
-		/* Connect to Client */
-		if (np_client_new(device, service, &client) != NP_E_SUCCESS)
-		{
+			/* Connect to Client */
+			np_error_t result = np_client_new(session->device(), service, &client);
 			lockdownd_service_descriptor_free(service);
-			lockdownd_client_free(lockdownClient);
-			idevice_free(device);
-
-			throw ServerError(ServerErrorCode::ConnectionFailed);
-		}
 
-		lockdownd_service_descriptor_free(service);
-		lockdownd_client_free(lockdownClient);
-		idevice_free(device);
+			if (result != NP_E_SUCCESS)
+			{
+				throw ServerError(ServerErrorCode::ConnectionFailed);
+			}
+		});
 
 		auto notificationConnection = std::make_shared<NotificationConnection>(altDevice, client);
 		return notificationConnection;
@@ -1175,116 +1256,164 @@ std::vector<std::shared_ptr<Device>> DeviceManager::availableDevices(bool includ
         fprintf(stderr, "ERROR: Unable to retrieve device list!\n");
         return availableDevices;
     }
+
+	// Probe all devices concurrently, since each uncached device requires a lockdown round trip.
+	std::vector<pplx::task<std::shared_ptr<Device>>> probeTasks;
+	std::set<std::string> probedUDIDs;
     
     for (int i = 0; i < count; i++)
     {
-        char *udid = udids[i];
-        
-        idevice_t device = NULL;
-        
-        if (includeNetworkDevices)
-        {
-            idevice_new(&device, udid);
-        }
-        else
-        {
-            idevice_new_ignore_network(&device, udid);
-        }
-        
-        if (!device)
-        {
-            continue;
-        }
-        
-        lockdownd_client_t client = NULL;
-        int result = lockdownd_client_new(device, &client, "altserver");
-        if (result != LOCKDOWN_E_SUCCESS)
-        {
-            fprintf(stderr, "ERROR: Connecting to device %s failed! (%d)\n", udid, result);
-            
-            idevice_free(device);
-            
-            continue;
-        }
-        
-        char *device_name = NULL;
-        if (lockdownd_get_device_name(client, &device_name) != LOCKDOWN_E_SUCCESS || device_name == NULL)
-        {
-            fprintf(stderr, "ERROR: Could not get device name!\n");
-            
-            lockdownd_client_free(client);
-            idevice_free(device);
-            
-            continue;
-        }
+		std::string udid = udids[i];
 
-		plist_t device_type_plist = NULL;
-		if (lockdownd_get_value(client, NULL, "ProductType", &device_type_plist) != LOCKDOWN_E_SUCCESS)
+		if (probedUDIDs.count(udid) > 0)
 		{
-			odslog("ERROR: Could not get device type for " << device_name);
-
-			lockdownd_client_free(client);
-			idevice_free(device);
-
+			// Duplicate.
 			continue;
 		}
 
-		Device::Type deviceType = Device::Type::iPhone;
+		probedUDIDs.insert(udid);
 
-		char* device_type_string = NULL;
-		plist_get_string_val(device_type_plist, &device_type_string);
+		auto task = pplx::create_task([this, udid, includeNetworkDevices]() {
+			return this->ProbeDevice(udid, includeNetworkDevices);
+		});
+		probeTasks.push_back(task);
+    }
+    
+    idevice_device_list_free(udids);
 
-		if (std::string(device_type_string).find("iPhone") != std::string::npos ||
-			std::string(device_type_string).find("iPod") != std::string::npos)
+	for (auto& task : probeTasks)
+	{
+		auto altDevice = task.get();
+		if (altDevice != nullptr)
 		{
-			deviceType = Device::Type::iPhone;
+			availableDevices.push_back(altDevice);
 		}
-		else if (std::string(device_type_string).find("iPad") != std::string::npos)
+	}
+    
+    return availableDevices;
+}
+
+std::shared_ptr<Device> DeviceManager::ProbeDevice(std::string udid, bool includeNetworkDevices) const
+{
+	idevice_t device = NULL;
+
+	// Cheap with an active event subscription, so always check the device is (still) reachable.
+	if (includeNetworkDevices)
+	{
+		idevice_new(&device, udid.c_str());
+	}
+	else
+	{
+		idevice_new_ignore_network(&device, udid.c_str());
+	}
+
+	if (!device)
+	{
+		return nullptr;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_deviceMetadataMutex);
+
+		auto iterator = _deviceMetadataCache.find(udid);
+		if (iterator != _deviceMetadataCache.end())
 		{
-			deviceType = Device::Type::iPad;
+			idevice_free(device);
+			return iterator->second;
 		}
-		else if (std::string(device_type_string).find("AppleTV") != std::string::npos)
+	}
+
+	std::string deviceName;
+	std::string productType;
+
+	auto session = DevicePool::instance()->ExistingSession(udid, includeNetworkDevices);
+	if (session != nullptr && !session->name().empty() && !session->productType().empty())
+	{
+		// Use values fetched when the session was opened instead of connecting again.
+		deviceName = session->name();
+		productType = session->productType();
+	}
+	else
+	{
+		lockdownd_client_t client = NULL;
+		int result = lockdownd_client_new(device, &client, "altserver");
+		if (result != LOCKDOWN_E_SUCCESS)
 		{
-			deviceType = Device::Type::AppleTV;
+			fprintf(stderr, "ERROR: Connecting to device %s failed! (%d)\n", udid.c_str(), result);
+
+			idevice_free(device);
+
+			return nullptr;
 		}
-		else
+
+		char *device_name = NULL;
+		if (lockdownd_get_device_name(client, &device_name) != LOCKDOWN_E_SUCCESS || device_name == NULL)
 		{
-			odslog("Unknown device type " << device_type_string << " for " << device_name);
-			deviceType = Device::Type::None;
+			fprintf(stderr, "ERROR: Could not get device name!\n");
+
+			lockdownd_client_free(client);
+			idevice_free(device);
+
+			return nullptr;
 		}
-        
-        lockdownd_client_free(client);
-        idevice_free(device);
 
-		bool isDuplicate = false;
+		deviceName = device_name;
+		free(device_name);
 
-		for (auto& device : availableDevices)
+		plist_t device_type_plist = NULL;
+		if (lockdownd_get_value(client, NULL, "ProductType", &device_type_plist) != LOCKDOWN_E_SUCCESS)
 		{
-			if (device->identifier() == udid)
-			{
-				// Duplicate.
-				isDuplicate = true;
-				break;
-			}
+			odslog("ERROR: Could not get device type for " << deviceName.c_str());
+
+			lockdownd_client_free(client);
+			idevice_free(device);
+
+			return nullptr;
 		}
 
-		if (isDuplicate)
+		char* device_type_string = NULL;
+		plist_get_string_val(device_type_plist, &device_type_string);
+
+		if (device_type_string != NULL)
 		{
-			continue;
+			productType = device_type_string;
+			free(device_type_string);
 		}
-        
-		auto altDevice = std::make_shared<Device>(device_name, udid, deviceType);
-        availableDevices.push_back(altDevice);
-        
-        if (device_name != NULL)
-        {
-            free(device_name);
-        }
-    }
-    
-    idevice_device_list_free(udids);
-    
-    return availableDevices;
+
+		plist_free(device_type_plist);
+
+		lockdownd_client_free(client);
+	}
+
+	idevice_free(device);
+
+	Device::Type deviceType = Device::Type::iPhone;
+
+	if (productType.find("iPhone") != std::string::npos ||
+		productType.find("iPod") != std::string::npos)
+	{
+		deviceType = Device::Type::iPhone;
+	}
+	else if (productType.find("iPad") != std::string::npos)
+	{
+		deviceType = Device::Type::iPad;
+	}
+	else if (productType.find("AppleTV") != std::string::npos)
+	{
+		deviceType = Device::Type::AppleTV;
+	}
+	else
+	{
+		odslog("Unknown device type " << productType.c_str() << " for " << deviceName.c_str());
+		deviceType = Device::Type::None;
+	}
+
+	auto altDevice = std::make_shared<Device>(deviceName, udid, deviceType);
+
+	std::lock_guard<std::mutex> lock(_deviceMetadataMutex);
+	_deviceMetadataCache[udid] = altDevice;
+
+	return altDevice;
 }
 
 std::function<void(std::shared_ptr<Device>)> DeviceManager::connectedDeviceCallback() const
@@ -1314,13 +1443,8 @@ std::map<std::string, std::shared_ptr<Device>>& DeviceManager::cachedDevices()
 
 #pragma mark - Callbacks -
 
-void DeviceManagerUpdateStatus(plist_t command, plist_t status, void *uuid)
+void DeviceManagerUpdateStatus(plist_t command, plist_t status, void *progressHandler)
 {
-	if (DeviceManager::instance()->_installationProgressHandlers.count((char*)uuid) == 0)
-	{
-		return;
-	}
-    
     int percent = 0;
     instproxy_status_get_percent_complete(status, &percent);
 
@@ -1331,11 +1455,14 @@ void DeviceManagerUpdateStatus(plist_t command, plist_t status, void *uuid)
 
 	double progress = ((double)percent / 100.0);
 
-	auto progressHandler = DeviceManager::instance()->_installationProgressHandlers[(char*)uuid];
-	progressHandler(progress, code, name, description);
+	auto& handler = *(std::function<void(double, int, char*, char*)>*)progressHandler;
+	handler(progress, code, name, description);
+
+	free(name);
+	free(description);
 }
 
-void DeviceManagerUpdateAppDeletionStatus(plist_t command, plist_t status, void* uuid)
+void DeviceManagerUpdateAppDeletionStatus(plist_t command, plist_t status, void* completionHandler)
 {
 	char *statusName = NULL;
 	instproxy_status_get_name(status, &statusName);
@@ -1345,35 +1472,34 @@ void DeviceManagerUpdateAppDeletionStatus(plist_t command, plist_t status, void*
 	uint64_t errorCode = 0;
 	instproxy_status_get_error(status, &errorName, &errorDescription, &errorCode);
 
-	if (std::string(statusName) == std::string("Complete") || errorCode != 0 || errorName != NULL)
+	if ((statusName != NULL && std::string(statusName) == std::string("Complete")) || errorCode != 0 || errorName != NULL)
 	{
-		auto completionHandler = DeviceManager::instance()->_deletionCompletionHandlers[(char*)uuid];
-		if (completionHandler != NULL)
-		{
-			if (errorName == NULL)
-			{
-				errorName = (char*)"";
-			}
-
-			if (errorDescription == NULL)
-			{
-				errorDescription = (char*)"";
-			}
+		auto& handler = *(std::function<void(bool, int, char*, char*)>*)completionHandler;
 
-			if (errorCode != 0 || std::string(errorName) != std::string())
-			{
-				odslog("Error removing app. " << errorCode << " (" << errorName << "). " << errorDescription);
-				completionHandler(false, errorCode, errorName, errorDescription);
-			}
-			else
-			{
-				odslog("Finished removing app!");
-				completionHandler(true, 0, errorName, errorDescription);
-			}
+		char* name = (errorName != NULL) ? errorName : (char*)"";
+		char* description = (errorDescription != NULL) ? errorDescription : (char*)"";
 
-			DeviceManager::instance()->_deletionCompletionHandlers.erase((char*)uuid);
+		if (errorCode != 0 || std::string(name) != std::string())
+		{
+			odslog("Error removing app. " << errorCode << " (" << name << "). " << description);
+			handler(false, errorCode, name, description);
+		}
+		else
+		{
+			odslog("Finished removing app!");
+			handler(true, 0, name, description);
 		}
 	}
+
+	free(statusName);
+	free(errorName);
+	free(errorDescription);
+}
+
+void DeviceManagerDidWriteFile(const char* path, afc_error_t error, void* handler)
+{
+	auto& didWriteFileHandler = *(std::function<void(const char*, afc_error_t)>*)handler;
+	didWriteFileHandler(path, error);
 }
 
 void DeviceDidChangeConnectionStatus(const idevice_event_t* event, void* user_data)
@@ -1382,18 +1508,8 @@ void DeviceDidChangeConnectionStatus(const idevice_event_t* event, void* user_da
 	{
 	case IDEVICE_DEVICE_ADD:
 	{
-		auto devices = DeviceManager::instance()->connectedDevices();
-		std::shared_ptr<Device> device = NULL;
-
-		for (auto& d : devices)
-		{
-			if (d->identifier() == event->udid)
-			{
-				device = d;
-				break;
-			}
-		}
-
+		// Only probe the device that was added rather than every connected device.
+		std::shared_ptr<Device> device = DeviceManager::instance()->ProbeDevice(event->udid, false);
 		if (device == NULL)
 		{
 			return;
@@ -1417,6 +1533,15 @@ void DeviceDidChangeConnectionStatus(const idevice_event_t* event, void* user_da
 	}
 	case IDEVICE_DEVICE_REMOVE:
 	{
+		// Pooled session (if any) is no longer usable, unless it uses the device's other connection.
+		DevicePool::instance()->InvalidateSession(event->udid, event->conn_type == CONNECTION_NETWORK);
+
+		{
+			// Refresh metadata next time the device connects, in case it was renamed in the meantime.
+			std::lock_guard<std::mutex> lock(DeviceManager::instance()->_deviceMetadataMutex);
+			DeviceManager::instance()->_deviceMetadataCache.erase(event->udid);
+		}
+
 		auto devices = DeviceManager::instance()->cachedDevices();
 		std::shared_ptr<Device> device = DeviceManager::instance()->cachedDevices()[event->udid];
 
@@ -11,6 +11,7 @@
 
 #include "Device.hpp"
 #include "ProvisioningProfile.hpp"
+#include "UploadManifest.hpp"
 
 #include <vector>
 #include <map>
@@ -62,9 +63,6 @@ private:
 
 	std::mutex _mutex;
 
-	std::map<std::string, std::function<void(double, int, char *, char *)>> _installationProgressHandlers;
-	std::map<std::string, std::function<void(bool, int, char*, char*)>> _deletionCompletionHandlers;
-
 	std::function<void(std::shared_ptr<Device>)> _connectedDeviceCallback;
 	std::function<void(std::shared_ptr<Device>)> _disconnectedDeviceCallback;
 
@@ -72,16 +70,27 @@ private:
 	std::map<std::string, std::shared_ptr<Device>>& cachedDevices();
     
     std::vector<std::shared_ptr<Device>> availableDevices(bool includeNetworkDevices) const;
+
+	// Device name and type only change rarely, so they're only queried once per connection.
+	mutable std::mutex _deviceMetadataMutex;
+	mutable std::map<std::string, std::shared_ptr<Device>> _deviceMetadataCache;
+
+	std::shared_ptr<Device> ProbeDevice(std::string udid, bool includeNetworkDevices) const;
     
-    void WriteDirectory(afc_client_t client, std::string directoryPath, std::string destinationPath, std::function<void(std::string)> wroteFileCallback);
-    void WriteFile(afc_client_t client, std::string filepath, std::string destinationPath, std::function<void(std::string)> wroteFileCallback);
+	void WriteDirectory(afc_client_t client, std::string directoryPath, std::string destinationPath, const UploadManifest& manifest, const std::optional<UploadManifest>& stagedManifest, std::function<void(std::string)> wroteFileCallback);
+	void WriteArchive(afc_client_t client, std::string appBundlePath, std::string destinationPath, uint64_t archiveSize, std::function<void(double)> progressHandler);
+
+	// Size of the uncompressed .ipa WriteArchive creates for the bundle.
+	uint64_t ArchiveSize(const UploadManifest& manifest, std::string appBundleName) const;
+	bool ShouldUploadArchive(const UploadManifest& manifest, const std::optional<UploadManifest>& stagedManifest, uint64_t archiveSize) const;
+
+	std::optional<UploadManifest> StagedUploadManifest(afc_client_t client, std::string destinationPath, std::filesystem::path manifestPath);
+	void WriteStagedUploadManifest(afc_client_t client, std::string destinationPath, const UploadManifest& manifest, std::filesystem::path manifestPath);
 
 	void InstallProvisioningProfile(std::shared_ptr<ProvisioningProfile> provisioningProfile, misagent_client_t mis);
 	void RemoveProvisioningProfile(std::shared_ptr<ProvisioningProfile> provisioningProfile, misagent_client_t mis);
 	std::vector<std::shared_ptr<ProvisioningProfile>> CopyProvisioningProfiles(misagent_client_t mis);
 
-	friend void DeviceManagerUpdateStatus(plist_t command, plist_t status, void* uuid);
-	friend void DeviceManagerUpdateAppDeletionStatus(plist_t command, plist_t status, void* udid);
 	friend void DeviceDidChangeConnectionStatus(const idevice_event_t* event, void* user_data);
 };
 
@@ -0,0 +1,524 @@
+//
+//  DevicePool.cpp
+//  AltServer-Windows
+//
+//  Copyright © 2020 Riley Testut. All rights reserved.
+//
+
+#include "DevicePool.hpp"
+
+#include <sstream>
+#include <vector>
+
+#include "ServerError.hpp"
+
+#include <WinSock2.h>
+
+#define odslog(msg) { std::wstringstream ss; ss << msg << std::endl; OutputDebugStringW(ss.str().c_str()); }
+
+// Sessions that have been idle for longer than this are verified with a lockdown round trip before reuse.
+static const std::chrono::seconds DeviceSessionHealthCheckInterval(5);
+
+// The device may close service connections that have been idle for a while, so restart them instead of reusing them.
+static const std::chrono::seconds DeviceSessionServiceIdleTimeout(30);
+
+// Sessions that have been idle for longer than this are disconnected.
+static const std::chrono::seconds DeviceSessionIdleTimeout(120);
+
+#pragma mark - DeviceSession -
+
+static void FreeClients(DeviceServiceClients& clients)
+{
+	if (clients.installationProxyClient != NULL)
+	{
+		instproxy_client_free(clients.installationProxyClient);
+		clients.installationProxyClient = NULL;
+	}
+
+	if (clients.misagentClient != NULL)
+	{
+		misagent_client_free(clients.misagentClient);
+		clients.misagentClient = NULL;
+	}
+
+	if (clients.afcClient != NULL)
+	{
+		afc_client_free(clients.afcClient);
+		clients.afcClient = NULL;
+	}
+}
+
+DeviceSession::DeviceSession(std::string udid, bool includeNetworkDevices) : _udid(udid), _isNetworkConnection(false), _device(NULL), _lockdownClient(NULL),
+	_installationProxyClient(NULL), _misagentClient(NULL), _afcClient(NULL), _isValid(true), _activeOperations(0), _lastUsedDate(std::chrono::steady_clock::now())
+{
+	/* Find Device */
+	if (idevice_new_ignore_network(&_device, udid.c_str()) != IDEVICE_E_SUCCESS)
+	{
+		if (!includeNetworkDevices || idevice_new(&_device, udid.c_str()) != IDEVICE_E_SUCCESS)
+		{
+			throw ServerError(ServerErrorCode::DeviceNotFound);
+		}
+
+		_isNetworkConnection = true;
+	}
+
+	/* Connect to Device */
+	if (lockdownd_client_new_with_handshake(_device, &_lockdownClient, "altserver") != LOCKDOWN_E_SUCCESS)
+	{
+		idevice_free(_device);
+		throw ServerError(ServerErrorCode::ConnectionFailed);
+	}
+
+	char* name = NULL;
+	if (lockdownd_get_device_name(_lockdownClient, &name) == LOCKDOWN_E_SUCCESS && name != NULL)
+	{
+		_name = name;
+		free(name);
+	}
+
+	plist_t productTypePlist = NULL;
+	if (lockdownd_get_value(_lockdownClient, NULL, "ProductType", &productTypePlist) == LOCKDOWN_E_SUCCESS && productTypePlist != NULL)
+	{
+		char* productType = NULL;
+		plist_get_string_val(productTypePlist, &productType);
+
+		if (productType != NULL)
+		{
+			_productType = productType;
+			free(productType);
+		}
+
+		plist_free(productTypePlist);
+	}
+
+	odslog("Opened device session: " << _udid.c_str());
+}
+
+DeviceSession::~DeviceSession()
+{
+	this->ReleaseServices();
+
+	lockdownd_client_free(_lockdownClient);
+	idevice_free(_device);
+
+	odslog("Closed device session: " << _udid.c_str());
+}
+
+lockdownd_service_descriptor_t DeviceSession::StartService(std::string identifier)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return this->StartLockdownService(identifier);
+}
+
+// Must be called with _mutex held.
+lockdownd_service_descriptor_t DeviceSession::StartLockdownService(std::string identifier)
+{
+	lockdownd_service_descriptor_t service = NULL;
+	if (lockdownd_start_service(_lockdownClient, identifier.c_str(), &service) != LOCKDOWN_E_SUCCESS || service == NULL)
+	{
+		throw ServerError(ServerErrorCode::ConnectionFailed);
+	}
+
+	return service;
+}
+
+// Returns false if the session has been discarded.
+bool DeviceSession::CheckOutServices(int services, DeviceServiceClients& clients)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	if (!_isValid)
+	{
+		return false;
+	}
+
+	if (!this->IsHealthy())
+	{
+		throw ServerError(ServerErrorCode::LostConnection);
+	}
+
+	try
+	{
+		/* Connect to Installation Proxy */
+		if (services & InstallationProxyService)
+		{
+			std::swap(clients.installationProxyClient, _installationProxyClient);
+
+			if (clients.installationProxyClient == NULL)
+			{
+				lockdownd_service_descriptor_t service = this->StartLockdownService("com.apple.mobile.installation_proxy");
+				instproxy_error_t result = instproxy_client_new(_device, service, &clients.installationProxyClient);
+				lockdownd_service_descriptor_free(service);
+
+				if (result != INSTPROXY_E_SUCCESS)
+				{
+					clients.installationProxyClient = NULL;
+					throw ServerError(ServerErrorCode::ConnectionFailed);
+				}
+			}
+		}
+
+		/* Connect to Misagent */
+		if (services & MisagentService)
+		{
+			std::swap(clients.misagentClient, _misagentClient);
+
+			if (clients.misagentClient == NULL)
+			{
+				lockdownd_service_descriptor_t service = this->StartLockdownService("com.apple.misagent");
+				misagent_error_t result = misagent_client_new(_device, service, &clients.misagentClient);
+				lockdownd_service_descriptor_free(service);
+
+				if (result != MISAGENT_E_SUCCESS)
+				{
+					clients.misagentClient = NULL;
+					throw ServerError(ServerErrorCode::ConnectionFailed);
+				}
+			}
+		}
+
+		/* Connect to AFC service */
+		if (services & AFCService)
+		{
+			std::swap(clients.afcClient, _afcClient);
+
+			if (clients.afcClient == NULL)
+			{
+				lockdownd_service_descriptor_t service = this->StartLockdownService("com.apple.afc");
+				afc_error_t result = afc_client_new(_device, service, &clients.afcClient);
+				lockdownd_service_descriptor_free(service);
+
+				if (result != AFC_E_SUCCESS)
+				{
+					clients.afcClient = NULL;
+					throw ServerError(ServerErrorCode::ConnectionFailed);
+				}
+			}
+		}
+	}
+	catch (std::exception& exception)
+	{
+		FreeClients(clients);
+		throw;
+	}
+
+	_activeOperations++;
+	return true;
+}
+
+void DeviceSession::ReturnServices(DeviceServiceClients& clients, bool reusable)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	_activeOperations--;
+	_lastUsedDate = std::chrono::steady_clock::now();
+
+	if (reusable && _isValid)
+	{
+		// Keep one idle client per service. Extra clients started for concurrent operations are freed below.
+		if (_installationProxyClient == NULL)
+		{
+			std::swap(_installationProxyClient, clients.installationProxyClient);
+		}
+
+		if (_misagentClient == NULL)
+		{
+			std::swap(_misagentClient, clients.misagentClient);
+		}
+
+		if (_afcClient == NULL)
+		{
+			std::swap(_afcClient, clients.afcClient);
+		}
+	}
+
+	FreeClients(clients);
+}
+
+void DeviceSession::ReleaseServices()
+{
+	DeviceServiceClients clients = { _installationProxyClient, _misagentClient, _afcClient };
+	FreeClients(clients);
+
+	_installationProxyClient = NULL;
+	_misagentClient = NULL;
+	_afcClient = NULL;
+}
+
+bool DeviceSession::IsHealthy()
+{
+	auto idleTime = std::chrono::steady_clock::now() - _lastUsedDate;
+	if (idleTime < DeviceSessionHealthCheckInterval)
+	{
+		return true;
+	}
+
+	if (idleTime > DeviceSessionServiceIdleTimeout)
+	{
+		this->ReleaseServices();
+	}
+
+	char* type = NULL;
+	if (lockdownd_query_type(_lockdownClient, &type) != LOCKDOWN_E_SUCCESS)
+	{
+		return false;
+	}
+
+	free(type);
+	return true;
+}
+
+std::string DeviceSession::udid() const
+{
+	return _udid;
+}
+
+std::string DeviceSession::name() const
+{
+	return _name;
+}
+
+std::string DeviceSession::productType() const
+{
+	return _productType;
+}
+
+bool DeviceSession::isNetworkConnection() const
+{
+	return _isNetworkConnection;
+}
+
+idevice_t DeviceSession::device() const
+{
+	return _device;
+}
+
+#pragma mark - DevicePool -
+
+DevicePool* DevicePool::_instance = nullptr;
+
+DevicePool* DevicePool::instance()
+{
+	if (_instance == 0)
+	{
+		_instance = new DevicePool();
+	}
+
+	return _instance;
+}
+
+DevicePool::DevicePool() : _isStopping(false)
+{
+	_expirationThread = std::thread([this]() {
+		std::unique_lock<std::mutex> lock(this->_mutex);
+
+		while (!this->_isStopping)
+		{
+			this->_expirationCondition.wait_for(lock, DeviceSessionIdleTimeout / 4);
+			if (this->_isStopping)
+			{
+				break;
+			}
+
+			lock.unlock();
+			this->ExpireIdleSessions();
+			lock.lock();
+		}
+	});
+}
+
+DevicePool::~DevicePool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_isStopping = true;
+	}
+
+	_expirationCondition.notify_all();
+	_expirationThread.join();
+}
+
+void DevicePool::PerformWithSession(std::string udid, bool includeNetworkDevices, int services, std::function<void(std::shared_ptr<DeviceSession>, const DeviceServiceClients&)> block)
+{
+	for (int attempt = 0; ; attempt++)
+	{
+		auto session = this->SessionForDevice(udid, includeNetworkDevices);
+
+		DeviceServiceClients clients = { NULL, NULL, NULL };
+
+		try
+		{
+			if (!session->CheckOutServices(services, clients))
+			{
+				// Session was discarded while we were waiting for it.
+				continue;
+			}
+		}
+		catch (ServerError& error)
+		{
+			this->InvalidateSession(session);
+
+			if (attempt == 0)
+			{
+				odslog("Reconnecting to device " << udid.c_str() << ". Error: " << error.code());
+				continue;
+			}
+
+			throw;
+		}
+
+		try
+		{
+			block(session, clients);
+		}
+		catch (ServerError& error)
+		{
+			bool isConnectionError = false;
+
+			switch ((ServerErrorCode)error.code())
+			{
+			case ServerErrorCode::ConnectionFailed:
+			case ServerErrorCode::LostConnection:
+			case ServerErrorCode::DeviceWriteFailed:
+				isConnectionError = true;
+				this->InvalidateSession(session);
+				break;
+
+			default: break;
+			}
+
+			session->ReturnServices(clients, !isConnectionError);
+			throw;
+		}
+		catch (LocalizedError& error)
+		{
+			// Reported by the device, so the connection is still fine.
+			session->ReturnServices(clients, true);
+			throw;
+		}
+		catch (std::exception& exception)
+		{
+			// We don't know what state the service connections were left in.
+			session->ReturnServices(clients, false);
+			throw;
+		}
+
+		session->ReturnServices(clients, true);
+		return;
+	}
+}
+
+std::shared_ptr<DeviceSession> DevicePool::ExistingSession(std::string udid, bool includeNetworkDevices)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	auto iterator = _sessions.find(udid);
+	if (iterator == _sessions.end())
+	{
+		return nullptr;
+	}
+
+	auto session = iterator->second;
+	if (!includeNetworkDevices && session->isNetworkConnection())
+	{
+		return nullptr;
+	}
+
+	return session;
+}
+
+std::shared_ptr<DeviceSession> DevicePool::SessionForDevice(std::string udid, bool includeNetworkDevices)
+{
+	auto session = this->ExistingSession(udid, includeNetworkDevices);
+	if (session != nullptr)
+	{
+		return session;
+	}
+
+	// Connect without holding _mutex so other devices aren't blocked by the handshake.
+	auto newSession = std::make_shared<DeviceSession>(udid, includeNetworkDevices);
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	auto iterator = _sessions.find(udid);
+	if (iterator != _sessions.end())
+	{
+		auto existingSession = iterator->second;
+		if (includeNetworkDevices || !existingSession->isNetworkConnection())
+		{
+			// Another request connected in the meantime.
+			return existingSession;
+		}
+
+		// Replace network session with our USB session.
+		existingSession->_isValid = false;
+	}
+
+	_sessions[udid] = newSession;
+	return newSession;
+}
+
+void DevicePool::InvalidateSession(std::string udid, bool isNetworkConnection)
+{
+	std::shared_ptr<DeviceSession> session = nullptr;
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		auto iterator = _sessions.find(udid);
+		if (iterator == _sessions.end() || iterator->second->isNetworkConnection() != isNetworkConnection)
+		{
+			return;
+		}
+
+		session = iterator->second;
+		session->_isValid = false;
+
+		_sessions.erase(iterator);
+	}
+
+	// Session is closed once the last reference (possibly an in-flight request) goes away.
+}
+
+void DevicePool::InvalidateSession(std::shared_ptr<DeviceSession> session)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	session->_isValid = false;
+
+	auto iterator = _sessions.find(session->udid());
+	if (iterator != _sessions.end() && iterator->second == session)
+	{
+		_sessions.erase(iterator);
+	}
+}
+
+void DevicePool::ExpireIdleSessions()
+{
+	std::vector<std::shared_ptr<DeviceSession>> expiredSessions;
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		auto now = std::chrono::steady_clock::now();
+
+		for (auto iterator = _sessions.begin(); iterator != _sessions.end();)
+		{
+			auto session = iterator->second;
+
+			// Skip sessions that are currently in use.
+			std::unique_lock<std::mutex> sessionLock(session->_mutex, std::try_to_lock);
+			if (!sessionLock.owns_lock() || session->_activeOperations > 0 || now - session->_lastUsedDate < DeviceSessionIdleTimeout)
+			{
+				iterator++;
+				continue;
+			}
+
+			session->_isValid = false;
+			expiredSessions.push_back(session);
+
+			iterator = _sessions.erase(iterator);
+		}
+	}
+
+	// Sessions are closed when expiredSessions goes out of scope, outside of _mutex.
+}
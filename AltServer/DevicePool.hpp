@@ -0,0 +1,136 @@
+//
+//  DevicePool.hpp
+//  AltServer-Windows
+//
+//  Copyright © 2020 Riley Testut. All rights reserved.
+//
+
+#ifndef DevicePool_hpp
+#define DevicePool_hpp
+
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/installation_proxy.h>
+#include <libimobiledevice/misagent.h>
+#include <libimobiledevice/afc.h>
+
+// Service clients checked out of a DeviceSession for one DevicePool::PerformWithSession() call.
+// Clients for services that weren't requested are NULL.
+struct DeviceServiceClients
+{
+	instproxy_client_t installationProxyClient;
+	misagent_client_t misagentClient;
+	afc_client_t afcClient;
+};
+
+// An authenticated lockdown session with a device, plus idle service clients
+// started through it. Sessions are owned by DevicePool and must only be used
+// from within DevicePool::PerformWithSession().
+class DeviceSession
+{
+public:
+	enum Service
+	{
+		InstallationProxyService = 1 << 0,
+		MisagentService = 1 << 1,
+		AFCService = 1 << 2,
+	};
+
+	DeviceSession(std::string udid, bool includeNetworkDevices);
+	~DeviceSession();
+
+	std::string udid() const;
+	std::string name() const;
+	std::string productType() const;
+	bool isNetworkConnection() const;
+
+	idevice_t device() const;
+
+	// Starts a service that isn't pooled. Caller must free the returned descriptor.
+	lockdownd_service_descriptor_t StartService(std::string identifier);
+
+private:
+	std::string _udid;
+	std::string _name;
+	std::string _productType;
+	bool _isNetworkConnection;
+
+	idevice_t _device;
+	lockdownd_client_t _lockdownClient;
+
+	// Idle clients, ready to be checked out. NULL while checked out or not started.
+	instproxy_client_t _installationProxyClient;
+	misagent_client_t _misagentClient;
+	afc_client_t _afcClient;
+
+	// Guards the lockdown client, the idle clients and the bookkeeping below. Only held while
+	// clients are checked out or returned, so operations using different services (or a second
+	// client of the same service) can run on a device at the same time.
+	std::mutex _mutex;
+	std::atomic<bool> _isValid;
+
+	int _activeOperations;
+	std::chrono::steady_clock::time_point _lastUsedDate;
+
+	lockdownd_service_descriptor_t StartLockdownService(std::string identifier);
+
+	bool CheckOutServices(int services, DeviceServiceClients& clients);
+	void ReturnServices(DeviceServiceClients& clients, bool reusable);
+	void ReleaseServices();
+
+	bool IsHealthy();
+
+	friend class DevicePool;
+};
+
+// Keeps one DeviceSession per device so back-to-back requests don't each pay
+// for device lookup, pair record loading and the lockdown SSL handshake.
+class DevicePool
+{
+public:
+	static DevicePool* instance();
+
+	// Runs block with a session for the device, connecting if needed. Clients for the requested
+	// services are checked out of the session before block is called (starting them if none is
+	// idle) and returned afterwards; if that fails on a reused session, the session is
+	// reconnected once. Errors thrown by block are rethrown, and the session is discarded
+	// if they indicate a lost connection.
+	void PerformWithSession(std::string udid, bool includeNetworkDevices, int services, std::function<void(std::shared_ptr<DeviceSession>, const DeviceServiceClients&)> block);
+
+	// Returns the pooled session for the device if one exists, without connecting.
+	std::shared_ptr<DeviceSession> ExistingSession(std::string udid, bool includeNetworkDevices);
+
+	// Discards the pooled session for the device if it uses the given kind of connection,
+	// so losing a device's network connection doesn't drop its USB session (or vice versa).
+	void InvalidateSession(std::string udid, bool isNetworkConnection);
+
+private:
+	DevicePool();
+	~DevicePool();
+
+	static DevicePool* _instance;
+
+	std::mutex _mutex;
+	std::map<std::string, std::shared_ptr<DeviceSession>> _sessions;
+
+	std::thread _expirationThread;
+	std::condition_variable _expirationCondition;
+	bool _isStopping;
+
+	std::shared_ptr<DeviceSession> SessionForDevice(std::string udid, bool includeNetworkDevices);
+	void InvalidateSession(std::shared_ptr<DeviceSession> session);
+
+	void ExpireIdleSessions();
+};
+
+#endif /* DevicePool_hpp */
@@ -0,0 +1,255 @@
+//
+//  UploadManifest.cpp
+//  AltServer-Windows
+//
+//  Copyright © 2020 Riley Testut. All rights reserved.
+//
+
+#include "UploadManifest.hpp"
+
+#include <fstream>
+#include <vector>
+
+#include <plist/plist.h>
+
+#include <corecrypto/ccdigest.h>
+#include <corecrypto/ccsha2.h>
+
+namespace fs = std::filesystem;
+
+extern std::vector<unsigned char> readFile(const char* filename);
+
+// Files are hashed in chunks so large binaries don't need to be read into memory at once.
+static const size_t UploadManifestHashChunkSize = 1024 * 1024;
+
+static std::string UploadManifestHashFile(fs::path filepath)
+{
+	std::ifstream file(filepath, std::ios::binary);
+	if (!file.is_open())
+	{
+		throw fs::filesystem_error("Failed to read file.", filepath, std::make_error_code(std::errc::io_error));
+	}
+
+	const struct ccdigest_info* di = ccsha256_di();
+	ccdigest_di_decl(di, context);
+	ccdigest_init(di, context);
+
+	std::vector<char> buffer(UploadManifestHashChunkSize);
+	while (file)
+	{
+		file.read(buffer.data(), buffer.size());
+
+		auto length = file.gcount();
+		if (length > 0)
+		{
+			ccdigest_update(di, context, (size_t)length, buffer.data());
+		}
+	}
+
+	if (file.bad())
+	{
+		throw fs::filesystem_error("Failed to read file.", filepath, std::make_error_code(std::errc::io_error));
+	}
+
+	std::string hash(di->output_size, '\0');
+	ccdigest_final(di, context, (unsigned char*)hash.data());
+	ccdigest_di_clear(di, context);
+
+	return hash;
+}
+
+bool UploadManifest::Entry::operator==(const Entry& other) const
+{
+	return this->isDirectory == other.isDirectory && this->size == other.size && this->hash == other.hash;
+}
+
+bool UploadManifest::Entry::operator!=(const Entry& other) const
+{
+	return !(*this == other);
+}
+
+UploadManifest::UploadManifest()
+{
+}
+
+UploadManifest::UploadManifest(fs::path directoryPath, std::string identifier) : _identifier(identifier)
+{
+	for (auto& item : fs::recursive_directory_iterator(directoryPath))
+	{
+		auto relativePath = fs::relative(item.path(), directoryPath).generic_string();
+
+		Entry entry;
+		entry.isDirectory = item.is_directory();
+		entry.size = entry.isDirectory ? 0 : (uint64_t)item.file_size();
+
+		if (!entry.isDirectory)
+		{
+			entry.hash = UploadManifestHashFile(item.path());
+		}
+
+		this->_entries[relativePath] = entry;
+	}
+}
+
+std::optional<UploadManifest> UploadManifest::ManifestAtPath(fs::path path)
+{
+	if (!fs::exists(path))
+	{
+		return std::nullopt;
+	}
+
+	auto data = readFile(path.string().c_str());
+
+	plist_t plist = NULL;
+	plist_from_memory((const char*)data.data(), (uint32_t)data.size(), &plist);
+	if (plist == NULL)
+	{
+		return std::nullopt;
+	}
+
+	plist_t identifierNode = plist_dict_get_item(plist, "Identifier");
+	plist_t entriesNode = plist_dict_get_item(plist, "Entries");
+
+	if (identifierNode == NULL || plist_get_node_type(identifierNode) != PLIST_STRING ||
+		entriesNode == NULL || plist_get_node_type(entriesNode) != PLIST_DICT)
+	{
+		plist_free(plist);
+		return std::nullopt;
+	}
+
+	UploadManifest manifest;
+
+	char* identifier = NULL;
+	plist_get_string_val(identifierNode, &identifier);
+	manifest._identifier = identifier;
+	free(identifier);
+
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(entriesNode, &iter);
+
+	bool isValid = true;
+
+	char* key = NULL;
+	plist_t node = NULL;
+
+	while (true)
+	{
+		plist_dict_next_item(entriesNode, iter, &key, &node);
+		if (key == NULL)
+		{
+			break;
+		}
+
+		plist_t directoryNode = plist_dict_get_item(node, "Directory");
+		plist_t sizeNode = plist_dict_get_item(node, "Size");
+		plist_t hashNode = plist_dict_get_item(node, "Hash");
+
+		if (directoryNode == NULL || sizeNode == NULL || hashNode == NULL)
+		{
+			free(key);
+			isValid = false;
+			break;
+		}
+
+		uint8_t isDirectory = 0;
+		plist_get_bool_val(directoryNode, &isDirectory);
+
+		uint64_t size = 0;
+		plist_get_uint_val(sizeNode, &size);
+
+		char* hash = NULL;
+		uint64_t hashLength = 0;
+		plist_get_data_val(hashNode, &hash, &hashLength);
+
+		Entry entry;
+		entry.isDirectory = (isDirectory != 0);
+		entry.size = size;
+		entry.hash = std::string(hash != NULL ? hash : "", (size_t)hashLength);
+		free(hash);
+
+		manifest._entries[key] = entry;
+		free(key);
+	}
+
+	free(iter);
+	plist_free(plist);
+
+	if (!isValid)
+	{
+		return std::nullopt;
+	}
+
+	return manifest;
+}
+
+void UploadManifest::WriteToPath(fs::path path) const
+{
+	plist_t entriesNode = plist_new_dict();
+
+	for (auto& pair : this->entries())
+	{
+		plist_t node = plist_new_dict();
+		plist_dict_set_item(node, "Directory", plist_new_bool(pair.second.isDirectory));
+		plist_dict_set_item(node, "Size", plist_new_uint(pair.second.size));
+		plist_dict_set_item(node, "Hash", plist_new_data(pair.second.hash.data(), pair.second.hash.size()));
+
+		plist_dict_set_item(entriesNode, pair.first.c_str(), node);
+	}
+
+	plist_t plist = plist_new_dict();
+	plist_dict_set_item(plist, "Identifier", plist_new_string(this->identifier().c_str()));
+	plist_dict_set_item(plist, "Entries", entriesNode);
+
+	char* data = NULL;
+	uint32_t length = 0;
+	plist_to_bin(plist, &data, &length);
+	plist_free(plist);
+
+	if (data == NULL)
+	{
+		throw fs::filesystem_error("Failed to serialize upload manifest.", path, std::make_error_code(std::errc::invalid_argument));
+	}
+
+	// Write to a temporary file first so a failed write never leaves a truncated manifest behind.
+	auto temporaryPath = path;
+	temporaryPath += ".tmp";
+
+	std::ofstream file(temporaryPath, std::ios::out | std::ios::binary | std::ios::trunc);
+	file.write(data, length);
+	file.close();
+
+	free(data);
+
+	if (file.fail())
+	{
+		fs::remove(temporaryPath);
+		throw fs::filesystem_error("Failed to write upload manifest.", path, std::make_error_code(std::errc::io_error));
+	}
+
+	fs::rename(temporaryPath, path);
+}
+
+std::string UploadManifest::identifier() const
+{
+	return _identifier;
+}
+
+const std::map<std::string, UploadManifest::Entry>& UploadManifest::entries() const
+{
+	return _entries;
+}
+
+size_t UploadManifest::numberOfFiles() const
+{
+	size_t numberOfFiles = 0;
+
+	for (auto& pair : this->entries())
+	{
+		if (!pair.second.isDirectory)
+		{
+			numberOfFiles++;
+		}
+	}
+
+	return numberOfFiles;
+}
@@ -0,0 +1,54 @@
+//
+//  UploadManifest.hpp
+//  AltServer-Windows
+//
+//  Copyright © 2020 Riley Testut. All rights reserved.
+//
+
+#ifndef UploadManifest_hpp
+#define UploadManifest_hpp
+
+#include <string>
+#include <map>
+#include <optional>
+#include <filesystem>
+
+// Describes the contents of an app bundle uploaded to a device's staging directory,
+// so later installs only need to upload the files that changed.
+class UploadManifest
+{
+public:
+	struct Entry
+	{
+		bool isDirectory;
+		uint64_t size;
+
+		// Raw SHA-256 digest of the file's contents. Empty for directories.
+		std::string hash;
+
+		bool operator==(const Entry& other) const;
+		bool operator!=(const Entry& other) const;
+	};
+
+	// Hashes every file in directoryPath.
+	UploadManifest(std::filesystem::path directoryPath, std::string identifier);
+
+	static std::optional<UploadManifest> ManifestAtPath(std::filesystem::path path);
+	void WriteToPath(std::filesystem::path path) const;
+
+	// Uniquely identifies a single upload; also written next to the staged bundle on the device.
+	std::string identifier() const;
+
+	// Keyed by path relative to the bundle, using '/' separators. Parent directories sort before their contents.
+	const std::map<std::string, Entry>& entries() const;
+
+	size_t numberOfFiles() const;
+
+private:
+	UploadManifest();
+
+	std::string _identifier;
+	std::map<std::string, Entry> _entries;
+};
+
+#endif /* UploadManifest_hpp */
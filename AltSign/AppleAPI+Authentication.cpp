@@ -652,8 +652,8 @@ pplx::task<std::pair<std::shared_ptr<Account>, std::shared_ptr<AppleAPISession>>
 
 					*adsidValue = std::string(adsid);
 					return this->FetchAuthToken(parameters, sk, anisetteData)
-					.then([=](std::string token) {
-						auto session = std::make_shared<AppleAPISession>(*adsidValue, token, anisetteData);
+					.then([=](std::pair<std::string, std::optional<time_t>> token) {
+						auto session = std::make_shared<AppleAPISession>(*adsidValue, token.first, anisetteData, token.second);
 						*sessionValue = *session;
 
 						return this->FetchAccount(session);
@@ -667,7 +667,7 @@ pplx::task<std::pair<std::shared_ptr<Account>, std::shared_ptr<AppleAPISession>>
 	return task;
 }
 
-pplx::task<std::string> AppleAPI::FetchAuthToken(std::map<std::string, plist_t> requestParameters, std::vector<unsigned char> sk, std::shared_ptr<AnisetteData> anisetteData)
+pplx::task<std::pair<std::string, std::optional<time_t>>> AppleAPI::FetchAuthToken(std::map<std::string, plist_t> requestParameters, std::vector<unsigned char> sk, std::shared_ptr<AnisetteData> anisetteData)
 {
 	auto apps = requestParameters["app"];
 	auto appNode = plist_array_get_item(apps, 0);
@@ -733,7 +733,26 @@ pplx::task<std::string> AppleAPI::FetchAuthToken(std::map<std::string, plist_t>
 
 		odslog("Got token for " << app << "!\nValue : " << token);
 
-		return std::string(token);
+		// "expiry" is in milliseconds since 1970, "duration" in seconds from now.
+		std::optional<time_t> expirationDate = std::nullopt;
+
+		auto expiryNode = plist_dict_get_item(tokenDictionary, "expiry");
+		auto durationNode = plist_dict_get_item(tokenDictionary, "duration");
+
+		if (expiryNode != nullptr && plist_get_node_type(expiryNode) == PLIST_UINT)
+		{
+			uint64_t expiry = 0;
+			plist_get_uint_val(expiryNode, &expiry);
+			expirationDate = (time_t)(expiry / 1000);
+		}
+		else if (durationNode != nullptr && plist_get_node_type(durationNode) == PLIST_UINT)
+		{
+			uint64_t duration = 0;
+			plist_get_uint_val(durationNode, &duration);
+			expirationDate = anisetteData->date().tv_sec + (time_t)duration;
+		}
+
+		return std::make_pair(std::string(token), expirationDate);
 	});
 }
 
@@ -956,9 +975,11 @@ pplx::task<plist_t> AppleAPI::SendAuthenticationRequest(std::map<std::string, pl
 		plist_dict_set_item(plist, parameter.first.c_str(), parameter.second);
 	}
 
-	char* plistXML = nullptr;
-	uint32_t length = 0;
-	plist_to_xml(plist, &plistXML, &length);
+	std::string plistXML;
+	plist_to_xml_with_writer(plist, [](const char* buffer, size_t length, void* context) -> int {
+		((std::string*)context)->append(buffer, length);
+		return 0;
+	}, &plistXML);
 
 	std::map<utility::string_t, utility::string_t> headers = {
 		{L"Content-Type", L"text/x-xml-plist"},
@@ -971,7 +992,7 @@ pplx::task<plist_t> AppleAPI::SendAuthenticationRequest(std::map<std::string, pl
 
 	http_request request(methods::POST);
 	request.set_request_uri(builder.to_string());
-	request.set_body(plistXML);
+	request.set_body(std::move(plistXML));
 
 	for (auto& pair : headers)
 	{
@@ -1088,7 +1109,6 @@ pplx::task<plist_t> AppleAPI::SendAuthenticationRequest(std::map<std::string, pl
 				}
           });
 
-		free(plistXML);
 		plist_free(plist);
 
 		return task;
@@ -97,6 +97,18 @@ bool decompress(const uint8_t* input, size_t input_size, std::vector<uint8_t>& o
     return true;
 }
 
+// Setting ALTSIGN_GSA_URL or ALTSIGN_DEVELOPER_SERVICES_URL points AltSign at a local stand-in for Apple's servers.
+utility::string_t ServerURL(const char* environmentVariable, std::string defaultURL)
+{
+	auto url = getenv(environmentVariable);
+	if (url == nullptr || *url == '\0')
+	{
+		return WideStringFromString(defaultURL);
+	}
+
+	return WideStringFromString(url);
+}
+
 AppleAPI* AppleAPI::instance_ = nullptr;
 
 AppleAPI* AppleAPI::getInstance()
@@ -109,12 +121,15 @@ AppleAPI* AppleAPI::getInstance()
     return instance_;
 }
 
-AppleAPI::AppleAPI() : _servicesClient(U("https://developerservices2.apple.com/services/v1")), _client(U("https://developerservices2.apple.com/services/QH65B2")), _gsaClient(U("https://gsa.apple.com"))
+AppleAPI::AppleAPI() :
+	_servicesClient(ServerURL("ALTSIGN_DEVELOPER_SERVICES_URL", "https://developerservices2.apple.com") + U("/services/v1")),
+	_client(ServerURL("ALTSIGN_DEVELOPER_SERVICES_URL", "https://developerservices2.apple.com") + U("/services/QH65B2")),
+	_gsaClient(ServerURL("ALTSIGN_GSA_URL", "https://gsa.apple.com"))
 {
 	http_client_config config;
 	config.set_validate_certificates(false);
 
-	_gsaClient = web::http::client::http_client(U("https://gsa.apple.com"), config);
+	_gsaClient = web::http::client::http_client(ServerURL("ALTSIGN_GSA_URL", "https://gsa.apple.com"), config);
 
 //    volatile long response_counter = 0;
 //    auto response_count_handler =
@@ -782,9 +797,11 @@ pplx::task<plist_t> AppleAPI::SendRequest(std::string uri,
 		plist_dict_set_item(plist, "teamId", plist_new_string(team->identifier().c_str()));
 	}
 
-	char* plistXML = nullptr;
-	uint32_t length = 0;
-	plist_to_xml(plist, &plistXML, &length);
+	std::string plistXML;
+	plist_to_xml_with_writer(plist, [](const char* buffer, size_t length, void* context) -> int {
+		((std::string*)context)->append(buffer, length);
+		return 0;
+	}, &plistXML);
 
 	auto wideURI = WideStringFromString(uri);
 	auto wideClientID = WideStringFromString(kClientID);
@@ -794,7 +811,7 @@ pplx::task<plist_t> AppleAPI::SendRequest(std::string uri,
 
 	http_request request(methods::POST);
 	request.set_request_uri(builder.to_string());
-	request.set_body(plistXML);
+	request.set_body(std::move(plistXML));
 
 	time_t time;
 	struct tm* tm;
@@ -873,7 +890,6 @@ pplx::task<plist_t> AppleAPI::SendRequest(std::string uri,
 						return plist;
 					});
 
-			free(plistXML);
 			plist_free(plist);
 
 			return task;
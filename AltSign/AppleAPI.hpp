@@ -38,6 +38,9 @@ public:
 		std::string password,
 		std::shared_ptr<AnisetteData> anisetteData,
 		std::optional<std::function <pplx::task<std::optional<std::string>>(void)>> verificationHandler);
+
+	// Also confirms the session is still accepted; throws APIErrorCode::InvalidSession once it isn't.
+	pplx::task<std::shared_ptr<Account>> FetchAccount(std::shared_ptr<AppleAPISession> session);
     
     // Teams
 	pplx::task<std::vector<std::shared_ptr<Team>>> FetchTeams(std::shared_ptr<Account> account, std::shared_ptr<AppleAPISession> session);
@@ -98,8 +101,7 @@ private:
 		std::shared_ptr<AppleAPISession> session,
 		std::shared_ptr<Team> team);
 
-	pplx::task<std::string> FetchAuthToken(std::map<std::string, plist_t> requestParameters, std::vector<unsigned char> sk, std::shared_ptr<AnisetteData> anisetteData);
-	pplx::task<std::shared_ptr<Account>> FetchAccount(std::shared_ptr<AppleAPISession> session);
+	pplx::task<std::pair<std::string, std::optional<time_t>>> FetchAuthToken(std::map<std::string, plist_t> requestParameters, std::vector<unsigned char> sk, std::shared_ptr<AnisetteData> anisetteData);
 
 	pplx::task<bool> RequestTwoFactorCode(
 		std::string dsid,
@@ -207,7 +209,17 @@ private:
 	template<typename T>
 	T ProcessResponse(plist_t plist, std::function<T(plist_t)> parseHandler, std::function<std::optional<APIError>(int64_t)> resultCodeHandler)
 	{
-		return this->ProcessAnyResponse(plist, "resultCode", { "userString", "resultString" }, parseHandler, resultCodeHandler);
+		return this->ProcessAnyResponse<T>(plist, "resultCode", { "userString", "resultString" }, parseHandler, [resultCodeHandler](int64_t resultCode) -> std::optional<APIError>
+		{
+			auto error = resultCodeHandler(resultCode);
+			if (!error.has_value() && resultCode == 1100)
+			{
+				// "Your session has expired. Please log in." Any request can fail this way once the token is rejected.
+				return std::make_optional<APIError>(APIErrorCode::InvalidSession);
+			}
+
+			return error;
+		});
 	}
 
 	template<typename T>
@@ -246,6 +258,10 @@ private:
 			{
 				throw error.value();
 			}
+			else if (resultCode == 1100)
+			{
+				throw APIError(APIErrorCode::InvalidSession);
+			}
 
 			std::string errorDescription;
 
@@ -24,6 +24,11 @@ AppleAPISession::AppleAPISession(std::string dsid, std::string authToken, std::s
 {
 }
 
+AppleAPISession::AppleAPISession(std::string dsid, std::string authToken, std::shared_ptr<AnisetteData> anisetteData, std::optional<time_t> expirationDate) :
+	_dsid(dsid), _authToken(authToken), _anisetteData(anisetteData), _expirationDate(expirationDate)
+{
+}
+
 std::ostream& operator<<(std::ostream& os, const AppleAPISession& session)
 {
 	os << "DSID : " << session.dsid() <<
@@ -47,4 +52,9 @@ std::shared_ptr<AnisetteData> AppleAPISession::anisetteData() const
 {
 	return _anisetteData;
 }
+
+std::optional<time_t> AppleAPISession::expirationDate() const
+{
+	return _expirationDate;
+}
 
@@ -16,6 +16,7 @@ class AnisetteData;
 #include <optional>
 #include <string>
 #include <memory>
+#include <ctime>
 
 class AppleAPISession
 {
@@ -24,17 +25,22 @@ public:
 	~AppleAPISession();
 
 	AppleAPISession(std::string dsid, std::string authToken, std::shared_ptr<AnisetteData> anisetteData);
+	AppleAPISession(std::string dsid, std::string authToken, std::shared_ptr<AnisetteData> anisetteData, std::optional<time_t> expirationDate);
 
 	std::string dsid() const;
 	std::string authToken() const;
 	std::shared_ptr<AnisetteData> anisetteData() const;
 
+	// When the auth token stops being accepted, if the server told us.
+	std::optional<time_t> expirationDate() const;
+
 	friend std::ostream& operator<<(std::ostream& os, const AppleAPISession& session);
 
 private:
 	std::string _dsid;
 	std::string _authToken;
 	std::shared_ptr<AnisetteData> _anisetteData;
+	std::optional<time_t> _expirationDate;
 };
 
 #pragma GCC visibility pop
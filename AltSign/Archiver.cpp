@@ -6,6 +6,7 @@
 //  Copyright © 2019 Riley Testut. All rights reserved.
 //
 
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
 
@@ -28,6 +29,7 @@ extern "C" {
 
 const int ALTReadBufferSize = 8192;
 const int ALTMaxFilenameLength = 512;
+const int ALTZipWriteBufferSize = 1024 * 1024;
 
 #include <sstream>
 #include <WinSock2.h>
@@ -244,32 +246,166 @@ std::string UnzipAppBundle(std::string filepath, std::string outputDirectory)
 }
 
 
-void WriteFileToZipFile(zipFile *zipFile, fs::path filepath, fs::path relativePath)
+// Buffers the archive ZipAppBundle writes for its output handler. minizip seeks back to fill in the local header
+// of every entry once it has been written, which only touches the buffer unless the entry was too large to stay buffered.
+struct ZipOutputStream
 {
-    bool isDirectory = fs::is_directory(filepath);
+    std::function<bool(uint64_t, const char *, size_t)> outputHandler;
+    size_t bufferSize;
     
-    std::string filename = relativePath.string();
+    std::vector<char> buffer;
+    uint64_t bufferOffset;
     
-    zip_fileinfo fileInfo = {};
+    // Rewrites of data that was already passed on, collected so a header costs a single call.
+    std::vector<char> patch;
+    uint64_t patchOffset;
+    
+    uint64_t position;
+    bool failed;
+};
+
+static bool FlushZipOutputPatch(ZipOutputStream *stream)
+{
+    if (!stream->patch.empty() && !stream->outputHandler(stream->patchOffset, stream->patch.data(), stream->patch.size()))
+    {
+        stream->failed = true;
+    }
     
-    char *bytes = nullptr;
-    unsigned int fileSize = 0;
+    stream->patch.clear();
+    return !stream->failed;
+}
+
+static bool FlushZipOutputStream(ZipOutputStream *stream)
+{
+    if (!FlushZipOutputPatch(stream))
+    {
+        return false;
+    }
     
-    if (isDirectory)
+    if (!stream->buffer.empty() && !stream->outputHandler(stream->bufferOffset, stream->buffer.data(), stream->buffer.size()))
     {
-        // Remove leading directory slash.
-        if (filename[0] == ALTDirectoryDeliminator)
+        stream->failed = true;
+        return false;
+    }
+    
+    stream->bufferOffset += stream->buffer.size();
+    stream->buffer.clear();
+    
+    return true;
+}
+
+static voidpf ZCALLBACK OpenZipOutputStream(voidpf opaque, const char *filename, int mode)
+{
+    return opaque;
+}
+
+static uLong ZCALLBACK ReadZipOutputStream(voidpf opaque, voidpf stream, void *buf, uLong size)
+{
+    return 0;
+}
+
+static uLong ZCALLBACK WriteZipOutputStream(voidpf opaque, voidpf stream, const void *buf, uLong size)
+{
+    auto outputStream = (ZipOutputStream *)stream;
+    auto bytes = (const char *)buf;
+    
+    if (outputStream->failed || outputStream->position + size > ALTZipArchiveMaximumSize)
+    {
+        outputStream->failed = true;
+        return 0;
+    }
+    
+    if (outputStream->position < outputStream->bufferOffset)
+    {
+        if (outputStream->position + size > outputStream->bufferOffset)
         {
-            filename = std::string(filename.begin() + 1, filename.end());
+            outputStream->failed = true;
+            return 0;
         }
         
-        // Add trailing directory slash.
-        if (filename[filename.size() - 1] != ALTDirectoryDeliminator)
+        if (!outputStream->patch.empty() && outputStream->patchOffset + outputStream->patch.size() != outputStream->position && !FlushZipOutputPatch(outputStream))
         {
-            filename = filename + ALTDirectoryDeliminator;
+            return 0;
         }
+        
+        if (outputStream->patch.empty())
+        {
+            outputStream->patchOffset = outputStream->position;
+        }
+        
+        outputStream->patch.insert(outputStream->patch.end(), bytes, bytes + size);
     }
     else
+    {
+        size_t bufferPosition = (size_t)(outputStream->position - outputStream->bufferOffset);
+        size_t overlap = std::min((size_t)size, outputStream->buffer.size() - bufferPosition);
+        
+        std::copy(bytes, bytes + overlap, outputStream->buffer.begin() + bufferPosition);
+        outputStream->buffer.insert(outputStream->buffer.end(), bytes + overlap, bytes + size);
+    }
+    
+    outputStream->position += size;
+    
+    // ZipAppBundle flushes between entries, this only kicks in for entries too large to buffer.
+    if (outputStream->buffer.size() >= outputStream->bufferSize * 2 && !FlushZipOutputStream(outputStream))
+    {
+        return 0;
+    }
+    
+    return size;
+}
+
+static long ZCALLBACK TellZipOutputStream(voidpf opaque, voidpf stream)
+{
+    auto outputStream = (ZipOutputStream *)stream;
+    return (long)outputStream->position;
+}
+
+static long ZCALLBACK SeekZipOutputStream(voidpf opaque, voidpf stream, uLong offset, int origin)
+{
+    auto outputStream = (ZipOutputStream *)stream;
+    
+    uint64_t end = outputStream->bufferOffset + outputStream->buffer.size();
+    uint64_t position = 0;
+    
+    switch (origin)
+    {
+        case ZLIB_FILEFUNC_SEEK_SET: position = offset; break;
+        case ZLIB_FILEFUNC_SEEK_CUR: position = outputStream->position + offset; break;
+        case ZLIB_FILEFUNC_SEEK_END: position = end + offset; break;
+        default: return -1;
+    }
+    
+    if (position > end)
+    {
+        return -1;
+    }
+    
+    outputStream->position = position;
+    return 0;
+}
+
+static int ZCALLBACK CloseZipOutputStream(voidpf opaque, voidpf stream)
+{
+    auto outputStream = (ZipOutputStream *)stream;
+    return FlushZipOutputStream(outputStream) ? 0 : -1;
+}
+
+static int ZCALLBACK TestErrorZipOutputStream(voidpf opaque, voidpf stream)
+{
+    auto outputStream = (ZipOutputStream *)stream;
+    return outputStream->failed ? 1 : 0;
+}
+
+static void WriteFileToZipFile(zipFile zipFile, fs::path filepath, std::string filename, std::vector<char>& buffer)
+{
+    bool isDirectory = fs::is_directory(filepath);
+    
+    zip_fileinfo fileInfo = {};
+    
+    std::ifstream ifs;
+    
+    if (!isDirectory)
     {
         fs::file_status status = fs::status(filepath);
         
@@ -280,65 +416,106 @@ void WriteFileToZipFile(zipFile *zipFile, fs::path filepath, fs::path relativePa
         
         fileInfo.external_fa = (unsigned int)(permissionsLong << 16L);
         
-        std::ifstream ifs(filepath.string());
-        std::vector<char> data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
-        
-        bytes = data.data();
-        fileSize = (unsigned int)data.size();
+        ifs.open(filepath, std::ios::in | std::ios::binary);
+        if (!ifs.is_open())
+        {
+            throw ArchiveError(ArchiveErrorCode::NoSuchFile);
+        }
     }
-
-	std::replace(filename.begin(), filename.end(), ALTDirectoryDeliminator, '/');
     
-    if (zipOpenNewFileInZip(*zipFile, (const char *)filename.c_str(), &fileInfo, NULL, 0, NULL, 0, NULL, Z_DEFLATED, Z_DEFAULT_COMPRESSION) != ZIP_OK)
+    // Stored, since that's much faster to create and for the device to extract than deflated entries.
+    if (zipOpenNewFileInZip(zipFile, filename.c_str(), &fileInfo, NULL, 0, NULL, 0, NULL, 0, 0) != ZIP_OK)
     {
         throw ArchiveError(ArchiveErrorCode::UnknownWrite);
     }
     
-    if (zipWriteInFileInZip(*zipFile, bytes, fileSize) != ZIP_OK)
+    // Copy in chunks so large binaries are never held in memory all at once.
+    while (!isDirectory && ifs)
+    {
+        ifs.read(buffer.data(), buffer.size());
+        
+        auto length = ifs.gcount();
+        if (length > 0 && zipWriteInFileInZip(zipFile, buffer.data(), (unsigned int)length) != ZIP_OK)
+        {
+            zipCloseFileInZip(zipFile);
+            throw ArchiveError(ArchiveErrorCode::UnknownWrite);
+        }
+    }
+    
+    if (!isDirectory && ifs.bad())
+    {
+        zipCloseFileInZip(zipFile);
+        throw ArchiveError(ArchiveErrorCode::CorruptFile);
+    }
+    
+    if (zipCloseFileInZip(zipFile) != ZIP_OK)
     {
-        zipCloseFileInZip(*zipFile);
         throw ArchiveError(ArchiveErrorCode::UnknownWrite);
     }
 }
 
-std::string ZipAppBundle(std::string filepath)
+uint64_t ZipAppBundle(std::string filepath, size_t bufferSize, std::function<bool(uint64_t offset, const char *data, size_t size)> outputHandler)
 {
     fs::path appBundlePath = filepath;
     
-    auto appBundleFilename = appBundlePath.filename();
-    auto appName = appBundlePath.filename().stem().string();
+    ZipOutputStream outputStream;
+    outputStream.outputHandler = outputHandler;
+    outputStream.bufferSize = bufferSize;
+    outputStream.bufferOffset = 0;
+    outputStream.patchOffset = 0;
+    outputStream.position = 0;
+    outputStream.failed = false;
     
-    auto ipaName = appName + ".ipa";
-    auto ipaPath = appBundlePath.remove_filename().append(ipaName);
-    
-    if (fs::exists(ipaPath))
-    {
-        fs::remove(ipaPath);
-    }
+    zlib_filefunc_def fileFunctions = { OpenZipOutputStream, ReadZipOutputStream, WriteZipOutputStream, TellZipOutputStream,
+        SeekZipOutputStream, CloseZipOutputStream, TestErrorZipOutputStream, &outputStream };
     
-    zipFile zipFile = zipOpen((const char *)ipaPath.string().c_str(), APPEND_STATUS_CREATE);
+    zipFile zipFile = zipOpen2(appBundlePath.filename().string().c_str(), APPEND_STATUS_CREATE, NULL, &fileFunctions);
     if (zipFile == nullptr)
     {
         throw ArchiveError(ArchiveErrorCode::UnknownWrite);
     }
     
-    fs::path payloadDirectory = "Payload";
-    fs::path appBundleDirectory = payloadDirectory.append(appBundleFilename.string());
+    std::vector<char> buffer(ALTZipWriteBufferSize);
     
-    fs::path rootPath = fs::relative("", appBundleDirectory);
-    
-    for (auto& entry: fs::recursive_directory_iterator(rootPath))
+    try
+    {
+        std::string appBundleDirectory = "Payload/" + appBundlePath.filename().string() + "/";
+        
+        WriteFileToZipFile(zipFile, appBundlePath, "Payload/", buffer);
+        WriteFileToZipFile(zipFile, appBundlePath, appBundleDirectory, buffer);
+        
+        for (auto& entry : fs::recursive_directory_iterator(appBundlePath))
+        {
+            // Undo the filename escaping applied by UnzipAppBundle.
+            auto filename = appBundleDirectory + replace_all(fs::relative(entry.path(), appBundlePath).generic_string(), "__colon__", ":");
+            
+            if (entry.is_directory())
+            {
+                filename += "/";
+            }
+            
+            WriteFileToZipFile(zipFile, entry.path(), filename, buffer);
+            
+            // Pass the archive on a chunk at a time, between entries so their headers are still buffered when minizip fills them in.
+            if (outputStream.buffer.size() >= bufferSize && !FlushZipOutputStream(&outputStream))
+            {
+                throw ArchiveError(ArchiveErrorCode::UnknownWrite);
+            }
+        }
+    }
+    catch (std::exception& exception)
     {
-        auto filepath = entry.path();
-        auto relativePath = entry.path().relative_path();
+        // Don't pass on the rest of an archive that is incomplete anyway.
+        outputStream.failed = true;
+        zipClose(zipFile, NULL);
         
-        WriteFileToZipFile(&zipFile, filepath, relativePath);
+        throw;
     }
     
-    WriteFileToZipFile(&zipFile, payloadDirectory, payloadDirectory);
-    WriteFileToZipFile(&zipFile, appBundleDirectory, appBundleDirectory);
-    
-    zipClose(zipFile, NULL);
+    if (zipClose(zipFile, NULL) != ZIP_OK)
+    {
+        throw ArchiveError(ArchiveErrorCode::UnknownWrite);
+    }
     
-    return ipaPath.string();
+    return outputStream.bufferOffset;
 }
@@ -9,9 +9,20 @@
 #ifndef Archiver_hpp
 #define Archiver_hpp
 
+#include <cstdint>
+#include <functional>
 #include <string>
 
+// The bundled minizip writes no zip64 records, so archives must stay below 4 GB, and its file
+// functions report offsets as a long, which limits them to 2 GB where long is 32-bit (Windows).
+const uint64_t ALTZipArchiveMaximumSize = 0x7FFFFFFF;
+
 std::string UnzipAppBundle(std::string filepath, std::string outputDirectory);
-std::string ZipAppBundle(std::string filepath);
+
+// Packages the app bundle into an uncompressed (stored) .ipa without writing it to disk, passing the archive to
+// outputHandler in chunks of about bufferSize bytes. Chunks arrive in order, except that the header of an entry too
+// large to buffer is rewritten at its earlier offset once the entry is complete. outputHandler returns false if it
+// couldn't write a chunk. Returns the size of the archive.
+uint64_t ZipAppBundle(std::string filepath, size_t bufferSize, std::function<bool(uint64_t offset, const char *data, size_t size)> outputHandler);
 
 #endif /* Archiver_hpp */
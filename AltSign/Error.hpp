@@ -58,6 +58,7 @@ enum class APIErrorCode
 	AuthenticationHandshakeFailed,
 
 	InvalidAnisetteData,
+	InvalidSession,
 };
 
 enum class ArchiveErrorCode
@@ -207,6 +208,9 @@ public:
 
 			case APIErrorCode::InvalidAnisetteData:
 				return "Invalid anisette data. Please close both iTunes and iCloud, then try again.";
+
+			case APIErrorCode::InvalidSession:
+				return "Your session has expired. Please sign in again.";
         }
 
 		return "Unknown error.";
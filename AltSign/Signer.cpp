@@ -10,6 +10,7 @@
 #include "Error.hpp"
 #include "Archiver.hpp"
 #include "Application.hpp"
+#include "ZipFolder.hpp"
 
 #include "ldid.hpp"
 
@@ -18,6 +19,9 @@
 #include <openssl/applink.c>
 
 #include <filesystem>
+#include <list>
+#include <map>
+#include <mutex>
 
 #include <thread>         // std::this_thread::sleep_for
 #include <chrono>         // std::chrono::seconds
@@ -115,78 +119,47 @@ extern std::string make_uuid();
 
 #define odslog(msg) { std::stringstream ss; ss << msg << std::endl; OutputDebugStringA(ss.str().c_str()); }
 
-std::string CertificatesContent(std::shared_ptr<Certificate> altCertificate)
+// Decoding the .p12 and building the certificate chain is the same for every app signed with a certificate,
+// so signing identities are cached by certificate serial number.
+std::mutex signingIdentitiesMutex;
+std::map<std::string, std::shared_ptr<ldid::SigningIdentity>> signingIdentities;
+
+std::shared_ptr<ldid::SigningIdentity> SigningIdentityForCertificate(std::shared_ptr<Certificate> altCertificate)
 {
+    std::lock_guard<std::mutex> lock(signingIdentitiesMutex);
+
+    auto cachedIdentity = signingIdentities.find(altCertificate->serialNumber());
+    if (cachedIdentity != signingIdentities.end())
+    {
+        return cachedIdentity->second;
+    }
+
     auto altCertificateP12Data = altCertificate->p12Data();
     if (!altCertificateP12Data.has_value())
     {
         throw SignError(SignErrorCode::InvalidCertificate);
     }
-    
-    BIO *inputP12Buffer = BIO_new(BIO_s_mem());
-    BIO_write(inputP12Buffer, altCertificateP12Data->data(), (int)altCertificateP12Data->size());
-    
-    auto inputP12 = d2i_PKCS12_bio(inputP12Buffer, NULL);
-    
+
     // Extract key + certificate from .p12.
-    EVP_PKEY *key = nullptr;
-    X509 *certificate = nullptr;
-    PKCS12_parse(inputP12, "", &key, &certificate, NULL);
-    
-	// Prepare certificate chain of trust.
-	auto* certificates = sk_X509_new(NULL);
-
-	BIO* rootCertificateBuffer = BIO_new_mem_buf(AppleRootCertificateData, (int)strlen(AppleRootCertificateData));
-	BIO* wwdrCertificateBuffer = NULL;
-
-	unsigned long issuerHash = X509_issuer_name_hash(certificate);
-	if (issuerHash == 0x817d2f7a)
-	{
-		// Use legacy WWDR certificate.
-		wwdrCertificateBuffer = BIO_new_mem_buf(LegacyAppleWWDRCertificateData, (int)strlen(LegacyAppleWWDRCertificateData));
-	}
-	else
-	{
-		// Use latest WWDR certificate.
-		wwdrCertificateBuffer = BIO_new_mem_buf(AppleWWDRCertificateData, (int)strlen(AppleWWDRCertificateData));
-	}
-
-	auto rootCertificate = PEM_read_bio_X509(rootCertificateBuffer, NULL, NULL, NULL);
-	if (rootCertificate != NULL)
-	{
-		sk_X509_push(certificates, rootCertificate);
-	}
-
-	auto wwdrCertificate = PEM_read_bio_X509(wwdrCertificateBuffer, NULL, NULL, NULL);
-	if (wwdrCertificate != NULL)
-	{
-		sk_X509_push(certificates, wwdrCertificate);
-	}
-    
-    // Create new .p12 in memory with private key and certificate chain.
-    char emptyString[] = "";
-    auto outputP12 = PKCS12_create(emptyString, emptyString, key, certificate, certificates, 0, 0, 0, 0, 0);
-    
-    BIO *outputP12Buffer = BIO_new(BIO_s_mem());
-    i2d_PKCS12_bio(outputP12Buffer, outputP12);
-    
-    char *buffer = NULL;
-    int size = (int)BIO_get_mem_data(outputP12Buffer, &buffer);
+    auto identity = std::make_shared<ldid::SigningIdentity>(std::string(altCertificateP12Data->begin(), altCertificateP12Data->end()));
 
-	// Create string before freeing memory.
-	std::string output((const char*)buffer, size);
+	// Prepare certificate chain of trust.
+	identity->AddCertificate(AppleRootCertificateData);
 
-    // Free .p12 structures
-    PKCS12_free(inputP12);
-    PKCS12_free(outputP12);
+	unsigned long issuerHash = X509_issuer_name_hash(identity->Certificate());
+	if (issuerHash == 0x817d2f7a)
+	{
+		// Use legacy WWDR certificate.
+		identity->AddCertificate(LegacyAppleWWDRCertificateData);
+	}
+	else
+	{
+		// Use latest WWDR certificate.
+		identity->AddCertificate(AppleWWDRCertificateData);
+	}
 
-	BIO_free(wwdrCertificateBuffer);
-	BIO_free(rootCertificateBuffer);
-    
-    BIO_free(inputP12Buffer);
-    BIO_free(outputP12Buffer);
-    
-    return output;
+    signingIdentities[altCertificate->serialNumber()] = identity;
+    return identity;
 }
 
 Signer::Signer(std::shared_ptr<Team> team, std::shared_ptr<Certificate> certificate) : _team(team), _certificate(certificate)
@@ -198,6 +171,35 @@ Signer::~Signer()
 	int i = 0;
 }
 
+static bool endsWith(const std::string& str, const std::string& suffix)
+{
+    return str.size() >= suffix.size() && 0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
+}
+
+std::shared_ptr<ProvisioningProfile> ProfileForBundleIdentifier(std::string bundleIdentifier, const std::vector<std::shared_ptr<ProvisioningProfile>>& profiles)
+{
+    for (auto& profile : profiles)
+    {
+        if (profile->bundleIdentifier() == bundleIdentifier)
+        {
+            return profile;
+        }
+    }
+    
+    return nullptr;
+}
+
+std::string EntitlementsContent(std::shared_ptr<ProvisioningProfile> profile)
+{
+    std::string entitlementsString;
+    plist_to_xml_with_writer(profile->entitlements(), [](const char *buffer, size_t length, void *context) -> int {
+        ((std::string *)context)->append(buffer, length);
+        return 0;
+    }, &entitlementsString);
+    
+    return entitlementsString;
+}
+
 void Signer::SignApp(std::string path, std::vector<std::shared_ptr<ProvisioningProfile>> profiles)
 {   
     fs::path appPath = fs::path(path);
@@ -207,126 +209,182 @@ void Signer::SignApp(std::string path, std::vector<std::shared_ptr<ProvisioningP
 		return std::tolower(c);
 	});
     
-    std::optional<fs::path> ipaPath;
-    fs::path appBundlePath;
+    if (pathExtension == ".ipa")
+    {
+        this->SignArchive(appPath, profiles);
+        return;
+    }
+    
+    fs::path appBundlePath = appPath;
     
-    try
+    std::map<std::string, std::string> entitlementsByFilepath;
+    
+    auto prepareApp = [&profiles, &entitlementsByFilepath](Application &app)
     {
-        if (pathExtension == ".ipa")
+        auto profile = ProfileForBundleIdentifier(app.bundleIdentifier(), profiles);
+        if (profile == nullptr)
         {
-            ipaPath = appPath;
-            
-            auto uuid = make_uuid();
-            auto outputDirectoryPath = appPath.remove_filename().append(uuid);
-            
-            fs::create_directory(outputDirectoryPath);
-            
-            appBundlePath = UnzipAppBundle(appPath.string(), outputDirectoryPath.string());
+            throw SignError(SignErrorCode::MissingProvisioningProfile);
+        }
+        
+        fs::path profilePath = fs::path(app.path()).append("embedded.mobileprovision");
+        
+		std::ofstream fout(profilePath.string(), std::ios::out | std::ios::binary);
+		fout.write((char*)& profile->data()[0], profile->data().size() * sizeof(char));
+		fout.close();
+        
+        entitlementsByFilepath[app.path()] = EntitlementsContent(profile);
+    };
+    
+    Application app(appBundlePath.string());
+    prepareApp(app);
+
+	for (auto appExtension : app.appExtensions())
+	{
+		prepareApp(*appExtension);
+	}
+    
+    // Sign application
+    ldid::DiskFolder appBundle(app.path());
+    auto identity = SigningIdentityForCertificate(this->certificate());
+    
+    ldid::Sign("", appBundle, *identity, "",
+               ldid::fun([&](const std::string &path, const std::string &binaryEntitlements) -> std::string {
+        std::string filepath;
+        
+        if (path.size() == 0)
+        {
+            filepath = app.path();
         }
         else
         {
-            appBundlePath = appPath;
+            filepath = fs::canonical(fs::path(app.path()).append(path)).string();
         }
+
+        auto entitlements = entitlementsByFilepath[filepath];
+        return entitlements;
+    }),
+               ldid::fun([&](const std::string &string) {
+		odslog("Signing: " << string);
+//            progress.completedUnitCount += 1;
+    }),
+               ldid::fun([&](const double signingProgress) {
+		odslog("Signing Progress: " << signingProgress);
+    }));
+}
+
+void Signer::SignArchive(fs::path ipaPath, std::vector<std::shared_ptr<ProvisioningProfile>> profiles)
+{
+    // Sign the app inside the .ipa, writing the resigned app straight to a new archive
+    // instead of extracting it to disk and zipping it back up afterwards.
+    fs::path resignedPath = fs::path(ipaPath).replace_filename(make_uuid() + ".ipa");
+    
+    try
+    {
+        ZipFolder archive(ipaPath.string(), resignedPath.string());
         
-        std::map<std::string, std::string> entitlementsByFilepath;
+        auto ignoreLink = ldid::fun([](const std::string &name, const ldid::Functor<std::string ()> &read) {});
         
-        auto profileForApp = [&profiles](Application &app) -> std::shared_ptr<ProvisioningProfile> {
-            for (auto& profile : profiles)
+        std::optional<std::string> appBundlePath;
+        archive.Find("Payload\\", ldid::fun([&](const std::string &name) {
+            if (!appBundlePath.has_value() && std::count(name.begin(), name.end(), '\\') == 1 && endsWith(name, ".app\\Info.plist"))
             {
-                if (profile->bundleIdentifier() == app.bundleIdentifier())
-                {
-                    return profile;
-                }
+                appBundlePath = "Payload\\" + name.substr(0, name.size() - 10);
             }
-            
-            return nullptr;
-        };
+        }), ignoreLink);
         
-        auto prepareApp = [&profileForApp, &entitlementsByFilepath](Application &app)
+        if (!appBundlePath.has_value())
         {
-            auto profile = profileForApp(app);
-            if (profile == nullptr)
+            throw SignError(SignErrorCode::MissingAppBundle);
+        }
+        
+        ldid::SubFolder appFolder(archive, *appBundlePath);
+        ldid::UnionFolder appBundle(appFolder);
+        
+        // App and app extension bundles, relative to the app bundle (as passed to ldid's alter callback).
+        std::vector<std::string> bundlePaths = { "" };
+        appFolder.Find("PlugIns\\", ldid::fun([&](const std::string &name) {
+            if (std::count(name.begin(), name.end(), '\\') == 1 && endsWith(name, ".appex\\Info.plist"))
             {
-                throw SignError(SignErrorCode::MissingProvisioningProfile);
+                bundlePaths.push_back("PlugIns\\" + name.substr(0, name.size() - 10));
             }
+        }), ignoreLink);
+        
+        std::map<std::string, std::string> entitlementsByBundlePath;
+        std::list<std::stringbuf> profileBuffers;
+        
+        for (auto& bundlePath : bundlePaths)
+        {
+            std::string bundleIdentifier;
             
-            fs::path profilePath = fs::path(app.path()).append("embedded.mobileprovision");
-            
-			std::ofstream fout(profilePath.string(), std::ios::out | std::ios::binary);
-			fout.write((char*)& profile->data()[0], profile->data().size() * sizeof(char));
-			fout.close();
+            appFolder.Open(bundlePath + "Info.plist", ldid::fun([&](std::streambuf &data, size_t length, const void *flag) {
+                std::string contents(length, '\0');
+                data.sgetn(&contents[0], length);
+                
+                plist_t plist = nullptr;
+                plist_from_memory(contents.data(), (uint32_t)contents.size(), &plist);
+                if (plist == nullptr)
+                {
+                    throw SignError(SignErrorCode::MissingInfoPlist);
+                }
+                
+                char *identifier = nullptr;
+                
+                auto node = plist_dict_get_item(plist, "CFBundleIdentifier");
+                if (node != nullptr)
+                {
+                    plist_get_string_val(node, &identifier);
+                }
+                
+                if (identifier != nullptr)
+                {
+                    bundleIdentifier = identifier;
+                    free(identifier);
+                }
+                
+                plist_free(plist);
+            }));
             
-            plist_t entitlements = profile->entitlements();
+            auto profile = ProfileForBundleIdentifier(bundleIdentifier, profiles);
+            if (profile == nullptr)
+            {
+                throw SignError(SignErrorCode::MissingProvisioningProfile);
+            }
             
-            char *entitlementsString = nullptr;
-            uint32_t entitlementsSize = 0;
-            plist_to_xml(entitlements, &entitlementsString, &entitlementsSize);
+            // Added to the archive by ldid along with the other resources.
+            profileBuffers.emplace_back(std::string(profile->data().begin(), profile->data().end()), std::ios::in);
+            appBundle(bundlePath + "embedded.mobileprovision", nullptr, profileBuffers.back());
             
-            entitlementsByFilepath[app.path()] = entitlementsString;
-        };
-        
-        Application app(appBundlePath.string());
-        prepareApp(app);
-
-		for (auto appExtension : app.appExtensions())
-		{
-			prepareApp(*appExtension);
-		}
+            entitlementsByBundlePath[bundlePath] = EntitlementsContent(profile);
+        }
         
-        // Sign application
-        ldid::DiskFolder appBundle(app.path());
-        std::string key = CertificatesContent(this->certificate());
+        auto identity = SigningIdentityForCertificate(this->certificate());
         
-        ldid::Sign("", appBundle, key, "",
+        ldid::Sign("", appBundle, *identity, "",
                    ldid::fun([&](const std::string &path, const std::string &binaryEntitlements) -> std::string {
-            std::string filepath;
-            
-            if (path.size() == 0)
-            {
-                filepath = app.path();
-            }
-            else
-            {
-                filepath = fs::canonical(fs::path(app.path()).append(path)).string();
-            }
-
-            auto entitlements = entitlementsByFilepath[filepath];
-            return entitlements;
+            return entitlementsByBundlePath[path];
         }),
                    ldid::fun([&](const std::string &string) {
-			odslog("Signing: " << string);
-//            progress.completedUnitCount += 1;
+            odslog("Signing: " << string);
         }),
                    ldid::fun([&](const double signingProgress) {
-			odslog("Signing Progress: " << signingProgress);
+            odslog("Signing Progress: " << signingProgress);
         }));
         
-        // Zip app back up.
-        if (ipaPath.has_value())
-        {
-            auto resignedPath = ZipAppBundle(appBundlePath.string());
-            
-            if (fs::exists(*ipaPath))
-            {
-                fs::remove(*ipaPath);
-            }
-            
-            fs::rename(*ipaPath, resignedPath);
-        }
-
-		return;
+        archive.Commit();
     }
     catch (std::exception& e)
     {
-        if (!ipaPath.has_value())
+        if (fs::exists(resignedPath))
         {
-            return;
+            fs::remove(resignedPath);
         }
         
-        fs::remove(*ipaPath);
-        
         throw;
     }
+    
+    fs::remove(ipaPath);
+    fs::rename(resignedPath, ipaPath);
 }
 
 std::shared_ptr<Team> Signer::team() const
@@ -12,6 +12,7 @@
 /* The classes below are exported */
 #pragma GCC visibility push(default)
 
+#include <filesystem>
 #include <string>
 #include <vector>
 
@@ -28,11 +29,14 @@ public:
     std::shared_ptr<Team> team() const;
     std::shared_ptr<Certificate> certificate() const;
     
+    // .ipa files are signed in place without being extracted.
     void SignApp(std::string appPath, std::vector<std::shared_ptr<ProvisioningProfile>> profiles);
     
 private:
     std::shared_ptr<Team> _team;
     std::shared_ptr<Certificate> _certificate;
+    
+    void SignArchive(std::filesystem::path ipaPath, std::vector<std::shared_ptr<ProvisioningProfile>> profiles);
 };
 
 #pragma GCC visibility pop
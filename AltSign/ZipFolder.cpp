@@ -0,0 +1,390 @@
+//
+//  ZipFolder.cpp
+//  AltSign-Windows
+//
+//  Copyright © 2020 Riley Testut. All rights reserved.
+//
+
+#include "ZipFolder.hpp"
+#include "Error.hpp"
+
+#include <algorithm>
+#include <ctime>
+#include <sstream>
+#include <vector>
+
+const int ALTZipFolderMaxFilenameLength = 512;
+const int ALTZipFolderCopyBufferSize = 1024 * 1024;
+const uLong ALTZipFolderDefaultFileAttributes = (uLong)0100644 << 16;
+
+// Unix file type bits, stored in the upper 16 bits of an entry's external attributes.
+const uLong ALTZipFolderFileTypeMask = 0170000;
+const uLong ALTZipFolderSymbolicLinkFileType = 0120000;
+
+extern char ALTDirectoryDeliminator;
+
+static bool startsWith(const std::string& str, const std::string& prefix)
+{
+    return str.size() >= prefix.size() && 0 == str.compare(0, prefix.size(), prefix);
+}
+
+// Zip entries store their modification date in local time.
+static tm_zip currentZipDate()
+{
+    time_t now = time(NULL);
+    struct tm *date = localtime(&now);
+    
+    tm_zip zipDate = {};
+    zipDate.tm_sec = date->tm_sec;
+    zipDate.tm_min = date->tm_min;
+    zipDate.tm_hour = date->tm_hour;
+    zipDate.tm_mday = date->tm_mday;
+    zipDate.tm_mon = date->tm_mon;
+    zipDate.tm_year = date->tm_year + 1900;
+    return zipDate;
+}
+
+// Writes straight into the currently open file of the output archive.
+class ZipFileBuffer : public std::streambuf
+{
+public:
+    ZipFileBuffer(zipFile zipFile) : _zipFile(zipFile)
+    {
+    }
+    
+    virtual std::streamsize xsputn(const char_type *data, std::streamsize size)
+    {
+        if (size > 0 && zipWriteInFileInZip(_zipFile, data, (unsigned int)size) != ZIP_OK)
+        {
+            throw ArchiveError(ArchiveErrorCode::UnknownWrite);
+        }
+        
+        return size;
+    }
+    
+    virtual int_type overflow(int_type next)
+    {
+        if (next != traits_type::eof())
+        {
+            char value = traits_type::to_char_type(next);
+            this->xsputn(&value, 1);
+        }
+        
+        return traits_type::not_eof(next);
+    }
+    
+private:
+    zipFile _zipFile;
+};
+
+// ldid still writes unchanged files so it can hash them along the way, but ZipFolder copies those entries raw instead.
+class DiscardBuffer : public std::streambuf
+{
+public:
+    virtual std::streamsize xsputn(const char_type *data, std::streamsize size)
+    {
+        return size;
+    }
+    
+    virtual int_type overflow(int_type next)
+    {
+        return traits_type::not_eof(next);
+    }
+};
+
+ZipFolder::ZipFolder(std::string inputPath, std::string outputPath) : _inputFile(NULL), _outputFile(NULL)
+{
+    _inputFile = unzOpen(inputPath.c_str());
+    if (_inputFile == NULL)
+    {
+        throw ArchiveError(ArchiveErrorCode::NoSuchFile);
+    }
+    
+    try
+    {
+        unz_global_info zipInfo;
+        if (unzGetGlobalInfo(_inputFile, &zipInfo) != UNZ_OK)
+        {
+            throw ArchiveError(ArchiveErrorCode::CorruptFile);
+        }
+        
+        std::vector<char> filename(ALTZipFolderMaxFilenameLength);
+        
+        for (uLong i = 0; i < zipInfo.number_entry; i++)
+        {
+            if (i > 0 && unzGoToNextFile(_inputFile) != UNZ_OK)
+            {
+                throw ArchiveError(ArchiveErrorCode::CorruptFile);
+            }
+            
+            Entry entry;
+            if (unzGetCurrentFileInfo(_inputFile, &entry.info, filename.data(), (uLong)filename.size(), NULL, 0, NULL, 0) != UNZ_OK ||
+                unzGetFilePos(_inputFile, &entry.position) != UNZ_OK)
+            {
+                throw ArchiveError(ArchiveErrorCode::CorruptFile);
+            }
+            
+            entry.filename = filename.data();
+            if (startsWith(entry.filename, "__MACOSX"))
+            {
+                continue;
+            }
+            
+            std::string path = entry.filename;
+            std::replace(path.begin(), path.end(), '/', ALTDirectoryDeliminator);
+            
+            auto result = _entries.insert(std::make_pair(path, entry));
+            if (result.second)
+            {
+                _orderedEntries.push_back(&result.first->second);
+            }
+        }
+        
+        _outputFile = zipOpen(outputPath.c_str(), APPEND_STATUS_CREATE);
+        if (_outputFile == NULL)
+        {
+            throw ArchiveError(ArchiveErrorCode::UnknownWrite);
+        }
+    }
+    catch (std::exception& exception)
+    {
+        unzClose(_inputFile);
+        throw;
+    }
+}
+
+ZipFolder::~ZipFolder()
+{
+    if (_outputFile != NULL)
+    {
+        // Never committed, so the output archive is incomplete.
+        zipClose(_outputFile, NULL);
+    }
+    
+    unzClose(_inputFile);
+}
+
+void ZipFolder::Commit()
+{
+    for (auto entry : _orderedEntries)
+    {
+        std::string path = entry->filename;
+        std::replace(path.begin(), path.end(), '/', ALTDirectoryDeliminator);
+        
+        if (_writtenEntries.count(path) > 0)
+        {
+            continue;
+        }
+        
+        this->CopyEntry(*entry);
+    }
+    
+    int result = zipClose(_outputFile, NULL);
+    _outputFile = NULL;
+    
+    if (result != ZIP_OK)
+    {
+        throw ArchiveError(ArchiveErrorCode::UnknownWrite);
+    }
+}
+
+const ZipFolder::Entry *ZipFolder::EntryAtPath(const std::string &path) const
+{
+    auto entry = _entries.find(path);
+    if (entry == _entries.end())
+    {
+        return nullptr;
+    }
+    
+    return &entry->second;
+}
+
+std::string ZipFolder::ReadEntry(const Entry &entry, size_t padding) const
+{
+    unz_file_pos position = entry.position;
+    if (unzGoToFilePos(_inputFile, &position) != UNZ_OK || unzOpenCurrentFile(_inputFile) != UNZ_OK)
+    {
+        throw ArchiveError(ArchiveErrorCode::CorruptFile);
+    }
+    
+    std::string data(entry.info.uncompressed_size + padding, '\0');
+    
+    size_t offset = 0;
+    while (offset < entry.info.uncompressed_size)
+    {
+        unsigned int length = (unsigned int)std::min<size_t>(entry.info.uncompressed_size - offset, ALTZipFolderCopyBufferSize);
+        
+        int result = unzReadCurrentFile(_inputFile, &data[offset], length);
+        if (result <= 0)
+        {
+            unzCloseCurrentFile(_inputFile);
+            throw ArchiveError(ArchiveErrorCode::CorruptFile);
+        }
+        
+        offset += result;
+    }
+    
+    // Also verifies the CRC now that the whole entry has been read.
+    if (unzCloseCurrentFile(_inputFile) != UNZ_OK)
+    {
+        throw ArchiveError(ArchiveErrorCode::CorruptFile);
+    }
+    
+    return data;
+}
+
+void ZipFolder::WriteEntry(const std::string &filename, const zip_fileinfo &fileInfo, const ldid::Functor<void (std::streambuf &)> &code)
+{
+    if (zipOpenNewFileInZip(_outputFile, filename.c_str(), &fileInfo, NULL, 0, NULL, 0, NULL, Z_DEFLATED, Z_DEFAULT_COMPRESSION) != ZIP_OK)
+    {
+        throw ArchiveError(ArchiveErrorCode::UnknownWrite);
+    }
+    
+    try
+    {
+        ZipFileBuffer buffer(_outputFile);
+        code(buffer);
+    }
+    catch (std::exception& exception)
+    {
+        zipCloseFileInZip(_outputFile);
+        throw;
+    }
+    
+    if (zipCloseFileInZip(_outputFile) != ZIP_OK)
+    {
+        throw ArchiveError(ArchiveErrorCode::UnknownWrite);
+    }
+}
+
+void ZipFolder::CopyEntry(const Entry &entry)
+{
+    int method = 0;
+    int level = 0;
+    
+    unz_file_pos position = entry.position;
+    if (unzGoToFilePos(_inputFile, &position) != UNZ_OK || unzOpenCurrentFile2(_inputFile, &method, &level, 1) != UNZ_OK)
+    {
+        throw ArchiveError(ArchiveErrorCode::CorruptFile);
+    }
+    
+    zip_fileinfo fileInfo = {};
+    fileInfo.dosDate = entry.info.dosDate;
+    fileInfo.internal_fa = entry.info.internal_fa;
+    fileInfo.external_fa = entry.info.external_fa;
+    
+    if (zipOpenNewFileInZip2(_outputFile, entry.filename.c_str(), &fileInfo, NULL, 0, NULL, 0, NULL, method, level, 1) != ZIP_OK)
+    {
+        unzCloseCurrentFile(_inputFile);
+        throw ArchiveError(ArchiveErrorCode::UnknownWrite);
+    }
+    
+    // Copies the compressed data as-is; the sizes and CRC come from the original entry.
+    std::vector<char> buffer(ALTZipFolderCopyBufferSize);
+    
+    int result = 0;
+    while ((result = unzReadCurrentFile(_inputFile, buffer.data(), (unsigned int)buffer.size())) > 0)
+    {
+        if (zipWriteInFileInZip(_outputFile, buffer.data(), (unsigned int)result) != ZIP_OK)
+        {
+            result = UNZ_ERRNO;
+            break;
+        }
+    }
+    
+    unzCloseCurrentFile(_inputFile);
+    
+    if (zipCloseFileInZipRaw(_outputFile, entry.info.uncompressed_size, entry.info.crc) != ZIP_OK || result < 0)
+    {
+        throw ArchiveError(ArchiveErrorCode::UnknownWrite);
+    }
+}
+
+void ZipFolder::Save(const std::string &path, bool edit, const void *flag, const ldid::Functor<void (std::streambuf &)> &code)
+{
+    auto entry = this->EntryAtPath(path);
+    
+    if (!edit && entry != nullptr && flag == entry)
+    {
+        // Unchanged file from this archive, so Commit() copies it without recompressing.
+        DiscardBuffer buffer;
+        code(buffer);
+        return;
+    }
+    
+    std::string filename = path;
+    std::replace(filename.begin(), filename.end(), ALTDirectoryDeliminator, '/');
+    
+    // Rewritten files keep the date and attributes of the entry they replace, while new ones (e.g. embedded.mobileprovision) are dated now.
+    zip_fileinfo fileInfo = {};
+    if (entry != nullptr)
+    {
+        fileInfo.dosDate = entry->info.dosDate;
+        fileInfo.internal_fa = entry->info.internal_fa;
+        fileInfo.external_fa = entry->info.external_fa;
+    }
+    else
+    {
+        fileInfo.tmz_date = currentZipDate();
+        fileInfo.external_fa = ALTZipFolderDefaultFileAttributes;
+    }
+    
+    this->WriteEntry(filename, fileInfo, code);
+    _writtenEntries.insert(path);
+}
+
+bool ZipFolder::Look(const std::string &path) const
+{
+    return this->EntryAtPath(path) != nullptr;
+}
+
+void ZipFolder::Open(const std::string &path, const ldid::Functor<void (std::streambuf &, size_t, const void *)> &code) const
+{
+    auto entry = this->EntryAtPath(path);
+    if (entry == nullptr)
+    {
+        throw ArchiveError(ArchiveErrorCode::NoSuchFile);
+    }
+    
+    std::stringbuf data(this->ReadEntry(*entry, 0), std::ios::in);
+    code(data, entry->info.uncompressed_size, entry);
+}
+
+void ZipFolder::View(const std::string &path, const ldid::Functor<void (const void *, size_t, const void *)> &code) const
+{
+    auto entry = this->EntryAtPath(path);
+    if (entry == nullptr)
+    {
+        throw ArchiveError(ArchiveErrorCode::NoSuchFile);
+    }
+    
+    // ldid::Folder::View guarantees 0x10 zero bytes past the end of the file.
+    auto data = this->ReadEntry(*entry, 0x10);
+    code(data.data(), entry->info.uncompressed_size, entry);
+}
+
+void ZipFolder::Find(const std::string &path, const ldid::Functor<void (const std::string &)> &code, const ldid::Functor<void (const std::string &, const ldid::Functor<std::string ()> &)> &link) const
+{
+    for (auto entry = _entries.lower_bound(path); entry != _entries.end() && startsWith(entry->first, path); entry++)
+    {
+        if (entry->first.back() == ALTDirectoryDeliminator)
+        {
+            // Directory
+            continue;
+        }
+        
+        auto name = entry->first.substr(path.size());
+        
+        if (((entry->second.info.external_fa >> 16) & ALTZipFolderFileTypeMask) == ALTZipFolderSymbolicLinkFileType)
+        {
+            // Symlink (e.g. a framework's Versions/Current), whose contents are its target.
+            auto linkEntry = &entry->second;
+            link(name, ldid::fun([&]() -> std::string {
+                return this->ReadEntry(*linkEntry, 0);
+            }));
+            continue;
+        }
+        
+        code(name);
+    }
+}
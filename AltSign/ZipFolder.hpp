@@ -0,0 +1,64 @@
+//
+//  ZipFolder.hpp
+//  AltSign-Windows
+//
+//  Copyright © 2020 Riley Testut. All rights reserved.
+//
+
+#ifndef ZipFolder_hpp
+#define ZipFolder_hpp
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "ldid.hpp"
+
+extern "C" {
+#include "unzip.h"
+#include "zip.h"
+}
+
+// ldid::Folder backed by an .ipa, so apps can be signed without extracting them to disk.
+// Files are read from the input archive, and everything ldid saves is written to the output archive.
+// Commit() then copies the remaining (unchanged) entries across as-is, without recompressing them.
+class ZipFolder : public ldid::Folder
+{
+public:
+    ZipFolder(std::string inputPath, std::string outputPath);
+    ~ZipFolder();
+    
+    void Commit();
+    
+    virtual void Save(const std::string &path, bool edit, const void *flag, const ldid::Functor<void (std::streambuf &)> &code);
+    virtual bool Look(const std::string &path) const;
+    virtual void Open(const std::string &path, const ldid::Functor<void (std::streambuf &, size_t, const void *)> &code) const;
+    virtual void Find(const std::string &path, const ldid::Functor<void (const std::string &)> &code, const ldid::Functor<void (const std::string &, const ldid::Functor<std::string ()> &)> &link) const;
+    virtual void View(const std::string &path, const ldid::Functor<void (const void *, size_t, const void *)> &code) const;
+    
+private:
+    struct Entry
+    {
+        std::string filename;
+        unz_file_pos position;
+        unz_file_info info;
+    };
+    
+    unzFile _inputFile;
+    zipFile _outputFile;
+    
+    // Keyed by ldid path ('\' separated), in archive order.
+    std::map<std::string, Entry> _entries;
+    std::vector<const Entry *> _orderedEntries;
+    
+    // Entries written to the output archive, which must not be copied again by Commit().
+    std::set<std::string> _writtenEntries;
+    
+    const Entry *EntryAtPath(const std::string &path) const;
+    std::string ReadEntry(const Entry &entry, size_t padding) const;
+    void WriteEntry(const std::string &filename, const zip_fileinfo &fileInfo, const ldid::Functor<void (std::streambuf &)> &code);
+    void CopyEntry(const Entry &entry);
+};
+
+#endif /* ZipFolder_hpp */
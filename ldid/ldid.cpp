@@ -35,10 +35,14 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <fstream>
+#include <future>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
@@ -122,6 +126,7 @@ namespace fs = std::experimental::filesystem;
 #endif
 
 #include "ldid.hpp"
+#include "pagehash.h"
 
 #define _assert___(line) \
     #line
@@ -1105,6 +1110,9 @@ struct Algorithm {
 	virtual void operator ()(uint8_t* hash, const void* data, size_t size) const = 0;
 	virtual void operator ()(ldid::Hash& hash, const void* data, size_t size) const = 0;
 	virtual void operator ()(std::vector<char>& hash, const void* data, size_t size) const = 0;
+
+	// hashes count pages of size bytes at once, which lets multi-buffer implementations work on several in parallel
+	virtual void operator ()(uint8_t* hashes, const uint8_t* const* pages, size_t count, size_t size) const = 0;
 };
 
 struct AlgorithmSHA1 :
@@ -1131,6 +1139,10 @@ struct AlgorithmSHA1 :
 		hash.resize(LDID_SHA1_DIGEST_LENGTH);
 		return operator ()(reinterpret_cast<uint8_t*>(hash.data()), data, size);
 	}
+
+	void operator ()(uint8_t* hashes, const uint8_t* const* pages, size_t count, size_t size) const {
+		ldid::GetPageHasher().sha1_(hashes, pages, count, size);
+	}
 };
 
 struct AlgorithmSHA256 :
@@ -1157,6 +1169,10 @@ struct AlgorithmSHA256 :
 		hash.resize(LDID_SHA256_DIGEST_LENGTH);
 		return operator ()(reinterpret_cast<uint8_t*>(hash.data()), data, size);
 	}
+
+	void operator ()(uint8_t* hashes, const uint8_t* const* pages, size_t count, size_t size) const {
+		ldid::GetPageHasher().sha256_(hashes, pages, count, size);
+	}
 };
 
 static const std::vector<Algorithm*>& GetAlgorithms() {
@@ -1292,8 +1308,61 @@ public:
 };
 #endif
 
+static std::atomic<ldid::Timings*> timings_(NULL);
+static std::atomic<bool> concurrent_(true);
+
+// the phase this thread is currently in (Phases for none) and when the thread entered it
+static thread_local ldid::Timings::Phase phase_(ldid::Timings::Phases);
+static thread_local std::chrono::steady_clock::time_point since_;
+
+// charges the time spent in a block to a phase; nested timers pause the enclosing one, so no time is counted twice
+class Timer {
+private:
+	bool active_;
+	ldid::Timings::Phase previous_;
+
+	static void Charge(std::chrono::steady_clock::time_point now) {
+		auto timings(timings_.load());
+		if (timings != NULL && phase_ != ldid::Timings::Phases)
+			timings->nanoseconds_[phase_] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - since_).count();
+		since_ = now;
+	}
+
+public:
+	Timer(ldid::Timings::Phase phase) :
+		active_(timings_.load() != NULL),
+		previous_(phase_)
+	{
+		if (!active_)
+			return;
+		Charge(std::chrono::steady_clock::now());
+		phase_ = phase;
+	}
+
+	~Timer() {
+		Stop();
+	}
+
+	// ends the phase before the end of the block
+	void Stop() {
+		if (!active_)
+			return;
+		Charge(std::chrono::steady_clock::now());
+		phase_ = previous_;
+		active_ = false;
+	}
+};
+
 namespace ldid {
 
+	void Time(Timings* timings) {
+		timings_ = timings;
+	}
+
+	void Concurrent(bool concurrent) {
+		concurrent_ = concurrent;
+	}
+
 	std::string Analyze(const void* data, size_t size) {
 		std::string entitlements;
 
@@ -1401,7 +1470,7 @@ namespace ldid {
 			put(output, &fat_header, sizeof(fat_header));
 			position += sizeof(fat_header);
 
-			_foreach(allocation, allocations) {
+			for (auto& allocation : allocations) {
 				auto& mach_header(allocation.mach_header_);
 
 				fat_arch fat_arch;
@@ -1415,11 +1484,11 @@ namespace ldid {
 			}
 		}
 
-		_foreach(allocation, allocations) {
+		// writes one slice, starting at its offset
+		auto slice([&](CodesignAllocation& allocation, std::streambuf& output, const Functor<void(double)>& percent) {
 			auto& mach_header(allocation.mach_header_);
 
-			pad(output, allocation.offset_ - position);
-			position = allocation.offset_;
+			size_t position(0);
 
 			std::vector<std::string> commands;
 			size_t execSegLimit = 0;
@@ -1524,7 +1593,55 @@ namespace ldid {
 				pad(output, allocation.alloc_ - saved);
 			else
 				_assert(allocation.alloc_ == saved);
-			position += allocation.alloc_;
+		});
+
+		if (allocations.size() == 1 || !concurrent_) {
+			for (auto& allocation : allocations) {
+				pad(output, allocation.offset_ - position);
+				slice(allocation, output, percent);
+				position = allocation.offset_ + allocation.limit_ + allocation.alloc_;
+			}
+			return;
+		}
+
+		// slices only depend on each other through their offsets, which are known by now, so sign them all at
+		// once; the first is written straight to the output while the rest are buffered until their turn comes
+		std::mutex mutex;
+		auto locked([&](double value) {
+			std::lock_guard<std::mutex> lock(mutex);
+			percent(value);
+		});
+		auto progress(fun(locked));
+
+		std::vector<std::stringbuf> buffers(allocations.size());
+		std::vector<std::future<void>> slices;
+		for (size_t index(1); index != allocations.size(); ++index)
+			slices.push_back(std::async(std::launch::async, [&, index]() {
+				slice(allocations[index], buffers[index], progress);
+			}));
+
+		for (size_t index(0); index != allocations.size(); ++index) {
+			auto& allocation(allocations[index]);
+			pad(output, allocation.offset_ - position);
+
+			if (index == 0)
+				slice(allocation, output, progress);
+			else {
+				{
+					// the slice's own thread accounts for its time
+					Timer timer(ldid::Timings::Phases);
+					slices[index - 1].get();
+				}
+
+				// hand the buffered slice over a chunk at a time rather than copying it whole, and free it right away
+				auto& buffer(buffers[index]);
+				char data[0x10000];
+				for (std::streamsize size; (size = buffer.sgetn(data, sizeof(data))) != 0; )
+					put(output, data, size);
+				std::stringbuf().swap(buffer);
+			}
+
+			position = allocation.offset_ + allocation.limit_ + allocation.alloc_;
 		}
 	}
 
@@ -1668,6 +1785,13 @@ public:
 	operator STACK_OF(X509)* () const {
 		return ca_;
 	}
+
+	void Add(X509* cert) {
+		if (ca_ == NULL)
+			ca_ = sk_X509_new_null();
+		_assert(ca_ != NULL);
+		_assert(sk_X509_push(ca_, cert) != 0);
+	}
 };
 
 class Signature {
@@ -1701,6 +1825,33 @@ public:
 };
 #endif
 
+struct ldid::SigningIdentity::Contents {
+#ifndef LDID_NOSMIME
+	Stuff stuff_;
+#endif
+	std::string team_;
+
+	Contents(const std::string& key)
+#ifndef LDID_NOSMIME
+		: stuff_(key)
+#endif
+	{
+#ifndef LDID_NOSMIME
+		auto name(X509_get_subject_name(stuff_));
+		_assert(name != NULL);
+		auto index(X509_NAME_get_index_by_NID(name, NID_organizationalUnitName, -1));
+		_assert(index >= 0);
+		auto next(X509_NAME_get_index_by_NID(name, NID_organizationalUnitName, index));
+		_assert(next == -1);
+		auto entry(X509_NAME_get_entry(name, index));
+		_assert(entry != NULL);
+		auto asn(X509_NAME_ENTRY_get_data(entry));
+		_assert(asn != NULL);
+		team_.assign(reinterpret_cast<char*>(ASN1_STRING_data(asn)), ASN1_STRING_length(asn));
+#endif
+	}
+};
+
 class NullBuffer :
 	public std::streambuf
 {
@@ -1742,6 +1893,7 @@ public:
 	}
 
 	virtual std::streamsize xsputn(const char_type* data, std::streamsize size) {
+		Timer timer(ldid::Timings::ResourceHashing);
 		LDID_SHA1_Update(&sha1_, data, size);
 		LDID_SHA256_Update(&sha256_, data, size);
 		return size;
@@ -1780,6 +1932,10 @@ static bool Starts(const std::string& lhs, const std::string& rhs) {
 	return lhs.size() >= rhs.size() && lhs.compare(0, rhs.size(), rhs) == 0;
 }
 
+static bool Ends(const std::string& lhs, const std::string& rhs) {
+	return lhs.size() >= rhs.size() && lhs.compare(lhs.size() - rhs.size(), rhs.size(), rhs) == 0;
+}
+
 class Split {
 public:
 	std::string dir;
@@ -1843,31 +1999,62 @@ static void Commit(const std::string& path, const std::string& temp) {
 
 namespace ldid {
 
-	Hash Sign(const void* idata, size_t isize, std::streambuf& output, const std::string& identifier, const std::string& entitlements, const std::string& requirement, const std::string& key, const Slots& slots, const Functor<void(double)>& percent) {
-		Hash hash;
+	SigningIdentity::SigningIdentity()
+	{
+	}
 
-		std::string team;
+	SigningIdentity::SigningIdentity(const std::string& key)
+	{
+		if (!key.empty())
+			contents_ = std::make_shared<Contents>(key);
+	}
 
+	void SigningIdentity::AddCertificate(const std::string& certificate) {
+		_assert(!empty());
 #ifndef LDID_NOSMIME
-		if (!key.empty()) {
-			Stuff stuff(key);
-			auto name(X509_get_subject_name(stuff));
-			_assert(name != NULL);
-			auto index(X509_NAME_get_index_by_NID(name, NID_organizationalUnitName, -1));
-			_assert(index >= 0);
-			auto next(X509_NAME_get_index_by_NID(name, NID_organizationalUnitName, index));
-			_assert(next == -1);
-			auto entry(X509_NAME_get_entry(name, index));
-			_assert(entry != NULL);
-			auto asn(X509_NAME_ENTRY_get_data(entry));
-			_assert(asn != NULL);
-			team.assign(reinterpret_cast<char*>(ASN1_STRING_data(asn)), ASN1_STRING_length(asn));
-		}
+		Buffer bio(certificate);
+		X509* cert(PEM_read_bio_X509(bio, NULL, NULL, NULL));
+		_assert(cert != NULL);
+		contents_->stuff_.Add(cert);
+#endif
+	}
+
+	bool SigningIdentity::empty() const {
+		return contents_ == NULL;
+	}
+
+	x509_st* SigningIdentity::Certificate() const {
+		_assert(!empty());
+#ifndef LDID_NOSMIME
+		return contents_->stuff_;
+#else
+		return NULL;
 #endif
+	}
+
+	const std::string& SigningIdentity::Team() const {
+		_assert(!empty());
+		return contents_->team_;
+	}
+
+	Hash Sign(const void* idata, size_t isize, std::streambuf& output, const std::string& identifier, const std::string& entitlements, const std::string& requirement, const std::string& key, const Slots& slots, const Functor<void(double)>& percent) {
+		return Sign(idata, isize, output, identifier, entitlements, requirement, SigningIdentity(key), slots, percent);
+	}
+
+	Hash Sign(const void* idata, size_t isize, std::streambuf& output, const std::string& identifier, const std::string& entitlements, const std::string& requirement, const SigningIdentity& identity, const Slots& slots, const Functor<void(double)>& percent) {
+		Hash hash;
+
+		std::string team;
+		if (!identity.empty())
+			team = identity.Team();
 
 		// XXX: this is just a "sufficiently large number"
 		size_t certificate(0x3000);
 
+		// slices may be signed concurrently, but the result is always the code directory hash of the last one
+		FatHeader source(const_cast<void*>(idata), isize);
+		const void* last(source.GetMachHeaders().empty() ? NULL : source.GetMachHeaders().back().GetBase());
+
 		Allocate(idata, isize, output, fun([&](const MachHeader& mach_header, size_t size) -> size_t {
 			size_t alloc(sizeof(struct SuperBlob));
 
@@ -1916,7 +2103,7 @@ namespace ldid {
 			for (Algorithm* algorithm : GetAlgorithms())
 				alloc = Align(alloc + directory + (special + normal) * algorithm->size_, 16);
 
-			if (!key.empty()) {
+			if (!identity.empty()) {
 				alloc += sizeof(struct BlobIndex);
 				alloc += sizeof(struct Blob);
 				alloc += certificate;
@@ -1926,6 +2113,7 @@ namespace ldid {
 			}), fun([&](const MachHeader& mach_header, std::streambuf& output, size_t limit, size_t execSegLimit, const std::string& overlap, const char* top, const Functor<void(double)>& percent) -> size_t {
 				Blobs blobs;
 				uint64_t execSegFlags = 0;
+				Hash cdhash;
 
 				if (true) {
 					std::stringbuf data;
@@ -2102,6 +2290,8 @@ namespace ldid {
 					if (!team.empty())
 						put(data, team.c_str(), team.size() + 1);
 
+					Timer timer(ldid::Timings::PageHashing);
+
 					std::vector<uint8_t> storage((special + normal) * algorithm.size_);
 					auto* hashes(&storage[special * algorithm.size_]);
 
@@ -2117,8 +2307,14 @@ namespace ldid {
 
 					percent(0);
 					if (normal != 1)
-						for (size_t i = 0; i != normal - 1; ++i) {
-							algorithm(hashes + i * algorithm.size_, (PageSize_ * i < overlap.size() ? overlap.data() : top) + PageSize_ * i, PageSize_);
+						for (size_t i = 0; i != normal - 1; ) {
+							// full pages are handed over in batches, so they can be hashed in parallel
+							const uint8_t* pages[16];
+							size_t count(std::min<size_t>(sizeof(pages) / sizeof(pages[0]), normal - 1 - i));
+							for (size_t j(0); j != count; ++j)
+								pages[j] = reinterpret_cast<const uint8_t*>((PageSize_ * (i + j) < overlap.size() ? overlap.data() : top) + PageSize_ * (i + j));
+							algorithm(hashes + i * algorithm.size_, pages, count, PageSize_);
+							i += count;
 							percent(double(i) / normal);
 						}
 					if (normal != 0)
@@ -2128,22 +2324,25 @@ namespace ldid {
 					put(data, storage.data(), storage.size());
 
 					const auto& save(insert(blobs, total == 0 ? CSSLOT_CODEDIRECTORY : CSSLOT_ALTERNATE + total - 1, CSMAGIC_CODEDIRECTORY, data));
-					algorithm(hash, save.data(), save.size());
+					algorithm(cdhash, save.data(), save.size());
 
 					++total;
 				}
 
 #ifndef LDID_NOSMIME
-				if (!key.empty()) {
+				if (!identity.empty()) {
 					std::stringbuf data;
 					const std::string& sign(blobs[CSSLOT_CODEDIRECTORY]);
 
-					Stuff stuff(key);
 					Buffer bio(sign);
 
-					Signature signature(stuff, sign);
-					Buffer result(signature);
-					std::string value(result);
+					std::string value;
+					{
+						Timer timer(ldid::Timings::CMS);
+						Signature signature((*identity).stuff_, sign);
+						Buffer result(signature);
+						value = static_cast<std::string>(result);
+					}
 					put(data, value.data(), value.size());
 
 					const auto& save(insert(blobs, CSSLOT_SIGNATURESLOT, CSMAGIC_BLOBWRAPPER, data));
@@ -2151,6 +2350,9 @@ namespace ldid {
 				}
 #endif
 
+				if (mach_header.GetBase() == last)
+					hash = cdhash;
+
 				return put(output, CSMAGIC_EMBEDDED_SIGNATURE, blobs);
 				}), percent);
 
@@ -2277,8 +2479,31 @@ namespace ldid {
 	void DiskFolder::Find(const std::string& path, const Functor<void(const std::string&)>& code, const Functor<void(const std::string&, const Functor<std::string()>&)>& link) const {
 		Find(path, "", code, link);
 	}
+
+	void DiskFolder::View(const std::string& path, const Functor<void(const void*, size_t, const void*)>& code) const {
+		auto from(Path(path));
+
+		struct _stat info;
+		_syscall(_stat(from.c_str(), &info));
+
+		// the zero bytes after the file come from the rest of its last page, so only map it if there are enough
+		size_t slack((0x1000 - (info.st_size & 0xfff)) & 0xfff);
+		if (slack < 0x10)
+			return Folder::View(path, code);
+
+		Map data(from, false);
+		code(data.data(), data.size(), NULL);
+	}
 #endif
 
+	void Folder::View(const std::string& path, const Functor<void(const void*, size_t, const void*)>& code) const {
+		Open(path, fun([&](std::streambuf& data, size_t length, const void* flag) {
+			std::string buffer(length + 0x10, '\0');
+			_assert(data.sgetn(&buffer[0], length) == length);
+			code(buffer.data(), length, flag);
+			}));
+	}
+
 	SubFolder::SubFolder(Folder& parent, const std::string& path) :
 		parent_(parent),
 		path_(path)
@@ -2297,6 +2522,10 @@ namespace ldid {
 		return parent_.Open(path_ + path, code);
 	}
 
+	void SubFolder::View(const std::string& path, const Functor<void(const void*, size_t, const void*)>& code) const {
+		return parent_.View(path_ + path, code);
+	}
+
 	void SubFolder::Find(const std::string& path, const Functor<void(const std::string&)>& code, const Functor<void(const std::string&, const Functor<std::string()>&)>& link) const {
 		return parent_.Find(path_ + path, code, link);
 	}
@@ -2341,6 +2570,13 @@ namespace ldid {
 		code(data, length, entry.flag_);
 	}
 
+	void UnionFolder::View(const std::string& path, const Functor<void(const void*, size_t, const void*)>& code) const {
+		auto file(resets_.find(path));
+		if (file == resets_.end())
+			return parent_.View(Map(path), code);
+		return Folder::View(path, code);
+	}
+
 	void UnionFolder::Find(const std::string& path, const Functor<void(const std::string&)>& code, const Functor<void(const std::string&, const Functor<std::string()>&)>& link) const {
 		for (auto& reset : resets_)
 			Map(path, code, reset.first, fun([&](const Functor<void(std::streambuf&, size_t, const void*)>& code) {
@@ -2451,11 +2687,184 @@ namespace ldid {
 		}
 	};
 
+	// The literal text every match of an extended regular expression must contain, so most paths can be
+	// classified (or rejected) without calling regexec. Only top-level literals are considered; anything
+	// inside groups, brackets or before a quantifier is left to the expression itself.
+	class Pattern {
+	private:
+		std::vector<std::string> literals_;
+		bool start_; // ^ anchored
+		bool end_; // $ anchored
+		bool prefix_; // literals_.front() begins the match
+		bool suffix_; // literals_.back() ends the match
+		bool exact_; // the literals (at most one) are the whole expression
+
+	public:
+		Pattern(const std::string& code) :
+			start_(false),
+			end_(false),
+			prefix_(false),
+			suffix_(false),
+			exact_(true)
+		{
+			std::string literal;
+			bool anchored(false);
+			bool last(false);
+			size_t atoms(0);
+
+			auto flush([&]() {
+				if (!literal.empty()) {
+					if (literals_.empty() && anchored)
+						prefix_ = true;
+					literals_.push_back(literal);
+					literal.clear();
+				}
+				last = false;
+			});
+
+			// skips a (possibly nested) group or bracket expression, returning the index just past it
+			auto skip([&](size_t i) -> size_t {
+				size_t depth(0);
+				for (; i != code.size(); ++i)
+					switch (code[i]) {
+					case '\\':
+						++i;
+						break;
+					case '[':
+						if (code[++i] == '^')
+							++i;
+						if (code[i] == ']')
+							++i;
+						while (code[i] != ']')
+							++i;
+						if (depth == 0)
+							return i + 1;
+						break;
+					case '(':
+						++depth;
+						break;
+					case ')':
+						if (--depth == 0)
+							return i + 1;
+						break;
+					}
+				_assert(false);
+				return i;
+			});
+
+			size_t i(0);
+			if (!code.empty() && code[0] == '^') {
+				start_ = true;
+				++i;
+			}
+
+			while (i != code.size()) {
+				char next(code[i]);
+				switch (next) {
+				case '\\':
+					_assert(i + 1 != code.size());
+					next = code[i + 1];
+					i += 2;
+					break;
+				case '.':
+					if (i + 2 == code.size() && code[i + 1] == '*') {
+						// a trailing .* matches anything, so it is the same as leaving the end unanchored
+						flush();
+						i += 2;
+						continue;
+					}
+				case '[':
+				case '(':
+					flush();
+					i = next == '.' ? i + 1 : skip(i);
+					exact_ = false;
+					++atoms;
+					continue;
+				case '*':
+				case '?':
+				case '{':
+					if (last)
+						literal.resize(literal.size() - 1);
+					flush();
+					i = next == '{' ? code.find('}', i) + 1 : i + 1;
+					exact_ = false;
+					continue;
+				case '+':
+					flush();
+					++i;
+					exact_ = false;
+					continue;
+				case '|':
+					// alternatives at the top level don't share any required text
+					literals_.clear();
+					prefix_ = false;
+					suffix_ = false;
+					exact_ = false;
+					return;
+				case '$':
+					if (i + 1 == code.size()) {
+						suffix_ = last;
+						end_ = true;
+						flush();
+						i++;
+						continue;
+					}
+				case '^':
+					flush();
+					++i;
+					exact_ = false;
+					++atoms;
+					continue;
+				default:
+					++i;
+					break;
+				}
+
+				if (literal.empty())
+					anchored = start_ && atoms == 0;
+				literal += next;
+				last = true;
+				++atoms;
+			}
+
+			flush();
+
+			if (exact_ && literals_.empty())
+				literals_.push_back("");
+		}
+
+		// Returns true or false when the literals decide the match, or -1 if the expression must be evaluated.
+		int operator ()(const std::string& data) const {
+			if (exact_) {
+				const std::string& literal(literals_.front());
+				if (start_ && end_)
+					return data == literal;
+				if (start_)
+					return Starts(data, literal);
+				if (end_)
+					return Ends(data, literal);
+				return data.find(literal) != std::string::npos;
+			}
+
+			if (prefix_ && !Starts(data, literals_.front()))
+				return false;
+			if (suffix_ && !Ends(data, literals_.back()))
+				return false;
+
+			for (const auto& literal : literals_)
+				if (data.find(literal) == std::string::npos)
+					return false;
+
+			return -1;
+		}
+	};
+
 	struct Rule {
 		unsigned weight_;
 		Mode mode_;
 		std::string code_;
 
+		mutable std::auto_ptr<Pattern> pattern_;
 		mutable std::auto_ptr<Expression> regex_;
 
 		Rule(unsigned weight, Mode mode, const std::string& code) :
@@ -2473,11 +2882,15 @@ namespace ldid {
 		}
 
 		void Compile() const {
+			pattern_.reset(new Pattern(code_));
 			regex_.reset(new Expression(code_));
 		}
 
 		bool operator ()(const std::string& data) const {
 			_assert(regex_.get() != NULL);
+			auto match((*pattern_)(data));
+			if (match != -1)
+				return match != 0;
 			return (*regex_)(data);
 		}
 
@@ -2496,21 +2909,75 @@ namespace ldid {
 		}
 	};
 
+	// the resource rules of CodeResources, keyed by the suffix of their files dictionary
+	static void Rules(std::map<std::string, std::multiset<Rule>>& versions, bool mac) {
+		auto& rules1(versions[""]);
+		auto& rules2(versions["2"]);
+
+		const std::string resources(mac ? "Resources\\" : "");
+
+		if (true) {
+			rules1.insert(Rule{ 1, NoMode, "^" + resources });
+			if (!mac) rules1.insert(Rule{ 10000, OmitMode, "^(Frameworks/[^/]+\\.framework/|PlugIns/[^/]+\\.appex/|PlugIns/[^/]+\\.appex/Frameworks/[^/]+\\.framework/|())SC_Info/[^/]+\\.(sinf|supf|supp)$" });
+			rules1.insert(Rule{ 1000, OptionalMode, "^" + resources + ".*\\.lproj/" });
+			rules1.insert(Rule{ 1100, OmitMode, "^" + resources + ".*\\.lproj/locversion.plist$" });
+			if (!mac) rules1.insert(Rule{ 10000, OmitMode, "^Watch/[^/]+\\.app/(Frameworks/[^/]+\\.framework/|PlugIns/[^/]+\\.appex/|PlugIns/[^/]+\\.appex/Frameworks/[^/]+\\.framework/)SC_Info/[^/]+\\.(sinf|supf|supp)$" });
+			rules1.insert(Rule{ 1, NoMode, "^version.plist$" });
+		}
+
+		if (true) {
+			rules2.insert(Rule{ 11, NoMode, ".*\\.dSYM($|/)" });
+			rules2.insert(Rule{ 20, NoMode, "^" + resources });
+			rules2.insert(Rule{ 2000, OmitMode, "^(.*/)?\\.DS_Store$" });
+			if (!mac) rules2.insert(Rule{ 10000, OmitMode, "^(Frameworks/[^/]+\\.framework/|PlugIns/[^/]+\\.appex/|PlugIns/[^/]+\\.appex/Frameworks/[^/]+\\.framework/|())SC_Info/[^/]+\\.(sinf|supf|supp)$" });
+			rules2.insert(Rule{ 10, NestedMode, "^(Frameworks|SharedFrameworks|PlugIns|Plug-ins|XPCServices|Helpers|MacOS|Library/(Automator|Spotlight|LoginItems))/" });
+			rules2.insert(Rule{ 1, NoMode, "^.*" });
+			rules2.insert(Rule{ 1000, OptionalMode, "^" + resources + ".*\\.lproj/" });
+			rules2.insert(Rule{ 1100, OmitMode, "^" + resources + ".*\\.lproj/locversion.plist$" });
+			rules2.insert(Rule{ 20, OmitMode, "^Info\\.plist$" });
+			rules2.insert(Rule{ 20, OmitMode, "^PkgInfo$" });
+			if (!mac) rules2.insert(Rule{ 10000, OmitMode, "^Watch/[^/]+\\.app/(Frameworks/[^/]+\\.framework/|PlugIns/[^/]+\\.appex/|PlugIns/[^/]+\\.appex/Frameworks/[^/]+\\.framework/)SC_Info/[^/]+\\.(sinf|supf|supp)$" });
+			rules2.insert(Rule{ 10, NestedMode, "^[^/]+$" });
+			rules2.insert(Rule{ 20, NoMode, "^embedded\\.provisionprofile$" });
+			rules2.insert(Rule{ 20, NoMode, "^version\\.plist$" });
+		}
+	}
+
+	size_t CheckRules(const std::vector<std::string>& paths, std::vector<std::pair<std::string, std::string>>& differences) {
+		std::map<std::string, std::multiset<Rule>> versions;
+		Rules(versions, false);
+
+		size_t decided(0);
+		for (const auto& version : versions)
+			for (const auto& rule : version.second) {
+				rule.Compile();
+				for (const auto& path : paths) {
+					if ((*rule.pattern_)(path) != -1)
+						++decided;
+					if (rule(path) != (*rule.regex_)(path))
+						differences.push_back(std::make_pair(rule.code_, path));
+				}
+			}
+
+		return decided;
+	}
+
 #ifndef LDID_NOPLIST
-	static Hash Sign(const uint8_t* prefix, size_t size, std::streambuf& buffer, Hash& hash, std::streambuf& save, const std::string& identifier, const std::string& entitlements, const std::string& requirement, const std::string& key, const Slots& slots, size_t length, const Functor<void(double)>& percent) {
-		// XXX: this is a miserable fail
-		std::stringbuf temp;
-		put(temp, prefix, size);
-		copy(buffer, temp, length - size, percent);
+	// Folder::View guarantees the zero bytes past the end of the file that this reads
+	static size_t Padded(size_t length) {
 		// XXX: this is a stupid hack
-		pad(temp, 0x10 - (length & 0xf));
-		auto data(temp.str());
+		return length + 0x10 - (length & 0xf);
+	}
 
+	static Hash Sign(const void* idata, size_t length, Hash& hash, std::streambuf& save, const std::string& identifier, const std::string& entitlements, const std::string& requirement, const SigningIdentity& identity, const Slots& slots, const Functor<void(double)>& percent) {
 		HashProxy proxy(hash, save);
-		return Sign(data.data(), data.size(), proxy, identifier, entitlements, requirement, key, slots, percent);
+		return Sign(idata, Padded(length), proxy, identifier, entitlements, requirement, identity, slots, percent);
 	}
 
-	Bundle Sign(const std::string& root, Folder& folder, const std::string& key, std::map<std::string, Hash>& remote, const std::string& requirement, const Functor<std::string(const std::string&, const std::string&)>& alter, const Functor<void(const std::string&)>& progress, const Functor<void(double)>& percent) {
+	Bundle Sign(const std::string& root, Folder& folder, const SigningIdentity& identity, std::map<std::string, Hash>& remote, const std::string& requirement, const Functor<std::string(const std::string&, const std::string&)>& alter, const Functor<void(const std::string&)>& progress, const Functor<void(double)>& percent) {
+		// whatever isn't timed more specifically below is spent reading, laying out and writing files
+		Timer timer(Timings::IO);
+
 		std::string executable;
 		std::string identifier;
 
@@ -2535,52 +3002,20 @@ namespace ldid {
 		}
 
 		std::string entitlements;
-		folder.Open(executable, fun([&](std::streambuf& buffer, size_t length, const void* flag) {
-			// XXX: this is a miserable fail
-			std::stringbuf temp;
-			copy(buffer, temp, length, percent);
-			// XXX: this is a stupid hack
-			pad(temp, 0x10 - (length & 0xf));
-			auto data(temp.str());
-			entitlements = alter(root, Analyze(data.data(), data.size()));
+		folder.View(executable, fun([&](const void* data, size_t length, const void* flag) {
+			entitlements = alter(root, Analyze(data, Padded(length)));
 			}));
 
 		static const std::string directory("_CodeSignature\\");
 		static const std::string signature(directory + "CodeResources");
 
 		std::map<std::string, std::multiset<Rule>> versions;
+		Rules(versions, mac);
 
 		auto& rules1(versions[""]);
-		auto& rules2(versions["2"]);
 
 		const std::string resources(mac ? "Resources\\" : "");
 
-		if (true) {
-			rules1.insert(Rule{ 1, NoMode, "^" + resources });
-			if (!mac) rules1.insert(Rule{ 10000, OmitMode, "^(Frameworks/[^/]+\\.framework/|PlugIns/[^/]+\\.appex/|PlugIns/[^/]+\\.appex/Frameworks/[^/]+\\.framework/|())SC_Info/[^/]+\\.(sinf|supf|supp)$" });
-			rules1.insert(Rule{ 1000, OptionalMode, "^" + resources + ".*\\.lproj/" });
-			rules1.insert(Rule{ 1100, OmitMode, "^" + resources + ".*\\.lproj/locversion.plist$" });
-			if (!mac) rules1.insert(Rule{ 10000, OmitMode, "^Watch/[^/]+\\.app/(Frameworks/[^/]+\\.framework/|PlugIns/[^/]+\\.appex/|PlugIns/[^/]+\\.appex/Frameworks/[^/]+\\.framework/)SC_Info/[^/]+\\.(sinf|supf|supp)$" });
-			rules1.insert(Rule{ 1, NoMode, "^version.plist$" });
-		}
-
-		if (true) {
-			rules2.insert(Rule{ 11, NoMode, ".*\\.dSYM($|/)" });
-			rules2.insert(Rule{ 20, NoMode, "^" + resources });
-			rules2.insert(Rule{ 2000, OmitMode, "^(.*/)?\\.DS_Store$" });
-			if (!mac) rules2.insert(Rule{ 10000, OmitMode, "^(Frameworks/[^/]+\\.framework/|PlugIns/[^/]+\\.appex/|PlugIns/[^/]+\\.appex/Frameworks/[^/]+\\.framework/|())SC_Info/[^/]+\\.(sinf|supf|supp)$" });
-			rules2.insert(Rule{ 10, NestedMode, "^(Frameworks|SharedFrameworks|PlugIns|Plug-ins|XPCServices|Helpers|MacOS|Library/(Automator|Spotlight|LoginItems))/" });
-			rules2.insert(Rule{ 1, NoMode, "^.*" });
-			rules2.insert(Rule{ 1000, OptionalMode, "^" + resources + ".*\\.lproj/" });
-			rules2.insert(Rule{ 1100, OmitMode, "^" + resources + ".*\\.lproj/locversion.plist$" });
-			rules2.insert(Rule{ 20, OmitMode, "^Info\\.plist$" });
-			rules2.insert(Rule{ 20, OmitMode, "^PkgInfo$" });
-			if (!mac) rules2.insert(Rule{ 10000, OmitMode, "^Watch/[^/]+\\.app/(Frameworks/[^/]+\\.framework/|PlugIns/[^/]+\\.appex/|PlugIns/[^/]+\\.appex/Frameworks/[^/]+\\.framework/)SC_Info/[^/]+\\.(sinf|supf|supp)$" });
-			rules2.insert(Rule{ 10, NestedMode, "^[^/]+$" });
-			rules2.insert(Rule{ 20, NoMode, "^embedded\\.provisionprofile$" });
-			rules2.insert(Rule{ 20, NoMode, "^version\\.plist$" });
-		}
-
 		std::map<std::string, Hash> local;
 
 		std::string failure(mac ? "Contents/|Versions/[^/]*/Resources/" : "");
@@ -2596,7 +3031,7 @@ namespace ldid {
 			bundle.resize(bundle.size() - resources.size());
 			SubFolder subfolder(folder, bundle);
 
-			bundles[nested[1]] = Sign(bundle, subfolder, key, local, "", Starts(name, "PlugIns\\") ? alter :
+			bundles[nested[1]] = Sign(bundle, subfolder, identity, local, "", Starts(name, "PlugIns\\") ? alter :
 				static_cast<const Functor<std::string(const std::string&, const std::string&)>&>(fun([&](const std::string&, const std::string& entitlements) -> std::string { return entitlements; }))
 				, progress, percent);
 			}), fun([&](const std::string& name, const Functor<std::string()>& read) {
@@ -2651,9 +3086,11 @@ namespace ldid {
 					case FAT_CIGAM:
 					case MH_MAGIC: case MH_MAGIC_64:
 					case MH_CIGAM: case MH_CIGAM_64:
-						folder.Save(name, true, flag, fun([&](std::streambuf& save) {
-							Slots slots;
-							Sign(header.bytes, size, data, hash, save, identifier, "", "", key, slots, length, percent);
+						folder.View(name, fun([&](const void* idata, size_t isize, const void*) {
+							folder.Save(name, true, flag, fun([&](std::streambuf& save) {
+								Slots slots;
+								Sign(idata, isize, hash, save, identifier, "", "", identity, slots, percent);
+								}));
 							}));
 						return;
 					}
@@ -2674,51 +3111,85 @@ namespace ldid {
 		auto plist(plist_new_dict());
 		_scope({ plist_free(plist); });
 
-		for (const auto& version : versions) {
-			auto files(plist_new_dict());
-			plist_dict_set_item(plist, ("files" + version.first).c_str(), files);
+		Timer timing(Timings::CodeResources);
 
+		for (const auto& version : versions)
 			for (const auto& rule : version.second)
 				rule.Compile();
 
+		// classify every file and link against all versions of the rules in one pass, keeping the
+		// highest weighted matching rule (or NULL) of each version
+		std::vector<const Rule*> matches;
+		matches.reserve((local.size() + links.size()) * versions.size());
+
+		auto classify([&](const std::string& name) {
+			for (const auto& version : versions) {
+				const Rule* match(NULL);
+				for (const auto& rule : version.second)
+					if (rule(name)) {
+						match = &rule;
+						break;
+					}
+				matches.push_back(match);
+			}
+		});
+
+		std::vector<std::string> paths;
+		paths.reserve(local.size());
+
+		for (const auto& hash : local) {
+			auto path = hash.first;
+			std::replace(path.begin(), path.end(), '\\', '/');
+			paths.push_back(path);
+			classify(hash.first);
+		}
+
+		for (const auto& link : links)
+			classify(link.first);
+
+		size_t index(0);
+		for (const auto& version : versions) {
+			auto files(plist_new_dict());
+			plist_dict_set_item(plist, ("files" + version.first).c_str(), files);
+
 			bool old(&version.second == &rules1);
 
+			size_t offset(index++);
+			auto path(paths.begin());
+
 			for (const auto& hash : local) {
-				auto path = hash.first;
-				std::replace(path.begin(), path.end(), '\\', '/');
+				const Rule* rule(matches[offset]);
+				offset += versions.size();
 
-				for (const auto& rule : version.second)
-					if (rule(hash.first)) {
-						if (!old && mac && excludes.find(hash.first) != excludes.end());
-						else if (old && rule.mode_ == NoMode)
-							plist_dict_set_item(files, path.c_str(), plist_new_data(reinterpret_cast<const char*>(hash.second.sha1_), sizeof(hash.second.sha1_)));
-						else if (rule.mode_ != OmitMode) {
-							auto entry(plist_new_dict());
-							plist_dict_set_item(entry, "hash", plist_new_data(reinterpret_cast<const char*>(hash.second.sha1_), sizeof(hash.second.sha1_)));
-							if (!old)
-								plist_dict_set_item(entry, "hash2", plist_new_data(reinterpret_cast<const char*>(hash.second.sha256_), sizeof(hash.second.sha256_)));
-							if (rule.mode_ == OptionalMode)
-								plist_dict_set_item(entry, "optional", plist_new_bool(true));
-							plist_dict_set_item(files, path.c_str(), entry);
-						}
+				const std::string& name(*path++);
 
-						break;
-					}
+				if (rule == NULL);
+				else if (!old && mac && excludes.find(hash.first) != excludes.end());
+				else if (old && rule->mode_ == NoMode)
+					plist_dict_set_item(files, name.c_str(), plist_new_data(reinterpret_cast<const char*>(hash.second.sha1_), sizeof(hash.second.sha1_)));
+				else if (rule->mode_ != OmitMode) {
+					auto entry(plist_new_dict());
+					plist_dict_set_item(entry, "hash", plist_new_data(reinterpret_cast<const char*>(hash.second.sha1_), sizeof(hash.second.sha1_)));
+					if (!old)
+						plist_dict_set_item(entry, "hash2", plist_new_data(reinterpret_cast<const char*>(hash.second.sha256_), sizeof(hash.second.sha256_)));
+					if (rule->mode_ == OptionalMode)
+						plist_dict_set_item(entry, "optional", plist_new_bool(true));
+					plist_dict_set_item(files, name.c_str(), entry);
+				}
 			}
 
-			for (const auto& link : links)
-				for (const auto& rule : version.second)
-					if (rule(link.first)) {
-						if (rule.mode_ != OmitMode) {
-							auto entry(plist_new_dict());
-							plist_dict_set_item(entry, "symlink", plist_new_string(link.second.c_str()));
-							if (rule.mode_ == OptionalMode)
-								plist_dict_set_item(entry, "optional", plist_new_bool(true));
-							plist_dict_set_item(files, link.first.c_str(), entry);
-						}
+			for (const auto& link : links) {
+				const Rule* rule(matches[offset]);
+				offset += versions.size();
 
-						break;
-					}
+				if (rule != NULL && rule->mode_ != OmitMode) {
+					auto entry(plist_new_dict());
+					plist_dict_set_item(entry, "symlink", plist_new_string(link.second.c_str()));
+					if (rule->mode_ == OptionalMode)
+						plist_dict_set_item(entry, "optional", plist_new_bool(true));
+					plist_dict_set_item(files, link.first.c_str(), entry);
+				}
+			}
 
 			if (!old && mac)
 				for (const auto& bundle : bundles) {
@@ -2767,12 +3238,16 @@ namespace ldid {
 						plist_dict_set_item(entry, "weight", plist_new_real(rule->weight_));
 				}
 		}
+		timing.Stop();
 
 		folder.Save(signature, true, NULL, fun([&](std::streambuf& save) {
 			HashProxy proxy(local[signature], save);
 			char* xml(NULL);
 			uint32_t size;
-			plist_to_xml(plist, &xml, &size);
+			{
+				Timer timer(Timings::CodeResources);
+				plist_to_xml(plist, &xml, &size);
+			}
 			_scope({ free(xml); });
 			put(proxy, xml, size);
 			}));
@@ -2780,13 +3255,13 @@ namespace ldid {
 		Bundle bundle;
 		bundle.path = executable;
 
-		folder.Open(executable, fun([&](std::streambuf& buffer, size_t length, const void* flag) {
+		folder.View(executable, fun([&](const void* data, size_t length, const void* flag) {
 			progress(root + executable);
 			folder.Save(executable, true, flag, fun([&](std::streambuf& save) {
 				Slots slots;
 				slots[1] = local.at(info);
 				slots[3] = local.at(signature);
-				bundle.hash = Sign(NULL, 0, buffer, local[executable], save, identifier, entitlements, requirement, key, slots, length, percent);
+				bundle.hash = Sign(data, length, local[executable], save, identifier, entitlements, requirement, identity, slots, percent);
 				}));
 			}));
 
@@ -2797,8 +3272,12 @@ namespace ldid {
 	}
 
 	Bundle Sign(const std::string& root, Folder& folder, const std::string& key, const std::string& requirement, const Functor<std::string(const std::string&, const std::string&)>& alter, const Functor<void(const std::string&)>& progress, const Functor<void(double)>& percent) {
+		return Sign(root, folder, SigningIdentity(key), requirement, alter, progress, percent);
+	}
+
+	Bundle Sign(const std::string& root, Folder& folder, const SigningIdentity& identity, const std::string& requirement, const Functor<std::string(const std::string&, const std::string&)>& alter, const Functor<void(const std::string&)>& progress, const Functor<void(double)>& percent) {
 		std::map<std::string, Hash> local;
-		return Sign(root, folder, key, local, requirement, alter, progress, percent);
+		return Sign(root, folder, identity, local, requirement, alter, progress, percent);
 	}
 #endif
 
@@ -3064,6 +3543,8 @@ int main(int argc, char* argv[]) {
 		exit(0);
 	}
 
+	ldid::SigningIdentity identity(key);
+
 	size_t filei(0), filee(0);
 	_foreach(file, files) try {
 		std::string path(file);
@@ -3075,7 +3556,7 @@ int main(int argc, char* argv[]) {
 #ifndef LDID_NOPLIST
 			_assert(!flag_r);
 			ldid::DiskFolder folder(path);
-			path += "\\" + Sign("", folder, key, requirement, ldid::fun([&](const std::string&, const std::string&) -> std::string { return entitlements; })
+			path += "\\" + Sign("", folder, identity, requirement, ldid::fun([&](const std::string&, const std::string&) -> std::string { return entitlements; })
 				, ldid::fun([&](const std::string&) {}), ldid::fun(dummy)
 			).path;
 #else
@@ -3093,7 +3574,7 @@ int main(int argc, char* argv[]) {
 				ldid::Unsign(input.data(), input.size(), output, ldid::fun(dummy));
 			else {
 				std::string identifier(flag_I ? : split.base.c_str());
-				ldid::Sign(input.data(), input.size(), output, identifier, entitlements, requirement, key, slots, ldid::fun(dummy));
+				ldid::Sign(input.data(), input.size(), output, identifier, entitlements, requirement, identity, slots, ldid::fun(dummy));
 			}
 
 			Commit(path, temp);
@@ -1,14 +1,20 @@
 #ifndef LDID_HPP
 #define LDID_HPP
 
+#include <atomic>
+#include <cstdint>
 #include <cstdlib>
 #include <map>
+#include <memory>
 #include <set>
 #include <sstream>
 #include <streambuf>
 #include <string>
+#include <utility>
 #include <vector>
 
+struct x509_st;
+
 namespace ldid {
 
 // I wish Apple cared about providing quality toolchains :/
@@ -54,6 +60,10 @@ class __declspec(dllexport) Folder {
     virtual bool Look(const std::string &path) const = 0;
     virtual void Open(const std::string &path, const Functor<void (std::streambuf &, size_t, const void *)> &code) const = 0;
     virtual void Find(const std::string &path, const Functor<void (const std::string &)> &code, const Functor<void (const std::string &, const Functor<std::string ()> &)> &link) const = 0;
+
+    // Provides the whole file as one contiguous, read-only block, followed by at least 0x10 zero bytes.
+    // Folders that can map files override this; the default reads the file into memory through Open.
+    virtual void View(const std::string &path, const Functor<void (const void *, size_t, const void *)> &code) const;
 };
 
 class __declspec(dllexport) DiskFolder :
@@ -77,6 +87,7 @@ class __declspec(dllexport) DiskFolder :
     virtual bool Look(const std::string &path) const;
     virtual void Open(const std::string &path, const Functor<void (std::streambuf &, size_t, const void *)> &code) const;
     virtual void Find(const std::string &path, const Functor<void (const std::string &)> &code, const Functor<void (const std::string &, const Functor<std::string ()> &)> &link) const;
+    virtual void View(const std::string &path, const Functor<void (const void *, size_t, const void *)> &code) const;
 };
 
 class __declspec(dllexport) SubFolder :
@@ -93,6 +104,7 @@ class __declspec(dllexport) SubFolder :
     virtual bool Look(const std::string &path) const;
     virtual void Open(const std::string &path, const Functor<void (std::streambuf &, size_t, const void *)> &code) const;
     virtual void Find(const std::string &path, const Functor<void (const std::string &)> &code, const Functor<void (const std::string &, const Functor<std::string ()> &)> &link) const;
+    virtual void View(const std::string &path, const Functor<void (const void *, size_t, const void *)> &code) const;
 };
 
 class __declspec(dllexport) UnionFolder :
@@ -120,6 +132,7 @@ class __declspec(dllexport) UnionFolder :
     virtual bool Look(const std::string &path) const;
     virtual void Open(const std::string &path, const Functor<void (std::streambuf &, size_t, const void *)> &code) const;
     virtual void Find(const std::string &path, const Functor<void (const std::string &)> &code, const Functor<void (const std::string &, const Functor<std::string ()> &)> &link) const;
+    virtual void View(const std::string &path, const Functor<void (const void *, size_t, const void *)> &code) const;
 
     void operator ()(const std::string &from) {
         deletes_.insert(from);
@@ -148,13 +161,75 @@ struct __declspec(dllexport) Bundle {
     Hash hash;
 };
 
+// Decodes a PKCS#12 signing key once, so it can be reused for every binary (and every app) signed with it.
+// A default constructed or empty-keyed identity produces ad-hoc signatures.
+class __declspec(dllexport) SigningIdentity {
+  public:
+    struct Contents;
+
+  private:
+    std::shared_ptr<Contents> contents_;
+
+  public:
+    SigningIdentity();
+    explicit SigningIdentity(const std::string &key);
+
+    // Appends a PEM encoded certificate to the chain embedded in each signature.
+    void AddCertificate(const std::string &certificate);
+
+    bool empty() const;
+    x509_st *Certificate() const;
+    const std::string &Team() const;
+
+    const Contents &operator *() const {
+        return *contents_;
+    }
+};
+
 __declspec(dllexport) Bundle Sign(const std::string &root, Folder &folder, const std::string &key, const std::string &requirement, const Functor<std::string (const std::string &, const std::string &)> &alter, const Functor<void (const std::string &)> &progress, const Functor<void (double)> &percent);
+__declspec(dllexport) Bundle Sign(const std::string &root, Folder &folder, const SigningIdentity &identity, const std::string &requirement, const Functor<std::string (const std::string &, const std::string &)> &alter, const Functor<void (const std::string &)> &progress, const Functor<void (double)> &percent);
 
 typedef std::map<uint32_t, Hash> Slots;
 
 Hash Sign(const void *idata, size_t isize, std::streambuf &output, const std::string &identifier, const std::string &entitlements, const std::string &requirement, const std::string &key, const Slots &slots, const Functor<void (double)> &percent);
+Hash Sign(const void *idata, size_t isize, std::streambuf &output, const std::string &identifier, const std::string &entitlements, const std::string &requirement, const SigningIdentity &identity, const Slots &slots, const Functor<void (double)> &percent);
 
 __declspec(dllexport) std::string Entitlements(std::string path);
+
+// Accumulates how long signing spends in each phase, for benchmarking. Phases never overlap on one thread,
+// but the slices of fat binaries are signed on threads of their own, so the sum can exceed the elapsed time.
+struct __declspec(dllexport) Timings {
+    enum Phase {
+        IO,
+        PageHashing,
+        ResourceHashing,
+        CodeResources,
+        CMS,
+        Phases
+    };
+
+    std::atomic<uint64_t> nanoseconds_[Phases];
+
+    Timings() {
+        for (auto &nanoseconds : nanoseconds_)
+            nanoseconds = 0;
+    }
+
+    double operator [](Phase phase) const {
+        return nanoseconds_[phase] / 1e9;
+    }
+};
+
+// Starts accumulating into timings, or stops timing altogether when passed NULL.
+__declspec(dllexport) void Time(Timings *timings);
+
+// Signs the slices of fat binaries on threads of their own (the default), or one after another when passed false.
+__declspec(dllexport) void Concurrent(bool concurrent);
+
+// Matches every path against each CodeResources rule of an iOS bundle twice: as signing does, where the rule's literal
+// text decides most paths, and with regexec alone. Adds the rule and path of every disagreement to differences and
+// returns how many of the matches the literals decided.
+__declspec(dllexport) size_t CheckRules(const std::vector<std::string> &paths, std::vector<std::pair<std::string, std::string>> &differences);
 }
 
 #endif//LDID_HPP
@@ -0,0 +1,728 @@
+/* ldid_bench - signs synthetic app bundles with ldid and reports where the time goes
+ *
+ * Generates a bundle shaped like the apps AltServer signs (a main executable, optionally fat, nested frameworks and
+ * app extensions, lots of resource files and a set of entitlements), signs it with a throwaway certificate (or a
+ * PKCS#12 key passed with --key, or ad-hoc with --adhoc) and prints the per-phase timings of each run as JSON.
+ *
+ * With --pages, it instead measures the throughput of every page hashing implementation the CPU supports on that
+ * many 4KB pages, and checks that they all produce the same hashes as OpenSSL.
+ *
+ * With --check-slices, it signs two copies of the bundle ad-hoc, one with the slices of its fat executable signed one
+ * after another and one with them signed concurrently, and fails unless both come out byte for byte the same.
+ *
+ * With --check-rules, it generates that many bundle paths and fails if any CodeResources rule classifies one of them
+ * differently through its literal text than through its regular expression.
+ *
+ *   ldid_bench [--binary-size bytes] [--slices count] [--frameworks count] [--framework-size bytes]
+ *              [--extensions count] [--resources count] [--resource-size bytes] [--entitlements count]
+ *              [--iterations count] [--key path.p12 | --adhoc] [--directory path] [--output path.json] [--keep]
+ *   ldid_bench --pages count [--iterations count] [--output path.json]
+ *   ldid_bench --check-slices [--binary-size bytes] [--slices count] [--directory path] [--keep]
+ *   ldid_bench --check-rules count
+*/
+
+#define NOMINMAX
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <openssl/pkcs12.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include "ldid.hpp"
+#include "pagehash.h"
+
+namespace fs = std::filesystem;
+
+struct Options {
+	size_t binarySize = 8 << 20;
+	size_t slices = 1;
+	size_t frameworks = 4;
+	size_t frameworkSize = 1 << 20;
+	size_t extensions = 2;
+	size_t resources = 2000;
+	size_t resourceSize = 4096;
+	size_t entitlements = 8;
+	size_t iterations = 3;
+	size_t pages = 0;
+	bool checkSlices = false;
+	size_t checkRules = 0;
+
+	std::string key;
+	bool adhoc = false;
+
+	fs::path directory = fs::temp_directory_path() / "ldid_bench";
+	std::string output;
+	bool keep = false;
+};
+
+static const char* Team = "BENCHTEAM1";
+
+static const char* PhaseNames[ldid::Timings::Phases] = {
+	"io",
+	"page_hashing",
+	"resource_hashing",
+	"code_resources",
+	"cms",
+};
+
+struct Run {
+	double generate;
+	double total;
+	double phases[ldid::Timings::Phases];
+};
+
+static void Fill(std::vector<uint8_t>& data, size_t offset, std::mt19937_64& random) {
+	for (; offset < data.size(); ++offset)
+		data[offset] = uint8_t(random());
+}
+
+template <typename Type_>
+static void Append(std::vector<uint8_t>& data, Type_ value) {
+	auto bytes(reinterpret_cast<const uint8_t*>(&value));
+	data.insert(data.end(), bytes, bytes + sizeof(value));
+}
+
+template <typename Type_>
+static void AppendBig(std::vector<uint8_t>& data, Type_ value) {
+	for (size_t shift(sizeof(value) * 8); shift != 0; shift -= 8)
+		data.push_back(uint8_t(uint64_t(value) >> (shift - 8)));
+}
+
+static void AppendSegment(std::vector<uint8_t>& data, const char* name, uint64_t address, uint64_t size, uint64_t offset, uint64_t length) {
+	char segment[16] = {};
+	strncpy(segment, name, sizeof(segment));
+
+	Append<uint32_t>(data, 0x19); // LC_SEGMENT_64
+	Append<uint32_t>(data, 72);
+	data.insert(data.end(), segment, segment + sizeof(segment));
+	Append<uint64_t>(data, address);
+	Append<uint64_t>(data, size);
+	Append<uint64_t>(data, offset);
+	Append<uint64_t>(data, length);
+	Append<int32_t>(data, 5);
+	Append<int32_t>(data, 5);
+	Append<uint32_t>(data, 0);
+	Append<uint32_t>(data, 0);
+}
+
+// A minimal arm64 executable: __PAGEZERO, __TEXT and a trailing __LINKEDIT, which is all ldid needs to lay out a signature.
+static std::vector<uint8_t> MachO(size_t size, uint32_t subtype, std::mt19937_64& random) {
+	size_t text(std::max<size_t>(0x8000, (size - std::min<size_t>(size, 0x1000)) & ~size_t(0x3fff)));
+	size_t link(std::max<size_t>(0x1000, size > text ? size - text : 0));
+
+	std::vector<uint8_t> commands;
+	AppendSegment(commands, "__PAGEZERO", 0, 0x100000000, 0, 0);
+	AppendSegment(commands, "__TEXT", 0x100000000, text, 0, text);
+	AppendSegment(commands, "__LINKEDIT", 0x100000000 + text, (link + 0x3fff) & ~size_t(0x3fff), text, link);
+
+	Append<uint32_t>(commands, 0x2); // LC_SYMTAB
+	Append<uint32_t>(commands, 24);
+	Append<uint32_t>(commands, uint32_t(text));
+	Append<uint32_t>(commands, 0);
+	Append<uint32_t>(commands, uint32_t(text));
+	Append<uint32_t>(commands, uint32_t(link));
+
+	std::vector<uint8_t> data;
+	Append<uint32_t>(data, 0xfeedfacf); // MH_MAGIC_64
+	Append<uint32_t>(data, 0x0100000c); // CPU_TYPE_ARM64
+	Append<uint32_t>(data, subtype);
+	Append<uint32_t>(data, 2); // MH_EXECUTE
+	Append<uint32_t>(data, 4);
+	Append<uint32_t>(data, uint32_t(commands.size()));
+	Append<uint32_t>(data, 0);
+	Append<uint32_t>(data, 0);
+	data.insert(data.end(), commands.begin(), commands.end());
+
+	size_t header(data.size());
+	data.resize(text + link);
+	Fill(data, header, random);
+	return data;
+}
+
+// Wraps one arm64 slice per subtype (ARM64_ALL, ARM64_V8, ARM64E) in a fat binary.
+static std::vector<uint8_t> Binary(size_t size, size_t slices, std::mt19937_64& random) {
+	if (slices <= 1)
+		return MachO(size, 0, random);
+
+	std::vector<std::vector<uint8_t>> thins;
+	for (uint32_t subtype(0); subtype != slices; ++subtype)
+		thins.push_back(MachO(size / slices, subtype, random));
+
+	std::vector<uint8_t> data;
+	AppendBig<uint32_t>(data, 0xcafebabe);
+	AppendBig<uint32_t>(data, uint32_t(thins.size()));
+
+	size_t offset(0x4000);
+	std::vector<size_t> offsets;
+	for (const auto& thin : thins) {
+		AppendBig<uint32_t>(data, 0x0100000c);
+		AppendBig<uint32_t>(data, uint32_t(offsets.size()));
+		AppendBig<uint32_t>(data, uint32_t(offset));
+		AppendBig<uint32_t>(data, uint32_t(thin.size()));
+		AppendBig<uint32_t>(data, 14);
+		offsets.push_back(offset);
+		offset = (offset + thin.size() + 0x3fff) & ~size_t(0x3fff);
+	}
+
+	for (size_t index(0); index != thins.size(); ++index) {
+		data.resize(offsets[index]);
+		data.insert(data.end(), thins[index].begin(), thins[index].end());
+	}
+
+	return data;
+}
+
+static void Write(const fs::path& path, const void* data, size_t size) {
+	fs::create_directories(path.parent_path());
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write(static_cast<const char*>(data), size);
+	if (!file)
+		throw std::runtime_error("Could not write " + path.string());
+}
+
+static void Write(const fs::path& path, const std::string& data) {
+	Write(path, data.data(), data.size());
+}
+
+static void Write(const fs::path& path, const std::vector<uint8_t>& data) {
+	Write(path, data.data(), data.size());
+}
+
+static std::string InfoPlist(const std::string& executable, const std::string& identifier, const std::string& type) {
+	std::ostringstream plist;
+	plist << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+	plist << "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n";
+	plist << "<plist version=\"1.0\">\n<dict>\n";
+	plist << "\t<key>CFBundleExecutable</key>\n\t<string>" << executable << "</string>\n";
+	plist << "\t<key>CFBundleIdentifier</key>\n\t<string>" << identifier << "</string>\n";
+	plist << "\t<key>CFBundlePackageType</key>\n\t<string>" << type << "</string>\n";
+	plist << "\t<key>CFBundleShortVersionString</key>\n\t<string>1.0</string>\n";
+	plist << "\t<key>CFBundleVersion</key>\n\t<string>1</string>\n";
+	plist << "</dict>\n</plist>\n";
+	return plist.str();
+}
+
+static std::string Entitlements(const std::string& identifier, size_t count) {
+	std::ostringstream plist;
+	plist << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+	plist << "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n";
+	plist << "<plist version=\"1.0\">\n<dict>\n";
+	plist << "\t<key>application-identifier</key>\n\t<string>" << Team << "." << identifier << "</string>\n";
+	plist << "\t<key>com.apple.developer.team-identifier</key>\n\t<string>" << Team << "</string>\n";
+	plist << "\t<key>get-task-allow</key>\n\t<true/>\n";
+	plist << "\t<key>keychain-access-groups</key>\n\t<array>\n\t\t<string>" << Team << ".*</string>\n\t</array>\n";
+	for (size_t index(4); index < count; ++index)
+		plist << "\t<key>com.example.ldid-bench.entitlement-" << index << "</key>\n\t<true/>\n";
+	plist << "</dict>\n</plist>\n";
+	return plist.str();
+}
+
+// Returns the number of files and bytes written.
+static std::pair<size_t, size_t> Generate(const Options& options, const fs::path& bundle) {
+	std::mt19937_64 random(0x6c646964);
+	std::pair<size_t, size_t> total(0, 0);
+
+	auto write([&](const fs::path& path, const std::vector<uint8_t>& data) {
+		Write(path, data);
+		++total.first;
+		total.second += data.size();
+	});
+
+	auto info([&](const fs::path& directory, const std::string& executable, const std::string& identifier, const std::string& type) {
+		auto plist(InfoPlist(executable, identifier, type));
+		write(directory / "Info.plist", std::vector<uint8_t>(plist.begin(), plist.end()));
+	});
+
+	info(bundle, "Bench", "com.example.ldid-bench", "APPL");
+	write(bundle / "Bench", Binary(options.binarySize, options.slices, random));
+
+	for (size_t index(0); index != options.frameworks; ++index) {
+		auto name("Bench" + std::to_string(index));
+		auto framework(bundle / "Frameworks" / (name + ".framework"));
+		info(framework, name, "com.example.ldid-bench.framework" + std::to_string(index), "FMWK");
+		write(framework / name, MachO(options.frameworkSize, 0, random));
+	}
+
+	for (size_t index(0); index != options.extensions; ++index) {
+		auto name("BenchExtension" + std::to_string(index));
+		auto extension(bundle / "PlugIns" / (name + ".appex"));
+		info(extension, name, "com.example.ldid-bench.extension" + std::to_string(index), "XPC!");
+		write(extension / name, MachO(std::max<size_t>(options.binarySize / 8, 0x10000), 0, random));
+	}
+
+	// spread resources over directories of a hundred files, every tenth of them localized
+	for (size_t index(0); index != options.resources; ++index) {
+		auto group(index / 100);
+		auto directory(group % 10 == 9 ? "Language" + std::to_string(group) + ".lproj" : "Assets" + std::to_string(group));
+
+		std::vector<uint8_t> data(options.resourceSize);
+		Fill(data, 0, random);
+		write(bundle / directory / ("Resource" + std::to_string(index) + ".dat"), data);
+	}
+
+	return total;
+}
+
+// Creates a self-signed certificate like the ones Apple issues developers, with the team as its organizational unit.
+static std::string TestKey() {
+	auto exponent(BN_new());
+	BN_set_word(exponent, RSA_F4);
+
+	auto rsa(RSA_new());
+	if (RSA_generate_key_ex(rsa, 2048, exponent, NULL) != 1)
+		throw std::runtime_error("Could not generate a test key.");
+	BN_free(exponent);
+
+	auto key(EVP_PKEY_new());
+	EVP_PKEY_assign_RSA(key, rsa);
+
+	auto certificate(X509_new());
+	X509_set_version(certificate, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+	X509_gmtime_adj(X509_get_notBefore(certificate), 0);
+	X509_gmtime_adj(X509_get_notAfter(certificate), 60 * 60 * 24);
+	X509_set_pubkey(certificate, key);
+
+	auto name(X509_get_subject_name(certificate));
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("iPhone Developer: ldid_bench"), -1, -1, 0);
+	X509_NAME_add_entry_by_txt(name, "OU", MBSTRING_ASC, reinterpret_cast<const unsigned char*>(Team), -1, -1, 0);
+	X509_NAME_add_entry_by_txt(name, "O", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("ldid_bench"), -1, -1, 0);
+	X509_set_issuer_name(certificate, name);
+
+	if (X509_sign(certificate, key, EVP_sha256()) == 0)
+		throw std::runtime_error("Could not sign the test certificate.");
+
+	auto p12(PKCS12_create(const_cast<char*>(""), const_cast<char*>("ldid_bench"), key, certificate, NULL, 0, 0, 0, 0, 0));
+	if (p12 == NULL)
+		throw std::runtime_error("Could not export the test key.");
+
+	unsigned char* data(NULL);
+	int size(i2d_PKCS12(p12, &data));
+	std::string value(reinterpret_cast<char*>(data), size);
+
+	OPENSSL_free(data);
+	PKCS12_free(p12);
+	X509_free(certificate);
+	EVP_PKEY_free(key);
+
+	return value;
+}
+
+static std::string ReadFile(const std::string& path) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		throw std::runtime_error("Could not read " + path);
+
+	std::ostringstream data;
+	data << file.rdbuf();
+	return data.str();
+}
+
+static void Usage() {
+	std::cerr << "usage: ldid_bench [--binary-size bytes] [--slices count] [--frameworks count] [--framework-size bytes]" << std::endl;
+	std::cerr << "                  [--extensions count] [--resources count] [--resource-size bytes] [--entitlements count]" << std::endl;
+	std::cerr << "                  [--iterations count] [--key path.p12 | --adhoc] [--directory path] [--output path.json] [--keep]" << std::endl;
+	std::cerr << "       ldid_bench --pages count [--iterations count] [--output path.json]" << std::endl;
+	std::cerr << "       ldid_bench --check-slices [--binary-size bytes] [--slices count] [--directory path] [--keep]" << std::endl;
+	std::cerr << "       ldid_bench --check-rules count" << std::endl;
+}
+
+static Options Parse(int argc, char* argv[]) {
+	Options options;
+
+	for (int index(1); index < argc; ++index) {
+		std::string argument(argv[index]);
+
+		if (argument == "--adhoc") {
+			options.adhoc = true;
+			continue;
+		}
+
+		if (argument == "--keep") {
+			options.keep = true;
+			continue;
+		}
+
+		if (argument == "--check-slices") {
+			options.checkSlices = true;
+			continue;
+		}
+
+		if (index + 1 == argc)
+			throw std::invalid_argument("Missing value for " + argument);
+		std::string value(argv[++index]);
+
+		auto number([&]() -> size_t {
+			return std::stoull(value, nullptr, 0);
+		});
+
+		if (argument == "--binary-size")
+			options.binarySize = number();
+		else if (argument == "--slices")
+			options.slices = number();
+		else if (argument == "--frameworks")
+			options.frameworks = number();
+		else if (argument == "--framework-size")
+			options.frameworkSize = number();
+		else if (argument == "--extensions")
+			options.extensions = number();
+		else if (argument == "--resources")
+			options.resources = number();
+		else if (argument == "--resource-size")
+			options.resourceSize = number();
+		else if (argument == "--entitlements")
+			options.entitlements = number();
+		else if (argument == "--iterations")
+			options.iterations = number();
+		else if (argument == "--pages")
+			options.pages = number();
+		else if (argument == "--check-rules")
+			options.checkRules = number();
+		else if (argument == "--key")
+			options.key = value;
+		else if (argument == "--directory")
+			options.directory = value;
+		else if (argument == "--output")
+			options.output = value;
+		else
+			throw std::invalid_argument("Unknown option " + argument);
+	}
+
+	if (options.slices < 1 || options.slices > 3)
+		throw std::invalid_argument("--slices must be between 1 and 3");
+	if (options.iterations < 1)
+		throw std::invalid_argument("--iterations must be at least 1");
+	if (options.checkSlices && options.slices < 2)
+		throw std::invalid_argument("--check-slices needs --slices 2 or 3");
+
+	return options;
+}
+
+static bool Same(const ldid::PageHasher& hasher, const ldid::PageHasher& reference, const std::vector<const uint8_t*>& pages, size_t size) {
+	for (auto sha256 : {false, true}) {
+		auto digest(sha256 ? 32 : 20);
+		std::vector<uint8_t> expected(pages.size() * digest), actual(pages.size() * digest);
+		(sha256 ? reference.sha256_ : reference.sha1_)(expected.data(), pages.data(), pages.size(), size);
+		(sha256 ? hasher.sha256_ : hasher.sha1_)(actual.data(), pages.data(), pages.size(), size);
+		if (actual != expected)
+			return false;
+	}
+
+	return true;
+}
+
+// Measures how fast each page hashing implementation gets through the same pages, in MB/s.
+static std::string Pages(const Options& options) {
+	const size_t size(0x1000);
+
+	std::mt19937_64 random(0x6c646964);
+	std::vector<uint8_t> data((options.pages + 1) * size);
+	Fill(data, 0, random);
+
+	std::vector<const uint8_t*> pages;
+	for (size_t index(0); index != options.pages; ++index)
+		pages.push_back(data.data() + index * size);
+
+	auto hashers(ldid::PageHashers());
+	const auto& reference(*hashers.front());
+
+	std::ostringstream json;
+	json.precision(1);
+	json << std::fixed;
+
+	json << "{\n";
+	json << "  \"pages\": " << options.pages << ", \"selected\": \"" << ldid::GetPageHasher().name_ << "\",\n";
+	json << "  \"hashers\": [\n";
+
+	for (size_t index(0); index != hashers.size(); ++index) {
+		const auto& hasher(*hashers[index]);
+
+		// besides whole pages, check the tails of binaries, whose last page can have any size
+		bool exact(Same(hasher, reference, pages, size));
+		for (size_t tail : {0, 1, 55, 56, 63, 64, 65, 119, 120, 1000, 4095})
+			exact = exact && Same(hasher, reference, std::vector<const uint8_t*>(pages.begin(), pages.begin() + std::min<size_t>(pages.size(), 11)), tail);
+
+		json << "    {\"name\": \"" << hasher.name_ << "\", \"exact\": " << (exact ? "true" : "false");
+
+		for (auto sha256 : {false, true}) {
+			std::vector<uint8_t> hashes(pages.size() * 32);
+			double best(0);
+
+			for (size_t iteration(0); iteration != options.iterations; ++iteration) {
+				auto start(std::chrono::steady_clock::now());
+				(sha256 ? hasher.sha256_ : hasher.sha1_)(hashes.data(), pages.data(), pages.size(), size);
+				auto seconds(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+				best = std::max(best, pages.size() * size / seconds / 1e6);
+			}
+
+			json << ", \"" << (sha256 ? "sha256" : "sha1") << "\": " << best;
+		}
+
+		json << "}" << (index + 1 != hashers.size() ? "," : "") << "\n";
+	}
+
+	json << "  ]\n}\n";
+	return json.str();
+}
+
+// Lists every file below directory with its contents, by path relative to it.
+static std::map<std::string, std::string> Contents(const fs::path& directory) {
+	std::map<std::string, std::string> contents;
+	for (const auto& entry : fs::recursive_directory_iterator(directory))
+		if (entry.is_regular_file())
+			contents[fs::relative(entry.path(), directory).generic_string()] = ReadFile(entry.path().string());
+	return contents;
+}
+
+// Signs the same bundle with the slices signed one after another and concurrently, and compares the results.
+static bool Slices(const Options& options) {
+	fs::remove_all(options.directory);
+
+	auto entitlements(Entitlements("com.example.ldid-bench", options.entitlements));
+	std::map<std::string, std::string> signatures[2];
+	for (auto concurrent : {false, true}) {
+		auto bundle(options.directory / (concurrent ? "Concurrent" : "Serial") / "Bench.app");
+		Generate(options, bundle);
+
+		ldid::Concurrent(concurrent);
+		auto start(std::chrono::steady_clock::now());
+		{
+			ldid::DiskFolder folder(bundle.string());
+			ldid::Sign("", folder, ldid::SigningIdentity(), "", ldid::fun([&](const std::string&, const std::string&) -> std::string {
+				return entitlements;
+			}), ldid::fun([](const std::string&) {}), ldid::fun([](double) {}));
+		}
+		auto seconds(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+		ldid::Concurrent(true);
+
+		std::cerr << (concurrent ? "concurrent" : "serial") << ": " << seconds << "s" << std::endl;
+		signatures[concurrent] = Contents(bundle);
+	}
+
+	if (!options.keep)
+		fs::remove_all(options.directory);
+
+	bool same(signatures[0].size() == signatures[1].size());
+	for (const auto& file : signatures[0]) {
+		auto other(signatures[1].find(file.first));
+		if (other == signatures[1].end() || other->second != file.second) {
+			std::cerr << file.first << " differs" << std::endl;
+			same = false;
+		}
+	}
+
+	std::cerr << signatures[0].size() << " files " << (same ? "identical" : "differ") << std::endl;
+	return same;
+}
+
+// Builds paths out of the names the rules look for, with now and then a character dropped, doubled or replaced, so
+// that both the literal text of the rules and what surrounds it are exercised.
+static std::vector<std::string> Paths(size_t count) {
+	static const char* names[] = {
+		"Frameworks", "SharedFrameworks", "PlugIns", "Plug-ins", "XPCServices", "Helpers", "MacOS", "Library",
+		"Automator", "Spotlight", "LoginItems", "Watch", "Resources", "SC_Info", "_CodeSignature", "Bench.framework",
+		"Bench.appex", "Bench.app", "Bench.dSYM", "en.lproj", "Base.lproj", ".lproj", "locversion.plist", "version.plist",
+		"Info.plist", "PkgInfo", ".DS_Store", "embedded.provisionprofile", "CodeResources", "Bench.sinf", "Bench.supf",
+		"Bench.supp", "Bench", "Assets.car", "image.png", "framework", "appex", "dSYM", "plist", "",
+	};
+	static const char characters[] = "/.\\$^()[]|*+?abcz019 _-";
+
+	std::mt19937_64 random(0x6c646964);
+	std::vector<std::string> paths;
+	paths.reserve(count);
+
+	while (paths.size() != count) {
+		std::string path;
+		for (size_t depth(1 + random() % 5); depth != 0; --depth) {
+			if (!path.empty())
+				path += '/';
+			path += names[random() % (sizeof(names) / sizeof(names[0]))];
+		}
+
+		for (size_t edits(random() % 4 == 0 ? 1 + random() % 2 : 0); edits != 0 && !path.empty(); --edits) {
+			auto offset(random() % path.size());
+			switch (random() % 3) {
+			case 0:
+				path.erase(offset, 1);
+				break;
+			case 1:
+				path.insert(offset, 1, path[offset]);
+				break;
+			case 2:
+				path[offset] = characters[random() % (sizeof(characters) - 1)];
+				break;
+			}
+		}
+
+		paths.push_back(path);
+	}
+
+	return paths;
+}
+
+// Checks that the literal text of every rule agrees with its regular expression on generated paths.
+static bool Rules(const Options& options) {
+	auto paths(Paths(options.checkRules));
+
+	std::vector<std::pair<std::string, std::string>> differences;
+	auto decided(ldid::CheckRules(paths, differences));
+
+	for (size_t index(0); index != std::min<size_t>(differences.size(), 20); ++index)
+		std::cerr << differences[index].first << " disagrees on \"" << differences[index].second << "\"" << std::endl;
+
+	std::cerr << paths.size() << " paths, " << decided << " matches decided by literals, " << differences.size() << " differences" << std::endl;
+	return differences.empty();
+}
+
+static void Print(std::ostream& json, const Run& run) {
+	json << "{\"generate\": " << run.generate << ", \"total\": " << run.total;
+	for (size_t phase(0); phase != ldid::Timings::Phases; ++phase)
+		json << ", \"" << PhaseNames[phase] << "\": " << run.phases[phase];
+	json << "}";
+}
+
+int main(int argc, char* argv[]) {
+	Options options;
+
+	try {
+		options = Parse(argc, argv);
+	}
+	catch (std::exception& exception) {
+		std::cerr << exception.what() << std::endl;
+		Usage();
+		return 1;
+	}
+
+	try {
+		if (options.pages != 0) {
+			auto json(Pages(options));
+			if (options.output.empty())
+				std::cout << json;
+			else
+				Write(options.output, json);
+			return 0;
+		}
+
+		if (options.checkSlices)
+			return Slices(options) ? 0 : 1;
+
+		if (options.checkRules != 0)
+			return Rules(options) ? 0 : 1;
+
+		ldid::SigningIdentity identity;
+		if (!options.adhoc)
+			identity = ldid::SigningIdentity(options.key.empty() ? TestKey() : ReadFile(options.key));
+
+		auto bundle(options.directory / "Bench.app");
+		auto entitlements(Entitlements("com.example.ldid-bench", options.entitlements));
+
+		std::vector<Run> runs;
+		std::pair<size_t, size_t> generated;
+
+		for (size_t iteration(0); iteration != options.iterations; ++iteration) {
+			Run run = {};
+
+			// every run signs a fresh copy, so none of them has to replace an existing signature
+			fs::remove_all(options.directory);
+
+			auto start(std::chrono::steady_clock::now());
+			generated = Generate(options, bundle);
+			auto signing(std::chrono::steady_clock::now());
+			run.generate = std::chrono::duration<double>(signing - start).count();
+
+			ldid::Timings timings;
+			ldid::Time(&timings);
+
+			{
+				ldid::DiskFolder folder(bundle.string());
+				ldid::Sign("", folder, identity, "", ldid::fun([&](const std::string&, const std::string&) -> std::string {
+					return entitlements;
+				}), ldid::fun([](const std::string&) {}), ldid::fun([](double) {}));
+			}
+
+			ldid::Time(NULL);
+
+			run.total = std::chrono::duration<double>(std::chrono::steady_clock::now() - signing).count();
+			for (size_t phase(0); phase != ldid::Timings::Phases; ++phase)
+				run.phases[phase] = timings[ldid::Timings::Phase(phase)];
+
+			std::cerr << "run " << iteration + 1 << "/" << options.iterations << ": " << run.total << "s" << std::endl;
+			runs.push_back(run);
+		}
+
+		if (!options.keep)
+			fs::remove_all(options.directory);
+
+		Run mean = {};
+		Run best = runs.front();
+		for (const auto& run : runs) {
+			mean.generate += run.generate / runs.size();
+			mean.total += run.total / runs.size();
+			for (size_t phase(0); phase != ldid::Timings::Phases; ++phase)
+				mean.phases[phase] += run.phases[phase] / runs.size();
+
+			if (run.total < best.total)
+				best = run;
+		}
+
+		std::ostringstream json;
+		json.precision(6);
+		json << std::fixed;
+
+		json << "{\n";
+		json << "  \"configuration\": {\"binary_size\": " << options.binarySize << ", \"slices\": " << options.slices;
+		json << ", \"frameworks\": " << options.frameworks << ", \"framework_size\": " << options.frameworkSize;
+		json << ", \"extensions\": " << options.extensions << ", \"resources\": " << options.resources;
+		json << ", \"resource_size\": " << options.resourceSize << ", \"entitlements\": " << options.entitlements;
+		json << ", \"signature\": \"" << (options.adhoc ? "ad-hoc" : "certificate") << "\"},\n";
+		json << "  \"bundle\": {\"files\": " << generated.first << ", \"bytes\": " << generated.second << "},\n";
+
+		json << "  \"runs\": [\n";
+		for (size_t index(0); index != runs.size(); ++index) {
+			json << "    ";
+			Print(json, runs[index]);
+			json << (index + 1 != runs.size() ? "," : "") << "\n";
+		}
+		json << "  ],\n";
+
+		json << "  \"mean\": ";
+		Print(json, mean);
+		json << ",\n  \"best\": ";
+		Print(json, best);
+		json << "\n}\n";
+
+		if (options.output.empty())
+			std::cout << json.str();
+		else
+			Write(options.output, json.str());
+	}
+	catch (std::exception& exception) {
+		ldid::Time(NULL);
+		std::cerr << "ldid_bench: " << exception.what() << std::endl;
+		return 1;
+	}
+	catch (const char* message) {
+		// ldid's assertions
+		ldid::Time(NULL);
+		std::cerr << "ldid_bench: " << message << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,380 @@
+/* ldid - (Mach-O) Link-Loader Identity Editor
+ * Copyright (C) 2007-2015  Jay Freeman (saurik)
+*/
+
+/* GNU Affero General Public License, Version 3 {{{ */
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**/
+/* }}} */
+
+// Code directories hash every page of a binary on its own, so instead of hashing them one at a time, the AVX2
+// implementation runs eight of them through SHA-1 or SHA-256 at once, one per 32-bit lane of a ymm register.
+// OpenSSL's single buffer code already switches to the SHA extensions (SHA-NI or ARMv8) at runtime, and those
+// beat eight lanes of AVX2, so the multi-buffer code is only used on CPUs that have AVX2 but not them.
+
+#include <cstring>
+
+#include "pagehash.h"
+
+#ifdef __APPLE__
+#include <CommonCrypto/CommonDigest.h>
+
+#define LDID_SHA1_DIGEST_LENGTH CC_SHA1_DIGEST_LENGTH
+#define LDID_SHA1 CC_SHA1
+#define LDID_SHA256_DIGEST_LENGTH CC_SHA256_DIGEST_LENGTH
+#define LDID_SHA256 CC_SHA256
+#else
+#include <openssl/sha.h>
+
+#define LDID_SHA1_DIGEST_LENGTH SHA_DIGEST_LENGTH
+#define LDID_SHA1 SHA1
+#define LDID_SHA256_DIGEST_LENGTH SHA256_DIGEST_LENGTH
+#define LDID_SHA256 SHA256
+#endif
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define LDID_PAGEHASH_AVX2
+
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+#if defined(__clang__) || defined(__GNUC__)
+#define LDID_TARGET(features) __attribute__((target(features)))
+#else
+#define LDID_TARGET(features)
+#endif
+#endif
+
+namespace ldid {
+
+static void PortableSHA1(uint8_t *hashes, const uint8_t *const *pages, size_t count, size_t size) {
+	for (size_t i(0); i != count; ++i)
+		LDID_SHA1(pages[i], size, hashes + i * LDID_SHA1_DIGEST_LENGTH);
+}
+
+static void PortableSHA256(uint8_t *hashes, const uint8_t *const *pages, size_t count, size_t size) {
+	for (size_t i(0); i != count; ++i)
+		LDID_SHA256(pages[i], size, hashes + i * LDID_SHA256_DIGEST_LENGTH);
+}
+
+static const PageHasher Portable_ = {
+#ifdef __APPLE__
+	"commoncrypto",
+#else
+	"openssl",
+#endif
+	&PortableSHA1,
+	&PortableSHA256,
+};
+
+#ifdef LDID_PAGEHASH_AVX2
+static const size_t Lanes_(8);
+
+static void CPUID(int info[4], int leaf, int subleaf) {
+#ifdef _MSC_VER
+	__cpuidex(info, leaf, subleaf);
+#else
+	unsigned a, b, c, d;
+	__cpuid_count(leaf, subleaf, a, b, c, d);
+	info[0] = a;
+	info[1] = b;
+	info[2] = c;
+	info[3] = d;
+#endif
+}
+
+#ifdef _MSC_VER
+LDID_TARGET("xsave")
+#endif
+static uint64_t XCR0() {
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	uint32_t low, high;
+	__asm__ volatile ("xgetbv" : "=a" (low), "=d" (high) : "c" (0));
+	return (uint64_t(high) << 32) | low;
+#endif
+}
+
+struct Features {
+	bool avx2_;
+	bool sha_;
+
+	Features() :
+		avx2_(false),
+		sha_(false)
+	{
+		int info[4];
+		CPUID(info, 0, 0);
+		if (info[0] < 7)
+			return;
+
+		CPUID(info, 1, 0);
+		bool osxsave((info[2] & (1 << 27)) != 0);
+		bool avx((info[2] & (1 << 28)) != 0);
+
+		CPUID(info, 7, 0);
+		sha_ = (info[1] & (1 << 29)) != 0;
+
+		// the OS has to save the ymm registers across context switches too
+		if (osxsave && avx && (XCR0() & 0x6) == 0x6)
+			avx2_ = (info[1] & (1 << 5)) != 0;
+	}
+};
+
+static const Features &GetFeatures() {
+	static const Features features;
+	return features;
+}
+
+template <int Bits_>
+LDID_TARGET("avx2") static inline __m256i Rol(__m256i value) {
+	return _mm256_or_si256(_mm256_slli_epi32(value, Bits_), _mm256_srli_epi32(value, 32 - Bits_));
+}
+
+template <int Bits_>
+LDID_TARGET("avx2") static inline __m256i Ror(__m256i value) {
+	return _mm256_or_si256(_mm256_srli_epi32(value, Bits_), _mm256_slli_epi32(value, 32 - Bits_));
+}
+
+LDID_TARGET("avx2") static inline __m256i Add(__m256i lhs, __m256i rhs) {
+	return _mm256_add_epi32(lhs, rhs);
+}
+
+LDID_TARGET("avx2") static inline __m256i Xor(__m256i lhs, __m256i rhs) {
+	return _mm256_xor_si256(lhs, rhs);
+}
+
+// Loads eight consecutive big endian words from every lane, so that words[i] holds word i of each lane.
+LDID_TARGET("avx2") static inline void Load(__m256i words[8], const uint8_t *const lanes[Lanes_], size_t offset) {
+	__m256i rows[8];
+	for (size_t i(0); i != 8; ++i)
+		rows[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(lanes[i] + offset));
+
+	__m256i pairs[8];
+	for (size_t i(0); i != 8; i += 4) {
+		pairs[i + 0] = _mm256_unpacklo_epi32(rows[i + 0], rows[i + 1]);
+		pairs[i + 1] = _mm256_unpackhi_epi32(rows[i + 0], rows[i + 1]);
+		pairs[i + 2] = _mm256_unpacklo_epi32(rows[i + 2], rows[i + 3]);
+		pairs[i + 3] = _mm256_unpackhi_epi32(rows[i + 2], rows[i + 3]);
+	}
+
+	__m256i quads[8];
+	for (size_t i(0); i != 8; i += 4) {
+		quads[i + 0] = _mm256_unpacklo_epi64(pairs[i + 0], pairs[i + 2]);
+		quads[i + 1] = _mm256_unpackhi_epi64(pairs[i + 0], pairs[i + 2]);
+		quads[i + 2] = _mm256_unpacklo_epi64(pairs[i + 1], pairs[i + 3]);
+		quads[i + 3] = _mm256_unpackhi_epi64(pairs[i + 1], pairs[i + 3]);
+	}
+
+	const __m256i swap(_mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+	for (size_t i(0); i != 4; ++i) {
+		words[i + 0] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(quads[i], quads[i + 4], 0x20), swap);
+		words[i + 4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(quads[i], quads[i + 4], 0x31), swap);
+	}
+}
+
+LDID_TARGET("avx2") static inline void RoundSHA1(__m256i &a, __m256i &b, __m256i &c, __m256i &d, __m256i &e, __m256i f, __m256i k, __m256i w) {
+	__m256i temp(Add(Add(Rol<5>(a), f), Add(Add(e, k), w)));
+	e = d;
+	d = c;
+	c = Rol<30>(b);
+	b = a;
+	a = temp;
+}
+
+LDID_TARGET("avx2") static void BlocksSHA1(__m256i state[5], const uint8_t *const lanes[Lanes_], size_t blocks) {
+	for (size_t block(0); block != blocks; ++block) {
+		__m256i w[80];
+		Load(w + 0, lanes, block * 64);
+		Load(w + 8, lanes, block * 64 + 32);
+		for (size_t t(16); t != 80; ++t)
+			w[t] = Rol<1>(Xor(Xor(w[t - 3], w[t - 8]), Xor(w[t - 14], w[t - 16])));
+
+		__m256i a(state[0]), b(state[1]), c(state[2]), d(state[3]), e(state[4]);
+
+		const __m256i k0(_mm256_set1_epi32(0x5a827999));
+		for (size_t t(0); t != 20; ++t)
+			RoundSHA1(a, b, c, d, e, Xor(d, _mm256_and_si256(b, Xor(c, d))), k0, w[t]);
+
+		const __m256i k1(_mm256_set1_epi32(0x6ed9eba1));
+		for (size_t t(20); t != 40; ++t)
+			RoundSHA1(a, b, c, d, e, Xor(Xor(b, c), d), k1, w[t]);
+
+		const __m256i k2(_mm256_set1_epi32(0x8f1bbcdc));
+		for (size_t t(40); t != 60; ++t)
+			RoundSHA1(a, b, c, d, e, _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c))), k2, w[t]);
+
+		const __m256i k3(_mm256_set1_epi32(0xca62c1d6));
+		for (size_t t(60); t != 80; ++t)
+			RoundSHA1(a, b, c, d, e, Xor(Xor(b, c), d), k3, w[t]);
+
+		state[0] = Add(state[0], a);
+		state[1] = Add(state[1], b);
+		state[2] = Add(state[2], c);
+		state[3] = Add(state[3], d);
+		state[4] = Add(state[4], e);
+	}
+}
+
+static const uint32_t SHA256K_[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+LDID_TARGET("avx2") static void BlocksSHA256(__m256i state[8], const uint8_t *const lanes[Lanes_], size_t blocks) {
+	for (size_t block(0); block != blocks; ++block) {
+		__m256i w[64];
+		Load(w + 0, lanes, block * 64);
+		Load(w + 8, lanes, block * 64 + 32);
+		for (size_t t(16); t != 64; ++t) {
+			__m256i s0(Xor(Xor(Ror<7>(w[t - 15]), Ror<18>(w[t - 15])), _mm256_srli_epi32(w[t - 15], 3)));
+			__m256i s1(Xor(Xor(Ror<17>(w[t - 2]), Ror<19>(w[t - 2])), _mm256_srli_epi32(w[t - 2], 10)));
+			w[t] = Add(Add(w[t - 16], s0), Add(w[t - 7], s1));
+		}
+
+		__m256i a(state[0]), b(state[1]), c(state[2]), d(state[3]), e(state[4]), f(state[5]), g(state[6]), h(state[7]);
+
+		for (size_t t(0); t != 64; ++t) {
+			__m256i s1(Xor(Xor(Ror<6>(e), Ror<11>(e)), Ror<25>(e)));
+			__m256i ch(Xor(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g)));
+			__m256i temp1(Add(Add(h, s1), Add(Add(ch, _mm256_set1_epi32(SHA256K_[t])), w[t])));
+			__m256i s0(Xor(Xor(Ror<2>(a), Ror<13>(a)), Ror<22>(a)));
+			__m256i maj(_mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b))));
+			__m256i temp2(Add(s0, maj));
+
+			h = g;
+			g = f;
+			f = e;
+			e = Add(d, temp1);
+			d = c;
+			c = b;
+			b = a;
+			a = Add(temp1, temp2);
+		}
+
+		state[0] = Add(state[0], a);
+		state[1] = Add(state[1], b);
+		state[2] = Add(state[2], c);
+		state[3] = Add(state[3], d);
+		state[4] = Add(state[4], e);
+		state[5] = Add(state[5], f);
+		state[6] = Add(state[6], g);
+		state[7] = Add(state[7], h);
+	}
+}
+
+typedef void (*Blocks)(__m256i *state, const uint8_t *const lanes[Lanes_], size_t blocks);
+
+// Runs up to eight equally sized buffers through a Merkle-Damgard hash with 64 byte blocks and a big endian length,
+// padding each of them in a tail of their own; lanes past count repeat the first buffer and are thrown away.
+LDID_TARGET("avx2") static void Hash(uint8_t *hashes, const uint8_t *const *pages, size_t count, size_t size, const uint32_t *initial, size_t words, Blocks blocks) {
+	const uint8_t *lanes[Lanes_];
+	for (size_t i(0); i != Lanes_; ++i)
+		lanes[i] = pages[i < count ? i : 0];
+
+	__m256i state[8];
+	for (size_t i(0); i != words; ++i)
+		state[i] = _mm256_set1_epi32(initial[i]);
+
+	size_t full(size / 64);
+	blocks(state, lanes, full);
+
+	size_t rest(size % 64);
+	size_t extra(rest < 56 ? 1 : 2);
+
+	uint8_t tails[Lanes_][128];
+	const uint8_t *ends[Lanes_];
+	for (size_t i(0); i != Lanes_; ++i) {
+		uint8_t *tail(tails[i]);
+		memcpy(tail, lanes[i] + full * 64, rest);
+		tail[rest] = 0x80;
+		memset(tail + rest + 1, 0, extra * 64 - rest - 1);
+
+		uint64_t bits(uint64_t(size) * 8);
+		for (size_t j(0); j != 8; ++j)
+			tail[extra * 64 - 1 - j] = uint8_t(bits >> (j * 8));
+
+		ends[i] = tail;
+	}
+
+	blocks(state, ends, extra);
+
+	uint32_t values[8][Lanes_];
+	for (size_t i(0); i != words; ++i)
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(values[i]), state[i]);
+
+	for (size_t lane(0); lane != count; ++lane)
+		for (size_t i(0); i != words; ++i) {
+			uint8_t *hash(hashes + (lane * words + i) * 4);
+			hash[0] = uint8_t(values[i][lane] >> 24);
+			hash[1] = uint8_t(values[i][lane] >> 16);
+			hash[2] = uint8_t(values[i][lane] >> 8);
+			hash[3] = uint8_t(values[i][lane]);
+		}
+}
+
+static void AVX2SHA1(uint8_t *hashes, const uint8_t *const *pages, size_t count, size_t size) {
+	static const uint32_t initial[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+	for (size_t i(0); i < count; i += Lanes_)
+		Hash(hashes + i * LDID_SHA1_DIGEST_LENGTH, pages + i, count - i < Lanes_ ? count - i : Lanes_, size, initial, 5, &BlocksSHA1);
+}
+
+static void AVX2SHA256(uint8_t *hashes, const uint8_t *const *pages, size_t count, size_t size) {
+	static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+	for (size_t i(0); i < count; i += Lanes_)
+		Hash(hashes + i * LDID_SHA256_DIGEST_LENGTH, pages + i, count - i < Lanes_ ? count - i : Lanes_, size, initial, 8, &BlocksSHA256);
+}
+
+static const PageHasher AVX2_ = {
+	"avx2x8",
+	&AVX2SHA1,
+	&AVX2SHA256,
+};
+#endif
+
+std::vector<const PageHasher *> PageHashers() {
+	std::vector<const PageHasher *> hashers;
+	hashers.push_back(&Portable_);
+#ifdef LDID_PAGEHASH_AVX2
+	if (GetFeatures().avx2_)
+		hashers.push_back(&AVX2_);
+#endif
+	return hashers;
+}
+
+const PageHasher &GetPageHasher() {
+	static const PageHasher &hasher([]() -> const PageHasher & {
+#ifdef LDID_PAGEHASH_AVX2
+		auto &features(GetFeatures());
+		if (features.avx2_ && !features.sha_)
+			return AVX2_;
+#endif
+		return Portable_;
+	}());
+	return hasher;
+}
+
+}
@@ -0,0 +1,27 @@
+#ifndef LDID_PAGEHASH_H
+#define LDID_PAGEHASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ldid {
+
+// Hashes count buffers of size bytes each, writing their digests one after another to hashes.
+typedef void (*PagesHash)(uint8_t *hashes, const uint8_t *const *pages, size_t count, size_t size);
+
+struct PageHasher {
+    const char *name_;
+    PagesHash sha1_;
+    PagesHash sha256_;
+};
+
+// Every implementation this CPU can run, starting with the portable one (OpenSSL or CommonCrypto).
+std::vector<const PageHasher *> PageHashers();
+
+// The implementation code pages are hashed with, chosen once for this CPU.
+const PageHasher &GetPageHasher();
+
+}
+
+#endif//LDID_PAGEHASH_H
@@ -439,6 +439,47 @@ int socket_accept(int fd, uint16_t port)
 	return result;
 }
 
+/**
+ * Creates a pair of connected stream sockets, e.g. for waking up a thread
+ * that is blocked in select(). On Windows this is emulated with a loopback
+ * TCP connection.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+int socket_pair(int fds[2])
+{
+#ifdef WIN32
+	struct sockaddr_in saddr;
+	int addr_len = sizeof(saddr);
+	int lfd = socket_create(0);
+	if (lfd < 0) {
+		return -1;
+	}
+
+	if (getsockname(lfd, (struct sockaddr*)&saddr, &addr_len) != 0) {
+		socket_close(lfd);
+		return -1;
+	}
+
+	fds[0] = socket_connect("127.0.0.1", ntohs(saddr.sin_port));
+	if (fds[0] < 0) {
+		socket_close(lfd);
+		return -1;
+	}
+
+	fds[1] = socket_accept(lfd, ntohs(saddr.sin_port));
+	socket_close(lfd);
+	if (fds[1] < 0) {
+		socket_close(fds[0]);
+		return -1;
+	}
+
+	return 0;
+#else
+	return socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+#endif
+}
+
 int socket_shutdown(int fd, int how)
 {
 	return shutdown(fd, how);
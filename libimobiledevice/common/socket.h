@@ -49,6 +49,7 @@ int socket_create(uint16_t port);
 int socket_connect(const char *addr, uint16_t port);
 int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout);
 int socket_accept(int fd, uint16_t port);
+int socket_pair(int fds[2]);
 
 int socket_shutdown(int fd, int how);
 int socket_close(int fd);
@@ -26,6 +26,7 @@
 #include <windows.h>
 typedef HANDLE thread_t;
 typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
 typedef volatile struct {
 	LONG lock;
 	int state;
@@ -36,6 +37,7 @@ typedef volatile struct {
 #include <pthread.h>
 typedef pthread_t thread_t;
 typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
 typedef pthread_once_t thread_once_t;
 #define THREAD_ONCE_INIT PTHREAD_ONCE_INIT
 #define THREAD_ID pthread_self()
@@ -45,6 +47,7 @@ typedef void* (*thread_func_t)(void* data);
 
 int thread_new(thread_t* thread, thread_func_t thread_func, void* data);
 void thread_free(thread_t thread);
+void thread_detach(thread_t thread);
 void thread_join(thread_t thread);
 
 void mutex_init(mutex_t* mutex);
@@ -52,6 +55,12 @@ void mutex_destroy(mutex_t* mutex);
 void mutex_lock(mutex_t* mutex);
 void mutex_unlock(mutex_t* mutex);
 
+void cond_init(cond_t* cond);
+void cond_destroy(cond_t* cond);
+void cond_broadcast(cond_t* cond);
+void cond_wait(cond_t* cond, mutex_t* mutex);
+int cond_wait_timeout(cond_t* cond, mutex_t* mutex, unsigned int timeout_ms);
+
 void thread_once(thread_once_t *once_control, void (*init_routine)(void));
 
 #endif
@@ -53,6 +53,7 @@
 #include <libgen.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <time.h>
 
 #ifdef WIN32
 #include <shlobj.h>
@@ -61,6 +62,7 @@
 #include "userpref.h"
 #include "debug.h"
 #include "utils.h"
+#include "thread.h"
 
 #ifndef HAVE_OPENSSL
 const ASN1_ARRAY_TYPE pkcs1_asn1_tab[] = {
@@ -91,8 +93,35 @@ const ASN1_ARRAY_TYPE pkcs1_asn1_tab[] = {
 
 #define USERPREF_CONFIG_FILE "SystemConfiguration"USERPREF_CONFIG_EXTENSION
 
+/* Cached pair records whose file can't be checked for changes are re-read after this many seconds */
+#define USERPREF_PAIR_RECORD_CACHE_TIMEOUT 30
+
 static char *__config_dir = NULL;
 
+struct pair_record_stamp {
+	int exists;
+	time_t mtime;
+	long long size;
+};
+
+/**
+ * Parsed pair record and the credentials decoded from it. Entries are
+ * dropped when the pair record is saved or deleted through userpref, or
+ * when the pair record file changes.
+ */
+struct pair_record_cache_entry {
+	char *udid;
+	plist_t pair_record;
+	struct pair_record_stamp stamp;
+	time_t timestamp;
+	userpref_credentials_t credentials;
+	struct pair_record_cache_entry *next;
+};
+
+static mutex_t pair_record_cache_mutex;
+static thread_once_t pair_record_cache_once = THREAD_ONCE_INIT;
+static struct pair_record_cache_entry *pair_record_cache = NULL;
+
 #ifdef WIN32
 static char *userpref_utf16_to_utf8(wchar_t *unistr, long len, long *items_read, long *items_written)
 {
@@ -264,6 +293,198 @@ userpref_error_t userpref_get_paired_udids(char ***list, unsigned int *count)
 	return USERPREF_E_SUCCESS;
 }
 
+static userpref_error_t pair_record_read(const char *udid, plist_t *pair_record);
+
+static void pair_record_cache_init(void)
+{
+	mutex_init(&pair_record_cache_mutex);
+}
+
+static void pair_record_cache_lock(void)
+{
+	thread_once(&pair_record_cache_once, pair_record_cache_init);
+	mutex_lock(&pair_record_cache_mutex);
+}
+
+/**
+ * Private function which gets the modification time and size of the pair
+ * record file, if it is accessible to us.
+ */
+static void pair_record_get_stamp(const char *udid, struct pair_record_stamp *stamp)
+{
+	struct stat st;
+
+	memset(stamp, '\0', sizeof(struct pair_record_stamp));
+
+	char *path = string_concat(userpref_get_config_dir(), DIR_SEP_S, udid, USERPREF_CONFIG_EXTENSION, NULL);
+	if (path && stat(path, &st) == 0) {
+		stamp->exists = 1;
+		stamp->mtime = st.st_mtime;
+		stamp->size = st.st_size;
+	}
+	free(path);
+}
+
+/**
+ * Private function which decodes the keys and certificates of a pair record.
+ */
+static userpref_credentials_t pair_record_credentials_new(plist_t pair_record)
+{
+	userpref_credentials_t credentials = (userpref_credentials_t)malloc(sizeof(struct userpref_credentials_private));
+	memset(credentials, '\0', sizeof(struct userpref_credentials_private));
+	credentials->refcount = 1;
+
+#ifdef HAVE_OPENSSL
+	key_data_t root_cert = { NULL, 0 };
+	key_data_t root_privkey = { NULL, 0 };
+	BIO* membp;
+
+	if (pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, &root_cert) == USERPREF_E_SUCCESS) {
+		membp = BIO_new_mem_buf(root_cert.data, root_cert.size);
+		PEM_read_bio_X509(membp, &credentials->root_cert, NULL, NULL);
+		BIO_free(membp);
+	}
+	free(root_cert.data);
+
+	if (pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, &root_privkey) == USERPREF_E_SUCCESS) {
+		membp = BIO_new_mem_buf(root_privkey.data, root_privkey.size);
+		PEM_read_bio_PrivateKey(membp, &credentials->root_privkey, NULL, NULL);
+		BIO_free(membp);
+	}
+	free(root_privkey.data);
+#else
+	gnutls_x509_crt_init(&credentials->root_cert);
+	gnutls_x509_crt_init(&credentials->host_cert);
+	gnutls_x509_privkey_init(&credentials->root_privkey);
+	gnutls_x509_privkey_init(&credentials->host_privkey);
+
+	pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, credentials->root_cert);
+	pair_record_import_crt_with_name(pair_record, USERPREF_HOST_CERTIFICATE_KEY, credentials->host_cert);
+	pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, credentials->root_privkey);
+	pair_record_import_key_with_name(pair_record, USERPREF_HOST_PRIVATE_KEY_KEY, credentials->host_privkey);
+#endif
+
+	return credentials;
+}
+
+/**
+ * Private function which drops a reference to the given credentials.
+ * Must be called with pair_record_cache_mutex held.
+ */
+static void pair_record_credentials_release(userpref_credentials_t credentials)
+{
+	if (--credentials->refcount > 0)
+		return;
+
+#ifdef HAVE_OPENSSL
+	if (credentials->root_cert)
+		X509_free(credentials->root_cert);
+	if (credentials->root_privkey)
+		EVP_PKEY_free(credentials->root_privkey);
+#else
+	gnutls_x509_crt_deinit(credentials->root_cert);
+	gnutls_x509_crt_deinit(credentials->host_cert);
+	gnutls_x509_privkey_deinit(credentials->root_privkey);
+	gnutls_x509_privkey_deinit(credentials->host_privkey);
+#endif
+	free(credentials);
+}
+
+static void pair_record_cache_entry_free(struct pair_record_cache_entry *entry)
+{
+	if (entry->credentials)
+		pair_record_credentials_release(entry->credentials);
+	plist_free(entry->pair_record);
+	free(entry->udid);
+	free(entry);
+}
+
+/**
+ * Private function which removes the cached pair record of a device.
+ * Must be called with pair_record_cache_mutex held.
+ */
+static void pair_record_cache_remove_locked(const char *udid)
+{
+	struct pair_record_cache_entry **link;
+
+	for (link = &pair_record_cache; *link; link = &(*link)->next) {
+		struct pair_record_cache_entry *entry = *link;
+		if (!strcmp(entry->udid, udid)) {
+			*link = entry->next;
+			pair_record_cache_entry_free(entry);
+			break;
+		}
+	}
+}
+
+static void pair_record_cache_remove(const char *udid)
+{
+	if (!udid)
+		return;
+
+	pair_record_cache_lock();
+	pair_record_cache_remove_locked(udid);
+	mutex_unlock(&pair_record_cache_mutex);
+}
+
+/**
+ * Private function which returns the cached pair record of a device,
+ * reading it from usbmuxd if it isn't cached or has changed since.
+ * Must be called with pair_record_cache_mutex held. The mutex is released
+ * while talking to usbmuxd.
+ */
+static userpref_error_t pair_record_cache_load(const char *udid, struct pair_record_cache_entry **result)
+{
+	struct pair_record_cache_entry *entry;
+	struct pair_record_stamp stamp;
+	time_t now = time(NULL);
+
+	pair_record_get_stamp(udid, &stamp);
+
+	for (entry = pair_record_cache; entry; entry = entry->next) {
+		if (!strcmp(entry->udid, udid)) {
+			break;
+		}
+	}
+
+	if (entry) {
+		if (stamp.exists == entry->stamp.exists && stamp.mtime == entry->stamp.mtime && stamp.size == entry->stamp.size
+		    && (stamp.exists || now - entry->timestamp < USERPREF_PAIR_RECORD_CACHE_TIMEOUT)) {
+			*result = entry;
+			return USERPREF_E_SUCCESS;
+		}
+		debug_info("pair record for %s changed, reloading", udid);
+		pair_record_cache_remove_locked(udid);
+	}
+
+	plist_t pair_record = NULL;
+
+	mutex_unlock(&pair_record_cache_mutex);
+	userpref_error_t ret = pair_record_read(udid, &pair_record);
+	mutex_lock(&pair_record_cache_mutex);
+
+	if (ret != USERPREF_E_SUCCESS || !pair_record) {
+		if (pair_record)
+			plist_free(pair_record);
+		return (ret != USERPREF_E_SUCCESS) ? ret : USERPREF_E_INVALID_CONF;
+	}
+
+	/* another thread might have loaded it in the meantime */
+	pair_record_cache_remove_locked(udid);
+
+	entry = (struct pair_record_cache_entry*)malloc(sizeof(struct pair_record_cache_entry));
+	entry->udid = strdup(udid);
+	entry->pair_record = pair_record;
+	entry->stamp = stamp;
+	entry->timestamp = now;
+	entry->credentials = NULL;
+	entry->next = pair_record_cache;
+	pair_record_cache = entry;
+
+	*result = entry;
+	return USERPREF_E_SUCCESS;
+}
+
 /**
  * Save a pair record for a device.
  *
@@ -285,6 +506,8 @@ userpref_error_t userpref_save_pair_record(const char *udid, uint32_t device_id,
 
 	free(record_data);
 
+	pair_record_cache_remove(udid);
+
 	return res == 0 ? USERPREF_E_SUCCESS: USERPREF_E_UNKNOWN_ERROR;
 }
 
@@ -298,6 +521,90 @@ userpref_error_t userpref_save_pair_record(const char *udid, uint32_t device_id,
  *         been saved previously.
  */
 userpref_error_t userpref_read_pair_record(const char *udid, plist_t *pair_record)
+{
+	struct pair_record_cache_entry *entry = NULL;
+
+	if (!udid || !pair_record)
+		return USERPREF_E_INVALID_ARG;
+
+	pair_record_cache_lock();
+	userpref_error_t ret = pair_record_cache_load(udid, &entry);
+	if (ret == USERPREF_E_SUCCESS) {
+		*pair_record = plist_copy(entry->pair_record);
+	}
+	mutex_unlock(&pair_record_cache_mutex);
+
+	return ret;
+}
+
+/**
+ * Get the decoded keys and certificates from the pair record of a device.
+ * They are decoded on first use and shared until the pair record changes.
+ *
+ * @param udid The device UDID as given by the device
+ * @param credentials Pointer that will be set to the credentials upon
+ *   successful return. Release with userpref_credentials_free().
+ *
+ * @return USERPREF_E_SUCCESS on success, or USERPREF_E_INVALID_CONF if
+ *   there is no pair record for the device.
+ */
+userpref_error_t userpref_get_credentials(const char *udid, userpref_credentials_t *credentials)
+{
+	struct pair_record_cache_entry *entry = NULL;
+
+	if (!udid || !credentials)
+		return USERPREF_E_INVALID_ARG;
+
+	pair_record_cache_lock();
+	userpref_error_t ret = pair_record_cache_load(udid, &entry);
+	if (ret == USERPREF_E_SUCCESS) {
+		if (!entry->credentials) {
+			entry->credentials = pair_record_credentials_new(entry->pair_record);
+		}
+		entry->credentials->refcount++;
+		*credentials = entry->credentials;
+	}
+	mutex_unlock(&pair_record_cache_mutex);
+
+	return ret;
+}
+
+/**
+ * Release credentials obtained with userpref_get_credentials().
+ *
+ * @param credentials The credentials to release, may be NULL.
+ */
+void userpref_credentials_free(userpref_credentials_t credentials)
+{
+	if (!credentials)
+		return;
+
+	pair_record_cache_lock();
+	pair_record_credentials_release(credentials);
+	mutex_unlock(&pair_record_cache_mutex);
+}
+
+/**
+ * Drop all cached pair records and credentials.
+ */
+void userpref_clear_cache(void)
+{
+	pair_record_cache_lock();
+	struct pair_record_cache_entry *entry = pair_record_cache;
+	pair_record_cache = NULL;
+	while (entry) {
+		struct pair_record_cache_entry *next = entry->next;
+		pair_record_cache_entry_free(entry);
+		entry = next;
+	}
+	mutex_unlock(&pair_record_cache_mutex);
+}
+
+/**
+ * Private function which reads and parses the pair record of a device
+ * from usbmuxd.
+ */
+static userpref_error_t pair_record_read(const char *udid, plist_t *pair_record)
 {
 	char* record_data = NULL;
 	uint32_t record_size = 0;
@@ -334,6 +641,8 @@ userpref_error_t userpref_delete_pair_record(const char *udid)
 {
 	int res = usbmuxd_delete_pair_record(udid);
 
+	pair_record_cache_remove(udid);
+
 	return res == 0 ? USERPREF_E_SUCCESS: USERPREF_E_UNKNOWN_ERROR;
 }
 
@@ -28,12 +28,15 @@
 #endif
 
 #ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/x509.h>
 typedef struct {
 	unsigned char *data;
 	unsigned int size;
 } key_data_t;
 #else
 #include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
 typedef gnutls_datum_t key_data_t;
 #endif
 
@@ -61,11 +64,34 @@ typedef enum {
 	USERPREF_E_UNKNOWN_ERROR = -256
 } userpref_error_t;
 
+/**
+ * Keys and certificates of a pair record, decoded once and shared between
+ * connections. Obtained with userpref_get_credentials() and released with
+ * userpref_credentials_free(). Members may be NULL if the pair record
+ * lacks the corresponding item.
+ */
+struct userpref_credentials_private {
+	int refcount;
+#ifdef HAVE_OPENSSL
+	X509 *root_cert;
+	EVP_PKEY *root_privkey;
+#else
+	gnutls_x509_crt_t root_cert;
+	gnutls_x509_privkey_t root_privkey;
+	gnutls_x509_crt_t host_cert;
+	gnutls_x509_privkey_t host_privkey;
+#endif
+};
+typedef struct userpref_credentials_private *userpref_credentials_t;
+
 const char *userpref_get_config_dir(void);
 int userpref_read_system_buid(char **system_buid);
 userpref_error_t userpref_read_pair_record(const char *udid, plist_t *pair_record);
 userpref_error_t userpref_save_pair_record(const char *udid, uint32_t device_id, plist_t pair_record);
 userpref_error_t userpref_delete_pair_record(const char *udid);
+userpref_error_t userpref_get_credentials(const char *udid, userpref_credentials_t *credentials);
+void userpref_credentials_free(userpref_credentials_t credentials);
+void userpref_clear_cache(void);
 
 userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_data_t public_key);
 #ifdef HAVE_OPENSSL
@@ -275,9 +275,16 @@ int plist_write_to_filename(plist_t plist, const char *filename, enum plist_form
 	if (!plist || !filename)
 		return 0;
 
-	if (format == PLIST_FORMAT_XML)
-		plist_to_xml(plist, &buffer, &length);
-	else if (format == PLIST_FORMAT_BINARY)
+	if (format == PLIST_FORMAT_XML) {
+		/* stream XML straight to the file */
+		FILE *f = fopen(filename, "wb");
+		int res;
+		if (!f)
+			return 0;
+		res = plist_to_xml_file(plist, f);
+		fclose(f);
+		return (res == 0) ? 1 : 0;
+	} else if (format == PLIST_FORMAT_BINARY)
 		plist_to_bin(plist, &buffer, &length);
 	else
 		return 0;
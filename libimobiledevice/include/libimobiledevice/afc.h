@@ -92,6 +92,12 @@ typedef enum {
 typedef struct afc_client_private afc_client_private;
 typedef afc_client_private *afc_client_t; /**< The client handle. */
 
+typedef struct afc_upload_private afc_upload_private;
+typedef afc_upload_private *afc_upload_t; /**< The handle of a batched upload. */
+
+/** Reports that a file queued with afc_upload_add_file() or afc_upload_add_local_file() has been written, or failed to. */
+typedef void (*afc_upload_cb_t) (const char *path, afc_error_t error, void *user_data);
+
 /* Interface */
 
 /**
@@ -368,6 +374,87 @@ afc_error_t afc_get_device_info_key(afc_client_t client, const char *key, char *
  */
 afc_error_t afc_dictionary_free(char **dictionary);
 
+/* Batched upload */
+
+/**
+ * Creates a batched upload. Directories and files added to it are sent to
+ * the device pipelined, without waiting for the response to each request,
+ * so uploading many small files isn't limited by round trips.
+ *
+ * @param client The client to upload with. It is locked while requests are
+ *        in flight.
+ * @param callback Function called for every file once it has been written
+ *        (or failed to), in the order the files were added. May be NULL.
+ * @param user_data Data passed to callback.
+ * @param upload Pointer that will be set to the new upload on success.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_upload_new(afc_client_t client, afc_upload_cb_t callback, void *user_data, afc_upload_t *upload);
+
+/**
+ * Queues creating a directory. Errors creating directories are ignored, as
+ * creating an existing directory is not an error for an upload; writing the
+ * files inside a missing directory will fail instead.
+ *
+ * @param upload The upload to add the directory to.
+ * @param path The fully-qualified path of the directory.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_upload_add_directory(afc_upload_t upload, const char *path);
+
+/**
+ * Queues writing a file. The data is copied. Queued requests are sent
+ * automatically once enough files or bytes have been queued, in which case
+ * the result of that flush is returned.
+ *
+ * @param upload The upload to add the file to.
+ * @param path The fully-qualified path of the file; it is created or
+ *        truncated.
+ * @param data The contents of the file.
+ * @param length The length of data.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_upload_add_file(afc_upload_t upload, const char *path, const char *data, uint32_t length);
+
+/**
+ * Queues writing a file with the contents of a local file. Unlike
+ * afc_upload_add_file() the contents aren't copied; the local file is read
+ * in chunks while the upload is flushed, so queuing large files doesn't
+ * hold them in memory. If the local file can't be read, the file fails
+ * with AFC_E_IO_ERROR.
+ *
+ * @param upload The upload to add the file to.
+ * @param path The fully-qualified path of the file; it is created or
+ *        truncated.
+ * @param local_path The path of the local file to read the contents from.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_upload_add_local_file(afc_upload_t upload, const char *path, const char *local_path);
+
+/**
+ * Sends all queued requests and waits for their responses.
+ *
+ * @param upload The upload to flush.
+ *
+ * @return AFC_E_SUCCESS if all queued files have been written, otherwise the
+ *         error of the first file that failed, or the connection error that
+ *         aborted the upload.
+ */
+afc_error_t afc_upload_flush(afc_upload_t upload);
+
+/**
+ * Frees an upload. Requests that haven't been flushed are discarded.
+ *
+ * @param upload The upload to free.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_upload_free(afc_upload_t upload);
+
 #ifdef __cplusplus
 }
 #endif
@@ -110,6 +110,9 @@ typedef enum {
 typedef struct instproxy_client_private instproxy_client_private;
 typedef instproxy_client_private *instproxy_client_t; /**< The client handle. */
 
+typedef struct instproxy_operation_private instproxy_operation_private;
+typedef instproxy_operation_private *instproxy_operation_t; /**< The handle of an asynchronous command. */
+
 /** Reports the status response of the given command */
 typedef void (*instproxy_status_cb_t) (plist_t command, plist_t status, void *user_data);
 
@@ -227,8 +230,8 @@ instproxy_error_t instproxy_lookup(instproxy_client_t client, const char** appid
  *         an error occured.
  *
  * @note If a callback function is given (async mode), this function returns
- *       INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *       created successfully; any error occuring during the command has to be
+ *       INSTPROXY_E_SUCCESS immediately if the command has been sent
+ *       successfully; any error occuring during the command has to be
  *       handled inside the specified callback function.
  */
 instproxy_error_t instproxy_install(instproxy_client_t client, const char *pkg_path, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
@@ -255,8 +258,8 @@ instproxy_error_t instproxy_install(instproxy_client_t client, const char *pkg_p
  *         an error occured.
  *
  * @note If a callback function is given (async mode), this function returns
- *       INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *       created successfully; any error occuring during the command has to be
+ *       INSTPROXY_E_SUCCESS immediately if the command has been sent
+ *       successfully; any error occuring during the command has to be
  *       handled inside the specified callback function.
  */
 instproxy_error_t instproxy_upgrade(instproxy_client_t client, const char *pkg_path, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
@@ -276,12 +279,80 @@ instproxy_error_t instproxy_upgrade(instproxy_client_t client, const char *pkg_p
  *     an error occured.
  *
  * @note If a callback function is given (async mode), this function returns
- *       INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *       created successfully; any error occuring during the command has to be
+ *       INSTPROXY_E_SUCCESS immediately if the command has been sent
+ *       successfully; any error occuring during the command has to be
  *       handled inside the specified callback function.
  */
 instproxy_error_t instproxy_uninstall(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
+/**
+ * Install an application on the device and return a handle that can be used
+ * to wait for the installation to finish.
+ *
+ * @param client The connected installation_proxy client
+ * @param pkg_path Path of the installation package (inside the AFC jail)
+ * @param client_options The client options to use, as PLIST_DICT, or NULL.
+ *        See instproxy_install for valid options.
+ * @param status_cb Callback function for progress and status information,
+ *        or NULL. It is called from the I/O thread of the device.
+ * @param user_data Callback data passed to status_cb.
+ * @param operation Pointer that will be set to the operation handle. Must be
+ *        freed with instproxy_operation_free.
+ *
+ * @return INSTPROXY_E_SUCCESS if the command has been sent or an
+ *         INSTPROXY_E_* error value if an error occured.
+ *
+ * @note Status messages of all commands running on a device are received by
+ *       one shared thread, so status_cb should not block.
+ */
+instproxy_error_t instproxy_install_async(instproxy_client_t client, const char *pkg_path, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data, instproxy_operation_t *operation);
+
+/**
+ * Uninstall an application from the device and return a handle that can be
+ * used to wait for the removal to finish.
+ *
+ * @param client The connected installation proxy client
+ * @param appid ApplicationIdentifier of the app to uninstall
+ * @param client_options The client options to use, as PLIST_DICT, or NULL.
+ * @param status_cb Callback function for progress and status information,
+ *        or NULL. It is called from the I/O thread of the device.
+ * @param user_data Callback data passed to status_cb.
+ * @param operation Pointer that will be set to the operation handle. Must be
+ *        freed with instproxy_operation_free.
+ *
+ * @return INSTPROXY_E_SUCCESS if the command has been sent or an
+ *         INSTPROXY_E_* error value if an error occured.
+ */
+instproxy_error_t instproxy_uninstall_async(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data, instproxy_operation_t *operation);
+
+/**
+ * Waits for an asynchronous command to finish.
+ *
+ * @param operation The operation handle.
+ * @param timeout Maximum time in milliseconds to wait, or 0 to wait until the
+ *        command has finished.
+ *
+ * @return INSTPROXY_E_SUCCESS if the command completed successfully,
+ *         INSTPROXY_E_RECEIVE_TIMEOUT if it is still running after timeout,
+ *         INSTPROXY_E_CONN_FAILED if the connection was lost or the client
+ *         was freed, or the INSTPROXY_E_* error reported by the device.
+ *
+ * @note Must not be called from the status callback of the same operation.
+ */
+instproxy_error_t instproxy_operation_wait(instproxy_operation_t operation, unsigned int timeout);
+
+/**
+ * Frees an operation handle. If the command is still running it continues
+ * in the background, and status_cb keeps being called until it finishes or
+ * the client is freed.
+ *
+ * @param operation The operation handle to free.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or INSTPROXY_E_INVALID_ARG when
+ *     operation is NULL.
+ */
+instproxy_error_t instproxy_operation_free(instproxy_operation_t operation);
+
 /**
  * List archived applications. This function runs synchronously.
  *
@@ -318,8 +389,8 @@ instproxy_error_t instproxy_lookup_archives(instproxy_client_t client, plist_t c
  *     an error occured.
  *
  * @note If a callback function is given (async mode), this function returns
- *       INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *       created successfully; any error occuring during the command has to be
+ *       INSTPROXY_E_SUCCESS immediately if the command has been sent
+ *       successfully; any error occuring during the command has to be
  *       handled inside the specified callback function.
  */
 instproxy_error_t instproxy_archive(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
@@ -342,8 +413,8 @@ instproxy_error_t instproxy_archive(instproxy_client_t client, const char *appid
  *     an error occured.
  *
  * @note If a callback function is given (async mode), this function returns
- *       INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *       created successfully; any error occuring during the command has to be
+ *       INSTPROXY_E_SUCCESS immediately if the command has been sent
+ *       successfully; any error occuring during the command has to be
  *       handled inside the specified callback function.
  */
 instproxy_error_t instproxy_restore(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
@@ -365,8 +436,8 @@ instproxy_error_t instproxy_restore(instproxy_client_t client, const char *appid
  *         an error occured.
  *
  * @note If a callback function is given (async mode), this function returns
- *       INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *       created successfully; any error occuring during the command has to be
+ *       INSTPROXY_E_SUCCESS immediately if the command has been sent
+ *       successfully; any error occuring during the command has to be
  *       handled inside the specified callback function.
  */
 instproxy_error_t instproxy_remove_archive(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
@@ -59,12 +59,18 @@ enum idevice_event_type {
 	IDEVICE_DEVICE_PAIRED
 };
 
+/** Type of connection a device is available on */
+enum idevice_connection_type {
+	CONNECTION_USBMUXD = 1, /**< Device is connected via USB (through usbmuxd) */
+	CONNECTION_NETWORK /**< Device is connected via the network (through usbmuxd) */
+};
+
 /* event data structure */
 /** Provides information about the occured event. */
 typedef struct {
 	enum idevice_event_type event; /**< The event type. */
 	const char *udid; /**< The device unique id. */
-	int conn_type; /**< The connection type. Currently only 1 for usbmuxd. */
+	enum idevice_connection_type conn_type; /**< The connection type the event refers to. */
 } idevice_event_t;
 
 /* event callback function prototype */
@@ -80,6 +86,29 @@ typedef void (*idevice_event_cb_t) (const idevice_event_t *event, void *user_dat
  */
 void idevice_set_debug_level(int level);
 
+/**
+ * Enable or disable TLS session resumption for SSL enabled connections.
+ *
+ * When enabled (the default), the session negotiated by the last successful
+ * handshake with a device's lockdownd or service port is offered again on the
+ * next connection to it, so that the device can skip the full handshake.
+ * Disabling it also discards all cached sessions.
+ *
+ * @param enabled Set to 0 to always perform a full handshake, or 1 to
+ *   resume cached sessions.
+ */
+void idevice_set_ssl_session_cache_enabled(int enabled);
+
+/**
+ * Get the number of SSL handshakes performed since the library was loaded.
+ *
+ * @param full_handshakes Pointer that will receive the number of full
+ *   handshakes. May be NULL.
+ * @param resumed_handshakes Pointer that will receive the number of
+ *   handshakes that resumed a cached session. May be NULL.
+ */
+void idevice_get_ssl_handshake_stats(uint32_t *full_handshakes, uint32_t *resumed_handshakes);
+
 /**
  * Register a callback function that will be called when device add/remove
  * events occur.
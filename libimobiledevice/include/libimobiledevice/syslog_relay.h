@@ -44,9 +44,21 @@ typedef enum {
 typedef struct syslog_relay_client_private syslog_relay_client_private;
 typedef syslog_relay_client_private *syslog_relay_client_t; /**< The client handle. */
 
+typedef struct syslog_relay_filter_private syslog_relay_filter_private;
+typedef syslog_relay_filter_private *syslog_relay_filter_t; /**< A compiled set of line filters. */
+
 /** Receives each character received from the device. */
 typedef void (*syslog_relay_receive_cb_t)(char c, void *user_data);
 
+/**
+ * Receives a batch of complete syslog lines from the device.
+ *
+ * Each line is NUL-terminated and has its trailing newline removed. The
+ * lines point into the capture buffer and are only valid until the
+ * callback returns.
+ */
+typedef void (*syslog_relay_receive_lines_cb_t)(const char **lines, const uint32_t *lengths, uint32_t count, void *user_data);
+
 /* Interface */
 
 /**
@@ -106,6 +118,30 @@ syslog_relay_error_t syslog_relay_client_free(syslog_relay_client_t client);
  */
 syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data);
 
+/**
+ * Starts capturing the syslog of the device, delivering whole lines.
+ *
+ * Unlike syslog_relay_start_capture(), data is received from the device in
+ * large blocks and split into lines on the relay's newline and NUL
+ * boundaries. Lines that don't pass the filter are dropped by the capture
+ * thread without invoking the callback.
+ *
+ * Use syslog_relay_stop_capture() to stop receiving the syslog.
+ *
+ * @param client The syslog_relay client to use
+ * @param filter Filter lines must pass to be delivered, or NULL to deliver
+ *     every line. The filter is not copied and must not be freed or
+ *     modified until the capture has been stopped.
+ * @param callback Callback to receive each batch of lines from the syslog.
+ * @param user_data Custom pointer passed to the callback function.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs or a syslog capture has already been started.
+ */
+syslog_relay_error_t syslog_relay_start_capture_lines(syslog_relay_client_t client, syslog_relay_filter_t filter, syslog_relay_receive_lines_cb_t callback, void* user_data);
+
 /**
  * Stops capturing the syslog of the device.
  *
@@ -153,6 +189,71 @@ syslog_relay_error_t syslog_relay_receive_with_timeout(syslog_relay_client_t cli
  */
 syslog_relay_error_t syslog_relay_receive(syslog_relay_client_t client, char *data, uint32_t size, uint32_t *received);
 
+/* Filtering */
+
+/**
+ * Creates an empty line filter for syslog_relay_start_capture_lines().
+ *
+ * A line passes the filter if it was logged by one of the added processes
+ * (or no process was added) and it matches one of the added substrings or
+ * regular expressions (or none were added).
+ *
+ * @param filter Pointer that will point to a newly allocated
+ *     syslog_relay_filter_t upon successful return. Must be freed using
+ *     syslog_relay_filter_free() after use.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success, or SYSLOG_RELAY_E_INVALID_ARG
+ *     when filter is NULL.
+ */
+syslog_relay_error_t syslog_relay_filter_new(syslog_relay_filter_t *filter);
+
+/**
+ * Frees a line filter.
+ *
+ * @param filter The filter to free.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success, or SYSLOG_RELAY_E_INVALID_ARG
+ *     when filter is NULL.
+ */
+syslog_relay_error_t syslog_relay_filter_free(syslog_relay_filter_t filter);
+
+/**
+ * Adds a process to a line filter.
+ *
+ * @param filter The filter to add to.
+ * @param process_name Name of the process as logged, e.g. "SpringBoard",
+ *     without any subsystem or pid.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success, or SYSLOG_RELAY_E_INVALID_ARG
+ *     when one or more parameters are invalid.
+ */
+syslog_relay_error_t syslog_relay_filter_add_process(syslog_relay_filter_t filter, const char *process_name);
+
+/**
+ * Adds a substring to a line filter.
+ *
+ * @param filter The filter to add to.
+ * @param substring Text to look for anywhere in the line.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success, or SYSLOG_RELAY_E_INVALID_ARG
+ *     when one or more parameters are invalid.
+ */
+syslog_relay_error_t syslog_relay_filter_add_substring(syslog_relay_filter_t filter, const char *substring);
+
+/**
+ * Adds a POSIX extended regular expression to a line filter. The
+ * expression is compiled once, here.
+ *
+ * @param filter The filter to add to.
+ * @param pattern The regular expression to match anywhere in the line.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success, SYSLOG_RELAY_E_INVALID_ARG
+ *     when one or more parameters are invalid or pattern doesn't compile,
+ *     or SYSLOG_RELAY_E_UNKNOWN_ERROR when regular expressions aren't
+ *     supported on this platform.
+ */
+syslog_relay_error_t syslog_relay_filter_add_regex(syslog_relay_filter_t filter, const char *pattern);
+
 #ifdef __cplusplus
 }
 #endif
@@ -34,6 +34,22 @@
 #include "common/debug.h"
 #include "endianness.h"
 
+/** Payloads up to this size are copied next to the packet header so the whole packet is sent at once. */
+#define AFC_COALESCE_MAX_PAYLOAD 0x10000
+
+/** Queued files or bytes after which afc_upload_add_file() flushes automatically. */
+#define AFC_UPLOAD_MAX_QUEUED_FILES 256
+#define AFC_UPLOAD_MAX_QUEUED_BYTES (8 * 1024 * 1024)
+
+/** Number of files an upload keeps open at the same time. */
+#define AFC_UPLOAD_WINDOW 64
+
+/** Size of the write requests an upload splits file contents into. */
+#define AFC_UPLOAD_CHUNK_SIZE (1024 * 1024)
+
+/** Number of unanswered requests after which an upload waits for responses. */
+#define AFC_UPLOAD_MAX_PENDING 256
+
 /**
  * Locks an AFC client, done for thread safety stuff
  *
@@ -90,6 +106,8 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_new_with_service_client(service_clie
 	memcpy(client_loc->afc_packet->magic, AFC_MAGIC, AFC_MAGIC_LEN);
 	client_loc->file_handle = 0;
 	client_loc->lock = 0;
+	client_loc->send_buffer = NULL;
+	client_loc->send_buffer_size = 0;
 	mutex_init(&client_loc->mutex);
 
 	*client = client_loc;
@@ -132,6 +150,7 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_free(afc_client_t client)
 		client->parent = NULL;
 	}
 	free(client->afc_packet);
+	free(client->send_buffer);
 	mutex_destroy(&client->mutex);
 	free(client);
 	return AFC_E_SUCCESS;
@@ -148,11 +167,17 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_free(afc_client_t client)
  * @param payload_length The length of data to send after the header.
  * @param bytes_sent The total number of bytes actually sent.
  *
+ * The header, data and payloads of up to AFC_COALESCE_MAX_PAYLOAD bytes are
+ * sent with a single send; larger payloads are sent separately rather than
+ * being copied.
+ *
  * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
  */
 static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation, const char *data, uint32_t data_length, const char* payload, uint32_t payload_length, uint32_t *bytes_sent)
 {
 	uint32_t sent = 0;
+	uint32_t header_length = 0;
+	uint32_t coalesced_length = 0;
 
 	if (!client || !client->parent || !client->afc_packet)
 		return AFC_E_INVALID_ARG;
@@ -173,52 +198,68 @@ static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation,
 
 	debug_buffer((char*)client->afc_packet, sizeof(AFCPacket));
 
-	/* send AFC packet header */
+	header_length = sizeof(AFCPacket) + data_length;
+	coalesced_length = header_length;
+	if (payload_length <= AFC_COALESCE_MAX_PAYLOAD) {
+		coalesced_length += payload_length;
+	}
+
+	if (client->send_buffer_size < coalesced_length) {
+		char *send_buffer = (char*)realloc(client->send_buffer, coalesced_length);
+		if (!send_buffer) {
+			return AFC_E_NO_MEM;
+		}
+		client->send_buffer = send_buffer;
+		client->send_buffer_size = coalesced_length;
+	}
+
+	/* AFC packet header */
 	AFCPacket_to_LE(client->afc_packet);
-	sent = 0;
-	service_send(client->parent, (void*)client->afc_packet, sizeof(AFCPacket), &sent);
+	memcpy(client->send_buffer, client->afc_packet, sizeof(AFCPacket));
 	AFCPacket_from_LE(client->afc_packet);
-	*bytes_sent += sent;
-	if (sent < sizeof(AFCPacket)) {
-		return AFC_E_SUCCESS;
-	}
 
-	/* send AFC packet data (if there's data to send) */
-	sent = 0;
+	/* AFC packet data (if there's data to send) */
 	if (data_length > 0) {
 		debug_info("packet data follows");
 		debug_buffer(data, data_length);
-		service_send(client->parent, data, data_length, &sent);
-	}
-	*bytes_sent += sent;
-	if (sent < data_length) {
-		return AFC_E_SUCCESS;
+		memcpy(client->send_buffer + sizeof(AFCPacket), data, data_length);
 	}
 
-	sent = 0;
 	if (payload_length > 0) {
 		debug_info("packet payload follows");
 		debug_buffer(payload, payload_length);
-		service_send(client->parent, payload, payload_length, &sent);
+		if (coalesced_length > header_length) {
+			memcpy(client->send_buffer + header_length, payload, payload_length);
+		}
 	}
+
+	sent = 0;
+	service_send(client->parent, client->send_buffer, coalesced_length, &sent);
 	*bytes_sent += sent;
-	if (sent < payload_length) {
+	if (sent < coalesced_length || coalesced_length == header_length + payload_length) {
 		return AFC_E_SUCCESS;
 	}
 
+	/* send large payloads directly */
+	sent = 0;
+	service_send(client->parent, payload, payload_length, &sent);
+	*bytes_sent += sent;
+
 	return AFC_E_SUCCESS;
 }
 
 /**
- * Receives data through an AFC client and sets a variable to the received data.
+ * Receives the response to a specific packet through an AFC client and sets
+ * a variable to the received data.
  *
  * @param client The client to receive data on.
+ * @param packet_num The number of the packet the response belongs to.
  * @param bytes The char* to point to the newly-received data.
  * @param bytes_recv How much data was received.
  *
  * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
  */
-static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t *bytes_recv)
+static afc_error_t afc_receive_packet(afc_client_t client, uint64_t packet_num, char **bytes, uint32_t *bytes_recv)
 {
 	AFCPacket header;
 	uint32_t entire_len = 0;
@@ -251,9 +292,9 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 	}
 
 	/* check if it has the correct packet number */
-	if (header.packet_num != client->afc_packet->packet_num) {
+	if (header.packet_num != packet_num) {
 		/* otherwise print a warning but do not abort */
-		debug_info("ERROR: Unexpected packet number (%lld != %lld) aborting.", header.packet_num, client->afc_packet->packet_num);
+		debug_info("ERROR: Unexpected packet number (%lld != %lld) aborting.", header.packet_num, packet_num);
 		return AFC_E_OP_HEADER_INVALID;
 	}
 
@@ -358,6 +399,21 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 	return AFC_E_SUCCESS;
 }
 
+/**
+ * Receives the response to the last packet sent through an AFC client and
+ * sets a variable to the received data.
+ *
+ * @param client The client to receive data on.
+ * @param bytes The char* to point to the newly-received data.
+ * @param bytes_recv How much data was received.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t *bytes_recv)
+{
+	return afc_receive_packet(client, client->afc_packet->packet_num, bytes, bytes_recv);
+}
+
 /**
  * Returns counts of null characters within a string.
  */
@@ -1036,3 +1092,463 @@ LIBIMOBILEDEVICE_API afc_error_t afc_dictionary_free(char **dictionary)
 
 	return AFC_E_SUCCESS;
 }
+
+/** A request of a batched upload that has been sent but not answered yet. */
+struct afc_upload_request {
+	uint64_t packet_num;
+	uint64_t operation;
+	uint32_t item;
+};
+
+/**
+ * Checks whether an error leaves the connection in an unknown state, so the
+ * remaining responses of an upload can't be received.
+ */
+static int afc_upload_is_fatal_error(afc_error_t error)
+{
+	switch (error) {
+		case AFC_E_MUX_ERROR:
+		case AFC_E_NOT_ENOUGH_DATA:
+		case AFC_E_OP_HEADER_INVALID:
+		case AFC_E_NO_MEM:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/**
+ * Sends a request of a batched upload without waiting for its response.
+ */
+static afc_error_t afc_upload_send(afc_upload_t upload, struct afc_upload_request *pending, uint32_t *num_pending, uint32_t item, uint64_t operation, const char *data, uint32_t data_length, const char *payload, uint32_t payload_length)
+{
+	uint32_t sent = 0;
+	afc_error_t ret = afc_dispatch_packet(upload->client, operation, data, data_length, payload, payload_length, &sent);
+	if (ret != AFC_E_SUCCESS) {
+		return ret;
+	}
+	if (sent < sizeof(AFCPacket) + data_length + payload_length) {
+		debug_info("could not send upload request");
+		return AFC_E_MUX_ERROR;
+	}
+
+	pending[*num_pending].packet_num = upload->client->afc_packet->packet_num;
+	pending[*num_pending].operation = operation;
+	pending[*num_pending].item = item;
+	(*num_pending)++;
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Receives the responses to all pending requests of a batched upload and
+ * records their results in the corresponding items.
+ *
+ * @return AFC_E_SUCCESS, or the error that made receiving the remaining
+ *     responses impossible.
+ */
+static afc_error_t afc_upload_receive(afc_upload_t upload, struct afc_upload_request *pending, uint32_t *num_pending)
+{
+	uint32_t i = 0;
+
+	for (i = 0; i < *num_pending; i++) {
+		struct afc_upload_item *item = &upload->items[pending[i].item];
+		char *data = NULL;
+		uint32_t bytes = 0;
+
+		afc_error_t ret = afc_receive_packet(upload->client, pending[i].packet_num, &data, &bytes);
+		if (afc_upload_is_fatal_error(ret)) {
+			free(data);
+			*num_pending = 0;
+			return ret;
+		}
+
+		if (pending[i].operation == AFC_OP_FILE_OPEN && ret == AFC_E_SUCCESS) {
+			if (data && bytes >= sizeof(uint64_t)) {
+				memcpy(&item->handle, data, sizeof(uint64_t));
+			} else {
+				ret = AFC_E_UNKNOWN_ERROR;
+			}
+		}
+
+		if (ret != AFC_E_SUCCESS && item->error == AFC_E_SUCCESS) {
+			item->error = ret;
+		}
+
+		if (pending[i].operation == AFC_OP_FILE_CLOSE) {
+			item->complete = 1;
+		}
+
+		free(data);
+	}
+
+	*num_pending = 0;
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Sends the requests of one window of files and receives their responses:
+ * first all opens, then all writes and closes.
+ */
+static afc_error_t afc_upload_write_window(afc_upload_t upload, uint32_t *files, uint32_t num_files, struct afc_upload_request *pending)
+{
+	uint32_t num_pending = 0;
+	uint32_t i = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	for (i = 0; i < num_files; i++) {
+		struct afc_upload_item *item = &upload->items[files[i]];
+		size_t path_length = strlen(item->path);
+		uint64_t file_mode = htole64(AFC_FOPEN_WRONLY);
+
+		char *data = (char*)malloc(sizeof(uint64_t) + path_length + 1);
+		if (!data) {
+			return AFC_E_NO_MEM;
+		}
+		memcpy(data, &file_mode, sizeof(uint64_t));
+		memcpy(data + sizeof(uint64_t), item->path, path_length + 1);
+
+		ret = afc_upload_send(upload, pending, &num_pending, files[i], AFC_OP_FILE_OPEN, data, sizeof(uint64_t) + path_length + 1, NULL, 0);
+		free(data);
+		if (ret != AFC_E_SUCCESS) {
+			return ret;
+		}
+	}
+
+	/* the handles are needed for everything else */
+	ret = afc_upload_receive(upload, pending, &num_pending);
+	if (ret != AFC_E_SUCCESS) {
+		return ret;
+	}
+
+	for (i = 0; i < num_files; i++) {
+		struct afc_upload_item *item = &upload->items[files[i]];
+		FILE *file = NULL;
+		uint32_t offset = 0;
+
+		if (item->error == AFC_E_SUCCESS && item->handle == 0) {
+			item->error = AFC_E_UNKNOWN_ERROR;
+		}
+		if (item->error != AFC_E_SUCCESS) {
+			item->complete = 1;
+			continue;
+		}
+
+		if (item->local_path) {
+			if (!upload->buffer) {
+				upload->buffer = (char*)malloc(AFC_UPLOAD_CHUNK_SIZE);
+				if (!upload->buffer) {
+					return AFC_E_NO_MEM;
+				}
+			}
+			file = fopen(item->local_path, "rb");
+			if (!file) {
+				debug_info("could not open %s", item->local_path);
+				item->error = AFC_E_IO_ERROR;
+			}
+		}
+
+		/* local files are read one chunk at a time; the chunk has been
+		 * sent by the time afc_upload_send returns, so one buffer does */
+		while (item->error == AFC_E_SUCCESS) {
+			const char *chunk = NULL;
+			uint32_t length = 0;
+
+			if (file) {
+				length = (uint32_t)fread(upload->buffer, 1, AFC_UPLOAD_CHUNK_SIZE, file);
+				if (length == 0 && ferror(file)) {
+					item->error = AFC_E_IO_ERROR;
+				}
+				chunk = upload->buffer;
+			} else {
+				length = item->length - offset;
+				if (length > AFC_UPLOAD_CHUNK_SIZE) {
+					length = AFC_UPLOAD_CHUNK_SIZE;
+				}
+				chunk = item->data + offset;
+			}
+
+			if (length == 0) {
+				break;
+			}
+
+			if (num_pending >= AFC_UPLOAD_MAX_PENDING) {
+				ret = afc_upload_receive(upload, pending, &num_pending);
+				if (ret != AFC_E_SUCCESS) {
+					break;
+				}
+			}
+
+			ret = afc_upload_send(upload, pending, &num_pending, files[i], AFC_OP_FILE_WRITE, (const char*)&item->handle, sizeof(uint64_t), chunk, length);
+			if (ret != AFC_E_SUCCESS) {
+				break;
+			}
+
+			offset += length;
+		}
+
+		if (file) {
+			fclose(file);
+		}
+		if (ret != AFC_E_SUCCESS) {
+			return ret;
+		}
+
+		if (num_pending >= AFC_UPLOAD_MAX_PENDING) {
+			ret = afc_upload_receive(upload, pending, &num_pending);
+			if (ret != AFC_E_SUCCESS) {
+				return ret;
+			}
+		}
+
+		ret = afc_upload_send(upload, pending, &num_pending, files[i], AFC_OP_FILE_CLOSE, (const char*)&item->handle, sizeof(uint64_t), NULL, 0);
+		if (ret != AFC_E_SUCCESS) {
+			return ret;
+		}
+	}
+
+	return afc_upload_receive(upload, pending, &num_pending);
+}
+
+/**
+ * Frees the queued items of an upload.
+ */
+static void afc_upload_clear(afc_upload_t upload)
+{
+	uint32_t i = 0;
+
+	for (i = 0; i < upload->count; i++) {
+		free(upload->items[i].path);
+		free(upload->items[i].data);
+		free(upload->items[i].local_path);
+	}
+
+	upload->count = 0;
+	upload->queued_bytes = 0;
+}
+
+/**
+ * Adds an item to an upload, taking ownership of path, data and local_path.
+ */
+static afc_error_t afc_upload_append(afc_upload_t upload, char *path, char *data, uint32_t length, char *local_path, int is_directory)
+{
+	if (upload->count == upload->capacity) {
+		uint32_t capacity = upload->capacity ? upload->capacity * 2 : 64;
+		struct afc_upload_item *items = (struct afc_upload_item*)realloc(upload->items, capacity * sizeof(struct afc_upload_item));
+		if (!items) {
+			free(path);
+			free(data);
+			free(local_path);
+			return AFC_E_NO_MEM;
+		}
+		upload->items = items;
+		upload->capacity = capacity;
+	}
+
+	struct afc_upload_item *item = &upload->items[upload->count++];
+	item->path = path;
+	item->data = data;
+	item->local_path = local_path;
+	item->length = length;
+	item->is_directory = is_directory;
+	item->handle = 0;
+	item->error = AFC_E_SUCCESS;
+	item->complete = 0;
+
+	upload->queued_bytes += length;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_upload_new(afc_client_t client, afc_upload_cb_t callback, void *user_data, afc_upload_t *upload)
+{
+	if (!client || !client->parent || !client->afc_packet || !upload)
+		return AFC_E_INVALID_ARG;
+
+	afc_upload_t upload_loc = (afc_upload_t)calloc(1, sizeof(struct afc_upload_private));
+	if (!upload_loc)
+		return AFC_E_NO_MEM;
+
+	upload_loc->client = client;
+	upload_loc->callback = callback;
+	upload_loc->user_data = user_data;
+
+	*upload = upload_loc;
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_upload_add_directory(afc_upload_t upload, const char *path)
+{
+	if (!upload || !path)
+		return AFC_E_INVALID_ARG;
+
+	char *path_loc = strdup(path);
+	if (!path_loc)
+		return AFC_E_NO_MEM;
+
+	return afc_upload_append(upload, path_loc, NULL, 0, NULL, 1);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_upload_add_file(afc_upload_t upload, const char *path, const char *data, uint32_t length)
+{
+	char *path_loc = NULL;
+	char *data_loc = NULL;
+
+	if (!upload || !path || (!data && length > 0))
+		return AFC_E_INVALID_ARG;
+
+	path_loc = strdup(path);
+	if (!path_loc)
+		return AFC_E_NO_MEM;
+
+	if (length > 0) {
+		data_loc = (char*)malloc(length);
+		if (!data_loc) {
+			free(path_loc);
+			return AFC_E_NO_MEM;
+		}
+		memcpy(data_loc, data, length);
+	}
+
+	afc_error_t ret = afc_upload_append(upload, path_loc, data_loc, length, NULL, 0);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	if (upload->count >= AFC_UPLOAD_MAX_QUEUED_FILES || upload->queued_bytes >= AFC_UPLOAD_MAX_QUEUED_BYTES) {
+		ret = afc_upload_flush(upload);
+	}
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_upload_add_local_file(afc_upload_t upload, const char *path, const char *local_path)
+{
+	char *path_loc = NULL;
+	char *local_path_loc = NULL;
+
+	if (!upload || !path || !local_path)
+		return AFC_E_INVALID_ARG;
+
+	path_loc = strdup(path);
+	local_path_loc = strdup(local_path);
+	if (!path_loc || !local_path_loc) {
+		free(path_loc);
+		free(local_path_loc);
+		return AFC_E_NO_MEM;
+	}
+
+	/* contents aren't held in memory, so only the file count limits the queue */
+	afc_error_t ret = afc_upload_append(upload, path_loc, NULL, 0, local_path_loc, 0);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	if (upload->count >= AFC_UPLOAD_MAX_QUEUED_FILES || upload->queued_bytes >= AFC_UPLOAD_MAX_QUEUED_BYTES) {
+		ret = afc_upload_flush(upload);
+	}
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_upload_flush(afc_upload_t upload)
+{
+	struct afc_upload_request *pending = NULL;
+	uint32_t files[AFC_UPLOAD_WINDOW];
+	uint32_t num_files = 0;
+	uint32_t num_pending = 0;
+	uint32_t i = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!upload)
+		return AFC_E_INVALID_ARG;
+
+	if (upload->count == 0)
+		return AFC_E_SUCCESS;
+
+	pending = (struct afc_upload_request*)malloc(AFC_UPLOAD_MAX_PENDING * sizeof(struct afc_upload_request));
+	if (!pending)
+		return AFC_E_NO_MEM;
+
+	afc_lock(upload->client);
+
+	/* directories were queued before their contents, so create them first */
+	for (i = 0; i < upload->count && ret == AFC_E_SUCCESS; i++) {
+		struct afc_upload_item *item = &upload->items[i];
+		if (!item->is_directory) {
+			continue;
+		}
+
+		if (num_pending >= AFC_UPLOAD_MAX_PENDING) {
+			ret = afc_upload_receive(upload, pending, &num_pending);
+			if (ret != AFC_E_SUCCESS) {
+				break;
+			}
+		}
+
+		ret = afc_upload_send(upload, pending, &num_pending, i, AFC_OP_MAKE_DIR, item->path, strlen(item->path) + 1, NULL, 0);
+	}
+
+	if (ret == AFC_E_SUCCESS) {
+		ret = afc_upload_receive(upload, pending, &num_pending);
+	}
+
+	for (i = 0; i < upload->count && ret == AFC_E_SUCCESS; i++) {
+		if (upload->items[i].is_directory) {
+			continue;
+		}
+
+		files[num_files++] = i;
+		if (num_files == AFC_UPLOAD_WINDOW) {
+			ret = afc_upload_write_window(upload, files, num_files, pending);
+			num_files = 0;
+		}
+	}
+
+	if (ret == AFC_E_SUCCESS && num_files > 0) {
+		ret = afc_upload_write_window(upload, files, num_files, pending);
+	}
+
+	afc_unlock(upload->client);
+
+	free(pending);
+
+	if (ret != AFC_E_SUCCESS) {
+		debug_info("upload aborted with error %d", ret);
+	}
+
+	/* report files in the order they were added */
+	for (i = 0; i < upload->count; i++) {
+		struct afc_upload_item *item = &upload->items[i];
+		if (item->is_directory) {
+			continue;
+		}
+
+		if (ret != AFC_E_SUCCESS && !item->complete && item->error == AFC_E_SUCCESS) {
+			item->error = ret;
+		}
+
+		if (upload->callback) {
+			upload->callback(item->path, item->error, upload->user_data);
+		}
+
+		if (ret == AFC_E_SUCCESS) {
+			ret = item->error;
+		}
+	}
+
+	afc_upload_clear(upload);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_upload_free(afc_upload_t upload)
+{
+	if (!upload)
+		return AFC_E_INVALID_ARG;
+
+	afc_upload_clear(upload);
+	free(upload->items);
+	free(upload->buffer);
+	free(upload);
+
+	return AFC_E_SUCCESS;
+}
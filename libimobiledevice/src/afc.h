@@ -57,6 +57,30 @@ struct afc_client_private {
 	int lock;
 	mutex_t mutex;
 	int free_parent;
+	char *send_buffer;
+	uint32_t send_buffer_size;
+};
+
+struct afc_upload_item {
+	char *path;
+	char *data;
+	char *local_path;
+	uint32_t length;
+	int is_directory;
+	uint64_t handle;
+	afc_error_t error;
+	int complete;
+};
+
+struct afc_upload_private {
+	afc_client_t client;
+	afc_upload_cb_t callback;
+	void *user_data;
+	struct afc_upload_item *items;
+	uint32_t count;
+	uint32_t capacity;
+	uint64_t queued_bytes;
+	char *buffer;
 };
 
 /* AFC Operations */
@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #ifdef WIN32
 #include <windows.h>
@@ -86,8 +87,169 @@ static unsigned long id_function(void)
 #endif
 #endif
 
+/* Sessions older than this are not offered for resumption anymore */
+#define SSL_SESSION_CACHE_TIMEOUT 300
+
+#ifdef HAVE_OPENSSL
+typedef SSL_SESSION *ssl_session_data_t;
+#else
+typedef gnutls_datum_t ssl_session_data_t;
+#endif
+
+/**
+ * Cached TLS session for a device port. lockdownd and the services it starts
+ * listen on different ports and keep separate session caches on the device.
+ */
+struct ssl_session_cache_entry {
+	char *udid;
+	uint16_t port;
+	time_t timestamp;
+	ssl_session_data_t session;
+	struct ssl_session_cache_entry *next;
+};
+
+static mutex_t ssl_session_cache_mutex;
+static struct ssl_session_cache_entry *ssl_session_cache = NULL;
+static int ssl_session_cache_enabled = 1;
+static uint32_t ssl_full_handshakes = 0;
+static uint32_t ssl_resumed_handshakes = 0;
+
+static void ssl_session_data_free(ssl_session_data_t session)
+{
+#ifdef HAVE_OPENSSL
+	if (session)
+		SSL_SESSION_free(session);
+#else
+	if (session.data)
+		gnutls_free(session.data);
+#endif
+}
+
+static void ssl_session_cache_entry_free(struct ssl_session_cache_entry *entry)
+{
+	ssl_session_data_free(entry->session);
+	free(entry->udid);
+	free(entry);
+}
+
+/**
+ * Internally used function to find the cached session for the given
+ * connection. Expired entries are dropped. Must be called with
+ * ssl_session_cache_mutex held.
+ *
+ * @return The cached entry or NULL if there is none.
+ */
+static struct ssl_session_cache_entry *ssl_session_cache_lookup(idevice_connection_t connection)
+{
+	struct ssl_session_cache_entry **link = &ssl_session_cache;
+	time_t now = time(NULL);
+
+	while (*link) {
+		struct ssl_session_cache_entry *entry = *link;
+		if (now - entry->timestamp > SSL_SESSION_CACHE_TIMEOUT) {
+			*link = entry->next;
+			ssl_session_cache_entry_free(entry);
+			continue;
+		}
+		if (entry->port == connection->port && !strcmp(entry->udid, connection->udid)) {
+			return entry;
+		}
+		link = &entry->next;
+	}
+	return NULL;
+}
+
+/**
+ * Internally used function to remove the cached session for the given
+ * connection, e.g. after a failed handshake.
+ */
+static void ssl_session_cache_discard(idevice_connection_t connection)
+{
+	struct ssl_session_cache_entry **link;
+
+	mutex_lock(&ssl_session_cache_mutex);
+	for (link = &ssl_session_cache; *link; link = &(*link)->next) {
+		struct ssl_session_cache_entry *entry = *link;
+		if (entry->port == connection->port && !strcmp(entry->udid, connection->udid)) {
+			*link = entry->next;
+			ssl_session_cache_entry_free(entry);
+			break;
+		}
+	}
+	mutex_unlock(&ssl_session_cache_mutex);
+}
+
+/**
+ * Internally used function to record a successful handshake. Takes ownership
+ * of session; if the handshake was a full one, it replaces the cached session
+ * for the connection.
+ */
+static void ssl_session_cache_store(idevice_connection_t connection, int resumed, ssl_session_data_t session)
+{
+	mutex_lock(&ssl_session_cache_mutex);
+	if (resumed) {
+		ssl_resumed_handshakes++;
+	} else {
+		ssl_full_handshakes++;
+	}
+
+	if (!ssl_session_cache_enabled || resumed) {
+		mutex_unlock(&ssl_session_cache_mutex);
+		ssl_session_data_free(session);
+		return;
+	}
+
+	struct ssl_session_cache_entry *entry = ssl_session_cache_lookup(connection);
+	if (entry) {
+		ssl_session_data_free(entry->session);
+	} else {
+		entry = (struct ssl_session_cache_entry*)malloc(sizeof(struct ssl_session_cache_entry));
+		entry->udid = strdup(connection->udid);
+		entry->port = connection->port;
+		entry->next = ssl_session_cache;
+		ssl_session_cache = entry;
+	}
+	entry->session = session;
+	entry->timestamp = time(NULL);
+	mutex_unlock(&ssl_session_cache_mutex);
+}
+
+static void ssl_session_cache_clear(void)
+{
+	struct ssl_session_cache_entry *entry = ssl_session_cache;
+	ssl_session_cache = NULL;
+
+	while (entry) {
+		struct ssl_session_cache_entry *next = entry->next;
+		ssl_session_cache_entry_free(entry);
+		entry = next;
+	}
+}
+
+void idevice_ssl_session_cache_remove(const char *udid)
+{
+	struct ssl_session_cache_entry **link = &ssl_session_cache;
+
+	if (!udid)
+		return;
+
+	mutex_lock(&ssl_session_cache_mutex);
+	while (*link) {
+		struct ssl_session_cache_entry *entry = *link;
+		if (!strcmp(entry->udid, udid)) {
+			*link = entry->next;
+			ssl_session_cache_entry_free(entry);
+		} else {
+			link = &entry->next;
+		}
+	}
+	mutex_unlock(&ssl_session_cache_mutex);
+}
+
 static void internal_idevice_init(void)
 {
+	mutex_init(&ssl_session_cache_mutex);
+
 #ifdef HAVE_OPENSSL
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 	int i;
@@ -109,6 +271,13 @@ static void internal_idevice_init(void)
 
 static void internal_idevice_deinit(void)
 {
+	userpref_clear_cache();
+
+	mutex_lock(&ssl_session_cache_mutex);
+	ssl_session_cache_clear();
+	mutex_unlock(&ssl_session_cache_mutex);
+	mutex_destroy(&ssl_session_cache_mutex);
+
 #ifdef HAVE_OPENSSL
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 	int i;
@@ -169,7 +338,7 @@ static void usbmux_event_cb(const usbmuxd_event_t *event, void *user_data)
 
 	ev.event = event->event;
 	ev.udid = event->device.udid;
-	ev.conn_type = CONNECTION_USBMUXD;
+	ev.conn_type = (event->device.conn_type == CONNECTION_TYPE_NETWORK) ? CONNECTION_NETWORK : CONNECTION_USBMUXD;
 
 	if (event_cb) {
 		event_cb(&ev, user_data);
@@ -247,6 +416,26 @@ LIBIMOBILEDEVICE_API void idevice_set_debug_level(int level)
 	internal_set_debug_level(level);
 }
 
+LIBIMOBILEDEVICE_API void idevice_set_ssl_session_cache_enabled(int enabled)
+{
+	mutex_lock(&ssl_session_cache_mutex);
+	ssl_session_cache_enabled = (enabled) ? 1 : 0;
+	if (!ssl_session_cache_enabled) {
+		ssl_session_cache_clear();
+	}
+	mutex_unlock(&ssl_session_cache_mutex);
+}
+
+LIBIMOBILEDEVICE_API void idevice_get_ssl_handshake_stats(uint32_t *full_handshakes, uint32_t *resumed_handshakes)
+{
+	mutex_lock(&ssl_session_cache_mutex);
+	if (full_handshakes)
+		*full_handshakes = ssl_full_handshakes;
+	if (resumed_handshakes)
+		*resumed_handshakes = ssl_resumed_handshakes;
+	mutex_unlock(&ssl_session_cache_mutex);
+}
+
 LIBIMOBILEDEVICE_API idevice_error_t idevice_new(idevice_t * device, const char *udid)
 {
 	usbmuxd_device_info_t muxdev;
@@ -316,6 +505,7 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connect(idevice_t device, uint16_t
 		}
 		idevice_connection_t new_connection = (idevice_connection_t)malloc(sizeof(struct idevice_connection_private));
 		new_connection->type = CONNECTION_USBMUXD;
+		new_connection->port = port;
 		new_connection->data = (void*)(long)sfd;
 		new_connection->ssl_data = NULL;
 		idevice_get_udid(device, &new_connection->udid);
@@ -517,6 +707,27 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_get_fd(idevice_connectio
 	return result;
 }
 
+/**
+ * Checks whether the SSL layer of a connection has already read data from the
+ * socket that has not been consumed yet. Such data doesn't make the socket
+ * readable, so callers that wait with select() must check this first.
+ *
+ * @param connection The connection to check.
+ *
+ * @return 1 if data is pending, 0 otherwise.
+ */
+int idevice_connection_has_pending_data(idevice_connection_t connection)
+{
+	if (!connection || !connection->ssl_data || !connection->ssl_data->session) {
+		return 0;
+	}
+#ifdef HAVE_OPENSSL
+	return SSL_pending(connection->ssl_data->session) > 0;
+#else
+	return gnutls_record_check_pending(connection->ssl_data->session) > 0;
+#endif
+}
+
 LIBIMOBILEDEVICE_API idevice_error_t idevice_get_handle(idevice_t device, uint32_t *handle)
 {
 	if (!device || !handle)
@@ -621,18 +832,7 @@ static void internal_ssl_cleanup(ssl_data_t ssl_data)
 	if (ssl_data->certificate) {
 		gnutls_certificate_free_credentials(ssl_data->certificate);
 	}
-	if (ssl_data->root_cert) {
-		gnutls_x509_crt_deinit(ssl_data->root_cert);
-	}
-	if (ssl_data->host_cert) {
-		gnutls_x509_crt_deinit(ssl_data->host_cert);
-	}
-	if (ssl_data->root_privkey) {
-		gnutls_x509_privkey_deinit(ssl_data->root_privkey);
-	}
-	if (ssl_data->host_privkey) {
-		gnutls_x509_privkey_deinit(ssl_data->host_privkey);
-	}
+	userpref_credentials_free(ssl_data->credentials);
 #endif
 }
 
@@ -685,7 +885,7 @@ static int internal_cert_callback(gnutls_session_t session, const gnutls_datum_t
 	gnutls_certificate_type_t type = gnutls_certificate_type_get(session);
 	if (type == GNUTLS_CRT_X509) {
 		ssl_data_t ssl_data = (ssl_data_t)gnutls_session_get_ptr(session);
-		if (ssl_data && ssl_data->host_privkey && ssl_data->host_cert) {
+		if (ssl_data && ssl_data->credentials && ssl_data->credentials->host_privkey && ssl_data->credentials->host_cert) {
 			debug_info("Passing certificate");
 #if GNUTLS_VERSION_NUMBER >= 0x020b07
 			st->cert_type = type;
@@ -694,8 +894,8 @@ static int internal_cert_callback(gnutls_session_t session, const gnutls_datum_t
 			st->type = type;
 #endif
 			st->ncerts = 1;
-			st->cert.x509 = &ssl_data->host_cert;
-			st->key.x509 = ssl_data->host_privkey;
+			st->cert.x509 = &ssl_data->credentials->host_cert;
+			st->key.x509 = ssl_data->credentials->host_privkey;
 			st->deinit_all = 0;
 			res = 0;
 		}
@@ -715,27 +915,18 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 #else
 	int return_me = 0;
 #endif
-	plist_t pair_record = NULL;
+	userpref_credentials_t credentials = NULL;
 
-	userpref_read_pair_record(connection->udid, &pair_record);
-	if (!pair_record) {
+	if (userpref_get_credentials(connection->udid, &credentials) != USERPREF_E_SUCCESS) {
 		debug_info("ERROR: Failed enabling SSL. Unable to read pair record for udid %s.", connection->udid);
 		return ret;
 	}
 
 #ifdef HAVE_OPENSSL
-	key_data_t root_cert = { NULL, 0 };
-	key_data_t root_privkey = { NULL, 0 };
-
-	pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, &root_cert);
-	pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, &root_privkey);
-
-	if (pair_record)
-		plist_free(pair_record);
-
 	BIO *ssl_bio = BIO_new(BIO_s_socket());
 	if (!ssl_bio) {
 		debug_info("ERROR: Could not create SSL bio.");
+		userpref_credentials_free(credentials);
 		return ret;
 	}
 	BIO_set_fd(ssl_bio, (int)(long)connection->data, BIO_NOCLOSE);
@@ -744,29 +935,17 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	if (ssl_ctx == NULL) {
 		debug_info("ERROR: Could not create SSL context.");
 		BIO_free(ssl_bio);
+		userpref_credentials_free(credentials);
 		return ret;
 	}
 
-	BIO* membp;
-	X509* rootCert = NULL;
-	membp = BIO_new_mem_buf(root_cert.data, root_cert.size);
-	PEM_read_bio_X509(membp, &rootCert, NULL, NULL);
-	BIO_free(membp);
-	if (SSL_CTX_use_certificate(ssl_ctx, rootCert) != 1) {
+	if (!credentials->root_cert || SSL_CTX_use_certificate(ssl_ctx, credentials->root_cert) != 1) {
 		debug_info("WARNING: Could not load RootCertificate");
 	}
-	X509_free(rootCert);
-	free(root_cert.data);
-
-	RSA* rootPrivKey = NULL;
-	membp = BIO_new_mem_buf(root_privkey.data, root_privkey.size);
-	PEM_read_bio_RSAPrivateKey(membp, &rootPrivKey, NULL, NULL);
-	BIO_free(membp);
-	if (SSL_CTX_use_RSAPrivateKey(ssl_ctx, rootPrivKey) != 1) {
+	if (!credentials->root_privkey || SSL_CTX_use_PrivateKey(ssl_ctx, credentials->root_privkey) != 1) {
 		debug_info("WARNING: Could not load RootPrivateKey");
 	}
-	RSA_free(rootPrivKey);
-	free(root_privkey.data);
+	userpref_credentials_free(credentials);
 
 	SSL *ssl = SSL_new(ssl_ctx);
 	if (!ssl) {
@@ -779,18 +958,30 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	SSL_set_verify(ssl, 0, ssl_verify_callback);
 	SSL_set_bio(ssl, ssl_bio, ssl_bio);
 
+	mutex_lock(&ssl_session_cache_mutex);
+	if (ssl_session_cache_enabled) {
+		struct ssl_session_cache_entry *entry = ssl_session_cache_lookup(connection);
+		if (entry) {
+			debug_info("Offering cached SSL session for port %d", connection->port);
+			SSL_set_session(ssl, entry->session);
+		}
+	}
+	mutex_unlock(&ssl_session_cache_mutex);
+
 	return_me = SSL_do_handshake(ssl);
 	if (return_me != 1) {
 		debug_info("ERROR in SSL_do_handshake: %s", ssl_error_to_string(SSL_get_error(ssl, return_me)));
 		SSL_free(ssl);
 		SSL_CTX_free(ssl_ctx);
+		ssl_session_cache_discard(connection);
 	} else {
 		ssl_data_t ssl_data_loc = (ssl_data_t)malloc(sizeof(struct ssl_data_private));
 		ssl_data_loc->session = ssl;
 		ssl_data_loc->ctx = ssl_ctx;
 		connection->ssl_data = ssl_data_loc;
 		ret = IDEVICE_E_SUCCESS;
-		debug_info("SSL mode enabled, cipher: %s", SSL_get_cipher(ssl));
+		ssl_session_cache_store(connection, SSL_session_reused(ssl), SSL_get1_session(ssl));
+		debug_info("SSL mode enabled, cipher: %s%s", SSL_get_cipher(ssl), SSL_session_reused(ssl) ? " (resumed)" : "");
 	}
 	/* required for proper multi-thread clean up to prevent leaks */
 	openssl_remove_thread_state();
@@ -811,18 +1002,8 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	gnutls_credentials_set(ssl_data_loc->session, GNUTLS_CRD_CERTIFICATE, ssl_data_loc->certificate);
 	gnutls_session_set_ptr(ssl_data_loc->session, ssl_data_loc);
 
-	gnutls_x509_crt_init(&ssl_data_loc->root_cert);
-	gnutls_x509_crt_init(&ssl_data_loc->host_cert);
-	gnutls_x509_privkey_init(&ssl_data_loc->root_privkey);
-	gnutls_x509_privkey_init(&ssl_data_loc->host_privkey);
-
-	pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, ssl_data_loc->root_cert);
-	pair_record_import_crt_with_name(pair_record, USERPREF_HOST_CERTIFICATE_KEY, ssl_data_loc->host_cert);
-	pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, ssl_data_loc->root_privkey);
-	pair_record_import_key_with_name(pair_record, USERPREF_HOST_PRIVATE_KEY_KEY, ssl_data_loc->host_privkey);
-
-	if (pair_record)
-		plist_free(pair_record);
+	/* the cached credentials are shared, so they are only referenced here */
+	ssl_data_loc->credentials = credentials;
 
 	debug_info("GnuTLS step 1...");
 	gnutls_transport_set_ptr(ssl_data_loc->session, (gnutls_transport_ptr_t)connection);
@@ -835,6 +1016,16 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 		debug_info("WARNING: errno says %s before handshake!", strerror(errno));
 	}
 
+	mutex_lock(&ssl_session_cache_mutex);
+	if (ssl_session_cache_enabled) {
+		struct ssl_session_cache_entry *entry = ssl_session_cache_lookup(connection);
+		if (entry) {
+			debug_info("Offering cached SSL session for port %d", connection->port);
+			gnutls_session_set_data(ssl_data_loc->session, entry->session.data, entry->session.size);
+		}
+	}
+	mutex_unlock(&ssl_session_cache_mutex);
+
 	do {
 		return_me = gnutls_handshake(ssl_data_loc->session);
 	} while(return_me == GNUTLS_E_AGAIN || return_me == GNUTLS_E_INTERRUPTED);
@@ -844,12 +1035,20 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	if (return_me != GNUTLS_E_SUCCESS) {
 		internal_ssl_cleanup(ssl_data_loc);
 		free(ssl_data_loc);
+		ssl_session_cache_discard(connection);
 		debug_info("GnuTLS reported something wrong: %s", gnutls_strerror(return_me));
 		debug_info("oh.. errno says %s", strerror(errno));
 	} else {
+		gnutls_datum_t session_data = { NULL, 0 };
+		int resumed = gnutls_session_is_resumed(ssl_data_loc->session);
+		if (!resumed) {
+			gnutls_session_get_data2(ssl_data_loc->session, &session_data);
+		}
+		ssl_session_cache_store(connection, resumed, session_data);
+
 		connection->ssl_data = ssl_data_loc;
 		ret = IDEVICE_E_SUCCESS;
-		debug_info("SSL mode enabled");
+		debug_info("SSL mode enabled%s", resumed ? " (resumed)" : "");
 	}
 #endif
 	return ret;
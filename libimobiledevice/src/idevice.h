@@ -46,10 +46,6 @@
 #include "common/userpref.h"
 #include "libimobiledevice/libimobiledevice.h"
 
-enum connection_type {
-	CONNECTION_USBMUXD = 1
-};
-
 struct ssl_data_private {
 #ifdef HAVE_OPENSSL
 	SSL *session;
@@ -57,17 +53,15 @@ struct ssl_data_private {
 #else
 	gnutls_certificate_credentials_t certificate;
 	gnutls_session_t session;
-	gnutls_x509_privkey_t root_privkey;
-	gnutls_x509_crt_t root_cert;
-	gnutls_x509_privkey_t host_privkey;
-	gnutls_x509_crt_t host_cert;
+	userpref_credentials_t credentials;
 #endif
 };
 typedef struct ssl_data_private *ssl_data_t;
 
 struct idevice_connection_private {
 	char *udid;
-	enum connection_type type;
+	uint16_t port;
+	enum idevice_connection_type type;
 	void *data;
 	ssl_data_t ssl_data;
 };
@@ -75,9 +69,12 @@ struct idevice_connection_private {
 struct idevice_private {
 	char *udid;
 	uint32_t mux_id;
-	enum connection_type conn_type;
+	enum idevice_connection_type conn_type;
 	void *conn_data;
 	int version;
 };
 
+void idevice_ssl_session_cache_remove(const char *udid);
+int idevice_connection_has_pending_data(idevice_connection_t connection);
+
 #endif
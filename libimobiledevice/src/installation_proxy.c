@@ -24,24 +24,63 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <errno.h>
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <sys/select.h>
+#endif
 #include <plist/plist.h>
 
 #include "installation_proxy.h"
 #include "property_list_service.h"
 #include "common/debug.h"
+#include "common/socket.h"
 
 typedef enum {
 	INSTPROXY_COMMAND_TYPE_ASYNC,
 	INSTPROXY_COMMAND_TYPE_SYNC
 } instproxy_command_type_t;
 
-struct instproxy_status_data {
+/** Seconds a device's I/O loop stays alive without any pending operation. */
+#define INSTPROXY_IO_LOOP_IDLE_TIMEOUT 30
+
+struct instproxy_io_loop;
+
+struct instproxy_operation_private {
+	int refcount;
 	instproxy_client_t client;
 	plist_t command;
-	instproxy_status_cb_t cbfunc;
+	char *command_name;
+	instproxy_status_cb_t status_cb;
 	void *user_data;
+	int fd;
+	int cancelled;
+	int complete;
+	instproxy_error_t result;
+	cond_t cond;
+	struct instproxy_io_loop *loop;
+	struct instproxy_operation_private *next;
+};
+
+/**
+ * Receives the status messages of all asynchronous commands running on a
+ * device. A single thread per device waits in select() until one of the
+ * registered connections (or the wake socket) becomes readable, so neither
+ * a thread per command nor polling with receive timeouts is needed.
+ */
+struct instproxy_io_loop {
+	char *udid;
+	int wake_fds[2];
+	instproxy_operation_t operations;
+	struct instproxy_io_loop *next;
 };
 
+/* Protects all I/O loops, their operation lists and client->operation. */
+static mutex_t io_mutex;
+static thread_once_t io_once = THREAD_ONCE_INIT;
+static struct instproxy_io_loop *io_loops = NULL;
+
 /**
  * Converts an error string identifier to a instproxy_error_t value.
  * Used internally to get correct error codes from a response.
@@ -229,6 +268,391 @@ static instproxy_error_t instproxy_error(property_list_service_error_t err)
 	return INSTPROXY_E_UNKNOWN_ERROR;
 }
 
+/**
+ * Returns the device connection of an installation_proxy client.
+ */
+static idevice_connection_t instproxy_get_connection(instproxy_client_t client)
+{
+	if (!client || !client->parent || !client->parent->parent) {
+		return NULL;
+	}
+	return client->parent->parent->connection;
+}
+
+static void instproxy_io_init(void)
+{
+	mutex_init(&io_mutex);
+}
+
+/**
+ * Creates a new operation for an asynchronous command. The returned
+ * operation holds one reference for the caller.
+ */
+static instproxy_operation_t instproxy_operation_new(instproxy_client_t client, plist_t command, instproxy_status_cb_t status_cb, void *user_data)
+{
+	instproxy_operation_t operation = (instproxy_operation_t)calloc(1, sizeof(struct instproxy_operation_private));
+	if (!operation) {
+		return NULL;
+	}
+
+	operation->refcount = 1;
+	operation->client = client;
+	operation->command = plist_copy(command);
+	instproxy_command_get_name(command, &operation->command_name);
+	operation->status_cb = status_cb;
+	operation->user_data = user_data;
+	operation->fd = -1;
+	operation->result = INSTPROXY_E_OP_IN_PROGRESS;
+	cond_init(&operation->cond);
+
+	return operation;
+}
+
+/**
+ * Drops a reference to an operation, freeing it when it was the last one.
+ * io_mutex must be held by the caller.
+ */
+static void instproxy_operation_release(instproxy_operation_t operation)
+{
+	if (--operation->refcount > 0) {
+		return;
+	}
+
+	plist_free(operation->command);
+	free(operation->command_name);
+	cond_destroy(&operation->cond);
+	free(operation);
+}
+
+/**
+ * Wakes up the thread of an I/O loop so it picks up added or cancelled
+ * operations.
+ */
+static void instproxy_io_loop_wake(struct instproxy_io_loop *loop)
+{
+	char c = 0;
+	if (loop) {
+		socket_send(loop->wake_fds[0], &c, 1);
+	}
+}
+
+/**
+ * Removes a finished operation from its I/O loop and wakes up anyone waiting
+ * for it. io_mutex must be held by the caller.
+ */
+static void instproxy_operation_finish(struct instproxy_io_loop *loop, instproxy_operation_t operation, instproxy_error_t result)
+{
+	instproxy_operation_t *p = &loop->operations;
+	while (*p && *p != operation) {
+		p = &(*p)->next;
+	}
+	if (*p) {
+		*p = operation->next;
+	}
+	operation->next = NULL;
+	operation->loop = NULL;
+
+	if (operation->client->operation == operation) {
+		operation->client->operation = NULL;
+	}
+	operation->client = NULL;
+
+	operation->result = result;
+	operation->complete = 1;
+	cond_broadcast(&operation->cond);
+
+	/* drop the reference held by the I/O loop */
+	instproxy_operation_release(operation);
+}
+
+/**
+ * Checks a status message for errors and completion, and passes it to the
+ * status callback.
+ *
+ * @param command The command the status belongs to.
+ * @param command_name The name of the command, for debug output.
+ * @param node The received status message.
+ * @param status_cb Pointer to a callback function or NULL.
+ * @param user_data Callback data passed to status_cb.
+ * @param complete Set to 1 if the command has finished.
+ *
+ * @return INSTPROXY_E_SUCCESS if the command completed successfully,
+ *     INSTPROXY_E_OP_IN_PROGRESS if it is still running, or an INSTPROXY_E_*
+ *     error value reported by the device.
+ */
+static instproxy_error_t instproxy_handle_status(plist_t command, const char *command_name, plist_t node, instproxy_status_cb_t status_cb, void *user_data, int *complete)
+{
+	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
+	char* status_name = NULL;
+	char* error_name = NULL;
+	char* error_description = NULL;
+	uint64_t error_code = 0;
+#ifndef STRIP_DEBUG_CODE
+	int percent_complete = 0;
+#endif
+
+	/* check status for possible error to allow reporting it and aborting it gracefully */
+	res = instproxy_status_get_error(node, &error_name, &error_description, &error_code);
+	if (res != INSTPROXY_E_SUCCESS) {
+		debug_info("command: %s, error %d, code 0x%08"PRIx64", name: %s, description: \"%s\"", command_name, res, error_code, error_name, error_description ? error_description: "N/A");
+		*complete = 1;
+	}
+
+	if (error_name) {
+		free(error_name);
+		error_name = NULL;
+	}
+
+	if (error_description) {
+		free(error_description);
+		error_description = NULL;
+	}
+
+	/* check status from response */
+	instproxy_status_get_name(node, &status_name);
+	if (!status_name) {
+		debug_info("failed to retrieve name from status response with error %d.", res);
+		*complete = 1;
+	}
+
+	if (status_name) {
+		if (!strcmp(status_name, "Complete")) {
+			*complete = 1;
+		} else {
+			res = INSTPROXY_E_OP_IN_PROGRESS;
+		}
+
+#ifndef STRIP_DEBUG_CODE
+		percent_complete = -1;
+		instproxy_status_get_percent_complete(node, &percent_complete);
+		if (percent_complete >= 0) {
+			debug_info("command: %s, status: %s, percent (%d%%)", command_name, status_name, percent_complete);
+		} else {
+			debug_info("command: %s, status: %s", command_name, status_name);
+		}
+#endif
+		free(status_name);
+		status_name = NULL;
+	}
+
+	/* invoke status callback function */
+	if (status_cb) {
+		status_cb(command, node, user_data);
+	}
+
+	return res;
+}
+
+/**
+ * Receives and handles the status messages of an operation once its
+ * connection became readable. Called from the I/O loop thread without
+ * io_mutex held.
+ *
+ * @param operation The operation to receive status messages for.
+ * @param result Set to the result of the operation if it has finished.
+ *
+ * @return 1 if the operation has finished, 0 otherwise.
+ */
+static int instproxy_operation_receive(instproxy_operation_t operation, instproxy_error_t *result)
+{
+	instproxy_client_t client = operation->client;
+	idevice_connection_t connection = instproxy_get_connection(client);
+	int complete = 0;
+
+	do {
+		plist_t node = NULL;
+
+		instproxy_lock(client);
+		instproxy_error_t res = instproxy_error(property_list_service_receive_plist(client->parent, &node));
+		instproxy_unlock(client);
+
+		if (res != INSTPROXY_E_SUCCESS) {
+			debug_info("could not receive plist, error %d", res);
+			*result = res;
+			return 1;
+		}
+
+		if (node) {
+			*result = instproxy_handle_status(operation->command, operation->command_name, node, operation->status_cb, operation->user_data, &complete);
+			plist_free(node);
+		}
+
+		/* data already decrypted by the SSL layer doesn't wake up select() */
+	} while (!complete && idevice_connection_has_pending_data(connection));
+
+	return complete;
+}
+
+/**
+ * Thread function of a device's I/O loop. Exits after the loop has been idle
+ * for INSTPROXY_IO_LOOP_IDLE_TIMEOUT seconds.
+ */
+static void* instproxy_io_loop_thread(void* arg)
+{
+	struct instproxy_io_loop *loop = (struct instproxy_io_loop*)arg;
+	struct instproxy_io_loop **p = NULL;
+	char buf[16];
+
+	mutex_lock(&io_mutex);
+
+	while (1) {
+		instproxy_operation_t operation = NULL;
+		instproxy_operation_t next = NULL;
+		instproxy_error_t result = INSTPROXY_E_UNKNOWN_ERROR;
+		struct timeval timeout;
+		fd_set fds;
+		int maxfd = loop->wake_fds[1];
+		int idle = 0;
+		int res = 0;
+
+		FD_ZERO(&fds);
+		FD_SET(loop->wake_fds[1], &fds);
+
+		for (operation = loop->operations; operation; operation = next) {
+			next = operation->next;
+			if (operation->cancelled) {
+				instproxy_operation_finish(loop, operation, INSTPROXY_E_CONN_FAILED);
+				continue;
+			}
+			FD_SET(operation->fd, &fds);
+			if (operation->fd > maxfd) {
+				maxfd = operation->fd;
+			}
+		}
+
+		idle = (loop->operations == NULL);
+		timeout.tv_sec = INSTPROXY_IO_LOOP_IDLE_TIMEOUT;
+		timeout.tv_usec = 0;
+
+		mutex_unlock(&io_mutex);
+		res = select(maxfd + 1, &fds, NULL, NULL, idle ? &timeout : NULL);
+		mutex_lock(&io_mutex);
+
+		if (res == 0) {
+			if (loop->operations == NULL) {
+				break;
+			}
+			continue;
+		}
+
+		if (res < 0) {
+#ifndef WIN32
+			if (errno == EINTR) {
+				continue;
+			}
+#endif
+			debug_info("select failed, cancelling all operations");
+			while (loop->operations) {
+				instproxy_operation_finish(loop, loop->operations, INSTPROXY_E_CONN_FAILED);
+			}
+			continue;
+		}
+
+		if (FD_ISSET(loop->wake_fds[1], &fds)) {
+			socket_receive(loop->wake_fds[1], buf, sizeof(buf));
+		}
+
+		/* operations are only removed by this thread, and new ones are
+		 * prepended, so next stays valid while io_mutex is released */
+		for (operation = loop->operations; operation; operation = next) {
+			next = operation->next;
+			if (operation->cancelled || !FD_ISSET(operation->fd, &fds)) {
+				continue;
+			}
+
+			mutex_unlock(&io_mutex);
+			int complete = instproxy_operation_receive(operation, &result);
+			mutex_lock(&io_mutex);
+
+			if (complete) {
+				instproxy_operation_finish(loop, operation, result);
+			}
+		}
+	}
+
+	/* unregister while still holding io_mutex so no new operation is added */
+	for (p = &io_loops; *p && *p != loop; p = &(*p)->next);
+	if (*p) {
+		*p = loop->next;
+	}
+
+	mutex_unlock(&io_mutex);
+
+	debug_info("I/O loop for %s is idle, exiting", loop->udid);
+
+	socket_close(loop->wake_fds[0]);
+	socket_close(loop->wake_fds[1]);
+	free(loop->udid);
+	free(loop);
+
+	return NULL;
+}
+
+/**
+ * Registers an operation with the I/O loop of its device, starting the loop
+ * if necessary. io_mutex must be held by the caller.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
+ *     an error occured.
+ */
+static instproxy_error_t instproxy_io_loop_add(instproxy_operation_t operation)
+{
+	idevice_connection_t connection = instproxy_get_connection(operation->client);
+	struct instproxy_io_loop *loop = NULL;
+	const char *udid = NULL;
+
+	if (!connection || idevice_connection_get_fd(connection, &operation->fd) != IDEVICE_E_SUCCESS) {
+		return INSTPROXY_E_CONN_FAILED;
+	}
+
+	udid = connection->udid ? connection->udid : "";
+	for (loop = io_loops; loop; loop = loop->next) {
+		if (!strcmp(loop->udid, udid)) {
+			break;
+		}
+	}
+
+	if (!loop) {
+		thread_t thread;
+
+		loop = (struct instproxy_io_loop*)calloc(1, sizeof(struct instproxy_io_loop));
+		if (!loop) {
+			return INSTPROXY_E_UNKNOWN_ERROR;
+		}
+
+		if (socket_pair(loop->wake_fds) != 0) {
+			debug_info("could not create wake sockets");
+			free(loop);
+			return INSTPROXY_E_UNKNOWN_ERROR;
+		}
+
+		loop->udid = strdup(udid);
+
+		/* the thread blocks on io_mutex until we are done here */
+		if (thread_new(&thread, instproxy_io_loop_thread, loop) != 0) {
+			socket_close(loop->wake_fds[0]);
+			socket_close(loop->wake_fds[1]);
+			free(loop->udid);
+			free(loop);
+			return INSTPROXY_E_UNKNOWN_ERROR;
+		}
+		thread_detach(thread);
+
+		loop->next = io_loops;
+		io_loops = loop;
+	}
+
+	/* reference held by the I/O loop until the operation finishes */
+	operation->refcount++;
+	operation->loop = loop;
+	operation->next = loop->operations;
+	loop->operations = operation;
+
+	instproxy_io_loop_wake(loop);
+
+	return INSTPROXY_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_new(idevice_t device, lockdownd_service_descriptor_t service, instproxy_client_t *client)
 {
 	property_list_service_client_t plistclient = NULL;
@@ -240,7 +664,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_new(idevice_t device, lo
 	instproxy_client_t client_loc = (instproxy_client_t) malloc(sizeof(struct instproxy_client_private));
 	client_loc->parent = plistclient;
 	mutex_init(&client_loc->mutex);
-	client_loc->receive_status_thread = (thread_t)NULL;
+	client_loc->operation = NULL;
 
 	*client = client_loc;
 	return INSTPROXY_E_SUCCESS;
@@ -255,17 +679,30 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_start_service(idevice_t
 
 LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_free(instproxy_client_t client)
 {
+	instproxy_operation_t operation = NULL;
+
 	if (!client)
 		return INSTPROXY_E_INVALID_ARG;
 
+	/* stop receiving status messages before the connection goes away */
+	thread_once(&io_once, instproxy_io_init);
+	mutex_lock(&io_mutex);
+	if (client->operation) {
+		operation = client->operation;
+		operation->refcount++;
+		operation->cancelled = 1;
+		instproxy_io_loop_wake(operation->loop);
+	}
+	mutex_unlock(&io_mutex);
+
+	if (operation) {
+		debug_info("cancelling pending operation");
+		instproxy_operation_wait(operation, 0);
+		instproxy_operation_free(operation);
+	}
+
 	property_list_service_client_free(client->parent);
 	client->parent = NULL;
-	if (client->receive_status_thread) {
-		debug_info("joining receive_status_thread");
-		thread_join(client->receive_status_thread);
-		thread_free(client->receive_status_thread);
-		client->receive_status_thread = (thread_t)NULL;
-	}
 	mutex_destroy(&client->mutex);
 	free(client);
 
@@ -319,13 +756,6 @@ static instproxy_error_t instproxy_receive_status_loop(instproxy_client_t client
 	int complete = 0;
 	plist_t node = NULL;
 	char* command_name = NULL;
-	char* status_name = NULL;
-	char* error_name = NULL;
-	char* error_description = NULL;
-	uint64_t error_code = 0;
-#ifndef STRIP_DEBUG_CODE
-	int percent_complete = 0;
-#endif
 
 	instproxy_command_get_name(command, &command_name);
 
@@ -343,54 +773,7 @@ static instproxy_error_t instproxy_receive_status_loop(instproxy_client_t client
 
 		/* parse status response */
 		if (node) {
-			/* check status for possible error to allow reporting it and aborting it gracefully */
-			res = instproxy_status_get_error(node, &error_name, &error_description, &error_code);
-			if (res != INSTPROXY_E_SUCCESS) {
-				debug_info("command: %s, error %d, code 0x%08"PRIx64", name: %s, description: \"%s\"", command_name, res, error_code, error_name, error_description ? error_description: "N/A");
-				complete = 1;
-			}
-
-			if (error_name) {
-				free(error_name);
-				error_name = NULL;
-			}
-
-			if (error_description) {
-				free(error_description);
-				error_description = NULL;
-			}
-
-			/* check status from response */
-			instproxy_status_get_name(node, &status_name);
-			if (!status_name) {
-				debug_info("failed to retrieve name from status response with error %d.", res);
-				complete = 1;
-			}
-
-			if (status_name) {
-				if (!strcmp(status_name, "Complete")) {
-					complete = 1;
-				} else {
-					res = INSTPROXY_E_OP_IN_PROGRESS;
-				}
-
-#ifndef STRIP_DEBUG_CODE
-				percent_complete = -1;
-				instproxy_status_get_percent_complete(node, &percent_complete);
-				if (percent_complete >= 0) {
-					debug_info("command: %s, status: %s, percent (%d%%)", command_name, status_name, percent_complete);
-				} else {
-					debug_info("command: %s, status: %s", command_name, status_name);
-				}
-#endif
-				free(status_name);
-				status_name = NULL;
-			}
-
-			/* invoke status callback function */
-			if (status_cb) {
-				status_cb(command, node, user_data);
-			}
+			res = instproxy_handle_status(command, command_name, node, status_cb, user_data, &complete);
 
 			plist_free(node);
 			node = NULL;
@@ -403,116 +786,47 @@ static instproxy_error_t instproxy_receive_status_loop(instproxy_client_t client
 	return res;
 }
 
-/**
- * Internally used "receive status" thread function that will call the specified
- * callback function when status update messages (or error messages) are
- * received.
- *
- * @param arg Pointer to an allocated struct instproxy_status_data that holds
- *     the required data about the connected client and the callback function.
- *
- * @return Always NULL.
- */
-static void* instproxy_receive_status_loop_thread(void* arg)
-{
-	struct instproxy_status_data *data = (struct instproxy_status_data*)arg;
-
-	/* run until the command is complete or an error occurs */
-	(void)instproxy_receive_status_loop(data->client, data->command, data->cbfunc, data->user_data);
-
-	/* cleanup */
-	instproxy_lock(data->client);
-
-	debug_info("done, cleaning up.");
-
-	if (data->command) {
-		plist_free(data->command);
-	}
-
-	if (data->client->receive_status_thread) {
-		thread_free(data->client->receive_status_thread);
-		data->client->receive_status_thread = (thread_t)NULL;
-	}
-
-	instproxy_unlock(data->client);
-	free(data);
-
-	return NULL;
-}
-
-/**
- * Internally used helper function that creates a "receive status" thread which
- * will call the passed callback function when a status is received.
- *
- * If async is 0 no thread will be created and the command will run
- * synchronously until it completes or an error occurs.
- *
- * @param client The connected installation proxy client
- * @param command Operation name. Will be passed to the callback function
- *        in async mode or shown in debug messages in sync mode.
- * @param async A boolean indicating if receive loop should be run
- *        asynchronously or block.
- * @param status_cb Pointer to a callback function or NULL.
- * @param user_data Callback data passed to status_cb.
- *
- * @return INSTPROXY_E_SUCCESS when the thread was created (async mode), or
- *         when the command completed successfully (sync).
- *         An INSTPROXY_E_* error value is returned if an error occured.
- */
-static instproxy_error_t instproxy_receive_status_loop_with_callback(instproxy_client_t client, plist_t command, instproxy_command_type_t async, instproxy_status_cb_t status_cb, void *user_data)
-{
-	if (!client || !client->parent || !command) {
-		return INSTPROXY_E_INVALID_ARG;
-	}
-
-	if (client->receive_status_thread) {
-		return INSTPROXY_E_OP_IN_PROGRESS;
-	}
-
-	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
-	if (async == INSTPROXY_COMMAND_TYPE_ASYNC) {
-		/* async mode */
-		struct instproxy_status_data *data = (struct instproxy_status_data*)malloc(sizeof(struct instproxy_status_data));
-		if (data) {
-			data->client = client;
-			data->command = plist_copy(command);
-			data->cbfunc = status_cb;
-			data->user_data = user_data;
-
-			if (thread_new(&client->receive_status_thread, instproxy_receive_status_loop_thread, data) == 0) {
-				res = INSTPROXY_E_SUCCESS;
-			}
-		}
-	} else {
-		/* sync mode as a fallback */
-		res = instproxy_receive_status_loop(client, command, status_cb, user_data);
-	}
-
-	return res;
-}
-
 /**
  * Internal core function to send a command and process the response.
  *
+ * In async mode the status messages are received by the I/O loop of the
+ * device, which calls status_cb from its own thread.
+ *
  * @param client The connected installation_proxy client
  * @param command The command specification dictionary.
  * @param async A boolean indicating whether the receive loop should be run
  *        asynchronously or block until completing the command.
  * @param status_cb Callback function to call if a command status is received.
  * @param user_data Callback data passed to status_cb.
+ * @param operation Set to the operation of the command in async mode, or
+ *        NULL if the caller isn't interested in its completion.
  *
  * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
  *     an error occured.
  */
-static instproxy_error_t instproxy_perform_command(instproxy_client_t client, plist_t command, instproxy_command_type_t async, instproxy_status_cb_t status_cb, void *user_data)
+static instproxy_error_t instproxy_perform_command(instproxy_client_t client, plist_t command, instproxy_command_type_t async, instproxy_status_cb_t status_cb, void *user_data, instproxy_operation_t *operation)
 {
+	instproxy_operation_t operation_loc = NULL;
+
 	if (!client || !client->parent || !command) {
 		return INSTPROXY_E_INVALID_ARG;
 	}
 
-	if (client->receive_status_thread) {
+	thread_once(&io_once, instproxy_io_init);
+	mutex_lock(&io_mutex);
+	if (client->operation) {
+		mutex_unlock(&io_mutex);
 		return INSTPROXY_E_OP_IN_PROGRESS;
 	}
+	if (async == INSTPROXY_COMMAND_TYPE_ASYNC) {
+		operation_loc = instproxy_operation_new(client, command, status_cb, user_data);
+		if (!operation_loc) {
+			mutex_unlock(&io_mutex);
+			return INSTPROXY_E_UNKNOWN_ERROR;
+		}
+		client->operation = operation_loc;
+	}
+	mutex_unlock(&io_mutex);
 
 	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
 
@@ -521,12 +835,67 @@ static instproxy_error_t instproxy_perform_command(instproxy_client_t client, pl
 	res = instproxy_send_command(client, command);
 	instproxy_unlock(client);
 
-	/* loop until status or error is received */
-	res = instproxy_receive_status_loop_with_callback(client, command, async, status_cb, user_data);
+	if (async != INSTPROXY_COMMAND_TYPE_ASYNC) {
+		/* loop until status or error is received */
+		if (res == INSTPROXY_E_SUCCESS) {
+			res = instproxy_receive_status_loop(client, command, status_cb, user_data);
+		}
+		return res;
+	}
+
+	mutex_lock(&io_mutex);
+	if (res == INSTPROXY_E_SUCCESS) {
+		res = instproxy_io_loop_add(operation_loc);
+	}
+	if (res != INSTPROXY_E_SUCCESS) {
+		client->operation = NULL;
+		instproxy_operation_release(operation_loc);
+	} else if (operation) {
+		*operation = operation_loc;
+	} else {
+		/* nobody waits for it, the I/O loop frees it when done */
+		instproxy_operation_release(operation_loc);
+	}
+	mutex_unlock(&io_mutex);
 
 	return res;
 }
 
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_operation_wait(instproxy_operation_t operation, unsigned int timeout)
+{
+	instproxy_error_t res = INSTPROXY_E_RECEIVE_TIMEOUT;
+
+	if (!operation)
+		return INSTPROXY_E_INVALID_ARG;
+
+	mutex_lock(&io_mutex);
+	while (!operation->complete) {
+		if (timeout == 0) {
+			cond_wait(&operation->cond, &io_mutex);
+		} else if (cond_wait_timeout(&operation->cond, &io_mutex, timeout) != 0) {
+			break;
+		}
+	}
+	if (operation->complete) {
+		res = operation->result;
+	}
+	mutex_unlock(&io_mutex);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_operation_free(instproxy_operation_t operation)
+{
+	if (!operation)
+		return INSTPROXY_E_INVALID_ARG;
+
+	mutex_lock(&io_mutex);
+	instproxy_operation_release(operation);
+	mutex_unlock(&io_mutex);
+
+	return INSTPROXY_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse_with_callback(instproxy_client_t client, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data)
 {
 	if (!client || !client->parent || !status_cb)
@@ -539,7 +908,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse_with_callback(instproxy_
 	if (client_options)
 		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
 
-	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, (void*)user_data);
+	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, (void*)user_data, NULL);
 
 	plist_free(command);
 
@@ -582,7 +951,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse(instproxy_client_t clien
 	if (client_options)
 		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
 
-	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_append_current_list_to_result_cb, (void*)&result_array);
+	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_append_current_list_to_result_cb, (void*)&result_array, NULL);
 
 	if (res == INSTPROXY_E_SUCCESS) {
 		*result = result_array;
@@ -639,7 +1008,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_lookup(instproxy_client_t clien
 		plist_dict_set_item(command, "ClientOptions", node);
 	}
 
-	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_copy_lookup_result_cb, (void*)&lookup_result);
+	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_copy_lookup_result_cb, (void*)&lookup_result, NULL);
 
 	if (res == INSTPROXY_E_SUCCESS) {
 		*result = lookup_result;
@@ -662,7 +1031,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_install(instproxy_client_t clie
 		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
 	plist_dict_set_item(command, "PackagePath", plist_new_string(pkg_path));
 
-	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data);
+	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data, NULL);
 
 	plist_free(command);
 
@@ -679,7 +1048,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_upgrade(instproxy_client_t clie
 		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
 	plist_dict_set_item(command, "PackagePath", plist_new_string(pkg_path));
 
-	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data);
+	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data, NULL);
 
 	plist_free(command);
 
@@ -696,7 +1065,47 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_uninstall(instproxy_client_t cl
 		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
 	plist_dict_set_item(command, "ApplicationIdentifier", plist_new_string(appid));
 
-	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data);
+	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data, NULL);
+
+	plist_free(command);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_install_async(instproxy_client_t client, const char *pkg_path, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data, instproxy_operation_t *operation)
+{
+	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
+
+	if (!operation)
+		return INSTPROXY_E_INVALID_ARG;
+
+	plist_t command = plist_new_dict();
+	plist_dict_set_item(command, "Command", plist_new_string("Install"));
+	if (client_options)
+		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
+	plist_dict_set_item(command, "PackagePath", plist_new_string(pkg_path));
+
+	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data, operation);
+
+	plist_free(command);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_uninstall_async(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data, instproxy_operation_t *operation)
+{
+	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
+
+	if (!operation)
+		return INSTPROXY_E_INVALID_ARG;
+
+	plist_t command = plist_new_dict();
+	plist_dict_set_item(command, "Command", plist_new_string("Uninstall"));
+	if (client_options)
+		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
+	plist_dict_set_item(command, "ApplicationIdentifier", plist_new_string(appid));
+
+	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data, operation);
 
 	plist_free(command);
 
@@ -712,7 +1121,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_lookup_archives(instproxy_clien
 	if (client_options)
 		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
 
-	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_copy_lookup_result_cb, (void*)result);
+	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_copy_lookup_result_cb, (void*)result, NULL);
 
 	plist_free(command);
 
@@ -729,7 +1138,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_archive(instproxy_client_t clie
 		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
 	plist_dict_set_item(command, "ApplicationIdentifier", plist_new_string(appid));
 
-	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data);
+	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data, NULL);
 
 	plist_free(command);
 
@@ -746,7 +1155,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_restore(instproxy_client_t clie
 		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
 	plist_dict_set_item(command, "ApplicationIdentifier", plist_new_string(appid));
 
-	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data);
+	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data, NULL);
 
 	plist_free(command);
 
@@ -763,7 +1172,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_remove_archive(instproxy_client
 		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
 	plist_dict_set_item(command, "ApplicationIdentifier", plist_new_string(appid));
 
-	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data);
+	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data, NULL);
 
 	plist_free(command);
 
@@ -794,7 +1203,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_check_capabilities_match(instpr
 		plist_dict_set_item(command, "Capabilities", capabilities_array);
 	}
 
-	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_copy_lookup_result_cb, (void*)&lookup_result);
+	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_copy_lookup_result_cb, (void*)&lookup_result, NULL);
 
 	if (res == INSTPROXY_E_SUCCESS) {
 		*result = lookup_result;
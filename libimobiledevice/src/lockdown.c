@@ -985,6 +985,7 @@ static lockdownd_error_t lockdownd_do_pair(lockdownd_client_t client, lockdownd_
 			if (!strcmp("Unpair", verb)) {
 				/* remove public key from config */
 				userpref_delete_pair_record(client->udid);
+				idevice_ssl_session_cache_remove(client->udid);
 			} else {
 				if (!strcmp("Pair", verb)) {
 					/* add returned escrow bag if available */
@@ -1003,6 +1004,7 @@ static lockdownd_error_t lockdownd_do_pair(lockdownd_client_t client, lockdownd_
 					}
 
 					userpref_save_pair_record(client->udid, client->mux_id, pair_record_plist);
+					idevice_ssl_session_cache_remove(client->udid);
 				}
 			}
 		} else {
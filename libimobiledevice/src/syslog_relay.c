@@ -32,6 +32,8 @@
 struct syslog_relay_worker_thread {
 	syslog_relay_client_t client;
 	syslog_relay_receive_cb_t cbfunc;
+	syslog_relay_receive_lines_cb_t lines_cbfunc;
+	syslog_relay_filter_t filter;
 	void *user_data;
 };
 
@@ -173,6 +175,206 @@ void *syslog_relay_worker(void *arg)
 	return NULL;
 }
 
+/**
+ * Finds the name of the process that logged a syslog line. Lines look like
+ * "Oct 19 12:00:00 Device-Name Process(Subsystem)[123] <Notice>: Message".
+ *
+ * @param line The NUL-terminated line.
+ * @param length Will be set to the length of the process name.
+ *
+ * @return A pointer to the process name within line, or NULL if the line
+ *     isn't in the expected format.
+ */
+static const char *syslog_relay_line_process(const char *line, size_t *length)
+{
+	const char *pid_end = strstr(line, "] <");
+	if (!pid_end) {
+		return NULL;
+	}
+
+	const char *pid_start = pid_end;
+	while (pid_start > line && *(pid_start-1) != '[') {
+		pid_start--;
+	}
+	if (pid_start == line) {
+		return NULL;
+	}
+	pid_start--;
+
+	const char *name = pid_start;
+	while (name > line && *(name-1) != ' ') {
+		name--;
+	}
+
+	const char *name_end = name;
+	while (name_end < pid_start && *name_end != '(') {
+		name_end++;
+	}
+
+	*length = name_end - name;
+	return name;
+}
+
+/**
+ * Checks whether a syslog line passes a filter.
+ *
+ * @param filter The filter to check against.
+ * @param line The NUL-terminated line.
+ *
+ * @return 1 if the line should be delivered, 0 otherwise.
+ */
+static int syslog_relay_filter_matches(syslog_relay_filter_t filter, const char *line)
+{
+	uint32_t i = 0;
+
+	if (filter->num_processes > 0) {
+		size_t length = 0;
+		const char *process = syslog_relay_line_process(line, &length);
+		if (!process) {
+			return 0;
+		}
+
+		int found = 0;
+		for (i = 0; i < filter->num_processes; i++) {
+			if (strlen(filter->processes[i]) == length && strncmp(filter->processes[i], process, length) == 0) {
+				found = 1;
+				break;
+			}
+		}
+		if (!found) {
+			return 0;
+		}
+	}
+
+	uint32_t num_patterns = filter->num_substrings;
+#ifdef HAVE_REGEX_H
+	num_patterns += filter->num_regexes;
+#endif
+	if (num_patterns == 0) {
+		return 1;
+	}
+
+	for (i = 0; i < filter->num_substrings; i++) {
+		if (strstr(line, filter->substrings[i])) {
+			return 1;
+		}
+	}
+
+#ifdef HAVE_REGEX_H
+	for (i = 0; i < filter->num_regexes; i++) {
+		if (regexec(&filter->regexes[i], line, 0, NULL, 0) == 0) {
+			return 1;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+void *syslog_relay_lines_worker(void *arg)
+{
+	syslog_relay_error_t ret = SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)arg;
+
+	if (!srwt)
+		return NULL;
+
+	/* Lines are handed out as pointers into the buffer, so an incomplete line
+	 * is moved back to the start rather than wrapping around the end. One
+	 * extra byte leaves room to terminate a line that fills the buffer. */
+	char *buffer = (char*)malloc(SYSLOG_RELAY_CAPTURE_BUFFER_SIZE + 1);
+	uint32_t capacity = 256;
+	const char **lines = (const char**)malloc(capacity * sizeof(const char*));
+	uint32_t *lengths = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+	uint32_t used = 0;
+
+	if (!buffer || !lines || !lengths) {
+		debug_info("Out of memory");
+		goto leave;
+	}
+
+	debug_info("Running");
+
+	while (srwt->client->parent) {
+		uint32_t bytes = 0;
+		ret = syslog_relay_receive_with_timeout(srwt->client, buffer + used, SYSLOG_RELAY_CAPTURE_BUFFER_SIZE - used, &bytes, 100);
+		if ((bytes == 0) && (ret == SYSLOG_RELAY_E_SUCCESS)) {
+			continue;
+		} else if (ret < 0) {
+			debug_info("Connection to syslog relay interrupted");
+			break;
+		}
+
+		char *end = buffer + used + bytes;
+		char *start = buffer;
+		char *p = NULL;
+		uint32_t count = 0;
+
+		for (p = buffer + used; p <= end; p++) {
+			if (p == end) {
+				/* A single line filled the whole buffer, deliver it as is. */
+				if (start != buffer || end != buffer + SYSLOG_RELAY_CAPTURE_BUFFER_SIZE) {
+					break;
+				}
+			} else if (*p != '\n' && *p != '\0') {
+				continue;
+			}
+
+			*p = '\0';
+			if (p > start && (!srwt->filter || syslog_relay_filter_matches(srwt->filter, start))) {
+				if (count == capacity) {
+					capacity *= 2;
+					const char **new_lines = (const char**)realloc(lines, capacity * sizeof(const char*));
+					uint32_t *new_lengths = (uint32_t*)realloc(lengths, capacity * sizeof(uint32_t));
+					if (new_lines) {
+						lines = new_lines;
+					}
+					if (new_lengths) {
+						lengths = new_lengths;
+					}
+					if (!new_lines || !new_lengths) {
+						debug_info("Out of memory");
+						goto leave;
+					}
+				}
+				lines[count] = start;
+				lengths[count] = (uint32_t)(p - start);
+				count++;
+			}
+			start = p + 1;
+		}
+
+		if (count > 0) {
+			srwt->lines_cbfunc(lines, lengths, count, srwt->user_data);
+		}
+
+		used = (start < end) ? (uint32_t)(end - start) : 0;
+		if (used > 0 && start != buffer) {
+			memmove(buffer, start, used);
+		}
+	}
+
+	/* deliver what was received of an unterminated last line */
+	if (used > 0) {
+		buffer[used] = '\0';
+		if (!srwt->filter || syslog_relay_filter_matches(srwt->filter, buffer)) {
+			lines[0] = buffer;
+			lengths[0] = used;
+			srwt->lines_cbfunc(lines, lengths, 1, srwt->user_data);
+		}
+	}
+
+leave:
+	free(buffer);
+	free(lines);
+	free(lengths);
+	free(srwt);
+
+	debug_info("Exiting");
+
+	return NULL;
+}
+
 LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data)
 {
 	if (!client || !callback)
@@ -190,6 +392,8 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_rela
 	if (srwt) {
 		srwt->client = client;
 		srwt->cbfunc = callback;
+		srwt->lines_cbfunc = NULL;
+		srwt->filter = NULL;
 		srwt->user_data = user_data;
 
 		if (thread_new(&client->worker, syslog_relay_worker, srwt) == 0) {
@@ -200,6 +404,35 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_rela
 	return res;
 }
 
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture_lines(syslog_relay_client_t client, syslog_relay_filter_t filter, syslog_relay_receive_lines_cb_t callback, void* user_data)
+{
+	if (!client || !callback)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	syslog_relay_error_t res = SYSLOG_RELAY_E_UNKNOWN_ERROR;
+
+	if (client->worker) {
+		debug_info("Another syslog capture thread appears to be running already.");
+		return res;
+	}
+
+	/* start worker thread */
+	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)malloc(sizeof(struct syslog_relay_worker_thread));
+	if (srwt) {
+		srwt->client = client;
+		srwt->cbfunc = NULL;
+		srwt->lines_cbfunc = callback;
+		srwt->filter = filter;
+		srwt->user_data = user_data;
+
+		if (thread_new(&client->worker, syslog_relay_lines_worker, srwt) == 0) {
+			res = SYSLOG_RELAY_E_SUCCESS;
+		}
+	}
+
+	return res;
+}
+
 LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_stop_capture(syslog_relay_client_t client)
 {
 	if (client->worker) {
@@ -214,4 +447,108 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_stop_capture(syslog_relay
 	}
 
 	return SYSLOG_RELAY_E_SUCCESS;
-}
\ No newline at end of file
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_filter_new(syslog_relay_filter_t *filter)
+{
+	if (!filter)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	syslog_relay_filter_t filter_loc = (syslog_relay_filter_t)calloc(1, sizeof(struct syslog_relay_filter_private));
+	if (!filter_loc)
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+
+	*filter = filter_loc;
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_filter_free(syslog_relay_filter_t filter)
+{
+	uint32_t i = 0;
+
+	if (!filter)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	for (i = 0; i < filter->num_processes; i++) {
+		free(filter->processes[i]);
+	}
+	free(filter->processes);
+
+	for (i = 0; i < filter->num_substrings; i++) {
+		free(filter->substrings[i]);
+	}
+	free(filter->substrings);
+
+#ifdef HAVE_REGEX_H
+	for (i = 0; i < filter->num_regexes; i++) {
+		regfree(&filter->regexes[i]);
+	}
+	free(filter->regexes);
+#endif
+
+	free(filter);
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+/**
+ * Appends a copy of a string to an array of strings.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success, or SYSLOG_RELAY_E_UNKNOWN_ERROR
+ *     when out of memory.
+ */
+static syslog_relay_error_t syslog_relay_filter_append(char ***strings, uint32_t *count, const char *string)
+{
+	char **new_strings = (char**)realloc(*strings, (*count + 1) * sizeof(char*));
+	if (!new_strings)
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	*strings = new_strings;
+
+	new_strings[*count] = strdup(string);
+	if (!new_strings[*count])
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	(*count)++;
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_filter_add_process(syslog_relay_filter_t filter, const char *process_name)
+{
+	if (!filter || !process_name || !*process_name)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	return syslog_relay_filter_append(&filter->processes, &filter->num_processes, process_name);
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_filter_add_substring(syslog_relay_filter_t filter, const char *substring)
+{
+	if (!filter || !substring || !*substring)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	return syslog_relay_filter_append(&filter->substrings, &filter->num_substrings, substring);
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_filter_add_regex(syslog_relay_filter_t filter, const char *pattern)
+{
+	if (!filter || !pattern)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+#ifdef HAVE_REGEX_H
+	regex_t *new_regexes = (regex_t*)realloc(filter->regexes, (filter->num_regexes + 1) * sizeof(regex_t));
+	if (!new_regexes)
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	filter->regexes = new_regexes;
+
+	if (regcomp(&filter->regexes[filter->num_regexes], pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+		debug_info("Could not compile regular expression %s", pattern);
+		return SYSLOG_RELAY_E_INVALID_ARG;
+	}
+	filter->num_regexes++;
+
+	return SYSLOG_RELAY_E_SUCCESS;
+#else
+	debug_info("Regular expressions are not supported on this platform.");
+	return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+#endif
+}
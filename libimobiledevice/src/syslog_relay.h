@@ -22,15 +22,38 @@
 #ifndef _SYSLOG_RELAY_H
 #define _SYSLOG_RELAY_H
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_REGEX_H
+#include <regex.h>
+#endif
+
 #include "libimobiledevice/syslog_relay.h"
 #include "service.h"
 #include "common/thread.h"
 
+/* Size of the buffer syslog_relay_start_capture_lines() receives into. */
+#define SYSLOG_RELAY_CAPTURE_BUFFER_SIZE 65536
+
 struct syslog_relay_client_private {
 	service_client_t parent;
 	thread_t worker;
 };
 
+struct syslog_relay_filter_private {
+	char **processes;
+	uint32_t num_processes;
+	char **substrings;
+	uint32_t num_substrings;
+#ifdef HAVE_REGEX_H
+	regex_t *regexes;
+	uint32_t num_regexes;
+#endif
+};
+
 void *syslog_relay_worker(void *arg);
+void *syslog_relay_lines_worker(void *arg);
 
 #endif
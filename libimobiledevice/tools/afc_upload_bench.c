@@ -0,0 +1,415 @@
+/*
+ * afc_upload_bench.c
+ * Batched versus sequential AFC upload benchmark against a fake AFC service
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "src/idevice.h"
+#include "src/service.h"
+#include "src/afc.h"
+#include "common/thread.h"
+
+#define MAX_HANDLES 4096
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int read_all(int fd, void *data, size_t length)
+{
+	size_t done = 0;
+	while (done < length) {
+		ssize_t res = recv(fd, (char*)data + done, length - done, 0);
+		if (res <= 0) {
+			return -1;
+		}
+		done += res;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const void *data, size_t length)
+{
+	size_t done = 0;
+	while (done < length) {
+		ssize_t res = send(fd, (const char*)data + done, length - done, 0);
+		if (res <= 0) {
+			return -1;
+		}
+		done += res;
+	}
+	return 0;
+}
+
+/* A reply the fake service holds back until the simulated link latency has passed. */
+struct reply {
+	double due;
+	uint64_t packet_num;
+	uint64_t operation;
+	uint64_t value;
+};
+
+/* Stands in for the device's AFC service on one end of a socket pair. It
+ * answers every request after a fixed latency and counts what was written,
+ * so both upload paths can be checked for the same result. */
+struct fake_afc {
+	int fd;
+	double latency;
+
+	struct reply *replies;
+	size_t replies_head;
+	size_t replies_count;
+	size_t replies_capacity;
+
+	uint64_t next_handle;
+	uint64_t open_bytes[MAX_HANDLES];
+	int open[MAX_HANDLES];
+
+	size_t directories;
+	size_t files;
+	uint64_t bytes;
+	size_t requests;
+};
+
+static void fake_afc_queue(struct fake_afc *afc, uint64_t packet_num, uint64_t operation, uint64_t value)
+{
+	if (afc->replies_head + afc->replies_count == afc->replies_capacity) {
+		memmove(afc->replies, afc->replies + afc->replies_head, afc->replies_count * sizeof(struct reply));
+		afc->replies_head = 0;
+		if (afc->replies_count == afc->replies_capacity) {
+			afc->replies_capacity = afc->replies_capacity ? afc->replies_capacity * 2 : 256;
+			afc->replies = (struct reply*)realloc(afc->replies, afc->replies_capacity * sizeof(struct reply));
+		}
+	}
+
+	struct reply *reply = &afc->replies[afc->replies_head + afc->replies_count++];
+	reply->due = now() + afc->latency;
+	reply->packet_num = packet_num;
+	reply->operation = operation;
+	reply->value = value;
+}
+
+static int fake_afc_send_due(struct fake_afc *afc)
+{
+	double t = now();
+	while (afc->replies_count > 0 && afc->replies[afc->replies_head].due <= t) {
+		struct reply *reply = &afc->replies[afc->replies_head];
+		char packet[sizeof(AFCPacket) + sizeof(uint64_t)];
+		AFCPacket header;
+
+		memcpy(header.magic, AFC_MAGIC, AFC_MAGIC_LEN);
+		header.entire_length = sizeof(packet);
+		header.this_length = sizeof(packet);
+		header.packet_num = reply->packet_num;
+		header.operation = reply->operation;
+		AFCPacket_to_LE(&header);
+		memcpy(packet, &header, sizeof(AFCPacket));
+
+		uint64_t value = htole64(reply->value);
+		memcpy(packet + sizeof(AFCPacket), &value, sizeof(uint64_t));
+
+		if (write_all(afc->fd, packet, sizeof(packet)) < 0) {
+			return -1;
+		}
+
+		afc->replies_head++;
+		afc->replies_count--;
+	}
+	return 0;
+}
+
+static int fake_afc_handle(struct fake_afc *afc)
+{
+	AFCPacket header;
+	if (read_all(afc->fd, &header, sizeof(AFCPacket)) < 0) {
+		return -1;
+	}
+	AFCPacket_from_LE(&header);
+	if (strncmp(header.magic, AFC_MAGIC, AFC_MAGIC_LEN) || header.this_length < sizeof(AFCPacket) || header.entire_length < header.this_length) {
+		fprintf(stderr, "fake AFC service: invalid packet\n");
+		return -1;
+	}
+
+	uint64_t data_length = header.this_length - sizeof(AFCPacket);
+	uint64_t payload_length = header.entire_length - header.this_length;
+	char *data = (char*)malloc(data_length + payload_length + 1);
+	if (read_all(afc->fd, data, data_length + payload_length) < 0) {
+		free(data);
+		return -1;
+	}
+
+	uint64_t handle = 0;
+	if (data_length >= sizeof(uint64_t)) {
+		memcpy(&handle, data, sizeof(uint64_t));
+		handle = le64toh(handle);
+	}
+	free(data);
+
+	afc->requests++;
+
+	switch (header.operation) {
+	case AFC_OP_MAKE_DIR:
+		afc->directories++;
+		fake_afc_queue(afc, header.packet_num, AFC_OP_STATUS, AFC_E_SUCCESS);
+		break;
+	case AFC_OP_FILE_OPEN:
+		if (afc->next_handle >= MAX_HANDLES) {
+			fake_afc_queue(afc, header.packet_num, AFC_OP_STATUS, AFC_E_NO_RESOURCES);
+			break;
+		}
+		handle = afc->next_handle++;
+		afc->open[handle] = 1;
+		afc->open_bytes[handle] = 0;
+		fake_afc_queue(afc, header.packet_num, AFC_OP_FILE_OPEN_RES, handle);
+		break;
+	case AFC_OP_FILE_WRITE:
+		if (handle >= MAX_HANDLES || !afc->open[handle]) {
+			fake_afc_queue(afc, header.packet_num, AFC_OP_STATUS, AFC_E_INVALID_ARG);
+			break;
+		}
+		afc->open_bytes[handle] += payload_length;
+		fake_afc_queue(afc, header.packet_num, AFC_OP_STATUS, AFC_E_SUCCESS);
+		break;
+	case AFC_OP_FILE_CLOSE:
+		if (handle >= MAX_HANDLES || !afc->open[handle]) {
+			fake_afc_queue(afc, header.packet_num, AFC_OP_STATUS, AFC_E_INVALID_ARG);
+			break;
+		}
+		afc->open[handle] = 0;
+		afc->files++;
+		afc->bytes += afc->open_bytes[handle];
+		fake_afc_queue(afc, header.packet_num, AFC_OP_STATUS, AFC_E_SUCCESS);
+		break;
+	default:
+		fake_afc_queue(afc, header.packet_num, AFC_OP_STATUS, AFC_E_SUCCESS);
+		break;
+	}
+
+	return 0;
+}
+
+static void *fake_afc_thread(void *arg)
+{
+	struct fake_afc *afc = (struct fake_afc*)arg;
+
+	while (1) {
+		int timeout = -1;
+		if (afc->replies_count > 0) {
+			double wait = afc->replies[afc->replies_head].due - now();
+			timeout = (wait > 0) ? (int)(wait * 1000) + 1 : 0;
+		}
+
+		struct pollfd pfd;
+		pfd.fd = afc->fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		int res = poll(&pfd, 1, timeout);
+		if (res < 0) {
+			break;
+		}
+		if (res > 0 && (pfd.revents & (POLLIN | POLLHUP))) {
+			if (fake_afc_handle(afc) < 0) {
+				break;
+			}
+		}
+		if (fake_afc_send_due(afc) < 0) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+enum mode {
+	MODE_SEQUENTIAL,
+	MODE_BATCHED,
+	MODE_BATCHED_LOCAL
+};
+
+struct upload_result {
+	size_t completed;
+	size_t failed;
+};
+
+static void upload_callback(const char *path, afc_error_t error, void *user_data)
+{
+	struct upload_result *result = (struct upload_result*)user_data;
+	if (error == AFC_E_SUCCESS) {
+		result->completed++;
+	} else {
+		result->failed++;
+	}
+}
+
+static int upload(afc_client_t client, enum mode mode, size_t count, const char *contents, uint32_t size, const char *local_path, struct upload_result *result)
+{
+	char path[64];
+	size_t i;
+
+	if (mode == MODE_SEQUENTIAL) {
+		if (afc_make_directory(client, "/Bench") != AFC_E_SUCCESS) {
+			return -1;
+		}
+		for (i = 0; i < count; i++) {
+			uint64_t handle = 0;
+			uint32_t written = 0;
+			snprintf(path, sizeof(path), "/Bench/file%zu", i);
+			if (afc_file_open(client, path, AFC_FOPEN_WRONLY, &handle) != AFC_E_SUCCESS
+				|| afc_file_write(client, handle, contents, size, &written) != AFC_E_SUCCESS
+				|| written != size
+				|| afc_file_close(client, handle) != AFC_E_SUCCESS) {
+				result->failed++;
+				continue;
+			}
+			result->completed++;
+		}
+		return 0;
+	}
+
+	afc_upload_t batch = NULL;
+	if (afc_upload_new(client, upload_callback, result, &batch) != AFC_E_SUCCESS) {
+		return -1;
+	}
+
+	afc_upload_add_directory(batch, "/Bench");
+	for (i = 0; i < count; i++) {
+		snprintf(path, sizeof(path), "/Bench/file%zu", i);
+		if (mode == MODE_BATCHED_LOCAL) {
+			afc_upload_add_local_file(batch, path, local_path);
+		} else {
+			afc_upload_add_file(batch, path, contents, size);
+		}
+	}
+
+	afc_error_t err = afc_upload_flush(batch);
+	afc_upload_free(batch);
+
+	return (err == AFC_E_SUCCESS) ? 0 : -1;
+}
+
+static int bench(const char *name, enum mode mode, size_t count, uint32_t size, double latency, const char *contents, const char *local_path)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		printf("%-24s could not create socket pair\n", name);
+		return -1;
+	}
+
+	/* A client whose connection talks to the fake service rather than usbmuxd. */
+	struct idevice_connection_private connection;
+	memset(&connection, 0, sizeof(connection));
+	connection.type = CONNECTION_USBMUXD;
+	connection.data = (void*)(long)fds[0];
+
+	struct service_client_private service;
+	service.connection = &connection;
+
+	afc_client_t client = NULL;
+	afc_client_new_with_service_client(&service, &client);
+
+	struct fake_afc *afc = (struct fake_afc*)calloc(1, sizeof(struct fake_afc));
+	afc->fd = fds[1];
+	afc->latency = latency;
+	afc->next_handle = 1;
+
+	thread_t worker;
+	thread_new(&worker, fake_afc_thread, afc);
+
+	struct upload_result result;
+	memset(&result, 0, sizeof(result));
+
+	double t0 = now();
+	int res = upload(client, mode, count, contents, size, local_path, &result);
+	double t1 = now();
+
+	/* Hanging up ends the fake service once it has answered everything. */
+	shutdown(fds[0], SHUT_RDWR);
+	thread_join(worker);
+	thread_free(worker);
+	afc_client_free(client);
+	close(fds[0]);
+	close(fds[1]);
+
+	printf("%-24s %8.2fs  %6zu requests  %6zu files  %10llu bytes\n", name,
+		t1 - t0, afc->requests, afc->files, (unsigned long long)afc->bytes);
+
+	if (res < 0 || result.failed > 0 || result.completed != count) {
+		printf("%-24s %zu of %zu files failed\n", name, count - result.completed, count);
+		res = -1;
+	} else if (afc->files != count || afc->bytes != (uint64_t)count * size || afc->directories != 1) {
+		printf("%-24s the service received %zu of %zu files and %llu of %llu bytes\n", name,
+			afc->files, count, (unsigned long long)afc->bytes, (unsigned long long)count * size);
+		res = -1;
+	}
+
+	free(afc->replies);
+	free(afc);
+
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t count = (argc > 1) ? (size_t)atol(argv[1]) : 1000;
+	uint32_t size = (argc > 2) ? (uint32_t)atol(argv[2]) : 4096;
+	double latency = ((argc > 3) ? atof(argv[3]) : 2) / 1000;
+	int res = 0;
+
+	if (count >= MAX_HANDLES) {
+		count = MAX_HANDLES - 1;
+	}
+
+	char *contents = (char*)malloc(size + 1);
+	uint32_t i;
+	for (i = 0; i < size; i++) {
+		contents[i] = 'a' + (i % 26);
+	}
+
+	char local_path[] = "/tmp/afc_upload_bench.XXXXXX";
+	int fd = mkstemp(local_path);
+	if (fd < 0 || write(fd, contents, size) != (ssize_t)size) {
+		printf("could not create %s\n", local_path);
+		free(contents);
+		return 1;
+	}
+	close(fd);
+
+	printf("uploading %zu files of %u bytes with %.1fms latency\n", count, size, latency * 1000);
+
+	if (bench("batched", MODE_BATCHED, count, size, latency, contents, local_path) < 0) res = 1;
+	if (bench("batched, local files", MODE_BATCHED_LOCAL, count, size, latency, contents, local_path) < 0) res = 1;
+	if (bench("sequential", MODE_SEQUENTIAL, count, size, latency, contents, local_path) < 0) res = 1;
+
+	unlink(local_path);
+	free(contents);
+
+	return res;
+}
@@ -47,12 +47,14 @@ static char* udid = NULL;
 static idevice_t device = NULL;
 static syslog_relay_client_t syslog = NULL;
 
-static void syslog_callback(char c, void *user_data)
+static void syslog_callback(const char **lines, const uint32_t *lengths, uint32_t count, void *user_data)
 {
-	putchar(c);
-	if (c == '\n') {
-		fflush(stdout);
+	uint32_t i;
+	for (i = 0; i < count; i++) {
+		fwrite(lines[i], 1, lengths[i], stdout);
+		putchar('\n');
 	}
+	fflush(stdout);
 }
 
 static int start_logging(void)
@@ -105,7 +107,7 @@ static int start_logging(void)
 	}
 
 	/* start capturing syslog */
-	serr = syslog_relay_start_capture(syslog, syslog_callback, NULL);
+	serr = syslog_relay_start_capture_lines(syslog, NULL, syslog_callback, NULL);
 	if (serr != SYSLOG_RELAY_E_SUCCESS) {
 		fprintf(stderr, "ERROR: Unable tot start capturing syslog.\n");
 		syslog_relay_client_free(syslog);
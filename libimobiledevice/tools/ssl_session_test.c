@@ -0,0 +1,413 @@
+/*
+ * ssl_session_test.c
+ * Test for TLS session resumption in idevice_connection_enable_ssl
+ *
+ * Performs handshakes against a loopback TLS server that stands in for a
+ * device's lockdownd and service ports, with a fake usbmuxd serving the pair
+ * record, and checks idevice_get_ssl_handshake_stats() and what the server
+ * saw: full versus resumed handshakes, separate sessions per port and
+ * device, expiry, dropping the session after a failed handshake and the
+ * idevice_set_ssl_session_cache_enabled() knob. Exits non-zero on failure.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <plist/plist.h>
+
+#include "src/idevice.h"
+#include "common/userpref.h"
+#include "common/thread.h"
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#define DEVICE_UDID "0000000000000000000000000000000000000001"
+#define OTHER_DEVICE_UDID "0000000000000000000000000000000000000002"
+#define LOCKDOWN_PORT 62078
+#define SERVICE_PORT 49152
+
+/* One second past SSL_SESSION_CACHE_TIMEOUT in src/idevice.c */
+#define SESSION_EXPIRY 301
+
+/* Interposes time() for the library (and OpenSSL) so session expiry can be
+ * tested without waiting for it. Needs default visibility to be exported
+ * from the executable. */
+static time_t time_offset = 0;
+
+__attribute__((visibility("default"))) time_t time(time_t *t)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	time_t result = ts.tv_sec + time_offset;
+	if (t) {
+		*t = result;
+	}
+	return result;
+}
+
+/* Fake usbmuxd, only answers ReadPairRecord */
+
+struct usbmuxd_header {
+	uint32_t length;
+	uint32_t version;
+	uint32_t message;
+	uint32_t tag;
+};
+
+static char socket_path[64];
+static int listen_fd = -1;
+static char *pair_record_data = NULL;
+static uint32_t pair_record_size = 0;
+
+static int read_full(int fd, void *buf, size_t length)
+{
+	size_t received = 0;
+	while (received < length) {
+		ssize_t res = recv(fd, (char*)buf + received, length - received, 0);
+		if (res <= 0) {
+			return -1;
+		}
+		received += res;
+	}
+	return 0;
+}
+
+static void *usbmuxd_thread(void *arg)
+{
+	int fd;
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		struct usbmuxd_header hdr;
+		while (read_full(fd, &hdr, sizeof(hdr)) == 0 && hdr.length >= sizeof(hdr)) {
+			uint32_t length = hdr.length - sizeof(hdr);
+			char *payload = (char*)malloc(length);
+			if (read_full(fd, payload, length) < 0) {
+				free(payload);
+				break;
+			}
+			free(payload);
+
+			plist_t reply = plist_new_dict();
+			plist_dict_set_item(reply, "PairRecordData", plist_new_data(pair_record_data, pair_record_size));
+			char *xml = NULL;
+			uint32_t xml_length = 0;
+			plist_to_xml(reply, &xml, &xml_length);
+			plist_free(reply);
+
+			hdr.length = sizeof(hdr) + xml_length;
+			hdr.version = 1;
+			hdr.message = 8;
+			send(fd, &hdr, sizeof(hdr), MSG_NOSIGNAL);
+			send(fd, xml, xml_length, MSG_NOSIGNAL);
+			free(xml);
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+static int start_usbmuxd(void)
+{
+	struct sockaddr_un addr;
+	char address[80];
+	thread_t worker;
+
+	snprintf(socket_path, sizeof(socket_path), "/tmp/ssl-session-test.%d", (int)getpid());
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	unlink(socket_path);
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 4) < 0) {
+		printf("could not listen on %s\n", socket_path);
+		return -1;
+	}
+
+	snprintf(address, sizeof(address), "UNIX:%s", socket_path);
+	setenv("USBMUXD_SOCKET_ADDRESS", address, 1);
+
+	thread_new(&worker, usbmuxd_thread, NULL);
+	thread_detach(worker);
+
+	return 0;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+/* OpenSSL 3 only allows TLS 1.0, which idevice_connection_enable_ssl uses,
+ * at security level 0. The client context can't be configured from here, so
+ * this points OpenSSL at a config that lowers the default for the process. */
+static char openssl_conf_path[64];
+
+static void set_openssl_conf(void)
+{
+	snprintf(openssl_conf_path, sizeof(openssl_conf_path), "/tmp/ssl-session-test.%d.cnf", (int)getpid());
+	FILE *f = fopen(openssl_conf_path, "w");
+	if (!f) {
+		return;
+	}
+	fputs("openssl_conf = conf\n[conf]\nssl_conf = ssl\n[ssl]\nsystem_default = tls\n"
+	      "[tls]\nCipherString = DEFAULT@SECLEVEL=0\nMinProtocol = TLSv1\n", f);
+	fclose(f);
+	setenv("OPENSSL_CONF", openssl_conf_path, 1);
+}
+#endif
+
+/* Loopback TLS server standing in for the device */
+
+static SSL_CTX *server_ctx = NULL;
+
+struct handshake {
+	int fd;
+	int fail;
+	int offered;
+	int reused;
+	int ok;
+};
+
+static int client_hello_callback(SSL *ssl, int *al, void *arg)
+{
+	const unsigned char *session_id = NULL;
+	struct handshake *handshake = (struct handshake*)SSL_get_app_data(ssl);
+	handshake->offered = SSL_client_hello_get0_session_id(ssl, &session_id) > 0;
+	return SSL_CLIENT_HELLO_SUCCESS;
+}
+
+static void *server_thread(void *arg)
+{
+	struct handshake *handshake = (struct handshake*)arg;
+
+	if (handshake->fail) {
+		/* the device dropping the connection mid-handshake */
+		char buf[512];
+		recv(handshake->fd, buf, sizeof(buf), 0);
+		close(handshake->fd);
+		return NULL;
+	}
+
+	SSL *ssl = SSL_new(server_ctx);
+	SSL_set_app_data(ssl, handshake);
+	SSL_set_fd(ssl, handshake->fd);
+	if (SSL_accept(ssl) == 1) {
+		handshake->ok = 1;
+		handshake->reused = SSL_session_reused(ssl);
+		char buf[16];
+		SSL_read(ssl, buf, sizeof(buf));
+		SSL_shutdown(ssl);
+	}
+	SSL_free(ssl);
+	close(handshake->fd);
+
+	return NULL;
+}
+
+static int create_device_credentials(void)
+{
+	/* device key pair; the pair record's device certificate is issued for it */
+	RSA *device_key = RSA_new();
+	BIGNUM *e = BN_new();
+	BN_set_word(e, 65537);
+	RSA_generate_key_ex(device_key, 2048, e, NULL);
+	BN_free(e);
+
+	BIO *bio = BIO_new(BIO_s_mem());
+	PEM_write_bio_RSAPublicKey(bio, device_key);
+	key_data_t public_key = { NULL, 0 };
+	public_key.size = BIO_get_mem_data(bio, &public_key.data);
+
+	plist_t pair_record = plist_new_dict();
+	userpref_error_t uerr = pair_record_generate_keys_and_certs(pair_record, public_key);
+	BIO_free(bio);
+	if (uerr != USERPREF_E_SUCCESS) {
+		printf("could not generate pair record (%d)\n", uerr);
+		RSA_free(device_key);
+		plist_free(pair_record);
+		return -1;
+	}
+
+	key_data_t device_cert_pem = { NULL, 0 };
+	pair_record_get_item_as_key_data(pair_record, "DeviceCertificate", &device_cert_pem);
+	bio = BIO_new_mem_buf(device_cert_pem.data, device_cert_pem.size);
+	X509 *device_cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	free(device_cert_pem.data);
+
+	EVP_PKEY *device_pkey = EVP_PKEY_new();
+	EVP_PKEY_assign_RSA(device_pkey, device_key);
+
+	/* idevice_connection_enable_ssl only speaks TLS 1.0 */
+	server_ctx = SSL_CTX_new(SSLv23_server_method());
+	SSL_CTX_set_security_level(server_ctx, 0);
+	SSL_CTX_set_min_proto_version(server_ctx, TLS1_VERSION);
+	SSL_CTX_set_options(server_ctx, SSL_OP_NO_TICKET);
+	SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_timeout(server_ctx, 24 * 3600);
+	SSL_CTX_set_client_hello_cb(server_ctx, client_hello_callback, NULL);
+	if (!device_cert || SSL_CTX_use_certificate(server_ctx, device_cert) != 1 || SSL_CTX_use_PrivateKey(server_ctx, device_pkey) != 1) {
+		printf("could not load device certificate\n");
+		return -1;
+	}
+	X509_free(device_cert);
+	EVP_PKEY_free(device_pkey);
+
+	plist_to_bin(pair_record, &pair_record_data, &pair_record_size);
+	plist_free(pair_record);
+
+	return 0;
+}
+
+/* Connects to the loopback server and enables SSL like lockdownd and
+ * service clients do. Returns 0 if the handshake succeeded. */
+static int handshake(const char *udid, uint16_t port, int fail, struct handshake *result)
+{
+	int fds[2];
+	thread_t worker;
+
+	memset(result, '\0', sizeof(*result));
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		return -1;
+	}
+	result->fd = fds[1];
+	result->fail = fail;
+	thread_new(&worker, server_thread, result);
+
+	struct idevice_connection_private connection;
+	memset(&connection, '\0', sizeof(connection));
+	connection.udid = (char*)udid;
+	connection.port = port;
+	connection.type = CONNECTION_USBMUXD;
+	connection.data = (void*)(long)fds[0];
+
+	idevice_error_t err = idevice_connection_enable_ssl(&connection);
+	if (err == IDEVICE_E_SUCCESS) {
+		uint32_t sent = 0;
+		idevice_connection_send(&connection, "bye", 3, &sent);
+		idevice_connection_disable_ssl(&connection);
+	} else {
+		shutdown(fds[0], SHUT_RDWR);
+	}
+	close(fds[0]);
+
+	thread_join(worker);
+	thread_free(worker);
+
+	return (err == IDEVICE_E_SUCCESS) ? 0 : -1;
+}
+
+static int failures = 0;
+
+/* Runs one handshake and checks how it went, both from the client's
+ * statistics and from what the server saw. */
+static void check(const char *name, const char *udid, uint16_t port, int fail, int expect_offered, int expect_resumed)
+{
+	uint32_t full_before = 0, resumed_before = 0;
+	uint32_t full_after = 0, resumed_after = 0;
+	struct handshake result;
+
+	idevice_get_ssl_handshake_stats(&full_before, &resumed_before);
+	int res = handshake(udid, port, fail, &result);
+	idevice_get_ssl_handshake_stats(&full_after, &resumed_after);
+
+	uint32_t full = full_after - full_before;
+	uint32_t resumed = resumed_after - resumed_before;
+	int passed;
+
+	if (fail) {
+		passed = (res < 0 && full == 0 && resumed == 0);
+		printf("%-44s %s\n", name, (res < 0) ? "failed as expected" : "succeeded");
+	} else {
+		passed = (res == 0 && result.ok && result.offered == expect_offered && result.reused == expect_resumed
+		          && full == (uint32_t)!expect_resumed && resumed == (uint32_t)expect_resumed);
+		printf("%-44s %s, %s (stats: +%u full, +%u resumed)\n", name,
+			(res < 0) ? "handshake failed" : (result.reused ? "resumed" : "full"),
+			result.offered ? "session offered" : "no session offered", full, resumed);
+	}
+
+	if (!passed) {
+		printf("%-44s FAILED\n", "");
+		failures++;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	signal(SIGPIPE, SIG_IGN);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	set_openssl_conf();
+#endif
+
+	if (start_usbmuxd() < 0 || create_device_credentials() < 0) {
+		return 1;
+	}
+
+	check("first connection", DEVICE_UDID, LOCKDOWN_PORT, 0, 0, 0);
+	check("reconnect to the same port", DEVICE_UDID, LOCKDOWN_PORT, 0, 1, 1);
+	check("reconnect again", DEVICE_UDID, LOCKDOWN_PORT, 0, 1, 1);
+	check("other port", DEVICE_UDID, SERVICE_PORT, 0, 0, 0);
+	check("other port, reconnect", DEVICE_UDID, SERVICE_PORT, 0, 1, 1);
+	check("other device", OTHER_DEVICE_UDID, LOCKDOWN_PORT, 0, 0, 0);
+
+	/* a failed handshake drops the cached session for that port only */
+	check("handshake fails", DEVICE_UDID, LOCKDOWN_PORT, 1, 0, 0);
+	check("after failure", DEVICE_UDID, LOCKDOWN_PORT, 0, 0, 0);
+	check("other port after failure", DEVICE_UDID, SERVICE_PORT, 0, 1, 1);
+
+	time_offset += SESSION_EXPIRY;
+	check("after expiry", DEVICE_UDID, LOCKDOWN_PORT, 0, 0, 0);
+	check("after expiry, reconnect", DEVICE_UDID, LOCKDOWN_PORT, 0, 1, 1);
+
+	idevice_set_ssl_session_cache_enabled(0);
+	check("cache disabled", DEVICE_UDID, LOCKDOWN_PORT, 0, 0, 0);
+	check("cache disabled, reconnect", DEVICE_UDID, LOCKDOWN_PORT, 0, 0, 0);
+	idevice_set_ssl_session_cache_enabled(1);
+	check("cache re-enabled", DEVICE_UDID, LOCKDOWN_PORT, 0, 0, 0);
+	check("cache re-enabled, reconnect", DEVICE_UDID, LOCKDOWN_PORT, 0, 1, 1);
+
+	close(listen_fd);
+	unlink(socket_path);
+	SSL_CTX_free(server_ctx);
+	free(pair_record_data);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	unlink(openssl_conf_path);
+#endif
+
+	printf("failures: %d\n", failures);
+
+	return (failures > 0) ? 1 : 0;
+}
+
+#else
+
+int main(int argc, char *argv[])
+{
+	printf("ssl_session_test requires libimobiledevice to be built with OpenSSL\n");
+	return 77;
+}
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ * syslog_relay_bench.c
+ * syslog_relay capture throughput benchmark
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "src/idevice.h"
+#include "src/service.h"
+#include "src/syslog_relay.h"
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Stands in for the device: sends syslog lines over one end of a socket
+ * pair, optionally paced to a given rate, then closes it. */
+struct writer {
+	int fd;
+	const char *data;
+	size_t data_size;
+	size_t total;
+	double rate;
+};
+
+static void *writer_thread(void *arg)
+{
+	struct writer *writer = (struct writer*)arg;
+	size_t sent = 0;
+	double start = now();
+
+	while (sent < writer->total) {
+		size_t offset = sent % writer->data_size;
+		size_t length = writer->data_size - offset;
+		if (length > 16384) {
+			length = 16384;
+		}
+		if (length > writer->total - sent) {
+			length = writer->total - sent;
+		}
+
+		ssize_t res = send(writer->fd, writer->data + offset, length, 0);
+		if (res <= 0) {
+			break;
+		}
+		sent += res;
+
+		if (writer->rate > 0) {
+			double due = start + sent / writer->rate;
+			double wait = due - now();
+			if (wait > 0) {
+				usleep((useconds_t)(wait * 1e6));
+			}
+		}
+	}
+
+	close(writer->fd);
+
+	return NULL;
+}
+
+/* Lines shaped like what syslog_relay sends, from a handful of processes. */
+static char *make_syslog(size_t size, size_t *length)
+{
+	static const char *processes[] = { "SpringBoard", "kernel", "locationd", "backboardd(FrontBoard)", "AltStore" };
+	static const char *messages[] = {
+		"Received state update for 3 (app<com.rileytestut.AltStore>, running-active-NotVisible",
+		"wl0: Roamed or switched channel, reason #8, bssid 00:11:22:33:44:55, last RSSI -67",
+		"Location icon should now be in state 'Active'",
+		"Sending event: <BKSHIDEvent: 0x15d2a4e0; type: Touch; timestamp: 7312.41>",
+		"Finished refreshing 4 apps in 12.3 seconds",
+	};
+	char *data = (char*)malloc(size + 256);
+	size_t used = 0;
+	int i = 0;
+
+	while (used < size) {
+		used += sprintf(data + used, "Oct 19 12:%02d:%02d Riley's iPhone %s[%d] <Notice>: %s\n",
+			(i / 60) % 60, i % 60, processes[i % 5], 40 + (i % 5), messages[(i * 3) % 5]);
+		i++;
+	}
+
+	*length = used;
+	return data;
+}
+
+struct counts {
+	size_t bytes;
+	size_t lines;
+	size_t callbacks;
+};
+
+static void byte_callback(char c, void *user_data)
+{
+	struct counts *counts = (struct counts*)user_data;
+	counts->bytes++;
+	counts->callbacks++;
+	if (c == '\n') {
+		counts->lines++;
+	}
+}
+
+static void lines_callback(const char **lines, const uint32_t *lengths, uint32_t count, void *user_data)
+{
+	struct counts *counts = (struct counts*)user_data;
+	uint32_t i;
+	for (i = 0; i < count; i++) {
+		counts->bytes += lengths[i] + 1;
+	}
+	counts->lines += count;
+	counts->callbacks++;
+}
+
+static int bench(const char *name, const char *data, size_t data_size, size_t total, double rate, syslog_relay_filter_t filter, int lines)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		printf("%-28s could not create socket pair\n", name);
+		return -1;
+	}
+
+	/* A client whose connection reads from the socket pair rather than usbmuxd. */
+	struct idevice_connection_private connection;
+	memset(&connection, 0, sizeof(connection));
+	connection.type = CONNECTION_USBMUXD;
+	connection.data = (void*)(long)fds[0];
+
+	struct service_client_private service;
+	service.connection = &connection;
+
+	struct syslog_relay_client_private client;
+	client.parent = &service;
+	client.worker = (thread_t)NULL;
+
+	struct counts counts;
+	memset(&counts, 0, sizeof(counts));
+
+	struct writer writer;
+	writer.fd = fds[1];
+	writer.data = data;
+	writer.data_size = data_size;
+	writer.total = total;
+	writer.rate = rate;
+
+	syslog_relay_error_t err;
+	if (lines) {
+		err = syslog_relay_start_capture_lines(&client, filter, lines_callback, &counts);
+	} else {
+		err = syslog_relay_start_capture(&client, byte_callback, &counts);
+	}
+	if (err != SYSLOG_RELAY_E_SUCCESS) {
+		printf("%-28s could not start capture (%d)\n", name, err);
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	double t0 = now();
+	thread_t writer_worker;
+	thread_new(&writer_worker, writer_thread, &writer);
+
+	/* The capture thread exits once it has read everything and sees the writer hang up. */
+	thread_join(client.worker);
+	thread_free(client.worker);
+	double t1 = now();
+
+	thread_join(writer_worker);
+	thread_free(writer_worker);
+	close(fds[0]);
+
+	printf("%-28s %8.1f MB/s  %8zu lines  %9zu callbacks\n", name,
+		total / (t1 - t0) / 1e6, counts.lines, counts.callbacks);
+
+	/* line capture counts a terminator for the unterminated last line too */
+	size_t expected = total;
+	if (lines && data[(total - 1) % data_size] != '\n') {
+		expected++;
+	}
+	if (!filter && counts.bytes != expected) {
+		printf("%-28s received %zu of %zu bytes\n", name, counts.bytes, expected);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	double megabytes = (argc > 1) ? atof(argv[1]) : 8;
+	double rate = (argc > 2) ? atof(argv[2]) * 1e6 : 0;
+	size_t total = (size_t)(megabytes * 1e6);
+	size_t data_size = 0;
+	int res = 0;
+
+	if (total == 0) {
+		total = 1;
+	}
+
+	char *data = make_syslog(1024 * 1024, &data_size);
+
+	if (rate > 0) {
+		printf("sending %.1f MB at %.1f MB/s\n", total / 1e6, rate / 1e6);
+	} else {
+		printf("sending %.1f MB as fast as possible\n", total / 1e6);
+	}
+
+	if (bench("per-byte", data, data_size, total, rate, NULL, 0) < 0) res = 1;
+	if (bench("lines", data, data_size, total, rate, NULL, 1) < 0) res = 1;
+
+	syslog_relay_filter_t filter = NULL;
+	syslog_relay_filter_new(&filter);
+	syslog_relay_filter_add_process(filter, "backboardd");
+	if (bench("lines, process filter", data, data_size, total, rate, filter, 1) < 0) res = 1;
+	syslog_relay_filter_free(filter);
+
+	syslog_relay_filter_new(&filter);
+	syslog_relay_filter_add_substring(filter, "Roamed");
+	if (bench("lines, substring filter", data, data_size, total, rate, filter, 1) < 0) res = 1;
+	syslog_relay_filter_free(filter);
+
+	syslog_relay_filter_new(&filter);
+	if (syslog_relay_filter_add_regex(filter, "apps in [0-9]+\\.[0-9]+ seconds") == SYSLOG_RELAY_E_SUCCESS) {
+		if (bench("lines, regex filter", data, data_size, total, rate, filter, 1) < 0) res = 1;
+	}
+	syslog_relay_filter_free(filter);
+
+	free(data);
+
+	return res;
+}
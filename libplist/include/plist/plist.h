@@ -75,6 +75,7 @@ extern "C"
 
 #include <sys/types.h>
 #include <stdarg.h>
+#include <stdio.h>
 
     /**
      * \mainpage libplist : A library to handle Apple Property Lists
@@ -98,6 +99,13 @@ extern "C"
      */
     typedef void* plist_array_iter;
 
+    /**
+     * Output callback used by the streaming export functions.
+     * It receives consecutive chunks of the output and returns 0 on
+     * success or a negative value to abort the export.
+     */
+    typedef int (*plist_write_func_t)(const char *buf, size_t len, void *user_data);
+
     /**
      * The enumeration of plist node types.
      */
@@ -619,6 +627,38 @@ extern "C"
      */
     void plist_to_xml(plist_t plist, char **plist_xml, uint32_t * length);
 
+    /**
+     * Export the #plist_t structure to XML format, passing the output to
+     * a callback in chunks instead of building it in memory. No memory is
+     * allocated while writing.
+     *
+     * @param plist the root node to export
+     * @param write the callback that receives the UTF-8 encoded output
+     * @param user_data passed through to the callback
+     * @return 0 on success, or -1 if the arguments are invalid or the callback
+     *         failed. The output is incomplete in that case.
+     */
+    int plist_to_xml_with_writer(plist_t plist, plist_write_func_t write, void *user_data);
+
+    /**
+     * Export the #plist_t structure to XML format and write it to a stream.
+     *
+     * @param plist the root node to export
+     * @param file the stream to write to, for example opened with fopen()
+     * @return 0 on success, -1 on error
+     */
+    int plist_to_xml_file(plist_t plist, FILE *file);
+
+    /**
+     * Export the #plist_t structure to XML format and write it to a file
+     * descriptor, like a file or socket.
+     *
+     * @param plist the root node to export
+     * @param fd the file descriptor to write to
+     * @return 0 on success, -1 on error
+     */
+    int plist_to_xml_fd(plist_t plist, int fd);
+
     /**
      * Export the #plist_t structure to binary format.
      *
@@ -708,6 +748,87 @@ extern "C"
      */
     char plist_compare_node_value(plist_t node_l, plist_t node_r);
 
+    /**
+     * State of an incremental base64 encoder or decoder.
+     * A state must be initialized with #plist_base64_state_init and must not
+     * be shared between encoding and decoding.
+     */
+    typedef struct {
+        uint8_t buf[4];
+        uint32_t count;
+    } plist_base64_state_t;
+
+    /** Number of characters needed to base64 encode __len bytes (without 0-termination). */
+    #define PLIST_BASE64_ENCODED_SIZE(__len) ((((__len) + 2) / 3) * 4)
+
+    /** Upper bound of bytes produced by base64 decoding __len characters. */
+    #define PLIST_BASE64_DECODED_SIZE(__len) ((((__len) + 3) / 4) * 3)
+
+    /**
+     * Encode a buffer as base64. Uses SIMD instructions when the CPU supports them.
+     *
+     * @param outbuf buffer receiving the 0-terminated result. Must hold at least
+     *            PLIST_BASE64_ENCODED_SIZE(size) + 1 bytes.
+     * @param buf the data to encode
+     * @param size length of the data
+     * @return the number of characters written, excluding the 0-termination.
+     */
+    size_t plist_base64_encode(char *outbuf, const uint8_t *buf, size_t size);
+
+    /**
+     * Decode a base64 string. Whitespace and characters outside of the base64
+     * alphabet are skipped, decoding stops at a 0-byte.
+     *
+     * @param outbuf buffer receiving the decoded data. Must hold at least
+     *            PLIST_BASE64_DECODED_SIZE(size) bytes.
+     * @param buf the base64 string
+     * @param size length of the string
+     * @return the number of bytes written to outbuf.
+     */
+    size_t plist_base64_decode(uint8_t *outbuf, const char *buf, size_t size);
+
+    /**
+     * Initialize an incremental base64 encoder or decoder.
+     *
+     * @param state the state to initialize
+     */
+    void plist_base64_state_init(plist_base64_state_t *state);
+
+    /**
+     * Encode the next chunk of an input stream as base64. Up to two trailing
+     * bytes are kept in the state until more input or #plist_base64_encode_final.
+     *
+     * @param state encoder state
+     * @param outbuf buffer receiving the encoded characters (not 0-terminated).
+     *            Must hold at least PLIST_BASE64_ENCODED_SIZE(size) bytes.
+     * @param buf the next chunk of data
+     * @param size length of the chunk
+     * @return the number of characters written.
+     */
+    size_t plist_base64_encode_update(plist_base64_state_t *state, char *outbuf, const uint8_t *buf, size_t size);
+
+    /**
+     * Flush the bytes kept by an incremental base64 encoder, including padding.
+     *
+     * @param state encoder state
+     * @param outbuf buffer receiving up to 4 characters (not 0-terminated).
+     * @return the number of characters written.
+     */
+    size_t plist_base64_encode_final(plist_base64_state_t *state, char *outbuf);
+
+    /**
+     * Decode the next chunk of a base64 input stream. Incomplete groups of
+     * characters are kept in the state until more input arrives.
+     *
+     * @param state decoder state
+     * @param outbuf buffer receiving the decoded data. Must hold at least
+     *            PLIST_BASE64_DECODED_SIZE(size) bytes.
+     * @param buf the next chunk of base64 characters
+     * @param size length of the chunk
+     * @return the number of bytes written to outbuf.
+     */
+    size_t plist_base64_decode_update(plist_base64_state_t *state, uint8_t *outbuf, const char *buf, size_t size);
+
     #define _PLIST_IS_TYPE(__plist, __plist_type) (__plist && (plist_get_node_type(__plist) == PLIST_##__plist_type))
 
     /* Helper macros for the different plist types */
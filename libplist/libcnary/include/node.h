@@ -28,13 +28,27 @@
 
 #define NODE_TYPE 1;
 
+/*
+ * Container children are kept in a growable array of node pointers by
+ * default, which makes indexed access and sibling lookups O(1). Define
+ * NODE_CHILD_LIST (configure --enable-linked-nodes) to use the original
+ * doubly linked list instead.
+ */
+#ifndef NODE_CHILD_LIST
+#define NODE_CHILD_ARRAY
+#endif
+
 struct node_list_t;
 
 // This class implements the abstract iterator class
 typedef struct node_t {
 	// Super class
+#ifdef NODE_CHILD_ARRAY
+	unsigned int index;	// slot in the parent's child array
+#else
 	struct node_t* next;
 	struct node_t* prev;
+#endif
 	unsigned int count;
 
 	// Local Members
@@ -24,13 +24,20 @@
 #ifndef NODE_LIST_H_
 #define NODE_LIST_H_
 
-struct node_t;
+#include "node.h"
 
 // This class implements the list_t abstract class
 typedef struct node_list_t {
+#ifdef NODE_CHILD_ARRAY
+	// children are stored in items[head] .. items[head + count - 1]
+	struct node_t** items;
+	unsigned int head;
+	unsigned int capacity;
+#else
 	// list_t members
 	struct node_t* begin;
 	struct node_t* end;
+#endif
 
 	// node_list_t members
 	unsigned int count;
@@ -44,4 +51,8 @@ int node_list_add(node_list_t* list, node_t* node);
 int node_list_insert(node_list_t* list, unsigned int index, node_t* node);
 int node_list_remove(node_list_t* list, node_t* node);
 
+#ifdef NODE_CHILD_ARRAY
+int node_list_contains(node_list_t* list, node_t* node);
+#endif
+
 #endif /* NODE_LIST_H_ */
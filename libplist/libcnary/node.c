@@ -32,7 +32,7 @@ void node_destroy(node_t* node) {
 
 	if (node->children && node->children->count > 0) {
 		node_t* ch;
-		while ((ch = node->children->begin)) {
+		while ((ch = node_first_child(node))) {
 			node_list_remove(node->children, ch);
 			node_destroy(ch);
 		}
@@ -53,8 +53,12 @@ node_t* node_create(node_t* parent, void* data) {
 	memset(node, '\0', sizeof(node_t));
 
 	node->data = data;
+#ifdef NODE_CHILD_ARRAY
+	node->index = 0;
+#else
 	node->next = NULL;
 	node->prev = NULL;
+#endif
 	node->count = 0;
 	node->parent = NULL;
 	node->children = NULL;
@@ -144,6 +148,45 @@ unsigned int node_n_children(struct node_t* node)
 	return node->count;
 }
 
+#ifdef NODE_CHILD_ARRAY
+
+node_t* node_nth_child(struct node_t* node, unsigned int n)
+{
+	if (!node || !node->children || n >= node->children->count) return NULL;
+	return node->children->items[node->children->head + n];
+}
+
+node_t* node_first_child(struct node_t* node)
+{
+	if (!node || !node->children || node->children->count == 0) return NULL;
+	return node->children->items[node->children->head];
+}
+
+node_t* node_prev_sibling(struct node_t* node)
+{
+	if (!node || !node->parent) return NULL;
+	node_list_t* list = node->parent->children;
+	if (!node_list_contains(list, node) || node->index == list->head) return NULL;
+	return list->items[node->index - 1];
+}
+
+node_t* node_next_sibling(struct node_t* node)
+{
+	if (!node || !node->parent) return NULL;
+	node_list_t* list = node->parent->children;
+	if (!node_list_contains(list, node) || node->index + 1 == list->head + list->count) return NULL;
+	return list->items[node->index + 1];
+}
+
+int node_child_position(struct node_t* parent, node_t* child)
+{
+	if (!parent || !child) return -1;
+	if (!node_list_contains(parent->children, child)) return -1;
+	return child->index - parent->children->head;
+}
+
+#else
+
 node_t* node_nth_child(struct node_t* node, unsigned int n)
 {
 	if (!node || !node->children || !node->children->begin) return NULL;
@@ -199,6 +242,8 @@ int node_child_position(struct node_t* parent, node_t* child)
 	return node_index;
 }
 
+#endif
+
 node_t* node_copy_deep(node_t* node, copy_func_t copy_func)
 {
 	if (!node) return NULL;
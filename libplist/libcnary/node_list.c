@@ -28,6 +28,130 @@
 #include "node.h"
 #include "node_list.h"
 
+#ifdef NODE_CHILD_ARRAY
+
+void node_list_destroy(node_list_t* list) {
+	if (!list) return;
+	free(list->items);
+	free(list);
+}
+
+node_list_t* node_list_create() {
+	node_list_t* list = (node_list_t*) malloc(sizeof(node_list_t));
+	if(list == NULL) {
+		return NULL;
+	}
+	memset(list, '\0', sizeof(node_list_t));
+
+	// Initialize structure
+	list->items = NULL;
+	list->head = 0;
+	list->capacity = 0;
+	list->count = 0;
+	return list;
+}
+
+static void node_list_reindex(node_list_t* list, unsigned int from, unsigned int to) {
+	unsigned int i;
+	for (i = from; i < to; i++) {
+		list->items[i]->index = i;
+	}
+}
+
+// Make room for one more element at the end of the array
+static int node_list_reserve(node_list_t* list) {
+	if (list->head + list->count < list->capacity) {
+		return 0;
+	}
+
+	if (list->head > list->count) {
+		// Plenty of space was freed at the front, move everything back
+		memmove(list->items, list->items + list->head, list->count * sizeof(node_t*));
+		list->head = 0;
+		node_list_reindex(list, 0, list->count);
+		return 0;
+	}
+
+	unsigned int capacity = (list->capacity > 0) ? list->capacity * 2 : 4;
+	node_t** items = (node_t**) realloc(list->items, capacity * sizeof(node_t*));
+	if (items == NULL) {
+		return -1;
+	}
+	list->items = items;
+	list->capacity = capacity;
+	return 0;
+}
+
+int node_list_add(node_list_t* list, node_t* node) {
+	if (!list || !node) return -1;
+	if (node_list_reserve(list) < 0) return -1;
+
+	// Store our new node behind the last element
+	unsigned int slot = list->head + list->count;
+	list->items[slot] = node;
+	node->index = slot;
+
+	// Increment our node count for this list
+	list->count++;
+	return 0;
+}
+
+int node_list_insert(node_list_t* list, unsigned int node_index, node_t* node) {
+	if (!list || !node) return -1;
+	if (node_index >= list->count) {
+		return node_list_add(list, node);
+	}
+
+	if (node_index == 0 && list->head > 0) {
+		// There is a free slot right in front of the first element
+		list->head--;
+		list->items[list->head] = node;
+		node->index = list->head;
+		list->count++;
+		return 0;
+	}
+
+	if (node_list_reserve(list) < 0) return -1;
+
+	// Move all following elements up by one
+	unsigned int slot = list->head + node_index;
+	unsigned int end = list->head + list->count;
+	memmove(list->items + slot + 1, list->items + slot, (end - slot) * sizeof(node_t*));
+	list->items[slot] = node;
+	list->count++;
+	node_list_reindex(list, slot, end + 1);
+	return 0;
+}
+
+int node_list_contains(node_list_t* list, node_t* node) {
+	if (!list || !node) return 0;
+	return node->index >= list->head && node->index < list->head + list->count && list->items[node->index] == node;
+}
+
+int node_list_remove(node_list_t* list, node_t* node) {
+	if (!list || !node) return -1;
+	if (list->count == 0) return -1;
+	if (!node_list_contains(list, node)) return -1;
+
+	unsigned int slot = node->index;
+	int node_index = slot - list->head;
+	if (slot == list->head) {
+		// we just removed the first element, no need to move anything
+		list->head++;
+	} else {
+		unsigned int end = list->head + list->count;
+		memmove(list->items + slot, list->items + slot + 1, (end - slot - 1) * sizeof(node_t*));
+		node_list_reindex(list, slot, end - 1);
+	}
+	list->count--;
+	if (list->count == 0) {
+		list->head = 0;
+	}
+	return node_index;
+}
+
+#else
+
 void node_list_destroy(node_list_t* list) {
 	free(list);
 }
@@ -153,3 +277,4 @@ int node_list_remove(node_list_t* list, node_t* node) {
 	return -1;
 }
 
+#endif
@@ -19,11 +19,32 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 #include <string.h>
+#include "plist.h"
 #include "base64.h"
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define BASE64_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define BASE64_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BASE64_TARGET(__t) __attribute__((target(__t)))
+#else
+#define BASE64_TARGET(__t)
+#endif
+
 static const char base64_str[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 static const char base64_pad = '=';
 
+/* sextet value used in decoder state for a padding character */
+#define BASE64_PAD_VALUE 64
+
 static const signed char base64_table[256] = {
 	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
 	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
@@ -43,76 +64,532 @@ static const signed char base64_table[256] = {
 	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
 };
 
-size_t base64encode(char *outbuf, const unsigned char *buf, size_t size)
+/*
+ * A codec encodes whole 3-byte groups (size is always a multiple of 3) and
+ * decodes as many complete, whitespace-free blocks as it can, advancing *buf
+ * past the consumed characters. Everything else is left to the scalar code.
+ */
+typedef struct {
+	base64_impl_t impl;
+	const char *name;
+	size_t (*encode)(char *outbuf, const unsigned char *buf, size_t size);
+	size_t (*decode)(unsigned char *outbuf, const char **buf, const char *end);
+} base64_codec_t;
+
+static size_t base64_encode_scalar(char *outbuf, const unsigned char *buf, size_t size)
 {
-	if (!outbuf || !buf || (size <= 0)) {
+	size_t n = 0;
+	size_t m = 0;
+	while (n + 3 <= size) {
+		unsigned int v = ((unsigned int)buf[n] << 16) | ((unsigned int)buf[n+1] << 8) | buf[n+2];
+		outbuf[m++] = base64_str[(v >> 18) & 63];
+		outbuf[m++] = base64_str[(v >> 12) & 63];
+		outbuf[m++] = base64_str[(v >> 6) & 63];
+		outbuf[m++] = base64_str[v & 63];
+		n+=3;
+	}
+	return m;
+}
+
+static size_t base64_encode_tail(char *outbuf, const unsigned char *buf, size_t size)
+{
+	if (size == 0) {
 		return 0;
 	}
+	unsigned int v = ((unsigned int)buf[0] << 16) | ((size > 1) ? ((unsigned int)buf[1] << 8) : 0);
+	outbuf[0] = base64_str[(v >> 18) & 63];
+	outbuf[1] = base64_str[(v >> 12) & 63];
+	outbuf[2] = (size > 1) ? base64_str[(v >> 6) & 63] : base64_pad;
+	outbuf[3] = base64_pad;
+	return 4;
+}
 
-	size_t n = 0;
+#ifdef BASE64_X86
+BASE64_TARGET("ssse3")
+static inline __m128i base64_enc_reshuffle_ssse3(__m128i in)
+{
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(t1, t3);
+}
+
+BASE64_TARGET("ssse3")
+static inline __m128i base64_enc_translate_ssse3(__m128i in)
+{
+	const __m128i lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	__m128i idx = _mm_subs_epu8(in, _mm_set1_epi8(51));
+	const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), in);
+	idx = _mm_or_si128(idx, _mm_and_si128(less, _mm_set1_epi8(13)));
+	return _mm_add_epi8(in, _mm_shuffle_epi8(lut, idx));
+}
+
+/* the block helpers are inlined into the AVX2 functions as well, so their
+ * tails stay VEX encoded and don't pay for SSE/AVX transitions */
+BASE64_TARGET("ssse3")
+static inline size_t base64_encode_blocks_ssse3(char *outbuf, const unsigned char **buf, size_t *size)
+{
 	size_t m = 0;
-	unsigned char input[3];
-	unsigned int output[4];
-	while (n < size) {
-		input[0] = buf[n];
-		input[1] = (n+1 < size) ? buf[n+1] : 0;
-		input[2] = (n+2 < size) ? buf[n+2] : 0;
-		output[0] = input[0] >> 2;
-		output[1] = ((input[0] & 3) << 4) + (input[1] >> 4);
-		output[2] = ((input[1] & 15) << 2) + (input[2] >> 6);
-		output[3] = input[2] & 63;
-		outbuf[m++] = base64_str[(int)output[0]];
-		outbuf[m++] = base64_str[(int)output[1]];
-		outbuf[m++] = (n+1 < size) ? base64_str[(int)output[2]] : base64_pad;
-		outbuf[m++] = (n+2 < size) ? base64_str[(int)output[3]] : base64_pad;
-		n+=3;
+	/* each round reads 16 bytes but consumes only 12 */
+	while (*size >= 16) {
+		__m128i str = _mm_loadu_si128((const __m128i*)*buf);
+		str = base64_enc_translate_ssse3(base64_enc_reshuffle_ssse3(str));
+		_mm_storeu_si128((__m128i*)(outbuf + m), str);
+		*buf += 12;
+		*size -= 12;
+		m += 16;
+	}
+	return m;
+}
+
+BASE64_TARGET("ssse3")
+static size_t base64_encode_ssse3(char *outbuf, const unsigned char *buf, size_t size)
+{
+	size_t m = base64_encode_blocks_ssse3(outbuf, &buf, &size);
+	return m + base64_encode_scalar(outbuf + m, buf, size);
+}
+
+BASE64_TARGET("avx2")
+static size_t base64_encode_avx2(char *outbuf, const unsigned char *buf, size_t size)
+{
+	size_t m = 0;
+	/* two 12-byte groups per round, one in each 128-bit lane */
+	while (size >= 28) {
+		__m256i str = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)buf)), _mm_loadu_si128((const __m128i*)(buf + 12)), 1);
+		str = _mm256_shuffle_epi8(str, _mm256_set_epi8(
+				10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+				10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+		const __m256i t0 = _mm256_and_si256(str, _mm256_set1_epi32(0x0fc0fc00));
+		const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		const __m256i t2 = _mm256_and_si256(str, _mm256_set1_epi32(0x003f03f0));
+		const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		str = _mm256_or_si256(t1, t3);
+
+		const __m256i lut = _mm256_setr_epi8(
+				'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+				'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+				'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+				'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+		__m256i idx = _mm256_subs_epu8(str, _mm256_set1_epi8(51));
+		const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), str);
+		idx = _mm256_or_si256(idx, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+		str = _mm256_add_epi8(str, _mm256_shuffle_epi8(lut, idx));
+
+		_mm256_storeu_si256((__m256i*)(outbuf + m), str);
+		buf += 24;
+		size -= 24;
+		m += 32;
+	}
+	m += base64_encode_blocks_ssse3(outbuf + m, &buf, &size);
+	return m + base64_encode_scalar(outbuf + m, buf, size);
+}
+
+/*
+ * Validation and translation of 16 characters at once. The nibble lookup
+ * tables flag every byte outside of [A-Za-z0-9+/], which makes the whole
+ * block fall back to the scalar decoder (whitespace, padding, garbage).
+ */
+BASE64_TARGET("ssse3")
+static inline size_t base64_decode_ssse3_blocks(unsigned char *outbuf, const char **buf, const char *end)
+{
+	const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2F = _mm_set1_epi8(0x2F);
+	const char *s = *buf;
+	size_t p = 0;
+
+	while (end - s >= 16) {
+		__m128i str = _mm_loadu_si128((const __m128i*)s);
+		const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2F);
+		const __m128i lo_nibbles = _mm_and_si128(str, mask_2F);
+		const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+		const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+		if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0) {
+			break;
+		}
+		const __m128i eq_2F = _mm_cmpeq_epi8(str, mask_2F);
+		str = _mm_add_epi8(str, _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2F, hi_nibbles)));
+
+		str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+		str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+		str = _mm_shuffle_epi8(str, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+		/* store exactly 12 bytes so callers only need room for the decoded data */
+		_mm_storel_epi64((__m128i*)(outbuf + p), str);
+		int tail = _mm_cvtsi128_si32(_mm_srli_si128(str, 8));
+		memcpy(outbuf + p + 8, &tail, 4);
+		s += 16;
+		p += 12;
+	}
+	*buf = s;
+	return p;
+}
+
+BASE64_TARGET("ssse3")
+static size_t base64_decode_ssse3(unsigned char *outbuf, const char **buf, const char *end)
+{
+	return base64_decode_ssse3_blocks(outbuf, buf, end);
+}
+
+BASE64_TARGET("avx2")
+static size_t base64_decode_avx2(unsigned char *outbuf, const char **buf, const char *end)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi = _mm256_setr_epi8(
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+			0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+			0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2F = _mm256_set1_epi8(0x2F);
+	const char *s = *buf;
+	size_t p = 0;
+
+	while (end - s >= 32) {
+		__m256i str = _mm256_loadu_si256((const __m256i*)s);
+		const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2F);
+		const __m256i lo_nibbles = _mm256_and_si256(str, mask_2F);
+		const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256())) != 0) {
+			break;
+		}
+		const __m256i eq_2F = _mm256_cmpeq_epi8(str, mask_2F);
+		str = _mm256_add_epi8(str, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2F, hi_nibbles)));
+
+		str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+		str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+		str = _mm256_shuffle_epi8(str, _mm256_setr_epi8(
+				2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+				2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+
+		_mm_storeu_si128((__m128i*)(outbuf + p), _mm256_castsi256_si128(str));
+		_mm_storel_epi64((__m128i*)(outbuf + p + 16), _mm256_extracti128_si256(str, 1));
+		s += 32;
+		p += 24;
+	}
+	*buf = s;
+	return p + base64_decode_ssse3_blocks(outbuf + p, buf, end);
+}
+
+static int base64_cpu_has_ssse3(void)
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 9)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+static int base64_cpu_has_avx2(void)
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return 0;
 	}
+	__cpuid(info, 1);
+	/* OSXSAVE and AVX, and the OS must preserve the YMM state */
+	if ((info[2] & ((1 << 27) | (1 << 28))) != ((1 << 27) | (1 << 28))) {
+		return 0;
+	}
+	if ((_xgetbv(0) & 6) != 6) {
+		return 0;
+	}
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#ifdef BASE64_NEON
+static size_t base64_encode_neon(char *outbuf, const unsigned char *buf, size_t size)
+{
+	uint8x16x4_t lut;
+	lut.val[0] = vld1q_u8((const uint8_t*)base64_str);
+	lut.val[1] = vld1q_u8((const uint8_t*)base64_str + 16);
+	lut.val[2] = vld1q_u8((const uint8_t*)base64_str + 32);
+	lut.val[3] = vld1q_u8((const uint8_t*)base64_str + 48);
+	const uint8x16_t mask = vdupq_n_u8(0x3F);
+	size_t m = 0;
+
+	while (size >= 48) {
+		uint8x16x3_t src = vld3q_u8(buf);
+		uint8x16x4_t dst;
+		dst.val[0] = vshrq_n_u8(src.val[0], 2);
+		dst.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(src.val[0], 4), vshrq_n_u8(src.val[1], 4)), mask);
+		dst.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(src.val[1], 2), vshrq_n_u8(src.val[2], 6)), mask);
+		dst.val[3] = vandq_u8(src.val[2], mask);
+		dst.val[0] = vqtbl4q_u8(lut, dst.val[0]);
+		dst.val[1] = vqtbl4q_u8(lut, dst.val[1]);
+		dst.val[2] = vqtbl4q_u8(lut, dst.val[2]);
+		dst.val[3] = vqtbl4q_u8(lut, dst.val[3]);
+		vst4q_u8((uint8_t*)(outbuf + m), dst);
+		buf += 48;
+		size -= 48;
+		m += 64;
+	}
+	return m + base64_encode_scalar(outbuf + m, buf, size);
+}
+
+static inline uint8x16_t base64_dec_translate_neon(uint8x16_t c, uint8x16_t *invalid)
+{
+	const uint8x16_t upper = vcltq_u8(vsubq_u8(c, vdupq_n_u8('A')), vdupq_n_u8(26));
+	const uint8x16_t lower = vcltq_u8(vsubq_u8(c, vdupq_n_u8('a')), vdupq_n_u8(26));
+	const uint8x16_t digit = vcltq_u8(vsubq_u8(c, vdupq_n_u8('0')), vdupq_n_u8(10));
+	const uint8x16_t plus = vceqq_u8(c, vdupq_n_u8('+'));
+	const uint8x16_t slash = vceqq_u8(c, vdupq_n_u8('/'));
+	uint8x16_t v = vandq_u8(upper, vsubq_u8(c, vdupq_n_u8('A')));
+	v = vorrq_u8(v, vandq_u8(lower, vsubq_u8(c, vdupq_n_u8('a' - 26))));
+	v = vorrq_u8(v, vandq_u8(digit, vaddq_u8(c, vdupq_n_u8(52 - '0'))));
+	v = vorrq_u8(v, vandq_u8(plus, vdupq_n_u8(62)));
+	v = vorrq_u8(v, vandq_u8(slash, vdupq_n_u8(63)));
+	const uint8x16_t valid = vorrq_u8(vorrq_u8(upper, lower), vorrq_u8(digit, vorrq_u8(plus, slash)));
+	*invalid = vorrq_u8(*invalid, vmvnq_u8(valid));
+	return v;
+}
+
+static size_t base64_decode_neon(unsigned char *outbuf, const char **buf, const char *end)
+{
+	const char *s = *buf;
+	size_t p = 0;
+
+	while (end - s >= 64) {
+		uint8x16x4_t src = vld4q_u8((const uint8_t*)s);
+		uint8x16_t invalid = vdupq_n_u8(0);
+		const uint8x16_t a = base64_dec_translate_neon(src.val[0], &invalid);
+		const uint8x16_t b = base64_dec_translate_neon(src.val[1], &invalid);
+		const uint8x16_t c = base64_dec_translate_neon(src.val[2], &invalid);
+		const uint8x16_t d = base64_dec_translate_neon(src.val[3], &invalid);
+		if (vmaxvq_u8(invalid) != 0) {
+			break;
+		}
+		uint8x16x3_t dst;
+		dst.val[0] = vorrq_u8(vshlq_n_u8(a, 2), vshrq_n_u8(b, 4));
+		dst.val[1] = vorrq_u8(vshlq_n_u8(b, 4), vshrq_n_u8(c, 2));
+		dst.val[2] = vorrq_u8(vshlq_n_u8(c, 6), d);
+		vst3q_u8(outbuf + p, dst);
+		s += 64;
+		p += 48;
+	}
+	*buf = s;
+	return p;
+}
+#endif
+
+static const base64_codec_t base64_codecs[] = {
+	{ BASE64_IMPL_SCALAR, "scalar", base64_encode_scalar, NULL },
+#ifdef BASE64_X86
+	{ BASE64_IMPL_SSSE3, "ssse3", base64_encode_ssse3, base64_decode_ssse3 },
+	{ BASE64_IMPL_AVX2, "avx2", base64_encode_avx2, base64_decode_avx2 },
+#endif
+#ifdef BASE64_NEON
+	{ BASE64_IMPL_NEON, "neon", base64_encode_neon, base64_decode_neon },
+#endif
+};
+
+static const base64_codec_t *base64_codec = NULL;
+
+static int base64_impl_supported(base64_impl_t impl)
+{
+	switch (impl) {
+	case BASE64_IMPL_SCALAR:
+		return 1;
+#ifdef BASE64_X86
+	case BASE64_IMPL_SSSE3:
+		return base64_cpu_has_ssse3();
+	case BASE64_IMPL_AVX2:
+		return base64_cpu_has_ssse3() && base64_cpu_has_avx2();
+#endif
+#ifdef BASE64_NEON
+	case BASE64_IMPL_NEON:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+int base64_select_impl(base64_impl_t impl)
+{
+	size_t i;
+	const base64_codec_t *best = NULL;
+	for (i = 0; i < sizeof(base64_codecs) / sizeof(base64_codecs[0]); i++) {
+		const base64_codec_t *codec = &base64_codecs[i];
+		if (impl != BASE64_IMPL_AUTO && codec->impl != impl) {
+			continue;
+		}
+		/* codecs are sorted by preference, the last supported one wins */
+		if (base64_impl_supported(codec->impl)) {
+			best = codec;
+		}
+	}
+	if (!best) {
+		return -1;
+	}
+	base64_codec = best;
+	return 0;
+}
+
+const char *base64_impl_name(void)
+{
+	if (!base64_codec) {
+		base64_select_impl(BASE64_IMPL_AUTO);
+	}
+	return base64_codec->name;
+}
+
+static inline const base64_codec_t *base64_get_codec(void)
+{
+	/* concurrent first calls all store the same pointer */
+	if (!base64_codec) {
+		base64_select_impl(BASE64_IMPL_AUTO);
+	}
+	return base64_codec;
+}
+
+PLIST_API void plist_base64_state_init(plist_base64_state_t *state)
+{
+	if (!state) return;
+	memset(state, '\0', sizeof(plist_base64_state_t));
+}
+
+PLIST_API size_t plist_base64_encode_update(plist_base64_state_t *state, char *outbuf, const uint8_t *buf, size_t size)
+{
+	if (!state || !outbuf || !buf || size == 0) {
+		return 0;
+	}
+
+	size_t m = 0;
+	if (state->count > 0) {
+		while (state->count < 3 && size > 0) {
+			state->buf[state->count++] = *buf++;
+			size--;
+		}
+		if (state->count < 3) {
+			return 0;
+		}
+		m += base64_encode_scalar(outbuf, state->buf, 3);
+		state->count = 0;
+	}
+
+	size_t rest = size % 3;
+	m += base64_get_codec()->encode(outbuf + m, buf, size - rest);
+	memcpy(state->buf, buf + size - rest, rest);
+	state->count = rest;
+	return m;
+}
+
+PLIST_API size_t plist_base64_encode_final(plist_base64_state_t *state, char *outbuf)
+{
+	if (!state || !outbuf) {
+		return 0;
+	}
+	size_t m = base64_encode_tail(outbuf, state->buf, state->count);
+	state->count = 0;
+	return m;
+}
+
+PLIST_API size_t plist_base64_encode(char *outbuf, const uint8_t *buf, size_t size)
+{
+	if (!outbuf || !buf || (size <= 0)) {
+		return 0;
+	}
+
+	size_t rest = size % 3;
+	size_t m = base64_get_codec()->encode(outbuf, buf, size - rest);
+	m += base64_encode_tail(outbuf + m, buf + size - rest, rest);
 	outbuf[m] = 0; // 0-termination!
 	return m;
 }
 
-unsigned char *base64decode(const char *buf, size_t *size)
+PLIST_API size_t plist_base64_decode_update(plist_base64_state_t *state, uint8_t *outbuf, const char *buf, size_t size)
 {
-	if (!buf || !size) return NULL;
-	size_t len = (*size > 0) ? *size : strlen(buf);
-	if (len <= 0) return NULL;
-	unsigned char *outbuf = (unsigned char*)malloc((len/4)*3+3);
+	if (!state || !outbuf || !buf) {
+		return 0;
+	}
+
+	const base64_codec_t *codec = base64_get_codec();
 	const char *ptr = buf;
-	int p = 0;
-	int wv, w1, w2, w3, w4;
-	int tmpval[4];
-	int tmpcnt = 0;
+	const char *end = buf + size;
+	size_t p = 0;
+	int wv;
 
-	do {
-		while (ptr < buf+len && (*ptr == ' ' || *ptr == '\t' || *ptr == '\n' || *ptr == '\r')) {
+	while (ptr < end) {
+		while (ptr < end && (*ptr == ' ' || *ptr == '\t' || *ptr == '\n' || *ptr == '\r')) {
 			ptr++;
 		}
-		if (*ptr == '\0' || ptr >= buf+len) {
+		if (ptr >= end || *ptr == '\0') {
 			break;
 		}
+		if (state->count == 0 && codec->decode) {
+			size_t n = codec->decode(outbuf + p, &ptr, end);
+			p += n;
+			if (n > 0) {
+				continue;
+			}
+		}
 		if ((wv = base64_table[(int)(unsigned char)*ptr++]) == -1) {
 			continue;
 		}
-		tmpval[tmpcnt++] = wv;
-		if (tmpcnt == 4) {
-			tmpcnt = 0;
-			w1 = tmpval[0];
-			w2 = tmpval[1];
-			w3 = tmpval[2];
-			w4 = tmpval[3];
-
-			if (w1 >= 0 && w2 >= 0) {
+		state->buf[state->count++] = (wv == -2) ? BASE64_PAD_VALUE : (uint8_t)wv;
+		if (state->count == 4) {
+			int w1 = state->buf[0];
+			int w2 = state->buf[1];
+			int w3 = state->buf[2];
+			int w4 = state->buf[3];
+			state->count = 0;
+
+			if (w1 < BASE64_PAD_VALUE && w2 < BASE64_PAD_VALUE) {
 				outbuf[p++] = (unsigned char)(((w1 << 2) + (w2 >> 4)) & 0xFF);
 			}
-			if (w2 >= 0 && w3 >= 0) {
+			if (w2 < BASE64_PAD_VALUE && w3 < BASE64_PAD_VALUE) {
 				outbuf[p++] = (unsigned char)(((w2 << 4) + (w3 >> 2)) & 0xFF);
 			}
-			if (w3 >= 0 && w4 >= 0) {
+			if (w3 < BASE64_PAD_VALUE && w4 < BASE64_PAD_VALUE) {
 				outbuf[p++] = (unsigned char)(((w3 << 6) + w4) & 0xFF);
 			}
 		}
-	} while (1);
+	}
+
+	return p;
+}
+
+PLIST_API size_t plist_base64_decode(uint8_t *outbuf, const char *buf, size_t size)
+{
+	plist_base64_state_t state;
+	plist_base64_state_init(&state);
+	return plist_base64_decode_update(&state, outbuf, buf, size);
+}
 
+size_t base64encode(char *outbuf, const unsigned char *buf, size_t size)
+{
+	return plist_base64_encode(outbuf, buf, size);
+}
+
+unsigned char *base64decode(const char *buf, size_t *size)
+{
+	if (!buf || !size) return NULL;
+	size_t len = (*size > 0) ? *size : strlen(buf);
+	if (len <= 0) return NULL;
+	unsigned char *outbuf = (unsigned char*)malloc((len/4)*3+3);
+	size_t p = plist_base64_decode(outbuf, buf, len);
 	outbuf[p] = 0;
 	*size = p;
 	return outbuf;
@@ -22,7 +22,21 @@
 #define BASE64_H
 #include <stdlib.h>
 
+typedef enum {
+	BASE64_IMPL_AUTO = 0,
+	BASE64_IMPL_SCALAR,
+	BASE64_IMPL_SSSE3,
+	BASE64_IMPL_AVX2,
+	BASE64_IMPL_NEON
+} base64_impl_t;
+
 size_t base64encode(char *outbuf, const unsigned char *buf, size_t size);
 unsigned char *base64decode(const char *buf, size_t *size);
 
+/* Select the codec used by all base64 functions. BASE64_IMPL_AUTO picks
+ * the fastest one supported by the CPU (the default). Returns 0 on success
+ * or -1 if the requested implementation is not available. */
+int base64_select_impl(base64_impl_t impl);
+const char *base64_impl_name(void);
+
 #endif
@@ -34,9 +34,6 @@
 
 #include <plist/plist.h>
 #include "plist.h"
-#include "hashtable.h"
-#include "bytearray.h"
-#include "ptrarray.h"
 
 #include <node.h>
 
@@ -862,163 +859,156 @@ PLIST_API void plist_from_bin(const char *plist_bin, uint32_t length, plist_t *
     plist_free(bplist.used_indexes);
 }
 
-static unsigned int plist_data_hash(const void* key)
-{
-    plist_data_t data = plist_get_data((plist_t) key);
-
-    unsigned int hash = data->type;
-    unsigned int i = 0;
-
-    char *buff = NULL;
-    unsigned int size = 0;
-
-    switch (data->type)
-    {
-    case PLIST_BOOLEAN:
-    case PLIST_UINT:
-    case PLIST_REAL:
-    case PLIST_DATE:
-    case PLIST_UID:
-        buff = (char *) &data->intval;	//works also for real as we use an union
-        size = 8;
-        break;
-    case PLIST_KEY:
-    case PLIST_STRING:
-        buff = data->strval;
-        size = data->length;
-        break;
-    case PLIST_DATA:
-    case PLIST_ARRAY:
-    case PLIST_DICT:
-        //for these types only hash pointer
-        buff = (char *) &key;
-        size = sizeof(const void*);
-        break;
-    default:
-        break;
-    }
-
-    // now perform hash using djb2 hashing algorithm
-    // see: http://www.cse.yorku.ca/~oz/hash.html
-    hash += 5381;
-    for (i = 0; i < size; buff++, i++) {
-        hash = ((hash << 5) + hash) + *buff;
-    }
-
-    return hash;
-}
-
-struct serialize_s
-{
-    ptrarray_t* objects;
-    hashtable_t* ref_table;
-};
+/*
+ * Binary writer
+ *
+ * The tree is walked once to number the objects. Scalar values are interned
+ * by content in an open addressing table, so equal strings, data blobs and
+ * numbers are stored only once; containers can't occur twice in a tree and
+ * are never looked up. While walking, the exact encoded size of every object
+ * is summed up so the output can be written into a single allocation.
+ */
 
-static void serialize_plist(node_t* node, void* data)
-{
-    uint64_t *index_val = NULL;
-    struct serialize_s *ser = (struct serialize_s *) data;
-    uint64_t current_index = ser->objects->len;
+typedef struct {
+    node_t *node;
+    uint64_t refs;       /* first child reference in bplist_writer_t.refs */
+    uint64_t length;     /* number of characters to write for strings */
+    uint8_t unicode;
+} bplist_object_t;
 
-    //first check that node is not yet in objects
-    void* val = hash_table_lookup(ser->ref_table, node);
-    if (val)
-    {
-        //data is already in table
-        return;
-    }
-    //insert new ref
-    index_val = (uint64_t *) malloc(sizeof(uint64_t));
-    assert(index_val != NULL);
-    *index_val = current_index;
-    hash_table_insert(ser->ref_table, node, index_val);
-
-    //now append current node to object array
-    ptr_array_add(ser->objects, node);
-
-    //now recurse on children
-    node_t *ch;
-    for (ch = node_first_child(node); ch; ch = node_next_sibling(ch)) {
-        serialize_plist(ch, data);
-    }
+typedef struct {
+    uint64_t hash;
+    uint64_t index;      /* object index + 1, 0 marks a free slot */
+} bplist_intern_t;
 
-    return;
-}
+typedef struct {
+    bplist_object_t *objects;
+    uint64_t num_objects;
+    uint64_t objects_capacity;
+    uint64_t *refs;
+    uint64_t num_refs;
+    uint64_t refs_capacity;
+    uint64_t refs_written;
+    bplist_intern_t *intern;
+    uint64_t intern_size;
+    uint64_t intern_count;
+    uint64_t size;       /* size of all objects without their references */
+    int error;
+} bplist_writer_t;
+
+#define BPLIST_INTERN_INITIAL_SIZE 64
 
 #define Log2(x) (x == 8 ? 3 : (x == 4 ? 2 : (x == 2 ? 1 : 0)))
 
-static void write_int(bytearray_t * bplist, uint64_t val)
+static uint8_t get_int_bytes(uint64_t val)
 {
-    int size = get_needed_bytes(val);
-    uint8_t sz;
+    uint8_t size = get_needed_bytes(val);
     //do not write 3bytes int node
-    if (size == 3)
-        size++;
-    sz = BPLIST_UINT | Log2(size);
-
-    val = be64toh(val);
-    byte_array_append(bplist, &sz, 1);
-    byte_array_append(bplist, (uint8_t*)&val + (8-size), size);
+    return (size == 3) ? 4 : size;
 }
 
-static void write_uint(bytearray_t * bplist, uint64_t val)
+static uint64_t get_header_bytes(uint64_t count)
 {
-    uint8_t sz = BPLIST_UINT | 4;
-    uint64_t zero = 0;
-
-    val = be64toh(val);
-    byte_array_append(bplist, &sz, 1);
-    byte_array_append(bplist, &zero, sizeof(uint64_t));
-    byte_array_append(bplist, &val, sizeof(uint64_t));
+    return (count < 15) ? 1 : 2 + get_int_bytes(count);
 }
 
-static void write_real(bytearray_t * bplist, double val)
-{
-    int size = get_real_bytes(val);	//cheat to know used space
-    uint8_t buff[16];
-    buff[7] = BPLIST_REAL | Log2(size);
-    if (size == sizeof(float)) {
-        float floatval = (float)val;
-        *(uint32_t*)(buff+8) = float_bswap32(*(uint32_t*)&floatval);
-    } else {
-        *(uint64_t*)(buff+8) = float_bswap64(*(uint64_t*)&val);
-    }
-    byte_array_append(bplist, buff+7, size+1);
-}
+#define BPLIST_HASH_SAMPLE 128
 
-static void write_date(bytearray_t * bplist, double val)
+/* Hashes at most the first and last BPLIST_HASH_SAMPLE bytes, together with
+ * the length. Equal hashes are always confirmed by a full compare, so large
+ * data blobs don't need to be read twice. */
+static uint64_t hash_bytes(const void *buf, uint64_t len, uint64_t seed)
 {
-    uint8_t buff[16];
-    buff[7] = BPLIST_DATE | 3;
-    *(uint64_t*)(buff+8) = float_bswap64(*(uint64_t*)&val);
-    byte_array_append(bplist, buff+7, 9);
+    const uint8_t *p = (const uint8_t*)buf;
+    uint64_t hash = seed ^ (len * 0x9E3779B97F4A7C15ULL);
+    uint64_t k;
+
+    if (len > BPLIST_HASH_SAMPLE * 2) {
+        hash = hash_bytes(p, BPLIST_HASH_SAMPLE, hash);
+        p += len - BPLIST_HASH_SAMPLE;
+        len = BPLIST_HASH_SAMPLE;
+    }
+    while (len >= 8) {
+        memcpy(&k, p, 8);
+        hash = (hash ^ k) * 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 32;
+        p += 8;
+        len -= 8;
+    }
+    k = 0;
+    if (len > 0) {
+        memcpy(&k, p, len);
+    }
+    hash = (hash ^ k) * 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 29;
+    return hash;
 }
 
-static void write_raw_data(bytearray_t * bplist, uint8_t mark, uint8_t * val, uint64_t size)
+static uint64_t plist_data_hash(plist_data_t data)
 {
-    uint8_t marker = mark | (size < 15 ? size : 0xf);
-    byte_array_append(bplist, &marker, sizeof(uint8_t));
-    if (size >= 15) {
-        write_int(bplist, size);
+    switch (data->type)
+    {
+    case PLIST_BOOLEAN:
+        return hash_bytes(&data->boolval, 1, data->type);
+    case PLIST_UINT:
+    case PLIST_REAL:
+    case PLIST_DATE:
+    case PLIST_UID:
+        //works also for real as we use an union
+        return hash_bytes(&data->intval, sizeof(uint64_t), data->type | (data->length << 8));
+    case PLIST_KEY:
+    case PLIST_STRING:
+        return hash_bytes(data->strval, data->length, data->type);
+    case PLIST_DATA:
+        return hash_bytes(data->buff, data->length, data->type);
+    default:
+        return data->type;
     }
-    if (BPLIST_UNICODE==mark) size <<= 1;
-    byte_array_append(bplist, val, size);
 }
 
-static void write_data(bytearray_t * bplist, uint8_t * val, uint64_t size)
+static int plist_data_equal(plist_data_t a, plist_data_t b)
 {
-    write_raw_data(bplist, BPLIST_DATA, val, size);
+    if (a->type != b->type)
+        return 0;
+
+    switch (a->type)
+    {
+    case PLIST_BOOLEAN:
+        return a->boolval == b->boolval;
+    case PLIST_UINT:
+    case PLIST_REAL:
+    case PLIST_DATE:
+    case PLIST_UID:
+        return a->length == b->length && a->intval == b->intval;
+    case PLIST_KEY:
+    case PLIST_STRING:
+        return a->length == b->length && (a->length == 0 || !memcmp(a->strval, b->strval, a->length));
+    case PLIST_DATA:
+        return a->length == b->length && (a->length == 0 || !memcmp(a->buff, b->buff, a->length));
+    default:
+        return 0;
+    }
 }
 
-static void write_string(bytearray_t * bplist, char *val, uint64_t size)
+static int is_ascii_string(char* s, int len)
 {
-    write_raw_data(bplist, BPLIST_STRING, (uint8_t *) val, size);
+  int ret = 1, i = 0;
+  for(i = 0; i < len; i++)
+  {
+      if ( !isascii( s[i] ) )
+      {
+          ret = 0;
+          break;
+      }
+  }
+  return ret;
 }
 
-static uint16_t *plist_utf8_to_utf16be(char *unistr, long size, long *items_read, long *items_written)
+/* Converts to big endian UTF-16 and returns the number of code units.
+ * Only counts the code units when outbuf is NULL. */
+static uint64_t plist_utf8_to_utf16be(const char *unistr, long size, uint8_t *outbuf)
 {
-	uint16_t *outbuf;
-	int p = 0;
+	uint64_t p = 0;
 	long i = 0;
 
 	unsigned char c0;
@@ -1027,12 +1017,8 @@ static uint16_t *plist_utf8_to_utf16be(char *unistr, long size, long *items_read
 	unsigned char c3;
 
 	uint32_t w;
-
-	outbuf = (uint16_t*)malloc(((size*2)+1)*sizeof(uint16_t));
-	if (!outbuf) {
-		PLIST_BIN_ERR("%s: Could not allocate %" PRIu64 " bytes\n", __func__, (uint64_t)((size*2)+1)*sizeof(uint16_t));
-		return NULL;
-	}
+	uint16_t units[2];
+	int n;
 
 	while (i < size) {
 		c0 = unistr[i];
@@ -1042,340 +1028,388 @@ static uint16_t *plist_utf8_to_utf16be(char *unistr, long size, long *items_read
 		if ((c0 >= 0xF0) && (i < size-3) && (c1 >= 0x80) && (c2 >= 0x80) && (c3 >= 0x80)) {
 			// 4 byte sequence.  Need to generate UTF-16 surrogate pair
 			w = ((((c0 & 7) << 18) + ((c1 & 0x3F) << 12) + ((c2 & 0x3F) << 6) + (c3 & 0x3F)) & 0x1FFFFF) - 0x010000;
-			outbuf[p++] = be16toh(0xD800 + (w >> 10));
-			outbuf[p++] = be16toh(0xDC00 + (w & 0x3FF));
+			units[0] = 0xD800 + (w >> 10);
+			units[1] = 0xDC00 + (w & 0x3FF);
+			n = 2;
 			i+=4;
 		} else if ((c0 >= 0xE0) && (i < size-2) && (c1 >= 0x80) && (c2 >= 0x80)) {
 			// 3 byte sequence
-			outbuf[p++] = be16toh(((c2 & 0x3F) + ((c1 & 3) << 6)) + (((c1 >> 2) & 15) << 8) + ((c0 & 15) << 12));
+			units[0] = ((c2 & 0x3F) + ((c1 & 3) << 6)) + (((c1 >> 2) & 15) << 8) + ((c0 & 15) << 12);
+			n = 1;
 			i+=3;
 		} else if ((c0 >= 0xC0) && (i < size-1) && (c1 >= 0x80)) {
 			// 2 byte sequence
-			outbuf[p++] = be16toh(((c1 & 0x3F) + ((c0 & 3) << 6)) + (((c0 >> 2) & 7) << 8));
+			units[0] = ((c1 & 0x3F) + ((c0 & 3) << 6)) + (((c0 >> 2) & 7) << 8);
+			n = 1;
 			i+=2;
 		} else if (c0 < 0x80) {
 			// 1 byte sequence
-			outbuf[p++] = be16toh(c0);
+			units[0] = c0;
+			n = 1;
 			i+=1;
 		} else {
 			// invalid character
-			PLIST_BIN_ERR("%s: invalid utf8 sequence in string at index %lu\n", __func__, i);
+			if (!outbuf) {
+				PLIST_BIN_ERR("%s: invalid utf8 sequence in string at index %lu\n", __func__, i);
+			}
 			break;
 		}
+		if (outbuf) {
+			int k;
+			for (k = 0; k < n; k++) {
+				outbuf[(p+k)*2] = units[k] >> 8;
+				outbuf[(p+k)*2+1] = units[k] & 0xFF;
+			}
+		}
+		p += n;
 	}
-	if (items_read) {
-		*items_read = i;
-	}
-	if (items_written) {
-		*items_written = p;
-	}
-	outbuf[p] = 0;
 
-	return outbuf;
+	return p;
 }
 
-static void write_unicode(bytearray_t * bplist, char *val, uint64_t size)
+static void *bplist_writer_reserve(bplist_writer_t *writer, void *buf, uint64_t *capacity, uint64_t needed, size_t item_size)
 {
-    long items_read = 0;
-    long items_written = 0;
-    uint16_t *unicodestr = NULL;
+    if (needed <= *capacity) {
+        return buf;
+    }
+    uint64_t new_capacity = (*capacity > 0) ? *capacity : 64;
+    while (new_capacity < needed) {
+        new_capacity <<= 1;
+    }
+    void *new_buf = realloc(buf, new_capacity * item_size);
+    if (!new_buf) {
+        PLIST_BIN_ERR("%s: could not allocate %" PRIu64 " bytes\n", __func__, (uint64_t)(new_capacity * item_size));
+        writer->error = 1;
+        return buf;
+    }
+    *capacity = new_capacity;
+    return new_buf;
+}
 
-    unicodestr = plist_utf8_to_utf16be(val, size, &items_read, &items_written);
-    write_raw_data(bplist, BPLIST_UNICODE, (uint8_t*)unicodestr, items_written);
-    free(unicodestr);
+static uint64_t bplist_writer_push(bplist_writer_t *writer, node_t *node)
+{
+    writer->objects = bplist_writer_reserve(writer, writer->objects, &writer->objects_capacity, writer->num_objects + 1, sizeof(bplist_object_t));
+    if (writer->error) {
+        return 0;
+    }
+    bplist_object_t *object = &writer->objects[writer->num_objects];
+    object->node = node;
+    object->refs = 0;
+    object->length = 0;
+    object->unicode = 0;
+    return writer->num_objects++;
 }
 
-static void write_array(bytearray_t * bplist, node_t* node, hashtable_t* ref_table, uint8_t ref_size)
+static int bplist_writer_grow_intern(bplist_writer_t *writer)
 {
-    node_t* cur = NULL;
-    uint64_t i = 0;
+    uint64_t new_size = writer->intern_size ? writer->intern_size << 1 : BPLIST_INTERN_INITIAL_SIZE;
+    bplist_intern_t *table = calloc(new_size, sizeof(bplist_intern_t));
+    uint64_t i;
+
+    if (!table) {
+        PLIST_BIN_ERR("%s: could not allocate intern table\n", __func__);
+        writer->error = 1;
+        return -1;
+    }
+    for (i = 0; i < writer->intern_size; i++) {
+        if (writer->intern[i].index) {
+            uint64_t slot = writer->intern[i].hash & (new_size - 1);
+            while (table[slot].index) {
+                slot = (slot + 1) & (new_size - 1);
+            }
+            table[slot] = writer->intern[i];
+        }
+    }
+    free(writer->intern);
+    writer->intern = table;
+    writer->intern_size = new_size;
+    return 0;
+}
+
+/* Returns 1 and the index of an equal object that was added before, or adds
+ * the node as a new object and returns 0 together with its index. */
+static int bplist_writer_intern(bplist_writer_t *writer, node_t *node, uint64_t *index)
+{
+    plist_data_t data = plist_get_data(node);
+    uint64_t hash = plist_data_hash(data);
+    uint64_t slot;
+
+    //keep the load factor at or below 1/2
+    if ((writer->intern_count + 1) * 2 > writer->intern_size && bplist_writer_grow_intern(writer) < 0) {
+        return 0;
+    }
+
+    slot = hash & (writer->intern_size - 1);
+    while (writer->intern[slot].index) {
+        bplist_intern_t *entry = &writer->intern[slot];
+        if (entry->hash == hash && plist_data_equal(plist_get_data(writer->objects[entry->index - 1].node), data)) {
+            *index = entry->index - 1;
+            return 1;
+        }
+        slot = (slot + 1) & (writer->intern_size - 1);
+    }
 
-    uint64_t size = node_n_children(node);
-    uint8_t marker = BPLIST_ARRAY | (size < 15 ? size : 0xf);
-    byte_array_append(bplist, &marker, sizeof(uint8_t));
-    if (size >= 15) {
-        write_int(bplist, size);
+    *index = bplist_writer_push(writer, node);
+    if (writer->error) {
+        return 0;
     }
+    writer->intern[slot].hash = hash;
+    writer->intern[slot].index = *index + 1;
+    writer->intern_count++;
+    return 0;
+}
+
+static uint64_t bplist_scalar_size(bplist_object_t *object)
+{
+    plist_data_t data = plist_get_data(object->node);
 
-    for (i = 0, cur = node_first_child(node); cur && i < size; cur = node_next_sibling(cur), i++) {
-        uint64_t idx = *(uint64_t *) (hash_table_lookup(ref_table, cur));
-        idx = be64toh(idx);
-        byte_array_append(bplist, (uint8_t*)&idx + (sizeof(uint64_t) - ref_size), ref_size);
+    switch (data->type)
+    {
+    case PLIST_BOOLEAN:
+        return 1;
+    case PLIST_UINT:
+        return (data->length == 16) ? 17 : 1 + get_int_bytes(data->intval);
+    case PLIST_REAL:
+        return 1 + get_real_bytes(data->realval);
+    case PLIST_DATE:
+        return 9;
+    case PLIST_UID:
+        return 1 + get_int_bytes((uint32_t)data->intval);
+    case PLIST_KEY:
+    case PLIST_STRING:
+        if (is_ascii_string(data->strval, data->length)) {
+            object->length = data->length;
+            return get_header_bytes(object->length) + object->length;
+        }
+        object->unicode = 1;
+        object->length = plist_utf8_to_utf16be(data->strval, data->length, NULL);
+        return get_header_bytes(object->length) + object->length * 2;
+    case PLIST_DATA:
+        return get_header_bytes(data->length) + data->length;
+    default:
+        return 0;
     }
 }
 
-static void write_dict(bytearray_t * bplist, node_t* node, hashtable_t* ref_table, uint8_t ref_size)
+static uint64_t bplist_writer_add(bplist_writer_t *writer, node_t *node)
 {
-    node_t* cur = NULL;
-    uint64_t i = 0;
+    plist_data_t data = plist_get_data(node);
+    uint64_t index = 0;
+
+    if (data->type == PLIST_ARRAY || data->type == PLIST_DICT) {
+        uint64_t count = node_n_children(node);
+        uint64_t refs = writer->num_refs;
+        uint64_t i = 0;
+        node_t *ch;
+
+        index = bplist_writer_push(writer, node);
+        writer->refs = bplist_writer_reserve(writer, writer->refs, &writer->refs_capacity, refs + count, sizeof(uint64_t));
+        if (writer->error) {
+            return 0;
+        }
+        writer->objects[index].refs = refs;
+        writer->num_refs += count;
+        if (data->type == PLIST_DICT) {
+            count /= 2;
+            writer->refs_written += count * 2;
+        } else {
+            writer->refs_written += count;
+        }
+        writer->size += get_header_bytes(count);
 
-    uint64_t size = node_n_children(node) / 2;
-    uint8_t marker = BPLIST_DICT | (size < 15 ? size : 0xf);
-    byte_array_append(bplist, &marker, sizeof(uint8_t));
-    if (size >= 15) {
-        write_int(bplist, size);
+        for (ch = node_first_child(node); ch && !writer->error; ch = node_next_sibling(ch)) {
+            uint64_t child = bplist_writer_add(writer, ch);
+            writer->refs[refs + i++] = child;
+        }
+        return index;
     }
 
-    for (i = 0, cur = node_first_child(node); cur && i < size; cur = node_next_sibling(node_next_sibling(cur)), i++) {
-        uint64_t idx1 = *(uint64_t *) (hash_table_lookup(ref_table, cur));
-        idx1 = be64toh(idx1);
-        byte_array_append(bplist, (uint8_t*)&idx1 + (sizeof(uint64_t) - ref_size), ref_size);
+    if (!bplist_writer_intern(writer, node, &index) && !writer->error) {
+        writer->size += bplist_scalar_size(&writer->objects[index]);
     }
+    return index;
+}
 
-    for (i = 0, cur = node_first_child(node); cur && i < size; cur = node_next_sibling(node_next_sibling(cur)), i++) {
-        uint64_t idx2 = *(uint64_t *) (hash_table_lookup(ref_table, cur->next));
-        idx2 = be64toh(idx2);
-        byte_array_append(bplist, (uint8_t*)&idx2 + (sizeof(uint64_t) - ref_size), ref_size);
+static uint8_t *write_be(uint8_t *p, uint64_t val, uint8_t size)
+{
+    while (size > 0) {
+        size--;
+        *p++ = (uint8_t)(val >> (size << 3));
     }
+    return p;
 }
 
-static void write_uid(bytearray_t * bplist, uint64_t val)
+static uint8_t *write_int(uint8_t *p, uint64_t val)
 {
-    val = (uint32_t)val;
-    int size = get_needed_bytes(val);
-    uint8_t sz;
-    //do not write 3bytes int node
-    if (size == 3)
-        size++;
-    sz = BPLIST_UID | (size-1); // yes, this is what Apple does...
+    uint8_t size = get_int_bytes(val);
+    *p++ = BPLIST_UINT | Log2(size);
+    return write_be(p, val, size);
+}
 
-    val = be64toh(val);
-    byte_array_append(bplist, &sz, 1);
-    byte_array_append(bplist, (uint8_t*)&val + (8-size), size);
+static uint8_t *write_header(uint8_t *p, uint8_t mark, uint64_t count)
+{
+    *p++ = mark | (count < 15 ? count : 0xf);
+    if (count >= 15) {
+        p = write_int(p, count);
+    }
+    return p;
 }
 
-static int is_ascii_string(char* s, int len)
+static uint8_t *write_object(uint8_t *p, bplist_writer_t *writer, bplist_object_t *object, uint8_t ref_size)
 {
-  int ret = 1, i = 0;
-  for(i = 0; i < len; i++)
-  {
-      if ( !isascii( s[i] ) )
-      {
-          ret = 0;
-          break;
-      }
-  }
-  return ret;
+    plist_data_t data = plist_get_data(object->node);
+    uint64_t size;
+    uint64_t i;
+
+    switch (data->type)
+    {
+    case PLIST_BOOLEAN:
+        *p++ = data->boolval ? BPLIST_TRUE : BPLIST_FALSE;
+        break;
+    case PLIST_UINT:
+        if (data->length == 16) {
+            *p++ = BPLIST_UINT | 4;
+            p = write_be(p, 0, 8);
+            p = write_be(p, data->intval, 8);
+        } else {
+            p = write_int(p, data->intval);
+        }
+        break;
+    case PLIST_REAL:
+        size = get_real_bytes(data->realval);	//cheat to know used space
+        *p++ = BPLIST_REAL | Log2(size);
+        if (size == sizeof(float)) {
+            float floatval = (float)data->realval;
+            uint32_t bits;
+            memcpy(&bits, &floatval, sizeof(uint32_t));
+            p = write_be(p, bits, sizeof(uint32_t));
+        } else {
+            uint64_t bits;
+            memcpy(&bits, &data->realval, sizeof(uint64_t));
+            p = write_be(p, bits, sizeof(uint64_t));
+        }
+        break;
+    case PLIST_DATE: {
+        uint64_t bits;
+        memcpy(&bits, &data->realval, sizeof(uint64_t));
+        *p++ = BPLIST_DATE | 3;
+        p = write_be(p, bits, sizeof(uint64_t));
+    }   break;
+    case PLIST_UID:
+        size = get_int_bytes((uint32_t)data->intval);
+        *p++ = BPLIST_UID | (size-1); // yes, this is what Apple does...
+        p = write_be(p, (uint32_t)data->intval, size);
+        break;
+    case PLIST_KEY:
+    case PLIST_STRING:
+        if (object->unicode) {
+            p = write_header(p, BPLIST_UNICODE, object->length);
+            plist_utf8_to_utf16be(data->strval, data->length, p);
+            p += object->length * 2;
+        } else {
+            p = write_header(p, BPLIST_STRING, object->length);
+            if (object->length > 0) {
+                memcpy(p, data->strval, object->length);
+            }
+            p += object->length;
+        }
+        break;
+    case PLIST_DATA:
+        p = write_header(p, BPLIST_DATA, data->length);
+        if (data->length > 0) {
+            memcpy(p, data->buff, data->length);
+        }
+        p += data->length;
+        break;
+    case PLIST_ARRAY:
+        size = node_n_children(object->node);
+        p = write_header(p, BPLIST_ARRAY, size);
+        for (i = 0; i < size; i++) {
+            p = write_be(p, writer->refs[object->refs + i], ref_size);
+        }
+        break;
+    case PLIST_DICT:
+        size = node_n_children(object->node) / 2;
+        p = write_header(p, BPLIST_DICT, size);
+        for (i = 0; i < size; i++) {
+            p = write_be(p, writer->refs[object->refs + i*2], ref_size);
+        }
+        for (i = 0; i < size; i++) {
+            p = write_be(p, writer->refs[object->refs + i*2 + 1], ref_size);
+        }
+        break;
+    default:
+        break;
+    }
+    return p;
 }
 
 PLIST_API void plist_to_bin(plist_t plist, char **plist_bin, uint32_t * length)
 {
-    ptrarray_t* objects = NULL;
-    hashtable_t* ref_table = NULL;
-    struct serialize_s ser_s;
+    bplist_writer_t writer;
     uint8_t offset_size = 0;
     uint8_t ref_size = 0;
-    uint64_t num_objects = 0;
-    uint64_t root_object = 0;
     uint64_t offset_table_index = 0;
-    bytearray_t *bplist_buff = NULL;
-    uint64_t i = 0;
+    uint64_t total = 0;
     uint8_t *buff = NULL;
-    uint64_t *offsets = NULL;
-    bplist_trailer_t trailer;
-    uint64_t objects_len = 0;
-    uint64_t buff_len = 0;
+    uint8_t *p = NULL;
+    uint64_t i = 0;
 
     //check for valid input
     if (!plist || !plist_bin || *plist_bin || !length)
         return;
 
-    //list of objects
-    objects = ptr_array_new(4096);
-    //hashtable to write only once same nodes
-    ref_table = hash_table_new(plist_data_hash, plist_data_compare, free);
-
-    //serialize plist
-    ser_s.objects = objects;
-    ser_s.ref_table = ref_table;
-    serialize_plist(plist, &ser_s);
-
-    //now stream to output buffer
-    offset_size = 0;			//unknown yet
-    objects_len = objects->len;
-    ref_size = get_needed_bytes(objects_len);
-    num_objects = objects->len;
-    root_object = 0;			//root is first in list
-    offset_table_index = 0;		//unknown yet
-
-    //figure out the storage size required
-    uint64_t req = 0;
-    for (i = 0; i < num_objects; i++)
-    {
-        node_t* node = ptr_array_index(objects, i);
-        plist_data_t data = plist_get_data(node);
-        uint64_t size;
-        uint8_t bsize;
-        switch (data->type)
-        {
-        case PLIST_BOOLEAN:
-            req += 1;
-            break;
-        case PLIST_KEY:
-        case PLIST_STRING:
-            req += 1;
-            if (data->length >= 15) {
-                bsize = get_needed_bytes(data->length);
-                if (bsize == 3) bsize = 4;
-                req += 1;
-                req += bsize;
-            }
-            if ( is_ascii_string(data->strval, data->length) )
-            {
-                req += data->length;
-            }
-            else
-            {
-                req += data->length * 2;
-            }
-            break;
-        case PLIST_REAL:
-            size = get_real_bytes(data->realval);
-            req += 1;
-            req += size;
-            break;
-        case PLIST_DATE:
-            req += 9;
-            break;
-        case PLIST_ARRAY:
-            size = node_n_children(node);
-            req += 1;
-            if (size >= 15) {
-                bsize = get_needed_bytes(size);
-                if (bsize == 3) bsize = 4;
-                req += 1;
-                req += bsize;
-            }
-            req += size * ref_size;
-            break;
-        case PLIST_DICT:
-            size = node_n_children(node) / 2;
-            req += 1;
-            if (size >= 15) {
-                bsize = get_needed_bytes(size);
-                if (bsize == 3) bsize = 4;
-                req += 1;
-                req += bsize;
-            }
-            req += size * 2 * ref_size;
-            break;
-        default:
-            size = data->length;
-            req += 1;
-            if (size >= 15) {
-                bsize = get_needed_bytes(size);
-                if (bsize == 3) bsize = 4;
-                req += 1;
-                req += bsize;
-            }
-            req += data->length;
-            break;
-        }
+    //number the objects and sum up their sizes
+    memset(&writer, '\0', sizeof(bplist_writer_t));
+    bplist_writer_add(&writer, plist);
+    if (writer.error) {
+        goto out;
     }
-    // add size of magic
-    req += BPLIST_MAGIC_SIZE;
-    req += BPLIST_VERSION_SIZE;
-    // add size of offset table
-    req += get_needed_bytes(req) * num_objects;
-    // add size of trailer
-    req += sizeof(bplist_trailer_t);
-
-    //setup a dynamic bytes array to store bplist in
-    bplist_buff = byte_array_new(req);
-
-    //set magic number and version
-    byte_array_append(bplist_buff, BPLIST_MAGIC, BPLIST_MAGIC_SIZE);
-    byte_array_append(bplist_buff, BPLIST_VERSION, BPLIST_VERSION_SIZE);
-
-    //write objects and table
-    offsets = (uint64_t *) malloc(num_objects * sizeof(uint64_t));
-    assert(offsets != NULL);
-    for (i = 0; i < num_objects; i++)
-    {
-
-        plist_data_t data = plist_get_data(ptr_array_index(objects, i));
-        offsets[i] = bplist_buff->len;
-
-        switch (data->type)
-        {
-        case PLIST_BOOLEAN:
-            buff = (uint8_t *) malloc(sizeof(uint8_t));
-            buff[0] = data->boolval ? BPLIST_TRUE : BPLIST_FALSE;
-            byte_array_append(bplist_buff, buff, sizeof(uint8_t));
-            free(buff);
-            break;
-
-        case PLIST_UINT:
-            if (data->length == 16) {
-                write_uint(bplist_buff, data->intval);
-            } else {
-                write_int(bplist_buff, data->intval);
-            }
-            break;
-
-        case PLIST_REAL:
-            write_real(bplist_buff, data->realval);
-            break;
 
-        case PLIST_KEY:
-        case PLIST_STRING:
-            if ( is_ascii_string(data->strval, data->length) )
-            {
-                write_string(bplist_buff, data->strval, data->length);
-            }
-            else
-            {
-                write_unicode(bplist_buff, data->strval, data->length);
-            }
-            break;
-        case PLIST_DATA:
-            write_data(bplist_buff, data->buff, data->length);
-            break;
-        case PLIST_ARRAY:
-            write_array(bplist_buff, ptr_array_index(objects, i), ref_table, ref_size);
-            break;
-        case PLIST_DICT:
-            write_dict(bplist_buff, ptr_array_index(objects, i), ref_table, ref_size);
-            break;
-        case PLIST_DATE:
-            write_date(bplist_buff, data->realval);
-            break;
-        case PLIST_UID:
-            write_uid(bplist_buff, data->intval);
-            break;
-        default:
-            break;
-        }
+    //now that the object count is known, the final layout is too
+    ref_size = get_needed_bytes(writer.num_objects);
+    offset_table_index = BPLIST_MAGIC_SIZE + BPLIST_VERSION_SIZE + writer.size + writer.refs_written * ref_size;
+    offset_size = get_needed_bytes(offset_table_index);
+    total = offset_table_index + writer.num_objects * offset_size + sizeof(bplist_trailer_t);
+    if (total > UINT32_MAX) {
+        PLIST_BIN_ERR("%s: binary plist of %" PRIu64 " bytes exceeds the maximum size\n", __func__, total);
+        goto out;
     }
 
-    //free intermediate objects
-    ptr_array_free(objects);
-    hash_table_destroy(ref_table);
-
-    //write offsets
-    buff_len = bplist_buff->len;
-    offset_size = get_needed_bytes(buff_len);
-    offset_table_index = bplist_buff->len;
-    for (i = 0; i < num_objects; i++) {
-        uint64_t offset = be64toh(offsets[i]);
-        byte_array_append(bplist_buff, (uint8_t*)&offset + (sizeof(uint64_t) - offset_size), offset_size);
+    buff = (uint8_t*)malloc(total);
+    if (!buff) {
+        PLIST_BIN_ERR("%s: could not allocate %" PRIu64 " bytes\n", __func__, total);
+        goto out;
     }
-    free(offsets);
 
-    //setup trailer
-    memset(trailer.unused, '\0', sizeof(trailer.unused));
-    trailer.offset_size = offset_size;
-    trailer.ref_size = ref_size;
-    trailer.num_objects = be64toh(num_objects);
-    trailer.root_object_index = be64toh(root_object);
-    trailer.offset_table_offset = be64toh(offset_table_index);
-
-    byte_array_append(bplist_buff, &trailer, sizeof(bplist_trailer_t));
+    //set magic number and version
+    memcpy(buff, BPLIST_MAGIC, BPLIST_MAGIC_SIZE);
+    memcpy(buff + BPLIST_MAGIC_SIZE, BPLIST_VERSION, BPLIST_VERSION_SIZE);
+
+    //write objects and their offsets
+    p = buff + BPLIST_MAGIC_SIZE + BPLIST_VERSION_SIZE;
+    for (i = 0; i < writer.num_objects; i++) {
+        write_be(buff + offset_table_index + i * offset_size, p - buff, offset_size);
+        p = write_object(p, &writer, &writer.objects[i], ref_size);
+    }
+    assert(p == buff + offset_table_index);
+
+    //write trailer
+    p = buff + offset_table_index + writer.num_objects * offset_size;
+    memset(p, '\0', 6);
+    p += 6;
+    *p++ = offset_size;
+    *p++ = ref_size;
+    p = write_be(p, writer.num_objects, sizeof(uint64_t));
+    p = write_be(p, 0, sizeof(uint64_t)); //root is first in list
+    p = write_be(p, offset_table_index, sizeof(uint64_t));
 
     //set output buffer and size
-    *plist_bin = bplist_buff->data;
-    *length = bplist_buff->len;
+    *plist_bin = (char*)buff;
+    *length = (uint32_t)total;
 
-    bplist_buff->data = NULL; // make sure we don't free the output buffer
-    byte_array_free(bplist_buff);
+out:
+    free(writer.objects);
+    free(writer.refs);
+    free(writer.intern);
 }
@@ -441,6 +441,8 @@ static void _plist_array_post_insert(plist_t node, plist_t item, long n)
         /* store pointer to item in array */
         ptr_array_insert(pa, item, n);
     } else {
+#ifdef NODE_CHILD_LIST
+        /* only needed for linked children, node_nth_child() is O(1) otherwise */
         if (((node_t*)node)->count > 100) {
             /* make new lookup array */
             pa = ptr_array_new(128);
@@ -453,6 +455,7 @@ static void _plist_array_post_insert(plist_t node, plist_t item, long n)
             }
             ((plist_data_t)((node_t*)node)->data)->hashtable = pa;
         }
+#endif
     }
 }
 
@@ -38,6 +38,12 @@
 #include <inttypes.h>
 #include <math.h>
 #include <limits.h>
+#include <errno.h>
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 #include <node.h>
 #include <node_list.h>
@@ -144,7 +150,79 @@ static size_t dtostr(char *buf, size_t bufsize, double realval)
     return p;
 }
 
-static void node_to_xml(node_t* node, bytearray_t **outbuf, uint32_t depth)
+#define XML_OUT_CHUNK_SIZE 16384
+
+/* Output of the XML writer. Either grows a str_buf in memory, or collects
+ * the output in a fixed size chunk that is passed to a callback whenever
+ * it is full. */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t capacity;
+    strbuf_t *strbuf;
+    plist_write_func_t write;
+    void *user_data;
+    int err;
+} xml_out_t;
+
+static void xml_out_flush(xml_out_t *out)
+{
+    if (out->strbuf || out->len == 0) {
+        return;
+    }
+    if (!out->err && out->write(out->buf, out->len, out->user_data) < 0) {
+        out->err = 1;
+    }
+    out->len = 0;
+}
+
+/* make room for len bytes, len must not exceed XML_OUT_CHUNK_SIZE */
+static void xml_out_reserve(xml_out_t *out, size_t len)
+{
+    if (out->capacity - out->len >= len) {
+        return;
+    }
+    if (out->strbuf) {
+        out->strbuf->len = out->len;
+        str_buf_grow(out->strbuf, (len > out->capacity) ? len : out->capacity);
+        out->buf = (char*)out->strbuf->data;
+        out->capacity = out->strbuf->capacity;
+    } else {
+        xml_out_flush(out);
+    }
+}
+
+static void xml_out_append(xml_out_t *out, const char *str, size_t len)
+{
+    if (len == 0) {
+        return;
+    }
+    if (out->capacity - out->len < len) {
+        if (!out->strbuf && len >= out->capacity) {
+            /* pass large strings to the callback directly */
+            xml_out_flush(out);
+            if (!out->err && out->write(str, len, out->user_data) < 0) {
+                out->err = 1;
+            }
+            return;
+        }
+        xml_out_reserve(out, len);
+    }
+    memcpy(out->buf + out->len, str, len);
+    out->len += len;
+}
+
+static void xml_out_indent(xml_out_t *out, uint32_t depth)
+{
+    static const char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+    while (depth > 0) {
+        uint32_t n = (depth < sizeof(tabs)-1) ? depth : sizeof(tabs)-1;
+        xml_out_append(out, tabs, n);
+        depth -= n;
+    }
+}
+
+static void node_to_xml(node_t* node, xml_out_t *out, uint32_t depth)
 {
     plist_data_t node_data = NULL;
 
@@ -153,12 +231,10 @@ static void node_to_xml(node_t* node, bytearray_t **outbuf, uint32_t depth)
 
     const char *tag = NULL;
     size_t tag_len = 0;
-    char *val = NULL;
+    char val[64];
     size_t val_len = 0;
 
-    uint32_t i = 0;
-
-    if (!node)
+    if (!node || out->err)
         return;
 
     node_data = plist_get_data(node);
@@ -180,19 +256,17 @@ static void node_to_xml(node_t* node, bytearray_t **outbuf, uint32_t depth)
     case PLIST_UINT:
         tag = XPLIST_INT;
         tag_len = XPLIST_INT_LEN;
-        val = (char*)malloc(64);
         if (node_data->length == 16) {
-            val_len = snprintf(val, 64, "%"PRIu64, node_data->intval);
+            val_len = snprintf(val, sizeof(val), "%"PRIu64, node_data->intval);
         } else {
-            val_len = snprintf(val, 64, "%"PRIi64, node_data->intval);
+            val_len = snprintf(val, sizeof(val), "%"PRIi64, node_data->intval);
         }
         break;
 
     case PLIST_REAL:
         tag = XPLIST_REAL;
         tag_len = XPLIST_REAL_LEN;
-        val = (char*)malloc(64);
-        val_len = dtostr(val, 64, node_data->realval);
+        val_len = dtostr(val, sizeof(val), node_data->realval);
         break;
 
     case PLIST_STRING:
@@ -230,46 +304,37 @@ static void node_to_xml(node_t* node, bytearray_t **outbuf, uint32_t depth)
             struct TM _btime;
             struct TM *btime = gmtime64_r(&timev, &_btime);
             if (btime) {
-                val = (char*)malloc(24);
-                memset(val, 0, 24);
                 struct tm _tmcopy;
                 copy_TM64_to_tm(btime, &_tmcopy);
                 val_len = strftime(val, 24, "%Y-%m-%dT%H:%M:%SZ", &_tmcopy);
-                if (val_len <= 0) {
-                    free (val);
-                    val = NULL;
-                }
             }
         }
         break;
     case PLIST_UID:
         tag = XPLIST_DICT;
         tag_len = XPLIST_DICT_LEN;
-        val = (char*)malloc(64);
         if (node_data->length == 16) {
-            val_len = snprintf(val, 64, "%"PRIu64, node_data->intval);
+            val_len = snprintf(val, sizeof(val), "%"PRIu64, node_data->intval);
         } else {
-            val_len = snprintf(val, 64, "%"PRIi64, node_data->intval);
+            val_len = snprintf(val, sizeof(val), "%"PRIi64, node_data->intval);
         }
         break;
     default:
         break;
     }
 
-    for (i = 0; i < depth; i++) {
-        str_buf_append(*outbuf, "\t", 1);
-    }
+    xml_out_indent(out, depth);
 
     /* append tag */
-    str_buf_append(*outbuf, "<", 1);
-    str_buf_append(*outbuf, tag, tag_len);
+    xml_out_append(out, "<", 1);
+    xml_out_append(out, tag, tag_len);
     if (node_data->type == PLIST_STRING || node_data->type == PLIST_KEY) {
         size_t j;
         size_t len;
         off_t start = 0;
         off_t cur = 0;
 
-        str_buf_append(*outbuf, ">", 1);
+        xml_out_append(out, ">", 1);
         tagOpen = TRUE;
 
         /* make sure we convert the following predefined xml entities */
@@ -278,18 +343,18 @@ static void node_to_xml(node_t* node, bytearray_t **outbuf, uint32_t depth)
         for (j = 0; j < len; j++) {
             switch (node_data->strval[j]) {
             case '<':
-                str_buf_append(*outbuf, node_data->strval + start, cur - start);
-                str_buf_append(*outbuf, "&lt;", 4);
+                xml_out_append(out, node_data->strval + start, cur - start);
+                xml_out_append(out, "&lt;", 4);
                 start = cur+1;
                 break;
             case '>':
-                str_buf_append(*outbuf, node_data->strval + start, cur - start);
-                str_buf_append(*outbuf, "&gt;", 4);
+                xml_out_append(out, node_data->strval + start, cur - start);
+                xml_out_append(out, "&gt;", 4);
                 start = cur+1;
                 break;
             case '&':
-                str_buf_append(*outbuf, node_data->strval + start, cur - start);
-                str_buf_append(*outbuf, "&amp;", 5);
+                xml_out_append(out, node_data->strval + start, cur - start);
+                xml_out_append(out, "&amp;", 5);
                 start = cur+1;
                 break;
             default:
@@ -297,75 +362,65 @@ static void node_to_xml(node_t* node, bytearray_t **outbuf, uint32_t depth)
             }
             cur++;
         }
-        str_buf_append(*outbuf, node_data->strval + start, cur - start);
+        xml_out_append(out, node_data->strval + start, cur - start);
     } else if (node_data->type == PLIST_DATA) {
-        str_buf_append(*outbuf, ">", 1);
+        xml_out_append(out, ">", 1);
         tagOpen = TRUE;
-        str_buf_append(*outbuf, "\n", 1);
+        xml_out_append(out, "\n", 1);
         if (node_data->length > 0) {
             uint32_t j = 0;
             uint32_t indent = (depth > 8) ? 8 : depth;
             uint32_t maxread = MAX_DATA_BYTES_PER_LINE(indent);
             size_t count = 0;
-            size_t amount = (node_data->length / 3 * 4) + 4 + (((node_data->length / maxread) + 1) * (indent+1));
-            if ((*outbuf)->len + amount > (*outbuf)->capacity) {
-                str_buf_grow(*outbuf, amount);
+            if (out->strbuf) {
+                size_t amount = (node_data->length / 3 * 4) + 4 + (((node_data->length / maxread) + 1) * (indent+1));
+                xml_out_reserve(out, amount);
             }
-            while (j < node_data->length) {
-                for (i = 0; i < indent; i++) {
-                    str_buf_append(*outbuf, "\t", 1);
-                }
+            while (j < node_data->length && !out->err) {
+                /* indent, one line of base64 with its terminating NUL, newline */
+                xml_out_reserve(out, indent + PLIST_BASE64_ENCODED_SIZE(maxread) + 2);
+                xml_out_indent(out, indent);
                 count = (node_data->length-j < maxread) ? node_data->length-j : maxread;
-                assert((*outbuf)->len + count < (*outbuf)->capacity);
-                (*outbuf)->len += base64encode((char*)(*outbuf)->data + (*outbuf)->len, node_data->buff + j, count);
-                str_buf_append(*outbuf, "\n", 1);
+                out->len += base64encode(out->buf + out->len, node_data->buff + j, count);
+                xml_out_append(out, "\n", 1);
                 j+=count;
             }
         }
-        for (i = 0; i < depth; i++) {
-            str_buf_append(*outbuf, "\t", 1);
-        }
+        xml_out_indent(out, depth);
     } else if (node_data->type == PLIST_UID) {
         /* special case for UID nodes: create a DICT */
-        str_buf_append(*outbuf, ">", 1);
+        xml_out_append(out, ">", 1);
         tagOpen = TRUE;
-        str_buf_append(*outbuf, "\n", 1);
+        xml_out_append(out, "\n", 1);
 
         /* add CF$UID key */
-        for (i = 0; i < depth+1; i++) {
-            str_buf_append(*outbuf, "\t", 1);
-        }
-        str_buf_append(*outbuf, "<key>CF$UID</key>", 17);
-        str_buf_append(*outbuf, "\n", 1);
+        xml_out_indent(out, depth+1);
+        xml_out_append(out, "<key>CF$UID</key>", 17);
+        xml_out_append(out, "\n", 1);
 
         /* add UID value */
-        for (i = 0; i < depth+1; i++) {
-            str_buf_append(*outbuf, "\t", 1);
-        }
-        str_buf_append(*outbuf, "<integer>", 9);
-        str_buf_append(*outbuf, val, val_len);
-        str_buf_append(*outbuf, "</integer>", 10);
-        str_buf_append(*outbuf, "\n", 1);
-
-        for (i = 0; i < depth; i++) {
-            str_buf_append(*outbuf, "\t", 1);
-        }
-    } else if (val) {
-        str_buf_append(*outbuf, ">", 1);
+        xml_out_indent(out, depth+1);
+        xml_out_append(out, "<integer>", 9);
+        xml_out_append(out, val, val_len);
+        xml_out_append(out, "</integer>", 10);
+        xml_out_append(out, "\n", 1);
+
+        xml_out_indent(out, depth);
+    } else if (val_len > 0) {
+        xml_out_append(out, ">", 1);
         tagOpen = TRUE;
-        str_buf_append(*outbuf, val, val_len);
+        xml_out_append(out, val, val_len);
     } else if (isStruct) {
         tagOpen = TRUE;
-        str_buf_append(*outbuf, ">", 1);
+        xml_out_append(out, ">", 1);
     } else {
         tagOpen = FALSE;
-        str_buf_append(*outbuf, "/>", 2);
+        xml_out_append(out, "/>", 2);
     }
-    free(val);
 
     if (isStruct) {
         /* add newline for structured types */
-        str_buf_append(*outbuf, "\n", 1);
+        xml_out_append(out, "\n", 1);
 
         /* add child nodes */
         if (node_data->type == PLIST_DICT && node->children) {
@@ -373,22 +428,20 @@ static void node_to_xml(node_t* node, bytearray_t **outbuf, uint32_t depth)
         }
         node_t *ch;
         for (ch = node_first_child(node); ch; ch = node_next_sibling(ch)) {
-            node_to_xml(ch, outbuf, depth+1);
+            node_to_xml(ch, out, depth+1);
         }
 
         /* fix indent for structured types */
-        for (i = 0; i < depth; i++) {
-            str_buf_append(*outbuf, "\t", 1);
-        }
+        xml_out_indent(out, depth);
     }
 
     if (tagOpen) {
         /* add closing tag */
-        str_buf_append(*outbuf, "</", 2);
-        str_buf_append(*outbuf, tag, tag_len);
-        str_buf_append(*outbuf, ">", 1);
+        xml_out_append(out, "</", 2);
+        xml_out_append(out, tag, tag_len);
+        xml_out_append(out, ">", 1);
     }
-    str_buf_append(*outbuf, "\n", 1);
+    xml_out_append(out, "\n", 1);
 
     return;
 }
@@ -534,22 +587,86 @@ static void node_estimate_size(node_t *node, uint64_t *size, uint32_t depth)
 PLIST_API void plist_to_xml(plist_t plist, char **plist_xml, uint32_t * length)
 {
     uint64_t size = 0;
+    xml_out_t out;
+
     node_estimate_size(plist, &size, 0);
     size += sizeof(XML_PLIST_PROLOG) + sizeof(XML_PLIST_EPILOG) - 1;
 
-    strbuf_t *outbuf = str_buf_new(size);
+    memset(&out, '\0', sizeof(xml_out_t));
+    out.strbuf = str_buf_new(size);
+    out.buf = (char*)out.strbuf->data;
+    out.capacity = out.strbuf->capacity;
+
+    xml_out_append(&out, XML_PLIST_PROLOG, sizeof(XML_PLIST_PROLOG)-1);
+
+    node_to_xml(plist, &out, 0);
+
+    xml_out_append(&out, XML_PLIST_EPILOG, sizeof(XML_PLIST_EPILOG));
+
+    *plist_xml = out.buf;
+    *length = out.len - 1;
+
+    out.strbuf->data = NULL;
+    str_buf_free(out.strbuf);
+}
+
+PLIST_API int plist_to_xml_with_writer(plist_t plist, plist_write_func_t write, void *user_data)
+{
+    char chunk[XML_OUT_CHUNK_SIZE];
+    xml_out_t out;
+
+    if (!plist || !write)
+        return -1;
+
+    memset(&out, '\0', sizeof(xml_out_t));
+    out.buf = chunk;
+    out.capacity = sizeof(chunk);
+    out.write = write;
+    out.user_data = user_data;
+
+    xml_out_append(&out, XML_PLIST_PROLOG, sizeof(XML_PLIST_PROLOG)-1);
+
+    node_to_xml(plist, &out, 0);
 
-    str_buf_append(outbuf, XML_PLIST_PROLOG, sizeof(XML_PLIST_PROLOG)-1);
+    xml_out_append(&out, XML_PLIST_EPILOG, sizeof(XML_PLIST_EPILOG)-1);
+    xml_out_flush(&out);
 
-    node_to_xml(plist, &outbuf, 0);
+    return (out.err) ? -1 : 0;
+}
 
-    str_buf_append(outbuf, XML_PLIST_EPILOG, sizeof(XML_PLIST_EPILOG));
+static int xml_write_file(const char *buf, size_t len, void *user_data)
+{
+    return (fwrite(buf, 1, len, (FILE*)user_data) == len) ? 0 : -1;
+}
+
+PLIST_API int plist_to_xml_file(plist_t plist, FILE *file)
+{
+    if (!file)
+        return -1;
+    return plist_to_xml_with_writer(plist, xml_write_file, file);
+}
 
-    *plist_xml = outbuf->data;
-    *length = outbuf->len - 1;
+static int xml_write_fd(const char *buf, size_t len, void *user_data)
+{
+    int fd = *(int*)user_data;
+    while (len > 0) {
+        int res = write(fd, buf, (len > INT_MAX) ? INT_MAX : len);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += res;
+        len -= res;
+    }
+    return 0;
+}
 
-    outbuf->data = NULL;
-    str_buf_free(outbuf);
+PLIST_API int plist_to_xml_fd(plist_t plist, int fd)
+{
+    if (fd < 0)
+        return -1;
+    return plist_to_xml_with_writer(plist, xml_write_fd, &fd);
 }
 
 struct _parse_ctx {
@@ -1270,23 +1387,27 @@ static void node_from_xml(parse_ctx ctx, plist_t *plist)
                         goto err_out;
                     }
                     if (tp->begin) {
-                        int requires_free = 0;
-                        char *str_content = text_parts_get_content(tp, 0, NULL, &requires_free);
-                        if (!str_content) {
-                            PLIST_XML_ERR("Could not get text content for '%s' node\n", tag);
-                            text_parts_free(first_part.next);
-                            ctx->err++;
-                            goto err_out;
+                        /* decode the text parts one by one instead of joining them first */
+                        size_t total_length = 0;
+                        text_part_t *part = tp;
+                        while (part && part->begin) {
+                            total_length += part->length;
+                            part = part->next;
                         }
-                        size_t size = tp->length;
-                        if (size > 0) {
-                            data->buff = base64decode(str_content, &size);
+                        if (total_length > 0) {
+                            plist_base64_state_t b64state;
+                            size_t size = 0;
+                            plist_base64_state_init(&b64state);
+                            data->buff = malloc(PLIST_BASE64_DECODED_SIZE(total_length) + 1);
+                            assert(data->buff);
+                            part = tp;
+                            while (part && part->begin) {
+                                size += plist_base64_decode_update(&b64state, data->buff + size, part->begin, part->length);
+                                part = part->next;
+                            }
+                            data->buff[size] = 0;
                             data->length = size;
                         }
-
-                        if (requires_free) {
-                            free(str_content);
-                        }
                     }
                     text_parts_free(tp->next);
                 }
@@ -0,0 +1,178 @@
+/*
+ * base64_bench.c
+ * base64 codec micro-benchmark and cross-check of the SIMD implementations
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "plist/plist.h"
+#include "base64.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _MSC_VER
+#pragma warning(disable:4996)
+#endif
+
+static const struct {
+    base64_impl_t impl;
+    const char *name;
+} impls[] = {
+    { BASE64_IMPL_SCALAR, "scalar" },
+    { BASE64_IMPL_SSSE3, "ssse3" },
+    { BASE64_IMPL_AVX2, "avx2" },
+    { BASE64_IMPL_NEON, "neon" },
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* wrap encoded output like the XML writer does: tab indented lines of 68 characters */
+static size_t wrap_lines(char *dst, const char *src, size_t len)
+{
+    size_t i, n = 0;
+    for (i = 0; i < len; i += 68) {
+        size_t chunk = (len - i < 68) ? len - i : 68;
+        dst[n++] = '\t';
+        memcpy(dst + n, src + i, chunk);
+        n += chunk;
+        dst[n++] = '\n';
+    }
+    return n;
+}
+
+static int check(const unsigned char *data, size_t size, const char *ref_enc, size_t ref_len)
+{
+    char *enc = malloc(PLIST_BASE64_ENCODED_SIZE(size) + 1);
+    char *wrapped = malloc(ref_len + (ref_len / 68 + 1) * 2);
+    unsigned char *dec = malloc(PLIST_BASE64_DECODED_SIZE(ref_len + (ref_len / 68 + 1) * 2) + 1);
+    plist_base64_state_t state;
+    size_t len, wlen, i, step;
+    int res = 0;
+
+    /* one-shot encode */
+    len = plist_base64_encode(enc, data, size);
+    if (len != ref_len || memcmp(enc, ref_enc, len) != 0) {
+        printf("  encode mismatch at size %zu\n", size);
+        res = -1;
+    }
+
+    /* incremental encode with odd chunk sizes */
+    for (step = 1; step < 40 && res == 0; step += 7) {
+        plist_base64_state_init(&state);
+        len = 0;
+        for (i = 0; i < size; i += step) {
+            len += plist_base64_encode_update(&state, enc + len, data + i, (size - i < step) ? size - i : step);
+        }
+        len += plist_base64_encode_final(&state, enc + len);
+        if (len != ref_len || memcmp(enc, ref_enc, len) != 0) {
+            printf("  incremental encode mismatch at size %zu, step %zu\n", size, step);
+            res = -1;
+        }
+    }
+
+    /* decode plain and line wrapped input, one-shot and incremental */
+    wlen = wrap_lines(wrapped, ref_enc, ref_len);
+    for (step = 0; step < 80 && res == 0; step += 13) {
+        const char *src = (step & 1) ? wrapped : ref_enc;
+        size_t srclen = (step & 1) ? wlen : ref_len;
+        if (step == 0) {
+            len = plist_base64_decode(dec, src, srclen);
+        } else {
+            plist_base64_state_init(&state);
+            len = 0;
+            for (i = 0; i < srclen; i += step) {
+                len += plist_base64_decode_update(&state, dec + len, src + i, (srclen - i < step) ? srclen - i : step);
+            }
+        }
+        if (len != size || memcmp(dec, data, size) != 0) {
+            printf("  decode mismatch at size %zu, step %zu\n", size, step);
+            res = -1;
+        }
+    }
+
+    free(enc);
+    free(wrapped);
+    free(dec);
+    return res;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t bench_size = (argc > 1) ? (size_t)strtoul(argv[1], NULL, 10) : 16*1024*1024;
+    unsigned char *data = malloc(bench_size + 256);
+    char *ref = malloc(PLIST_BASE64_ENCODED_SIZE(bench_size + 256) + 1);
+    char *enc = malloc(PLIST_BASE64_ENCODED_SIZE(bench_size) + 1);
+    char *wrapped = malloc(PLIST_BASE64_ENCODED_SIZE(bench_size) * 2 + 2);
+    unsigned char *dec = malloc(bench_size * 2 + 16);
+    size_t i, k, size;
+    int res = 0;
+
+    srand(1);
+    for (i = 0; i < bench_size + 256; i++) {
+        data[i] = (unsigned char)rand();
+    }
+
+    for (k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+        if (base64_select_impl(impls[k].impl) < 0) {
+            printf("%-7s not supported\n", impls[k].name);
+            continue;
+        }
+
+        /* cross-check every implementation against the scalar reference */
+        for (size = 0; size < 256; size++) {
+            size_t ref_len;
+            base64_select_impl(BASE64_IMPL_SCALAR);
+            ref_len = plist_base64_encode(ref, data, size);
+            base64_select_impl(impls[k].impl);
+            if (check(data, size, ref, ref_len) < 0) {
+                res = 1;
+                break;
+            }
+        }
+
+        double t0 = now();
+        size_t enc_len = plist_base64_encode(enc, data, bench_size);
+        double t1 = now();
+        size_t dec_len = plist_base64_decode(dec, enc, enc_len);
+        double t2 = now();
+        size_t wlen = wrap_lines(wrapped, enc, enc_len);
+        double t3 = now();
+        size_t wdec_len = plist_base64_decode(dec, wrapped, wlen);
+        double t4 = now();
+        if (dec_len != bench_size || wdec_len != bench_size || memcmp(dec, data, bench_size) != 0) {
+            printf("%-7s round trip failed\n", impls[k].name);
+            res = 1;
+            continue;
+        }
+
+        printf("%-7s encode %8.1f MB/s  decode %8.1f MB/s  decode (wrapped) %8.1f MB/s\n", impls[k].name,
+            bench_size / (t1 - t0) / 1e6, enc_len / (t2 - t1) / 1e6, wlen / (t4 - t3) / 1e6);
+    }
+
+    free(data);
+    free(ref);
+    free(enc);
+    free(wrapped);
+    free(dec);
+    return res;
+}
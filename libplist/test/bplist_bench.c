@@ -0,0 +1,171 @@
+/*
+ * bplist_bench.c
+ * binary plist writer throughput benchmark
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "plist/plist.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _MSC_VER
+#pragma warning(disable:4996)
+#endif
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* something shaped like an instproxy Browse reply: many app dictionaries
+ * sharing most of their keys and a good part of their values */
+static plist_t make_app_list(int count)
+{
+    plist_t apps = plist_new_array();
+    unsigned char icon[512];
+    char buf[128];
+    int i;
+
+    for (i = 0; i < (int)sizeof(icon); i++) {
+        icon[i] = (unsigned char)(i * 31);
+    }
+
+    for (i = 0; i < count; i++) {
+        plist_t app = plist_new_dict();
+        plist_t caps = plist_new_array();
+
+        snprintf(buf, sizeof(buf), "com.example.app%d", i);
+        plist_dict_set_item(app, "CFBundleIdentifier", plist_new_string(buf));
+        snprintf(buf, sizeof(buf), "App %d \xc3\xa9t\xc3\xa9", i);
+        plist_dict_set_item(app, "CFBundleDisplayName", plist_new_string(buf));
+        plist_dict_set_item(app, "CFBundleVersion", plist_new_string("1.0"));
+        plist_dict_set_item(app, "CFBundleShortVersionString", plist_new_string("1.0.0"));
+        plist_dict_set_item(app, "ApplicationType", plist_new_string((i % 4) ? "User" : "System"));
+        snprintf(buf, sizeof(buf), "/private/var/containers/Bundle/Application/%08X-0000-0000-0000-000000000000/App%d.app", i, i);
+        plist_dict_set_item(app, "Path", plist_new_string(buf));
+        plist_dict_set_item(app, "StaticDiskUsage", plist_new_uint(1024 * 1024 + i));
+        plist_dict_set_item(app, "DynamicDiskUsage", plist_new_uint(4096));
+        plist_dict_set_item(app, "IsUpgradeable", plist_new_bool(i & 1));
+        plist_dict_set_item(app, "MinimumOSVersion", plist_new_real(12.0));
+        plist_dict_set_item(app, "IconData", plist_new_data((char*)icon, sizeof(icon)));
+        plist_array_append_item(caps, plist_new_string("armv7"));
+        plist_array_append_item(caps, plist_new_string("arm64"));
+        plist_dict_set_item(app, "UIRequiredDeviceCapabilities", caps);
+        plist_array_append_item(apps, app);
+    }
+
+    return apps;
+}
+
+static plist_t load_file(const char *path)
+{
+    plist_t plist = NULL;
+    FILE *f = fopen(path, "rb");
+    char *buf;
+    long size;
+
+    if (!f) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(size);
+    if (fread(buf, 1, size, f) == (size_t)size) {
+        plist_from_memory(buf, size, &plist);
+    }
+    fclose(f);
+    free(buf);
+    return plist;
+}
+
+static int bench(const char *name, plist_t plist, int iterations)
+{
+    char *bin = NULL;
+    char *xml1 = NULL;
+    char *xml2 = NULL;
+    uint32_t len = 0;
+    uint32_t xlen1 = 0;
+    uint32_t xlen2 = 0;
+    plist_t copy = NULL;
+    double t0, t1;
+    int i, res = 0;
+
+    /* the output has to read back to the same tree */
+    plist_to_bin(plist, &bin, &len);
+    plist_from_bin(bin, len, &copy);
+    plist_to_xml(plist, &xml1, &xlen1);
+    plist_to_xml(copy, &xml2, &xlen2);
+    if (!copy || xlen1 != xlen2 || memcmp(xml1, xml2, xlen1) != 0) {
+        printf("%-24s round trip failed\n", name);
+        res = -1;
+    }
+    plist_free(copy);
+    free(xml1);
+    free(xml2);
+    free(bin);
+    if (res < 0) {
+        return res;
+    }
+
+    t0 = now();
+    for (i = 0; i < iterations; i++) {
+        bin = NULL;
+        plist_to_bin(plist, &bin, &len);
+        free(bin);
+    }
+    t1 = now();
+
+    printf("%-24s %9u bytes  %9.1f MB/s  %9.0f plists/s\n", name, len,
+        (double)len * iterations / (t1 - t0) / 1e6, iterations / (t1 - t0));
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = (argc > 1) ? atoi(argv[1]) : 200;
+    int res = 0;
+    int i;
+
+    if (iterations < 1) {
+        iterations = 1;
+    }
+
+    plist_t small = make_app_list(10);
+    plist_t large = make_app_list(5000);
+    if (bench("synthetic (10 apps)", small, iterations * 100) < 0) res = 1;
+    if (bench("synthetic (5000 apps)", large, iterations / 10 + 1) < 0) res = 1;
+    plist_free(small);
+    plist_free(large);
+
+    for (i = 2; i < argc; i++) {
+        plist_t plist = load_file(argv[i]);
+        if (!plist) {
+            printf("%-24s could not be read\n", argv[i]);
+            res = 1;
+            continue;
+        }
+        if (bench(argv[i], plist, iterations) < 0) res = 1;
+        plist_free(plist);
+    }
+
+    return res;
+}
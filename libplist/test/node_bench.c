@@ -0,0 +1,197 @@
+/*
+ * node_bench.c
+ * container operation benchmark for the libcnary child layouts
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "plist/plist.h"
+#include <node.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _MSC_VER
+#pragma warning(disable:4996)
+#endif
+
+#ifdef NODE_CHILD_ARRAY
+#define LAYOUT "array"
+#else
+#define LAYOUT "list"
+#endif
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *op, uint32_t size, uint32_t ops, double t)
+{
+    printf("%-6s %-14s %8u items  %10.1f ns/op\n", LAYOUT, op, size, t / ops * 1e9);
+}
+
+static uint64_t item_value(plist_t item)
+{
+    uint64_t val = 0;
+    plist_get_uint_val(item, &val);
+    return val;
+}
+
+static int bench_array(uint32_t size)
+{
+    plist_t array = plist_new_array();
+    plist_array_iter iter = NULL;
+    plist_t item = NULL;
+    uint64_t sum = 0;
+    double t0, t1;
+    uint32_t i;
+    int res = 0;
+
+    t0 = now();
+    for (i = 0; i < size; i++) {
+        plist_array_append_item(array, plist_new_uint(i));
+    }
+    t1 = now();
+    report("append", size, size, t1 - t0);
+
+    /* the pattern used by most callers: a for loop over the indexes */
+    t0 = now();
+    for (i = 0; i < plist_array_get_size(array); i++) {
+        if (item_value(plist_array_get_item(array, i)) != i) {
+            res = -1;
+        }
+    }
+    t1 = now();
+    report("get_item", size, size, t1 - t0);
+
+    t0 = now();
+    for (i = 0; i < size; i++) {
+        if (plist_array_get_item_index(plist_array_get_item(array, i)) != i) {
+            res = -1;
+        }
+    }
+    t1 = now();
+    report("get_item_index", size, size, t1 - t0);
+
+    t0 = now();
+    plist_array_new_iter(array, &iter);
+    do {
+        item = NULL;
+        plist_array_next_item(array, iter, &item);
+        sum += item_value(item);
+    } while (item);
+    free(iter);
+    t1 = now();
+    report("iterate", size, size, t1 - t0);
+    if (sum != (uint64_t)size * (size - 1) / 2) {
+        res = -1;
+    }
+
+    /* insert in front, remove from the middle, replace at the end */
+    t0 = now();
+    for (i = 0; i < 64; i++) {
+        plist_array_insert_item(array, plist_new_uint(size + i), 0);
+        plist_array_remove_item(array, size / 2);
+        plist_array_set_item(array, plist_new_uint(i), size - 1);
+    }
+    t1 = now();
+    report("modify", size, 64 * 3, t1 - t0);
+    if (plist_array_get_size(array) != size || item_value(plist_array_get_item(array, 0)) != size + 63
+        || item_value(plist_array_get_item(array, size - 1)) != 63) {
+        res = -1;
+    }
+
+    t0 = now();
+    plist_free(array);
+    t1 = now();
+    report("free", size, size, t1 - t0);
+
+    if (res < 0) {
+        printf("%-6s array of %u items: unexpected contents\n", LAYOUT, size);
+    }
+    return res;
+}
+
+static int bench_dict(uint32_t size)
+{
+    plist_t dict = plist_new_dict();
+    plist_t copy = NULL;
+    plist_dict_iter iter = NULL;
+    plist_t item = NULL;
+    char key[32];
+    uint64_t sum = 0;
+    double t0, t1;
+    uint32_t i;
+    int res = 0;
+
+    t0 = now();
+    for (i = 0; i < size; i++) {
+        snprintf(key, sizeof(key), "key%u", i);
+        plist_dict_set_item(dict, key, plist_new_uint(i));
+    }
+    t1 = now();
+    report("dict_set_item", size, size, t1 - t0);
+
+    t0 = now();
+    plist_dict_new_iter(dict, &iter);
+    do {
+        char *k = NULL;
+        item = NULL;
+        plist_dict_next_item(dict, iter, &k, &item);
+        sum += item_value(item);
+        free(k);
+    } while (item);
+    free(iter);
+    t1 = now();
+    report("dict_iterate", size, size, t1 - t0);
+    if (sum != (uint64_t)size * (size - 1) / 2) {
+        res = -1;
+    }
+
+    t0 = now();
+    copy = plist_copy(dict);
+    t1 = now();
+    report("dict_copy", size, size, t1 - t0);
+    if (plist_dict_get_size(copy) != size) {
+        res = -1;
+    }
+
+    plist_free(copy);
+    plist_free(dict);
+
+    if (res < 0) {
+        printf("%-6s dict of %u items: unexpected contents\n", LAYOUT, size);
+    }
+    return res;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t max_size = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 10) : 100000;
+    uint32_t size;
+    int res = 0;
+
+    for (size = 10; size <= max_size; size *= 10) {
+        if (bench_array(size) < 0) res = 1;
+        if (bench_dict(size) < 0) res = 1;
+    }
+
+    return res;
+}
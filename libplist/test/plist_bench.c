@@ -0,0 +1,600 @@
+/*
+ * plist_bench.c
+ * parse/serialize throughput, allocation and memory benchmark
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "plist/plist.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _MSC_VER
+#pragma warning(disable:4996)
+#endif
+
+/*
+ * Allocation tracking. With glibc the allocator can be replaced by the
+ * executable, which lets us count every allocation made by libplist
+ * (including strdup() and friends) and keep track of the peak heap usage.
+ * Other platforms report -1 for these values.
+ */
+#if defined(__GLIBC__)
+#include <malloc.h>
+
+#define HAVE_ALLOC_STATS 1
+
+/* the replacements must be visible to libplist despite -fvisibility=hidden */
+#define ALLOC_EXPORT __attribute__((visibility("default")))
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static int alloc_tracking = 0;
+static size_t alloc_count = 0;
+static size_t alloc_live = 0;
+static size_t alloc_peak = 0;
+
+static void alloc_add(void *ptr)
+{
+    if (alloc_tracking && ptr) {
+        alloc_count++;
+        alloc_live += malloc_usable_size(ptr);
+        if (alloc_live > alloc_peak) {
+            alloc_peak = alloc_live;
+        }
+    }
+}
+
+static void alloc_remove(void *ptr)
+{
+    if (alloc_tracking && ptr) {
+        size_t size = malloc_usable_size(ptr);
+        alloc_live = (alloc_live > size) ? alloc_live - size : 0;
+    }
+}
+
+ALLOC_EXPORT void *malloc(size_t size)
+{
+    void *ptr = __libc_malloc(size);
+    alloc_add(ptr);
+    return ptr;
+}
+
+ALLOC_EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    void *ptr = __libc_calloc(nmemb, size);
+    alloc_add(ptr);
+    return ptr;
+}
+
+ALLOC_EXPORT void *realloc(void *ptr, size_t size)
+{
+    void *res;
+    alloc_remove(ptr);
+    res = __libc_realloc(ptr, size);
+    alloc_add(res ? res : ptr);
+    return res;
+}
+
+ALLOC_EXPORT void free(void *ptr)
+{
+    alloc_remove(ptr);
+    __libc_free(ptr);
+}
+#endif
+
+typedef struct {
+    long allocs;
+    long peak;
+} alloc_stats_t;
+
+static void alloc_stats_begin(void)
+{
+#ifdef HAVE_ALLOC_STATS
+    alloc_count = 0;
+    alloc_live = 0;
+    alloc_peak = 0;
+    alloc_tracking = 1;
+#endif
+}
+
+static alloc_stats_t alloc_stats_end(void)
+{
+    alloc_stats_t stats = { -1, -1 };
+#ifdef HAVE_ALLOC_STATS
+    alloc_tracking = 0;
+    stats.allocs = (long)alloc_count;
+    stats.peak = (long)alloc_peak;
+#endif
+    return stats;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Corpus. Besides the files given on the command line, a few payloads are
+ * generated that look like what AltServer and libimobiledevice handle all
+ * the time.
+ */
+
+static void fill(char *buf, size_t len, unsigned int seed)
+{
+    size_t i;
+    for (i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = (char)(seed >> 16);
+    }
+}
+
+static plist_t make_provisioning_profile(void)
+{
+    plist_t profile = plist_new_dict();
+    plist_t entitlements = plist_new_dict();
+    plist_t certificates = plist_new_array();
+    plist_t devices = plist_new_array();
+    plist_t groups = plist_new_array();
+    plist_t platforms = plist_new_array();
+    char buf[2048];
+    int i;
+
+    plist_dict_set_item(profile, "AppIDName", plist_new_string("XC com example app"));
+    plist_array_append_item(groups, plist_new_string("ABCDE12345"));
+    plist_dict_set_item(profile, "ApplicationIdentifierPrefix", groups);
+    plist_dict_set_item(profile, "CreationDate", plist_new_date(600000000, 0));
+    plist_array_append_item(platforms, plist_new_string("iOS"));
+    plist_dict_set_item(profile, "Platform", platforms);
+    plist_dict_set_item(profile, "IsXcodeManaged", plist_new_bool(1));
+
+    for (i = 0; i < 2; i++) {
+        fill(buf, 1400, i);
+        plist_array_append_item(certificates, plist_new_data(buf, 1400));
+    }
+    plist_dict_set_item(profile, "DeveloperCertificates", certificates);
+
+    plist_dict_set_item(entitlements, "application-identifier", plist_new_string("ABCDE12345.com.example.app"));
+    plist_dict_set_item(entitlements, "com.apple.developer.team-identifier", plist_new_string("ABCDE12345"));
+    plist_dict_set_item(entitlements, "get-task-allow", plist_new_bool(1));
+    groups = plist_new_array();
+    plist_array_append_item(groups, plist_new_string("ABCDE12345.*"));
+    plist_dict_set_item(entitlements, "keychain-access-groups", groups);
+    groups = plist_new_array();
+    plist_array_append_item(groups, plist_new_string("group.com.example.app"));
+    plist_dict_set_item(entitlements, "com.apple.security.application-groups", groups);
+    plist_dict_set_item(profile, "Entitlements", entitlements);
+
+    plist_dict_set_item(profile, "ExpirationDate", plist_new_date(600604800, 0));
+    plist_dict_set_item(profile, "Name", plist_new_string("iOS Team Provisioning Profile: com.example.app"));
+
+    for (i = 0; i < 100; i++) {
+        snprintf(buf, sizeof(buf), "%08x%08x%08x%08x%08x", i, i * 7, i * 13, i * 17, i * 31);
+        plist_array_append_item(devices, plist_new_string(buf));
+    }
+    plist_dict_set_item(profile, "ProvisionedDevices", devices);
+
+    plist_dict_set_item(profile, "TeamName", plist_new_string("Example Team"));
+    plist_dict_set_item(profile, "TimeToLive", plist_new_uint(7));
+    plist_dict_set_item(profile, "UUID", plist_new_string("01234567-89AB-CDEF-0123-456789ABCDEF"));
+    plist_dict_set_item(profile, "Version", plist_new_uint(1));
+
+    return profile;
+}
+
+static plist_t make_code_resources(int files)
+{
+    plist_t resources = plist_new_dict();
+    plist_t files1 = plist_new_dict();
+    plist_t files2 = plist_new_dict();
+    plist_t rules = plist_new_dict();
+    char path[256];
+    char hash[32];
+    int i;
+
+    for (i = 0; i < files; i++) {
+        plist_t entry = plist_new_dict();
+        snprintf(path, sizeof(path), "Assets/Images/%03d/image_%d@2x.png", i / 50, i);
+        fill(hash, sizeof(hash), i);
+        plist_dict_set_item(files1, path, plist_new_data(hash, 20));
+        plist_dict_set_item(entry, "hash", plist_new_data(hash, 20));
+        plist_dict_set_item(entry, "hash2", plist_new_data(hash, 32));
+        if (i % 10 == 0) {
+            plist_dict_set_item(entry, "optional", plist_new_bool(1));
+        }
+        plist_dict_set_item(files2, path, entry);
+    }
+    plist_dict_set_item(resources, "files", files1);
+    plist_dict_set_item(resources, "files2", files2);
+
+    plist_dict_set_item(rules, "^.*", plist_new_bool(1));
+    {
+        plist_t rule = plist_new_dict();
+        plist_dict_set_item(rule, "optional", plist_new_bool(1));
+        plist_dict_set_item(rule, "weight", plist_new_real(1000));
+        plist_dict_set_item(rules, "^.*\\.lproj/", rule);
+        rule = plist_new_dict();
+        plist_dict_set_item(rule, "omit", plist_new_bool(1));
+        plist_dict_set_item(rule, "weight", plist_new_real(1100));
+        plist_dict_set_item(rules, "^.*\\.lproj/locversion.plist$", rule);
+    }
+    plist_dict_set_item(rules, "^version.plist$", plist_new_bool(1));
+    plist_dict_set_item(resources, "rules", rules);
+    plist_dict_set_item(resources, "rules2", plist_copy(rules));
+
+    return resources;
+}
+
+static plist_t make_lockdown_values(void)
+{
+    plist_t response = plist_new_dict();
+    plist_t value = plist_new_dict();
+    plist_t abis = plist_new_array();
+    char buf[512];
+    int i;
+
+    plist_dict_set_item(value, "ActivationState", plist_new_string("Activated"));
+    plist_dict_set_item(value, "BasebandVersion", plist_new_string("3.02.01"));
+    plist_dict_set_item(value, "BluetoothAddress", plist_new_string("aa:bb:cc:dd:ee:ff"));
+    plist_dict_set_item(value, "BoardId", plist_new_uint(12));
+    plist_dict_set_item(value, "BuildVersion", plist_new_string("18A373"));
+    plist_dict_set_item(value, "ChipID", plist_new_uint(32768));
+    plist_dict_set_item(value, "DeviceClass", plist_new_string("iPhone"));
+    plist_dict_set_item(value, "DeviceColor", plist_new_string("1"));
+    plist_dict_set_item(value, "DeviceName", plist_new_string("Example iPhone"));
+    fill(buf, 64, 1);
+    plist_dict_set_item(value, "DieID", plist_new_uint(0x1234567890ABCDEFULL));
+    plist_dict_set_item(value, "HardwareModel", plist_new_string("D22AP"));
+    plist_dict_set_item(value, "HasSiDP", plist_new_bool(1));
+    plist_dict_set_item(value, "ProductType", plist_new_string("iPhone10,3"));
+    plist_dict_set_item(value, "ProductVersion", plist_new_string("14.0"));
+    plist_dict_set_item(value, "ProductionSOC", plist_new_bool(1));
+    plist_dict_set_item(value, "SerialNumber", plist_new_string("C39XXXXXXXXX"));
+    plist_dict_set_item(value, "TimeZone", plist_new_string("America/Los_Angeles"));
+    plist_dict_set_item(value, "TimeZoneOffsetFromUTC", plist_new_real(-25200.0));
+    plist_dict_set_item(value, "UniqueChipID", plist_new_uint(1234567890123ULL));
+    plist_dict_set_item(value, "UniqueDeviceID", plist_new_string("00008030-001A2B3C4D5E6F70"));
+    plist_dict_set_item(value, "Uses24HourClock", plist_new_bool(0));
+    plist_dict_set_item(value, "WiFiAddress", plist_new_string("aa:bb:cc:dd:ee:00"));
+    for (i = 0; i < 3; i++) {
+        plist_array_append_item(abis, plist_new_string(i ? "arm64e" : "arm64"));
+    }
+    plist_dict_set_item(value, "SupportedDeviceFamilies", abis);
+    plist_dict_set_item(value, "DevicePublicKey", plist_new_data(buf, 64));
+    fill(buf, 512, 2);
+    plist_dict_set_item(value, "ActivationPublicKey", plist_new_data(buf, 512));
+
+    plist_dict_set_item(response, "Request", plist_new_string("GetValue"));
+    plist_dict_set_item(response, "Value", value);
+
+    return response;
+}
+
+static plist_t make_device_list(int devices)
+{
+    plist_t response = plist_new_dict();
+    plist_t list = plist_new_array();
+    char buf[64];
+    int i;
+
+    for (i = 0; i < devices; i++) {
+        plist_t device = plist_new_dict();
+        plist_t props = plist_new_dict();
+        plist_dict_set_item(device, "DeviceID", plist_new_uint(i + 1));
+        plist_dict_set_item(device, "MessageType", plist_new_string("Attached"));
+        plist_dict_set_item(props, "ConnectionSpeed", plist_new_uint(480000000));
+        plist_dict_set_item(props, "ConnectionType", plist_new_string((i & 1) ? "Network" : "USB"));
+        plist_dict_set_item(props, "DeviceID", plist_new_uint(i + 1));
+        plist_dict_set_item(props, "LocationID", plist_new_uint(0x14100000 + i));
+        plist_dict_set_item(props, "ProductID", plist_new_uint(0x12a8));
+        snprintf(buf, sizeof(buf), "00008030-%016X", i);
+        plist_dict_set_item(props, "SerialNumber", plist_new_string(buf));
+        plist_dict_set_item(device, "Properties", props);
+        plist_array_append_item(list, device);
+    }
+    plist_dict_set_item(response, "DeviceList", list);
+
+    return response;
+}
+
+static plist_t load_file(const char *path)
+{
+    plist_t plist = NULL;
+    FILE *f = fopen(path, "rb");
+    char *buf;
+    long size;
+
+    if (!f) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(size > 0 ? size : 1);
+    if (size > 0 && fread(buf, 1, size, f) == (size_t)size) {
+        plist_from_memory(buf, size, &plist);
+    }
+    fclose(f);
+    free(buf);
+    return plist;
+}
+
+static long count_nodes(plist_t node)
+{
+    long count = 1;
+    plist_t item = NULL;
+    char *key = NULL;
+
+    switch (plist_get_node_type(node)) {
+    case PLIST_ARRAY: {
+        plist_array_iter iter = NULL;
+        plist_array_new_iter(node, &iter);
+        do {
+            item = NULL;
+            plist_array_next_item(node, iter, &item);
+            if (item) {
+                count += count_nodes(item);
+            }
+        } while (item);
+        free(iter);
+    }   break;
+    case PLIST_DICT: {
+        plist_dict_iter iter = NULL;
+        plist_dict_new_iter(node, &iter);
+        do {
+            item = NULL;
+            plist_dict_next_item(node, iter, &key, &item);
+            if (item) {
+                /* the key is a node too */
+                count += 1 + count_nodes(item);
+            }
+            free(key);
+            key = NULL;
+        } while (item);
+        free(iter);
+    }   break;
+    default:
+        break;
+    }
+    return count;
+}
+
+/*
+ * Measurements
+ */
+
+typedef struct {
+    double parse_mbs;
+    double serialize_mbs;
+    long parse_allocs;
+    long parse_peak;
+    long serialize_allocs;
+    long serialize_peak;
+} result_t;
+
+static void serialize(plist_t plist, int binary, char **out, uint32_t *len)
+{
+    *out = NULL;
+    *len = 0;
+    if (binary) {
+        plist_to_bin(plist, out, len);
+    } else {
+        plist_to_xml(plist, out, len);
+    }
+}
+
+static plist_t parse(const char *buf, uint32_t len, int binary)
+{
+    plist_t plist = NULL;
+    if (binary) {
+        plist_from_bin(buf, len, &plist);
+    } else {
+        plist_from_xml(buf, len, &plist);
+    }
+    return plist;
+}
+
+static int measure(plist_t plist, int binary, double min_time, result_t *res)
+{
+    alloc_stats_t stats;
+    char *buf = NULL;
+    uint32_t len = 0;
+    char *out = NULL;
+    uint32_t out_len = 0;
+    plist_t parsed = NULL;
+    double elapsed = 0;
+    long runs = 0;
+
+    serialize(plist, binary, &buf, &len);
+    if (!buf) {
+        return -1;
+    }
+
+    /* allocations and peak heap usage of a single run */
+    alloc_stats_begin();
+    parsed = parse(buf, len, binary);
+    stats = alloc_stats_end();
+    res->parse_allocs = stats.allocs;
+    res->parse_peak = stats.peak;
+    if (!parsed) {
+        free(buf);
+        return -1;
+    }
+
+    alloc_stats_begin();
+    serialize(parsed, binary, &out, &out_len);
+    free(out);
+    stats = alloc_stats_end();
+    res->serialize_allocs = stats.allocs;
+    res->serialize_peak = stats.peak;
+
+    /* throughput, repeated until min_time has passed */
+    while (elapsed < min_time || runs == 0) {
+        double t0 = now();
+        plist_t p = parse(buf, len, binary);
+        elapsed += now() - t0;
+        plist_free(p);
+        runs++;
+    }
+    res->parse_mbs = (double)len * runs / elapsed / 1e6;
+
+    elapsed = 0;
+    runs = 0;
+    while (elapsed < min_time || runs == 0) {
+        double t0 = now();
+        serialize(parsed, binary, &out, &out_len);
+        elapsed += now() - t0;
+        free(out);
+        runs++;
+    }
+    res->serialize_mbs = (double)len * runs / elapsed / 1e6;
+
+    plist_free(parsed);
+    free(buf);
+    return (int)len;
+}
+
+static void json_string(const char *str)
+{
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            printf("\\%c", *str);
+        } else if ((unsigned char)*str < 0x20) {
+            printf("\\u%04x", *str);
+        } else {
+            putchar(*str);
+        }
+    }
+    putchar('"');
+}
+
+static void print_usage(const char *name)
+{
+    printf("Usage: %s [--json] [--quick] [FILE...]\n", name);
+    printf("\n");
+    printf("Measures parse and serialize throughput, allocations per node and peak\n");
+    printf("heap usage for the XML and binary formats. The built-in corpus of typical\n");
+    printf("payloads is extended with the given plist files.\n");
+    printf("\n");
+    printf("  --json   print machine readable results\n");
+    printf("  --quick  run each measurement only briefly\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct {
+        const char *name;
+        plist_t plist;
+    } corpus[64];
+    int num_corpus = 0;
+    int json = 0;
+    double min_time = 0.25;
+    int res = 0;
+    int first = 1;
+    int i, binary;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--json")) {
+            json = 1;
+        } else if (!strcmp(argv[i], "--quick")) {
+            min_time = 0.01;
+        } else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (num_corpus < 60) {
+            plist_t plist = load_file(argv[i]);
+            if (!plist) {
+                fprintf(stderr, "Could not read %s\n", argv[i]);
+                res = 1;
+                continue;
+            }
+            corpus[num_corpus].name = argv[i];
+            corpus[num_corpus].plist = plist;
+            num_corpus++;
+        }
+    }
+
+    corpus[num_corpus].name = "provisioning_profile";
+    corpus[num_corpus++].plist = make_provisioning_profile();
+    corpus[num_corpus].name = "code_resources";
+    corpus[num_corpus++].plist = make_code_resources(2000);
+    corpus[num_corpus].name = "lockdown_getvalue";
+    corpus[num_corpus++].plist = make_lockdown_values();
+    corpus[num_corpus].name = "usbmuxd_device_list";
+    corpus[num_corpus++].plist = make_device_list(8);
+
+    if (json) {
+        printf("{\n  \"benchmark\": \"plist_bench\",\n  \"alloc_stats\": %s,\n  \"results\": [", 
+#ifdef HAVE_ALLOC_STATS
+            "true"
+#else
+            "false"
+#endif
+            );
+    } else {
+        printf("%-28s %-6s %9s %7s %10s %10s %9s %10s %9s\n", "payload", "format", "bytes", "nodes",
+            "parse MB/s", "write MB/s", "allocs/n", "parse peak", "write peak");
+    }
+
+    for (i = 0; i < num_corpus; i++) {
+        long nodes = count_nodes(corpus[i].plist);
+        for (binary = 0; binary < 2; binary++) {
+            result_t r;
+            int len;
+
+            memset(&r, '\0', sizeof(result_t));
+            len = measure(corpus[i].plist, binary, min_time, &r);
+            if (len < 0) {
+                fprintf(stderr, "%s: %s round trip failed\n", corpus[i].name, binary ? "binary" : "xml");
+                res = 1;
+                continue;
+            }
+
+            if (json) {
+                printf("%s\n    {\"name\": ", first ? "" : ",");
+                json_string(corpus[i].name);
+                printf(", \"format\": \"%s\", \"bytes\": %d, \"nodes\": %ld, "
+                    "\"parse_mb_s\": %.2f, \"serialize_mb_s\": %.2f, "
+                    "\"parse_allocs\": %ld, \"parse_allocs_per_node\": %.3f, \"parse_peak_bytes\": %ld, "
+                    "\"serialize_allocs\": %ld, \"serialize_peak_bytes\": %ld}",
+                    binary ? "binary" : "xml", len, nodes,
+                    r.parse_mbs, r.serialize_mbs,
+                    r.parse_allocs, (r.parse_allocs >= 0) ? (double)r.parse_allocs / nodes : -1.0, r.parse_peak,
+                    r.serialize_allocs, r.serialize_peak);
+                first = 0;
+            } else {
+                printf("%-28.28s %-6s %9d %7ld %10.1f %10.1f %9.2f %10ld %9ld\n", corpus[i].name,
+                    binary ? "binary" : "xml", len, nodes, r.parse_mbs, r.serialize_mbs,
+                    (r.parse_allocs >= 0) ? (double)r.parse_allocs / nodes : -1.0, r.parse_peak, r.serialize_peak);
+            }
+        }
+        plist_free(corpus[i].plist);
+    }
+
+    if (json) {
+        printf("\n  ]\n}\n");
+    }
+
+    return res;
+}
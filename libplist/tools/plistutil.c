@@ -111,6 +111,7 @@ int main(int argc, char *argv[])
     plist_t root_node = NULL;
     char *plist_out = NULL;
     uint32_t size = 0;
+    int xml_out = 0;
     int read_size = 0;
     char *plist_entire = NULL;
     struct stat filestats;
@@ -147,39 +148,47 @@ int main(int argc, char *argv[])
     // convert from binary to xml or vice-versa
     if (plist_is_binary(plist_entire, read_size))
     {
+        // xml is streamed to the output below
         plist_from_bin(plist_entire, read_size, &root_node);
-        plist_to_xml(root_node, &plist_out, &size);
+        xml_out = 1;
     }
     else
     {
         plist_from_xml(plist_entire, read_size, &root_node);
         plist_to_bin(root_node, &plist_out, &size);
     }
-    plist_free(root_node);
     free(plist_entire);
 
-    if (plist_out)
+    if (plist_out || (xml_out && root_node))
     {
+        FILE *oplist = stdout;
         if (options->out_file != NULL)
         {
-            FILE *oplist = fopen(options->out_file, "wb");
+            oplist = fopen(options->out_file, "wb");
             if (!oplist) {
                 printf("ERROR: Could not open output file '%s': %s\n", options->out_file, strerror(errno));
+                plist_free(root_node);
+                free(plist_out);
                 free(options);
                 return 1;
             }
-            fwrite(plist_out, size, sizeof(char), oplist);
-            fclose(oplist);
         }
         // if no output file specified, write to stdout
+
+        if (xml_out)
+            plist_to_xml_file(root_node, oplist);
         else
-            fwrite(plist_out, size, sizeof(char), stdout);
+            fwrite(plist_out, size, sizeof(char), oplist);
+
+        if (oplist != stdout)
+            fclose(oplist);
 
         free(plist_out);
     }
     else
         printf("ERROR: Failed to convert input file.\n");
 
+    plist_free(root_node);
     free(options);
     return 0;
 }
@@ -24,6 +24,11 @@
 #endif
 #include "thread.h"
 
+#ifndef WIN32
+#include <errno.h>
+#include <sys/time.h>
+#endif
+
 int thread_new(THREAD_T *thread, thread_func_t thread_func, void* data)
 {
 #ifdef WIN32
@@ -123,6 +128,58 @@ void mutex_unlock(mutex_t* mutex)
 #endif
 }
 
+void cond_init(cond_t* cond)
+{
+#ifdef WIN32
+	InitializeConditionVariable(cond);
+#else
+	pthread_cond_init(cond, NULL);
+#endif
+}
+
+void cond_destroy(cond_t* cond)
+{
+#ifdef WIN32
+	/* nothing to do */
+#else
+	pthread_cond_destroy(cond);
+#endif
+}
+
+void cond_broadcast(cond_t* cond)
+{
+#ifdef WIN32
+	WakeAllConditionVariable(cond);
+#else
+	pthread_cond_broadcast(cond);
+#endif
+}
+
+/**
+ * Waits until cond is signalled or timeout_ms milliseconds have passed.
+ * mutex must be locked by the caller; it is unlocked while waiting.
+ *
+ * @return 0 if cond was signalled, or a non-zero value on timeout.
+ */
+int cond_wait_timeout(cond_t* cond, mutex_t* mutex, unsigned int timeout_ms)
+{
+#ifdef WIN32
+	return SleepConditionVariableCS(cond, mutex, timeout_ms) ? 0 : 1;
+#else
+	struct timeval now;
+	struct timespec abstime;
+
+	gettimeofday(&now, NULL);
+	abstime.tv_sec = now.tv_sec + timeout_ms / 1000;
+	abstime.tv_nsec = (now.tv_usec + (timeout_ms % 1000) * 1000) * 1000;
+	if (abstime.tv_nsec >= 1000000000) {
+		abstime.tv_sec++;
+		abstime.tv_nsec -= 1000000000;
+	}
+	return (pthread_cond_timedwait(cond, mutex, &abstime) == ETIMEDOUT) ? 1 : 0;
+#endif
+}
+
 void thread_once(thread_once_t *once_control, void (*init_routine)(void))
 {
 #ifdef WIN32
@@ -28,6 +28,7 @@
 #include <windows.h>
 typedef HANDLE THREAD_T;
 typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
 typedef volatile struct {
 	LONG lock;
 	int state;
@@ -40,6 +41,7 @@ typedef volatile struct {
 #include <signal.h>
 typedef pthread_t THREAD_T;
 typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
 typedef pthread_once_t thread_once_t;
 #define THREAD_ONCE_INIT PTHREAD_ONCE_INIT
 #define THREAD_ID pthread_self()
@@ -71,6 +73,11 @@ void mutex_destroy(mutex_t* mutex);
 void mutex_lock(mutex_t* mutex);
 void mutex_unlock(mutex_t* mutex);
 
+void cond_init(cond_t* cond);
+void cond_destroy(cond_t* cond);
+void cond_broadcast(cond_t* cond);
+int cond_wait_timeout(cond_t* cond, mutex_t* mutex, unsigned int timeout_ms);
+
 void thread_once(thread_once_t *once_control, void (*init_routine)(void));
 
 #endif
@@ -192,6 +192,10 @@ int usbmuxd_get_device_by_udid(const char *udid, usbmuxd_device_info_t *device);
  *      This behavior can be changed by adding DEVICE_LOOKUP_PREFER_NETWORK
  *      to the options in which case it will select the network connection.
  *
+ * @note While an event subscription is active (see usbmuxd_events_subscribe)
+ *      the lookup is answered from the device list maintained by the event
+ *      listener without contacting usbmuxd. Otherwise usbmuxd is queried.
+ *
  * @see enum usbmux_lookup_options
  *
  * @return 0 if no matching device is connected, 1 if the device was found,
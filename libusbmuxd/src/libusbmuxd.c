@@ -60,6 +60,7 @@
 #endif
 #else
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #if defined(HAVE_PROGRAM_INVOCATION_SHORT_NAME) && !defined(HAVE_PROGRAM_INVOCATION_SHORT_NAME_ERRNO_H)
@@ -115,6 +116,7 @@ static int libusbmuxd_debug = 0;
 #define LIBUSBMUXD_ERROR(format, ...) LIBUSBMUXD_DEBUG(0, format, __VA_ARGS__)
 
 static struct collection devices;
+static mutex_t devices_mutex;
 static THREAD_T devmon = THREAD_T_NULL;
 static int listenfd = -1;
 static int cancelling = 0;
@@ -134,9 +136,158 @@ static struct collection listeners;
 thread_once_t listener_init_once = THREAD_ONCE_INIT;
 mutex_t listener_mutex;
 
+/**
+ * Device registry.
+ *
+ * While the device monitor thread is running, the devices it learns about
+ * through its listen connection are indexed by UDID so that lookups can be
+ * answered without contacting usbmuxd. The registry is only marked ready
+ * once usbmuxd has finished reporting the devices present at listen time;
+ * until then (or when no listener is running) lookups fall back to a
+ * one-shot device list query.
+ *
+ * devices and registry_buckets are protected by devices_mutex. When both
+ * are needed, listener_mutex must be locked before devices_mutex.
+ */
+#define DEVICE_REGISTRY_BUCKETS 64
+#define DEVICE_REGISTRY_SETTLE_TIME 100
+
+struct device_registry_entry {
+	usbmuxd_device_info_t *dev;
+	struct device_registry_entry *next;
+};
+
+static struct device_registry_entry *registry_buckets[DEVICE_REGISTRY_BUCKETS];
+static volatile int registry_ready = 0;
+
+static unsigned int registry_hash(const char *udid)
+{
+	/* FNV-1a */
+	unsigned int h = 2166136261u;
+	while (*udid) {
+		h ^= (unsigned char)*udid++;
+		h *= 16777619u;
+	}
+	return h % DEVICE_REGISTRY_BUCKETS;
+}
+
+static void registry_add(usbmuxd_device_info_t *dev)
+{
+	struct device_registry_entry *entry = (struct device_registry_entry*)malloc(sizeof(struct device_registry_entry));
+	unsigned int bucket = registry_hash(dev->udid);
+	entry->dev = dev;
+	entry->next = registry_buckets[bucket];
+	registry_buckets[bucket] = entry;
+}
+
+static void registry_remove(usbmuxd_device_info_t *dev)
+{
+	struct device_registry_entry **pentry = &registry_buckets[registry_hash(dev->udid)];
+	while (*pentry) {
+		struct device_registry_entry *entry = *pentry;
+		if (entry->dev == dev) {
+			*pentry = entry->next;
+			free(entry);
+			return;
+		}
+		pentry = &entry->next;
+	}
+}
+
+static void registry_clear()
+{
+	int i;
+	for (i = 0; i < DEVICE_REGISTRY_BUCKETS; i++) {
+		struct device_registry_entry *entry = registry_buckets[i];
+		while (entry) {
+			struct device_registry_entry *next = entry->next;
+			free(entry);
+			entry = next;
+		}
+		registry_buckets[i] = NULL;
+	}
+}
+
+static void device_info_copy(usbmuxd_device_info_t *device, const usbmuxd_device_info_t *dev)
+{
+	device->handle = dev->handle;
+	device->product_id = dev->product_id;
+	char *t = stpncpy(device->udid, dev->udid, sizeof(device->udid)-1);
+	*t = '\0';
+	device->conn_type = dev->conn_type;
+	memcpy(device->conn_data, dev->conn_data, sizeof(device->conn_data));
+}
+
+static usbmuxd_device_info_t *device_select(usbmuxd_device_info_t *dev_usbmuxd, usbmuxd_device_info_t *dev_network, enum usbmux_lookup_options options)
+{
+	if (dev_network && dev_usbmuxd) {
+		return (options & DEVICE_LOOKUP_PREFER_NETWORK) ? dev_network : dev_usbmuxd;
+	} else if (dev_network) {
+		return dev_network;
+	}
+	return dev_usbmuxd;
+}
+
+/**
+ * Looks up a device in the registry.
+ *
+ * @return 1 if the device was found, 0 if it is not connected, or -1 if
+ *    the registry is not available and usbmuxd has to be queried instead.
+ */
+static int registry_lookup(const char *udid, usbmuxd_device_info_t *device, enum usbmux_lookup_options options)
+{
+	usbmuxd_device_info_t *dev_network = NULL;
+	usbmuxd_device_info_t *dev_usbmuxd = NULL;
+	usbmuxd_device_info_t *dev = NULL;
+	int result = 0;
+
+	if (!registry_ready) {
+		return -1;
+	}
+
+	mutex_lock(&devices_mutex);
+	if (!registry_ready) {
+		mutex_unlock(&devices_mutex);
+		return -1;
+	}
+	if (!udid) {
+		FOREACH(usbmuxd_device_info_t *di, &devices) {
+			if ((options & DEVICE_LOOKUP_USBMUX) && (di->conn_type == CONNECTION_TYPE_USB)) {
+				dev_usbmuxd = di;
+				break;
+			} else if ((options & DEVICE_LOOKUP_NETWORK) && (di->conn_type == CONNECTION_TYPE_NETWORK)) {
+				dev_network = di;
+				break;
+			}
+		} ENDFOREACH
+	} else {
+		struct device_registry_entry *entry;
+		for (entry = registry_buckets[registry_hash(udid)]; entry; entry = entry->next) {
+			if (strcmp(udid, entry->dev->udid) != 0) {
+				continue;
+			}
+			if ((options & DEVICE_LOOKUP_USBMUX) && (entry->dev->conn_type == CONNECTION_TYPE_USB)) {
+				dev_usbmuxd = entry->dev;
+			} else if ((options & DEVICE_LOOKUP_NETWORK) && (entry->dev->conn_type == CONNECTION_TYPE_NETWORK)) {
+				dev_network = entry->dev;
+			}
+		}
+	}
+
+	dev = device_select(dev_usbmuxd, dev_network, options);
+	if (dev) {
+		device_info_copy(device, dev);
+		result = 1;
+	}
+	mutex_unlock(&devices_mutex);
+
+	return result;
+}
+
 /**
  * Finds a device info record by its handle.
  * if the record is not found, NULL is returned.
+ * devices_mutex must be held by the caller.
  */
 static usbmuxd_device_info_t *devices_find(uint32_t handle)
 {
@@ -461,32 +612,15 @@ static int receive_packet(int sfd, struct usbmuxd_header *header, void **payload
 }
 
 /**
- * Retrieves the result code to a previously sent request.
+ * Extracts the result code from a reply packet received by receive_packet.
+ * Takes ownership of res.
  */
-static int usbmuxd_get_result(int sfd, uint32_t tag, uint32_t *result, void **result_plist)
+static int get_result_from_packet(struct usbmuxd_header *hdr, uint32_t *res, uint32_t tag, uint32_t *result, void **result_plist)
 {
-	struct usbmuxd_header hdr;
-	int recv_len;
-	uint32_t *res = NULL;
-
-	if (!result) {
-		return -EINVAL;
-	}
-	*result = -1;
-	if (result_plist) {
-		*result_plist = NULL;
-	}
-
-	recv_len = receive_packet(sfd, &hdr, (void**)&res, 5000);
-	if (recv_len < 0 || (size_t)recv_len < sizeof(hdr)) {
-		free(res);
-		return (recv_len < 0 ? recv_len : -EPROTO);
-	}
-
-	if (hdr.message == MESSAGE_RESULT) {
+	if (hdr->message == MESSAGE_RESULT) {
 		int ret = 0;
-		if (hdr.tag != tag) {
-			LIBUSBMUXD_DEBUG(1, "%s: WARNING: tag mismatch (%d != %d). Proceeding anyway.\n", __func__, hdr.tag, tag);
+		if (hdr->tag != tag) {
+			LIBUSBMUXD_DEBUG(1, "%s: WARNING: tag mismatch (%d != %d). Proceeding anyway.\n", __func__, hdr->tag, tag);
 		}
 		if (res) {
 			memcpy(result, res, sizeof(uint32_t));
@@ -495,9 +629,10 @@ static int usbmuxd_get_result(int sfd, uint32_t tag, uint32_t *result, void **re
 		if (res)
 			free(res);
 		return ret;
-	} else if (hdr.message == MESSAGE_PLIST) {
+	} else if (hdr->message == MESSAGE_PLIST) {
 		if (!result_plist) {
 			LIBUSBMUXD_DEBUG(1, "%s: MESSAGE_PLIST result but result_plist pointer is NULL!\n", __func__);
+			plist_free((plist_t)res);
 			return -1;
 		}
 		*result_plist = (plist_t)res;
@@ -505,12 +640,38 @@ static int usbmuxd_get_result(int sfd, uint32_t tag, uint32_t *result, void **re
 		return 1;
 	}
 
-	LIBUSBMUXD_DEBUG(1, "%s: Unexpected message of type %d received!\n", __func__, hdr.message);
+	LIBUSBMUXD_DEBUG(1, "%s: Unexpected message of type %d received!\n", __func__, hdr->message);
 	if (res)
 		free(res);
 	return -EPROTO;
 }
 
+/**
+ * Retrieves the result code to a previously sent request.
+ */
+static int usbmuxd_get_result(int sfd, uint32_t tag, uint32_t *result, void **result_plist)
+{
+	struct usbmuxd_header hdr;
+	int recv_len;
+	uint32_t *res = NULL;
+
+	if (!result) {
+		return -EINVAL;
+	}
+	*result = -1;
+	if (result_plist) {
+		*result_plist = NULL;
+	}
+
+	recv_len = receive_packet(sfd, &hdr, (void**)&res, 5000);
+	if (recv_len < 0 || (size_t)recv_len < sizeof(hdr)) {
+		free(res);
+		return (recv_len < 0 ? recv_len : -EPROTO);
+	}
+
+	return get_result_from_packet(&hdr, res, tag, result, result_plist);
+}
+
 static int send_packet(int sfd, uint32_t message, uint32_t tag, void *payload, uint32_t payload_size)
 {
 	struct usbmuxd_header header;
@@ -539,8 +700,8 @@ static int send_packet(int sfd, uint32_t message, uint32_t tag, void *payload, u
 		sent += ssize;
 	}
 	if (sent != (int)header.length) {
+		/* callers close the socket */
 		LIBUSBMUXD_DEBUG(1, "%s: ERROR: could not send whole packet (sent %d of %d)\n", __func__, sent, header.length);
-		socket_close(sfd);
 		return -1;
 	}
 	return sent;
@@ -699,14 +860,18 @@ static void get_prog_name()
 #endif
 }
 
+static thread_once_t client_info_once = THREAD_ONCE_INIT;
+
+static void init_client_info(void)
+{
+	get_bundle_id();
+	get_prog_name();
+}
+
 static plist_t create_plist_message(const char* message_type)
 {
-	if (!bundle_id) {
-		get_bundle_id();
-	}
-	if (!prog_name) {
-		get_prog_name();
-	}
+	thread_once(&client_info_once, init_client_info);
+
 	plist_t plist = plist_new_dict();
 	if (bundle_id) {
 		plist_dict_set_item(plist, "BundleID", plist_new_string(bundle_id));
@@ -764,50 +929,250 @@ static int send_connect_packet(int sfd, uint32_t tag, uint32_t device_id, uint16
 	return res;
 }
 
-static int send_list_devices_packet(int sfd, uint32_t tag)
+static plist_t create_pair_record_message(const char* msgtype, const char* pair_record_id, uint32_t device_id, plist_t data)
 {
-	int res = -1;
-
 	/* construct message plist */
-	plist_t plist = create_plist_message("ListDevices");
+	plist_t plist = create_plist_message(msgtype);
+	plist_dict_set_item(plist, "PairRecordID", plist_new_string(pair_record_id));
+	if (data) {
+		plist_dict_set_item(plist, "PairRecordData", plist_copy(data));
+	}
+	if (device_id > 0) {
+		plist_dict_set_item(plist, "DeviceID", plist_new_uint(device_id));
+	}
 
-	res = send_plist_packet(sfd, tag, plist);
-	plist_free(plist);
+	return plist;
+}
 
-	return res;
+/**
+ * Control connection.
+ *
+ * Requests that leave the connection usable afterwards (ListDevices,
+ * ReadBUID and the pair record requests) share one long-lived connection to
+ * usbmuxd instead of opening a new socket each. Every request is sent with
+ * its own tag. One of the waiting threads reads from the socket at a time
+ * and hands each reply to the request with the matching tag, while the
+ * others wait on control_cond. If the connection fails, all pending
+ * requests fail with -ECONNRESET and are retried once on a new connection.
+ *
+ * control_fd, control_reading and control_requests are protected by
+ * control_mutex.
+ */
+#define CONTROL_REQUEST_TIMEOUT 5000
+
+struct control_request {
+	uint32_t tag;
+	int done;
+	int error;
+	struct usbmuxd_header hdr;
+	void *payload;
+	struct control_request *next;
+};
+
+static thread_once_t control_init_once = THREAD_ONCE_INIT;
+static mutex_t control_mutex;
+static cond_t control_cond;
+static int control_fd = -1;
+static int control_reading = 0;
+static struct control_request *control_requests = NULL;
+
+static void control_init(void)
+{
+	mutex_init(&control_mutex);
+	cond_init(&control_cond);
 }
 
-static int send_read_buid_packet(int sfd, uint32_t tag)
+static uint64_t control_time_ms()
 {
-	int res = -1;
+#ifdef WIN32
+	return GetTickCount64();
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
 
-	/* construct message plist */
-	plist_t plist = create_plist_message("ReadBUID");
+/**
+ * Drops the control connection and fails all pending requests.
+ * Must be called with control_mutex held. If another thread is currently
+ * reading from the socket, it is only shut down here and closed by that
+ * thread.
+ */
+static void control_connection_fail()
+{
+	struct control_request *req;
 
-	res = send_plist_packet(sfd, tag, plist);
-	plist_free(plist);
+	if (control_fd >= 0) {
+		if (control_reading) {
+			socket_shutdown(control_fd, SHUT_RDWR);
+		} else {
+			socket_close(control_fd);
+		}
+		control_fd = -1;
+	}
 
-	return res;
+	for (req = control_requests; req; req = req->next) {
+		if (!req->done) {
+			req->done = 1;
+			req->error = -ECONNRESET;
+		}
+	}
+	cond_broadcast(&control_cond);
 }
 
-static int send_pair_record_packet(int sfd, uint32_t tag, const char* msgtype, const char* pair_record_id, uint32_t device_id, plist_t data)
+/**
+ * Reads the next packet from the control connection and dispatches it to
+ * the waiting request. Must be called with control_mutex held; it is
+ * released while reading.
+ */
+static void control_read_reply(unsigned int timeout)
 {
-	int res = -1;
+	struct usbmuxd_header hdr;
+	void *payload = NULL;
+	int fd = control_fd;
+	int recv_len;
 
-	/* construct message plist */
-	plist_t plist = create_plist_message(msgtype);
-	plist_dict_set_item(plist, "PairRecordID", plist_new_string(pair_record_id));
-	if (data) {
-		plist_dict_set_item(plist, "PairRecordData", plist_copy(data));
+	control_reading = 1;
+	mutex_unlock(&control_mutex);
+	recv_len = receive_packet(fd, &hdr, &payload, timeout);
+	mutex_lock(&control_mutex);
+	control_reading = 0;
+
+	if (fd != control_fd) {
+		/* connection was dropped while we were reading */
+		socket_close(fd);
+		free(payload);
+	} else if (recv_len == 0) {
+		/* timeout */
+	} else if (recv_len < 0 || (size_t)recv_len < sizeof(hdr)) {
+		free(payload);
+		control_connection_fail();
+	} else {
+		struct control_request *req;
+		for (req = control_requests; req; req = req->next) {
+			if (!req->done && req->tag == hdr.tag) {
+				break;
+			}
+		}
+		if (req) {
+			req->hdr = hdr;
+			req->payload = payload;
+			req->done = 1;
+		} else {
+			LIBUSBMUXD_DEBUG(1, "%s: Discarding reply with unknown tag %d\n", __func__, hdr.tag);
+			if (hdr.message == MESSAGE_PLIST) {
+				plist_free((plist_t)payload);
+			} else {
+				free(payload);
+			}
+		}
 	}
-	if (device_id > 0) {
-		plist_dict_set_item(plist, "DeviceID", plist_new_uint(device_id));
+	cond_broadcast(&control_cond);
+}
+
+/**
+ * Sends a request over the control connection and waits for the reply.
+ *
+ * @return 1 if a reply was received, in which case result (and result_plist
+ *   if the reply was a plist) is set like usbmuxd_get_result does, or a
+ *   negative errno value otherwise.
+ */
+static int control_request(plist_t message, uint32_t *result, plist_t *result_plist)
+{
+	struct control_request req;
+	struct control_request **link;
+	int attempt;
+
+	*result = -1;
+	if (result_plist) {
+		*result_plist = NULL;
 	}
-	
-	res = send_plist_packet(sfd, tag, plist);
-	plist_free(plist);
 
-	return res;
+	thread_once(&control_init_once, control_init);
+
+	for (attempt = 0; attempt < 2; attempt++) {
+		memset(&req, '\0', sizeof(req));
+
+		mutex_lock(&control_mutex);
+		if (control_fd < 0) {
+			int sfd = connect_usbmuxd_socket();
+			if (sfd < 0) {
+				mutex_unlock(&control_mutex);
+				LIBUSBMUXD_DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n", __func__, strerror(errno));
+				return sfd;
+			}
+			control_fd = sfd;
+		}
+
+		req.tag = ++use_tag;
+		req.next = control_requests;
+		control_requests = &req;
+
+		if (send_plist_packet(control_fd, req.tag, message) <= 0) {
+			LIBUSBMUXD_DEBUG(1, "%s: Error sending request\n", __func__);
+			control_connection_fail();
+		}
+
+		uint64_t deadline = control_time_ms() + CONTROL_REQUEST_TIMEOUT;
+		while (!req.done) {
+			uint64_t now = control_time_ms();
+			if (now >= deadline) {
+				req.done = 1;
+				req.error = -ETIMEDOUT;
+				break;
+			}
+			if (!control_reading) {
+				control_read_reply((unsigned int)(deadline - now));
+			} else {
+				cond_wait_timeout(&control_cond, &control_mutex, (unsigned int)(deadline - now));
+			}
+		}
+
+		for (link = &control_requests; *link; link = &(*link)->next) {
+			if (*link == &req) {
+				*link = req.next;
+				break;
+			}
+		}
+		mutex_unlock(&control_mutex);
+
+		if (req.error != -ECONNRESET) {
+			break;
+		}
+		LIBUSBMUXD_DEBUG(1, "%s: Control connection lost, %s\n", __func__, (attempt == 0) ? "reconnecting" : "giving up");
+	}
+
+	if (req.error < 0) {
+		return req.error;
+	}
+
+	return get_result_from_packet(&req.hdr, (uint32_t*)req.payload, req.tag, result, result_plist);
+}
+
+/**
+ * Returns a snapshot of the known devices so callers can hand them to
+ * listeners without holding devices_mutex, which a listener might need
+ * again (e.g. via idevice_new). The caller frees the returned array.
+ */
+static usbmuxd_device_info_t *copy_device_list(int *count)
+{
+	usbmuxd_device_info_t *devs = NULL;
+	int n = 0;
+
+	mutex_lock(&devices_mutex);
+	devs = (usbmuxd_device_info_t*)malloc(sizeof(usbmuxd_device_info_t) * (collection_count(&devices) + 1));
+	if (devs) {
+		FOREACH(usbmuxd_device_info_t *dev, &devices) {
+			if (dev) {
+				memcpy(&devs[n++], dev, sizeof(usbmuxd_device_info_t));
+			}
+		} ENDFOREACH
+	}
+	mutex_unlock(&devices_mutex);
+
+	*count = n;
+	return devs;
 }
 
 /**
@@ -985,11 +1350,18 @@ static int get_next_event(int sfd)
 		// when then usbmuxd connection fails,
 		// generate remove events for every device that
 		// is still present so applications know about it
-		FOREACH(usbmuxd_device_info_t *dev, &devices) {
+		struct collection lostdevs;
+		registry_ready = 0;
+		mutex_lock(&devices_mutex);
+		lostdevs = devices;
+		collection_init(&devices);
+		registry_clear();
+		mutex_unlock(&devices_mutex);
+		FOREACH(usbmuxd_device_info_t *dev, &lostdevs) {
 			generate_event(dev, UE_DEVICE_REMOVE);
-			collection_remove(&devices, dev);
 			free(dev);
 		} ENDFOREACH
+		collection_free(&lostdevs);
 		return -EIO;
 	}
 
@@ -1000,7 +1372,10 @@ static int get_next_event(int sfd)
 
 	if (hdr.message == MESSAGE_DEVICE_ADD) {
 		usbmuxd_device_info_t *devinfo = (usbmuxd_device_info_t*)payload;
+		mutex_lock(&devices_mutex);
 		collection_add(&devices, devinfo);
+		registry_add(devinfo);
+		mutex_unlock(&devices_mutex);
 		generate_event(devinfo, UE_DEVICE_ADD);
 		payload = NULL;
 	} else if (hdr.message == MESSAGE_DEVICE_REMOVE) {
@@ -1009,25 +1384,36 @@ static int get_next_event(int sfd)
 
 		memcpy(&handle, payload, sizeof(uint32_t));
 
+		mutex_lock(&devices_mutex);
 		devinfo = devices_find(handle);
+		if (devinfo) {
+			collection_remove(&devices, devinfo);
+			registry_remove(devinfo);
+		}
+		mutex_unlock(&devices_mutex);
 		if (!devinfo) {
 			LIBUSBMUXD_DEBUG(1, "%s: WARNING: got device remove message for handle %d, but couldn't find the corresponding handle in the device list. This event will be ignored.\n", __func__, handle);
 		} else {
 			generate_event(devinfo, UE_DEVICE_REMOVE);
-			collection_remove(&devices, devinfo);
 			free(devinfo);
 		}
 	} else if (hdr.message == MESSAGE_DEVICE_PAIRED) {
 		uint32_t handle;
 		usbmuxd_device_info_t *devinfo;
 
+		usbmuxd_device_info_t paireddev;
 		memcpy(&handle, payload, sizeof(uint32_t));
 
+		mutex_lock(&devices_mutex);
 		devinfo = devices_find(handle);
+		if (devinfo) {
+			memcpy(&paireddev, devinfo, sizeof(usbmuxd_device_info_t));
+		}
+		mutex_unlock(&devices_mutex);
 		if (!devinfo) {
 			LIBUSBMUXD_DEBUG(1, "%s: WARNING: got paired message for device handle %d, but couldn't find the corresponding handle in the device list. This event will be ignored.\n", __func__, handle);
 		} else {
-			generate_event(devinfo, UE_DEVICE_PAIRED);
+			generate_event(&paireddev, UE_DEVICE_PAIRED);
 		}
 	} else if (hdr.length > 0) {
 		LIBUSBMUXD_DEBUG(1, "%s: Unexpected message type %d length %d received!\n", __func__, hdr.message, hdr.length);
@@ -1040,11 +1426,15 @@ static int get_next_event(int sfd)
 
 static void device_monitor_cleanup(void* data)
 {
+	registry_ready = 0;
+	mutex_lock(&devices_mutex);
+	registry_clear();
 	FOREACH(usbmuxd_device_info_t *dev, &devices) {
 		collection_remove(&devices, dev);
 		free(dev);
 	} ENDFOREACH
 	collection_free(&devices);
+	mutex_unlock(&devices_mutex);
 
 	socket_close(listenfd);
 	listenfd = -1;
@@ -1058,7 +1448,9 @@ static void device_monitor_cleanup(void* data)
 static void *device_monitor(void *data)
 {
 	int running = 1;
+	mutex_lock(&devices_mutex);
 	collection_init(&devices);
+	mutex_unlock(&devices_mutex);
 	cancelling = 0;
 
 #ifdef HAVE_THREAD_CLEANUP
@@ -1072,6 +1464,13 @@ static void *device_monitor(void *data)
 		}
 
 		while (running) {
+			if (!registry_ready && socket_check_fd(listenfd, FDM_READ, DEVICE_REGISTRY_SETTLE_TIME) == 0) {
+				/* usbmuxd reports all present devices right after the
+				 * listen request; once it goes quiet the registry is
+				 * complete and can be used for lookups */
+				registry_ready = 1;
+				continue;
+			}
 			int res = get_next_event(listenfd);
 			if (res < 0) {
 			    break;
@@ -1098,6 +1497,7 @@ static void init_listeners(void)
 {
 	collection_init(&listeners);
 	mutex_init(&listener_mutex);
+	mutex_init(&devices_mutex);
 }
 
 USBMUXD_API int usbmuxd_events_subscribe(usbmuxd_subscription_context_t *ctx, usbmuxd_event_cb_t callback, void *user_data)
@@ -1130,14 +1530,16 @@ USBMUXD_API int usbmuxd_events_subscribe(usbmuxd_subscription_context_t *ctx, us
 		}
 	} else {
 		/* we need to submit DEVICE_ADD events to the new listener */
-		FOREACH(usbmuxd_device_info_t *dev, &devices) {
-			if (dev) {
-				usbmuxd_event_t ev;
-				ev.event = UE_DEVICE_ADD;
-				memcpy(&ev.device, dev, sizeof(usbmuxd_device_info_t));
-				(*ctx)->callback(&ev, (*ctx)->user_data);
-			}
-		} ENDFOREACH
+		int i;
+		int count = 0;
+		usbmuxd_device_info_t *devs = copy_device_list(&count);
+		for (i = 0; i < count; i++) {
+			usbmuxd_event_t ev;
+			ev.event = UE_DEVICE_ADD;
+			memcpy(&ev.device, &devs[i], sizeof(usbmuxd_device_info_t));
+			(*ctx)->callback(&ev, (*ctx)->user_data);
+		}
+		free(devs);
 		mutex_unlock(&listener_mutex);
 	}
 
@@ -1155,14 +1557,16 @@ USBMUXD_API int usbmuxd_events_unsubscribe(usbmuxd_subscription_context_t ctx)
 
 	mutex_lock(&listener_mutex);
 	if (collection_remove(&listeners, ctx) == 0) {
-		FOREACH(usbmuxd_device_info_t *dev, &devices) {
-			if (dev) {
-				usbmuxd_event_t ev;
-				ev.event = UE_DEVICE_REMOVE;
-				memcpy(&ev.device, dev, sizeof(usbmuxd_device_info_t));
-				(ctx)->callback(&ev, (ctx)->user_data);
-			}
-		} ENDFOREACH
+		int i;
+		int count = 0;
+		usbmuxd_device_info_t *devs = copy_device_list(&count);
+		for (i = 0; i < count; i++) {
+			usbmuxd_event_t ev;
+			ev.event = UE_DEVICE_REMOVE;
+			memcpy(&ev.device, &devs[i], sizeof(usbmuxd_device_info_t));
+			(ctx)->callback(&ev, (ctx)->user_data);
+		}
+		free(devs);
 		free(ctx);
 	}
 	num = collection_count(&listeners);
@@ -1220,49 +1624,48 @@ USBMUXD_API int usbmuxd_get_device_list(usbmuxd_device_info_t **device_list)
 
 	*device_list = NULL;
 
-retry:
-	sfd = connect_usbmuxd_socket();
-	if (sfd < 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: error opening socket!\n", __func__);
-		return sfd;
-	}
-
-	tag = ++use_tag;
 	if ((proto_version == 1) && (try_list_devices)) {
-		if (send_list_devices_packet(sfd, tag) > 0) {
-			plist_t list = NULL;
-			if ((usbmuxd_get_result(sfd, tag, &res, &list) == 1) && (res == 0)) {
-				plist_t devlist = plist_dict_get_item(list, "DeviceList");
-				if (devlist && plist_get_node_type(devlist) == PLIST_ARRAY) {
-					collection_init(&tmpdevs);
-					uint32_t numdevs = plist_array_get_size(devlist);
-					uint32_t i;
-					for (i = 0; i < numdevs; i++) {
-						plist_t pdev = plist_array_get_item(devlist, i);
-						plist_t props = plist_dict_get_item(pdev, "Properties");
-						usbmuxd_device_info_t *devinfo = device_info_from_plist(props);
-						if (!devinfo) {
-							socket_close(sfd);
-							LIBUSBMUXD_DEBUG(1, "%s: Could not create device info object from properties!\n", __func__);
-							plist_free(list);
-							return -1;
-						}
-						collection_add(&tmpdevs, devinfo);
+		plist_t msg = create_plist_message("ListDevices");
+		plist_t list = NULL;
+		int ret = control_request(msg, &res, &list);
+		plist_free(msg);
+		if ((ret == 1) && (res == 0)) {
+			plist_t devlist = plist_dict_get_item(list, "DeviceList");
+			if (devlist && plist_get_node_type(devlist) == PLIST_ARRAY) {
+				collection_init(&tmpdevs);
+				uint32_t numdevs = plist_array_get_size(devlist);
+				uint32_t i;
+				for (i = 0; i < numdevs; i++) {
+					plist_t pdev = plist_array_get_item(devlist, i);
+					plist_t props = plist_dict_get_item(pdev, "Properties");
+					usbmuxd_device_info_t *devinfo = device_info_from_plist(props);
+					if (!devinfo) {
+						LIBUSBMUXD_DEBUG(1, "%s: Could not create device info object from properties!\n", __func__);
+						plist_free(list);
+						return -1;
 					}
-					plist_free(list);
-					goto got_device_list;
+					collection_add(&tmpdevs, devinfo);
 				}
-			} else {
-				if (res == RESULT_BADVERSION) {
-					proto_version = 0;
-				}
-				socket_close(sfd);
-				try_list_devices = 0;
 				plist_free(list);
-				goto retry;
+				goto got_device_list;
 			}
-			plist_free(list);
+		} else if (ret < 0) {
+			LIBUSBMUXD_DEBUG(1, "%s: error opening socket!\n", __func__);
+			return ret;
+		} else {
+			if (res == RESULT_BADVERSION) {
+				proto_version = 0;
+			}
+			try_list_devices = 0;
 		}
+		plist_free(list);
+	}
+
+retry:
+	sfd = connect_usbmuxd_socket();
+	if (sfd < 0) {
+		LIBUSBMUXD_DEBUG(1, "%s: error opening socket!\n", __func__);
+		return sfd;
 	}
 
 	tag = ++use_tag;
@@ -1325,11 +1728,11 @@ retry:
 		}
 	}
 
-got_device_list:
-
 	// explicitly close connection
 	socket_close(sfd);
 
+got_device_list:
+
 	// create copy of device info entries from collection
 	newlist = (usbmuxd_device_info_t*)malloc(sizeof(usbmuxd_device_info_t) * (collection_count(&tmpdevs) + 1));
 	dev_cnt = 0;
@@ -1366,6 +1769,13 @@ USBMUXD_API int usbmuxd_get_device_by_udid(const char *udid, usbmuxd_device_info
 	if (!device) {
 		return -EINVAL;
 	}
+
+	result = registry_lookup(udid, device, DEVICE_LOOKUP_USBMUX);
+	if (result >= 0) {
+		return result;
+	}
+	result = 0;
+
 	if (usbmuxd_get_device_list(&dev_list) < 0) {
 		return -ENODEV;
 	}
@@ -1385,12 +1795,7 @@ USBMUXD_API int usbmuxd_get_device_by_udid(const char *udid, usbmuxd_device_info
 	}
 
 	if (dev) {
-		device->handle = dev->handle;
-		device->product_id = dev->product_id;
-		char *t = stpncpy(device->udid, dev->udid, sizeof(device->udid)-1);
-		*t = '\0';
-		device->conn_type = dev->conn_type;
-		memcpy(device->conn_data, dev->conn_data, sizeof(device->conn_data));
+		device_info_copy(device, dev);
 		result = 1;
 	}
 
@@ -1411,14 +1816,21 @@ USBMUXD_API int usbmuxd_get_device(const char *udid, usbmuxd_device_info_t *devi
 	if (!device) {
 		return -EINVAL;
 	}
-	if (usbmuxd_get_device_list(&dev_list) < 0) {
-		return -ENODEV;
-	}
 
 	if (options == 0) {
 		options = DEVICE_LOOKUP_USBMUX;
 	}
 
+	result = registry_lookup(udid, device, options);
+	if (result >= 0) {
+		return result;
+	}
+	result = 0;
+
+	if (usbmuxd_get_device_list(&dev_list) < 0) {
+		return -ENODEV;
+	}
+
 	for (i = 0; dev_list[i].handle > 0; i++) {
 		if (!udid) {
 			if ((options & DEVICE_LOOKUP_USBMUX) && (dev_list[i].conn_type == CONNECTION_TYPE_USB)) {
@@ -1440,21 +1852,9 @@ USBMUXD_API int usbmuxd_get_device(const char *udid, usbmuxd_device_info_t *devi
 		}
 	}
 
-	if (dev_network && dev_usbmuxd) {
-		dev = (options & DEVICE_LOOKUP_PREFER_NETWORK) ? dev_network : dev_usbmuxd;
-	} else if (dev_network) {
-		dev = dev_network;
-	} else if (dev_usbmuxd) {
-		dev = dev_usbmuxd;
-	}
-
+	dev = device_select(dev_usbmuxd, dev_network, options);
 	if (dev) {
-		device->handle = dev->handle;
-		device->product_id = dev->product_id;
-		char *t = stpncpy(device->udid, dev->udid, sizeof(device->udid)-1);
-		*t = '\0';
-		device->conn_type = dev->conn_type;
-		memcpy(device->conn_data, dev->conn_data, sizeof(device->conn_data));
+		device_info_copy(device, dev);
 		result = 1;
 	}
 
@@ -1564,8 +1964,6 @@ USBMUXD_API int usbmuxd_recv(int sfd, char *data, uint32_t len, uint32_t *recv_b
 
 USBMUXD_API int usbmuxd_read_buid(char **buid)
 {
-	int sfd;
-	int tag;
 	int ret = -1;
 
 	if (!buid) {
@@ -1573,40 +1971,31 @@ USBMUXD_API int usbmuxd_read_buid(char **buid)
 	}
 	*buid = NULL;
 
-	sfd = connect_usbmuxd_socket();
-	if (sfd < 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n", __func__, strerror(errno));
-		return sfd;
-	}
-
 	proto_version = 1;
-	tag = ++use_tag;
-	if (send_read_buid_packet(sfd, tag) <= 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: Error sending ReadBUID message!\n", __func__);
-	} else {
-		uint32_t rc = 0;
-		plist_t pl = NULL;
-		ret = usbmuxd_get_result(sfd, tag, &rc, &pl);
-		if ((ret == 1) && (rc == 0)) {
-			plist_t node = plist_dict_get_item(pl, "BUID");
-			if (node && plist_get_node_type(node) == PLIST_STRING) {
-				plist_get_string_val(node, buid);
-			}
-			ret = 0;
-		} else if (ret == 1) {
-			ret = -(int)rc;
+
+	uint32_t rc = 0;
+	plist_t pl = NULL;
+	plist_t msg = create_plist_message("ReadBUID");
+	ret = control_request(msg, &rc, &pl);
+	plist_free(msg);
+	if ((ret == 1) && (rc == 0)) {
+		plist_t node = plist_dict_get_item(pl, "BUID");
+		if (node && plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, buid);
 		}
-		plist_free(pl);
+		ret = 0;
+	} else if (ret == 1) {
+		ret = -(int)rc;
+	} else {
+		LIBUSBMUXD_DEBUG(1, "%s: Error sending ReadBUID message!\n", __func__);
 	}
-	socket_close(sfd);
+	plist_free(pl);
 
 	return ret;
 }
 
 USBMUXD_API int usbmuxd_read_pair_record(const char* record_id, char **record_data, uint32_t *record_size)
 {
-	int sfd;
-	int tag;
 	int ret = -1;
 
 	if (!record_id || !record_data || !record_size) {
@@ -1615,77 +2004,57 @@ USBMUXD_API int usbmuxd_read_pair_record(const char* record_id, char **record_da
 	*record_data = NULL;
 	*record_size = 0;
 
-	sfd = connect_usbmuxd_socket();
-	if (sfd < 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n",
-				__func__, strerror(errno));
-		return sfd;
-	}
-
 	proto_version = 1;
-	tag = ++use_tag;
 
-	if (send_pair_record_packet(sfd, tag, "ReadPairRecord", record_id, 0, NULL) <= 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: Error sending ReadPairRecord message!\n", __func__);
-	} else {
-		uint32_t rc = 0;
-		plist_t pl = NULL;
-		ret = usbmuxd_get_result(sfd, tag, &rc, &pl);
-		if ((ret == 1) && (rc == 0)) {
-			plist_t node = plist_dict_get_item(pl, "PairRecordData");
-			if (node && plist_get_node_type(node) == PLIST_DATA) {
-				uint64_t int64val = 0;
-				plist_get_data_val(node, record_data, &int64val);
-				if (*record_data && int64val > 0) {
-					*record_size = (uint32_t)int64val;
-					ret = 0;
-				}
+	uint32_t rc = 0;
+	plist_t pl = NULL;
+	plist_t msg = create_pair_record_message("ReadPairRecord", record_id, 0, NULL);
+	ret = control_request(msg, &rc, &pl);
+	plist_free(msg);
+	if ((ret == 1) && (rc == 0)) {
+		plist_t node = plist_dict_get_item(pl, "PairRecordData");
+		if (node && plist_get_node_type(node) == PLIST_DATA) {
+			uint64_t int64val = 0;
+			plist_get_data_val(node, record_data, &int64val);
+			if (*record_data && int64val > 0) {
+				*record_size = (uint32_t)int64val;
+				ret = 0;
 			}
-		} else if (ret == 1) {
-			ret = -(int)rc;
 		}
-		plist_free(pl);
+	} else if (ret == 1) {
+		ret = -(int)rc;
+	} else {
+		LIBUSBMUXD_DEBUG(1, "%s: Error sending ReadPairRecord message!\n", __func__);
 	}
-	socket_close(sfd);
+	plist_free(pl);
 
 	return ret;
 }
 
 USBMUXD_API int usbmuxd_save_pair_record_with_device_id(const char* record_id, uint32_t device_id, const char *record_data, uint32_t record_size)
 {
-	int sfd;
-	int tag;
 	int ret = -1;
 
 	if (!record_id || !record_data || !record_size) {
 		return -EINVAL;
 	}
 
-	sfd = connect_usbmuxd_socket();
-	if (sfd < 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n",
-				__func__, strerror(errno));
-		return sfd;
-	}
-
 	proto_version = 1;
-	tag = ++use_tag;
 
+	uint32_t rc = 0;
 	plist_t data = plist_new_data(record_data, record_size);
-	if (send_pair_record_packet(sfd, tag, "SavePairRecord", record_id, device_id, data) <= 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: Error sending SavePairRecord message!\n", __func__);
+	plist_t msg = create_pair_record_message("SavePairRecord", record_id, device_id, data);
+	ret = control_request(msg, &rc, NULL);
+	if ((ret == 1) && (rc == 0)) {
+		ret = 0;
+	} else if (ret == 1) {
+		ret = -(int)rc;
+		LIBUSBMUXD_DEBUG(1, "%s: Error: saving pair record failed: %d\n", __func__, ret);
 	} else {
-		uint32_t rc = 0;
-		ret = usbmuxd_get_result(sfd, tag, &rc, NULL);
-		if ((ret == 1) && (rc == 0)) {
-			ret = 0;
-		} else if (ret == 1) {
-			ret = -(int)rc;
-			LIBUSBMUXD_DEBUG(1, "%s: Error: saving pair record failed: %d\n", __func__, ret);
-		}
+		LIBUSBMUXD_DEBUG(1, "%s: Error sending SavePairRecord message!\n", __func__);
 	}
+	plist_free(msg);
 	plist_free(data);
-	socket_close(sfd);
 
 	return ret;
 }
@@ -1697,37 +2066,26 @@ USBMUXD_API int usbmuxd_save_pair_record(const char* record_id, const char *reco
 
 USBMUXD_API int usbmuxd_delete_pair_record(const char* record_id)
 {
-	int sfd;
-	int tag;
 	int ret = -1;
 
 	if (!record_id) {
 		return -EINVAL;
 	}
 
-	sfd = connect_usbmuxd_socket();
-	if (sfd < 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n",
-				__func__, strerror(errno));
-		return sfd;
-	}
-
 	proto_version = 1;
-	tag = ++use_tag;
 
-	if (send_pair_record_packet(sfd, tag, "DeletePairRecord", record_id, 0, NULL) <= 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: Error sending DeletePairRecord message!\n", __func__);
+	uint32_t rc = 0;
+	plist_t msg = create_pair_record_message("DeletePairRecord", record_id, 0, NULL);
+	ret = control_request(msg, &rc, NULL);
+	plist_free(msg);
+	if ((ret == 1) && (rc == 0)) {
+		ret = 0;
+	} else if (ret == 1) {
+		ret = -(int)rc;
+		LIBUSBMUXD_DEBUG(1, "%s: Error: deleting pair record failed: %d\n", __func__, ret);
 	} else {
-		uint32_t rc = 0;
-		ret = usbmuxd_get_result(sfd, tag, &rc, NULL);
-		if ((ret == 1) && (rc == 0)) {
-			ret = 0;
-		} else if (ret == 1) {
-			ret = -(int)rc;
-			LIBUSBMUXD_DEBUG(1, "%s: Error: deleting pair record failed: %d\n", __func__, ret);
-		}
+		LIBUSBMUXD_DEBUG(1, "%s: Error sending DeletePairRecord message!\n", __func__);
 	}
-	socket_close(sfd);
 
 	return ret;
 }
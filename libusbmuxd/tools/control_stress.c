@@ -0,0 +1,445 @@
+/*
+ * control_stress.c
+ * Stress test for the shared usbmuxd control connection
+ *
+ * Runs a fake usbmuxd on a unix socket that answers requests out of order,
+ * drives it from several threads through the public libusbmuxd API and
+ * restarts it halfway through. Exits non-zero if a reply is delivered to
+ * the wrong request, a request fails, or more connections than expected
+ * are opened.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <plist/plist.h>
+
+#include "usbmuxd.h"
+#include "usbmuxd-proto.h"
+#include "thread.h"
+
+#define NUM_THREADS 16
+#define REQUESTS_PER_THREAD 320
+#define MAX_CONNECTIONS 16
+#define MAX_BATCH 8
+
+#define FAKE_BUID "00000000-0000-0000-0000-000000000000"
+#define FAKE_UDID "0000000000000000000000000000000000000000"
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fake usbmuxd */
+
+struct connection {
+	int fd;
+	THREAD_T worker;
+};
+
+static char socket_path[64];
+static int listen_fd = -1;
+static volatile int server_running = 1;
+static volatile int restart_requested = 0;
+static volatile int restart_done = 0;
+
+static mutex_t server_mutex;
+static struct connection connections[MAX_CONNECTIONS];
+static int num_connections = 0;
+static int connections_before_restart = 0;
+
+static int create_listen_socket(void)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+	unlink(socket_path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int read_full(int fd, void *buf, size_t length)
+{
+	size_t received = 0;
+	while (received < length) {
+		ssize_t res = recv(fd, (char*)buf + received, length - received, 0);
+		if (res <= 0) {
+			return -1;
+		}
+		received += res;
+	}
+	return 0;
+}
+
+static int send_reply(int fd, uint32_t tag, plist_t reply)
+{
+	struct usbmuxd_header hdr;
+	char *xml = NULL;
+	uint32_t length = 0;
+	int res = 0;
+
+	plist_to_xml(reply, &xml, &length);
+
+	hdr.length = sizeof(hdr) + length;
+	hdr.version = 1;
+	hdr.message = MESSAGE_PLIST;
+	hdr.tag = tag;
+
+	if (send(fd, &hdr, sizeof(hdr), MSG_NOSIGNAL) != sizeof(hdr) ||
+	    send(fd, xml, length, MSG_NOSIGNAL) != (ssize_t)length) {
+		res = -1;
+	}
+	free(xml);
+
+	return res;
+}
+
+static plist_t create_result(uint32_t number)
+{
+	plist_t reply = plist_new_dict();
+	plist_dict_set_item(reply, "MessageType", plist_new_string("Result"));
+	plist_dict_set_item(reply, "Number", plist_new_uint(number));
+	return reply;
+}
+
+/* Builds the reply for a request. Pair record data echoes the record id so
+ * the client can tell whether it got the reply meant for it. */
+static plist_t create_reply(plist_t request)
+{
+	char *message = NULL;
+	char *record_id = NULL;
+	plist_t reply = NULL;
+
+	plist_get_string_val(plist_dict_get_item(request, "MessageType"), &message);
+	plist_get_string_val(plist_dict_get_item(request, "PairRecordID"), &record_id);
+
+	if (!message) {
+		reply = create_result(RESULT_BADCOMMAND);
+	} else if (strcmp(message, "ListDevices") == 0) {
+		plist_t props = plist_new_dict();
+		plist_dict_set_item(props, "DeviceID", plist_new_uint(1));
+		plist_dict_set_item(props, "ProductID", plist_new_uint(0x12a8));
+		plist_dict_set_item(props, "SerialNumber", plist_new_string(FAKE_UDID));
+		plist_dict_set_item(props, "ConnectionType", plist_new_string("USB"));
+		plist_t dev = plist_new_dict();
+		plist_dict_set_item(dev, "DeviceID", plist_new_uint(1));
+		plist_dict_set_item(dev, "MessageType", plist_new_string("Attached"));
+		plist_dict_set_item(dev, "Properties", props);
+		plist_t list = plist_new_array();
+		plist_array_append_item(list, dev);
+		reply = plist_new_dict();
+		plist_dict_set_item(reply, "DeviceList", list);
+	} else if (strcmp(message, "ReadBUID") == 0) {
+		reply = plist_new_dict();
+		plist_dict_set_item(reply, "BUID", plist_new_string(FAKE_BUID));
+	} else if (strcmp(message, "ReadPairRecord") == 0 && record_id) {
+		reply = plist_new_dict();
+		plist_dict_set_item(reply, "PairRecordData", plist_new_data(record_id, strlen(record_id)));
+	} else if (strcmp(message, "DeletePairRecord") == 0 && record_id) {
+		reply = create_result(RESULT_OK);
+	} else {
+		reply = create_result(RESULT_BADCOMMAND);
+	}
+
+	free(message);
+	free(record_id);
+
+	return reply;
+}
+
+static int read_request(int fd, uint32_t *tag, plist_t *request)
+{
+	struct usbmuxd_header hdr;
+	char *payload = NULL;
+
+	if (read_full(fd, &hdr, sizeof(hdr)) < 0 || hdr.length < sizeof(hdr)) {
+		return -1;
+	}
+
+	uint32_t length = hdr.length - sizeof(hdr);
+	payload = (char*)malloc(length + 1);
+	if (read_full(fd, payload, length) < 0) {
+		free(payload);
+		return -1;
+	}
+
+	*tag = hdr.tag;
+	*request = NULL;
+	plist_from_xml(payload, length, request);
+	free(payload);
+
+	return (*request) ? 0 : -1;
+}
+
+/* Serves one client connection. Requests that arrive close together are
+ * collected and answered in reverse order. */
+static void *connection_thread(void *arg)
+{
+	struct connection *conn = (struct connection*)arg;
+	uint32_t tags[MAX_BATCH];
+	plist_t requests[MAX_BATCH];
+
+	while (1) {
+		int count = 0;
+		int i;
+
+		if (read_request(conn->fd, &tags[0], &requests[0]) < 0) {
+			break;
+		}
+		count++;
+
+		while (count < MAX_BATCH) {
+			struct pollfd pfd = { conn->fd, POLLIN, 0 };
+			if (poll(&pfd, 1, 1) <= 0 || read_request(conn->fd, &tags[count], &requests[count]) < 0) {
+				break;
+			}
+			count++;
+		}
+
+		for (i = count - 1; i >= 0; i--) {
+			plist_t reply = create_reply(requests[i]);
+			send_reply(conn->fd, tags[i], reply);
+			plist_free(reply);
+			plist_free(requests[i]);
+		}
+	}
+
+	return NULL;
+}
+
+/* Drops every client connection and replaces the listening socket, like a
+ * usbmuxd restart. The new socket is bound before clients are
+ * disconnected so their reconnect attempt does not race the restart. */
+static void restart_server(void)
+{
+	int i;
+
+	close(listen_fd);
+	listen_fd = create_listen_socket();
+
+	mutex_lock(&server_mutex);
+	connections_before_restart = num_connections;
+	for (i = 0; i < num_connections; i++) {
+		shutdown(connections[i].fd, SHUT_RDWR);
+	}
+	mutex_unlock(&server_mutex);
+}
+
+static void *server_thread(void *arg)
+{
+	while (server_running) {
+		if (restart_requested) {
+			restart_server();
+			restart_requested = 0;
+			restart_done = 1;
+		}
+
+		struct pollfd pfd = { listen_fd, POLLIN, 0 };
+		if (poll(&pfd, 1, 10) <= 0) {
+			continue;
+		}
+
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+
+		mutex_lock(&server_mutex);
+		if (num_connections >= MAX_CONNECTIONS) {
+			num_connections++;
+			mutex_unlock(&server_mutex);
+			close(fd);
+			continue;
+		}
+		struct connection *conn = &connections[num_connections++];
+		conn->fd = fd;
+		thread_new(&conn->worker, connection_thread, conn);
+		mutex_unlock(&server_mutex);
+	}
+
+	return NULL;
+}
+
+/* Clients */
+
+static mutex_t stats_mutex;
+static int completed = 0;
+static int failures = 0;
+static int mismatches = 0;
+
+static void record(int failed, int mismatched)
+{
+	mutex_lock(&stats_mutex);
+	completed++;
+	if (failed) {
+		failures++;
+	}
+	if (mismatched) {
+		mismatches++;
+	}
+	mutex_unlock(&stats_mutex);
+}
+
+static void *client_thread(void *arg)
+{
+	long index = (long)arg;
+	int i;
+
+	for (i = 0; i < REQUESTS_PER_THREAD; i++) {
+		char record_id[64];
+		int res;
+
+		snprintf(record_id, sizeof(record_id), "%ld-%d", index, i);
+
+		switch (i % 4) {
+		case 0: {
+			char *data = NULL;
+			uint32_t size = 0;
+			res = usbmuxd_read_pair_record(record_id, &data, &size);
+			record(res != 0, res == 0 && (size != strlen(record_id) || memcmp(data, record_id, size) != 0));
+			free(data);
+			break;
+		}
+		case 1: {
+			char *buid = NULL;
+			res = usbmuxd_read_buid(&buid);
+			record(res != 0, res == 0 && (!buid || strcmp(buid, FAKE_BUID) != 0));
+			free(buid);
+			break;
+		}
+		case 2: {
+			usbmuxd_device_info_t *list = NULL;
+			res = usbmuxd_get_device_list(&list);
+			record(res < 0, res == 1 && strcmp(list[0].udid, FAKE_UDID) != 0);
+			if (res >= 0) {
+				usbmuxd_device_list_free(&list);
+			}
+			break;
+		}
+		default:
+			res = usbmuxd_delete_pair_record(record_id);
+			record(res != 0, 0);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	THREAD_T server;
+	THREAD_T clients[NUM_THREADS];
+	char address[sizeof(socket_path) + 5];
+	int total = NUM_THREADS * REQUESTS_PER_THREAD;
+	int res = 0;
+	long i;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	snprintf(socket_path, sizeof(socket_path), "/tmp/usbmuxd-control-stress.%d", (int)getpid());
+	listen_fd = create_listen_socket();
+	if (listen_fd < 0) {
+		printf("could not listen on %s\n", socket_path);
+		return 1;
+	}
+	snprintf(address, sizeof(address), "UNIX:%s", socket_path);
+	setenv("USBMUXD_SOCKET_ADDRESS", address, 1);
+
+	mutex_init(&server_mutex);
+	mutex_init(&stats_mutex);
+	thread_new(&server, server_thread, NULL);
+
+	double t0 = now();
+	for (i = 0; i < NUM_THREADS; i++) {
+		thread_new(&clients[i], client_thread, (void*)i);
+	}
+
+	/* restart the fake once half of the requests have been answered */
+	while (1) {
+		mutex_lock(&stats_mutex);
+		int done = completed;
+		mutex_unlock(&stats_mutex);
+		if (done >= total / 2) {
+			break;
+		}
+		usleep(1000);
+	}
+	restart_requested = 1;
+
+	for (i = 0; i < NUM_THREADS; i++) {
+		thread_join(clients[i]);
+		thread_free(clients[i]);
+	}
+	double t1 = now();
+
+	server_running = 0;
+	thread_join(server);
+	thread_free(server);
+
+	for (i = 0; i < num_connections && i < MAX_CONNECTIONS; i++) {
+		shutdown(connections[i].fd, SHUT_RDWR);
+		thread_join(connections[i].worker);
+		thread_free(connections[i].worker);
+		close(connections[i].fd);
+	}
+	close(listen_fd);
+	unlink(socket_path);
+
+	printf("%d threads, %d requests in %.2f s\n", NUM_THREADS, completed, t1 - t0);
+	printf("connections: %d before restart, %d after\n", connections_before_restart, num_connections - connections_before_restart);
+	printf("failed requests: %d\n", failures);
+	printf("mismatched replies: %d\n", mismatches);
+
+	if (failures > 0 || mismatches > 0) {
+		res = 1;
+	}
+	if (!restart_done) {
+		printf("fake usbmuxd was not restarted\n");
+		res = 1;
+	} else if (connections_before_restart != 1 || num_connections != 2) {
+		printf("expected one control connection before and one after the restart\n");
+		res = 1;
+	}
+
+	return res;
+}